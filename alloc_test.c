@@ -0,0 +1,340 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nat_traversal.h"
+#include "utils.h"
+
+/*
+ * alloc_test, proves the punch path allocation-free. Two contexts enroll with
+ * a minimal punch server run in this process and connect to each other over
+ * loopback again and again. malloc, calloc and realloc are interposed, and
+ * once the first attempts have warmed the session pool up, none of the
+ * following attempts may reach them. This is done for each of the runs
+ * below: the peer of the attempts behind a cone or a symmetric NAT, which
+ * punches from one socket per hole, and with one path or several measured.
+ */
+
+#define WARMUP_ATTEMPTS 3
+#define COUNTED_ATTEMPTS 50
+#define ATTEMPT_TIMEOUT_MS 5000
+#define MSG_BUF_SIZE 512
+
+// definition checked against extern declaration
+int verbose = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int counting;
+static long allocs;
+
+void *malloc(size_t size) {
+  allocs += counting;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocs += counting;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocs += counting;
+  return __libc_realloc(ptr, size);
+}
+
+// one enrolled client of the fake punch server
+struct client {
+  nt_ctx *ctx;
+  struct my_peer_info info;
+  int conn;
+  char in[MSG_BUF_SIZE];
+  size_t in_len;
+  int connected;
+  int failed;
+};
+
+static struct client clients[2];
+
+struct run {
+  const char *name;
+  nat_type type; // of the second context, the one connected to
+  int max_paths;
+};
+
+static const struct run runs[] = {
+    {"cone, 1 path", FullCone, 1},
+    {"symmetric, 1 path", SymmetricNAT, 1},
+    {"cone, 3 paths", FullCone, 3},
+    {"symmetric, 3 paths", SymmetricNAT, 3},
+};
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void reply(int conn, uint16_t type, uint8_t status, const void *body,
+                  size_t len) {
+  char buf[MSG_BUF_SIZE];
+  type = htons(type);
+  memcpy(buf, &type, sizeof(type));
+  buf[2] = status;
+  memcpy(buf + 3, body, len);
+  if (send(conn, buf, 3 + len, MSG_NOSIGNAL) != (ssize_t)(3 + len)) {
+    printf("fake server: send failed\n");
+    exit(1);
+  }
+}
+
+static struct client *client_of(uint32_t id) {
+  return id >= 1 && id <= 2 ? &clients[id - 1] : NULL;
+}
+
+// answers Enroll, GetPeerInfo and NotifyPeer like punch_server does, returns
+// the bytes used or 0 for an incomplete message
+static size_t serve(struct client *c, const char *msg, size_t len) {
+  uint16_t type;
+  uint32_t id;
+  if (len < sizeof(type)) {
+    return 0;
+  }
+  memcpy(&type, msg, sizeof(type));
+  type = ntohs(type);
+  if (type == Enroll) {
+    // ip, port, type, ip6, port6, meta length and meta
+    size_t need = 2 + IP_STR_LEN + 4 + IP_STR_LEN + 2 + 1;
+    if (len < need || len < need + (uint8_t)msg[need - 1]) {
+      return 0;
+    }
+    memcpy(c->info.ip, msg + 2, IP_STR_LEN);
+    memcpy(&c->info.port, msg + 2 + IP_STR_LEN, 2);
+    memcpy(&c->info.type, msg + 4 + IP_STR_LEN, 2);
+    c->info.len = 0;
+    char body[sizeof(id) + RESUME_TOKEN_LEN] = {0};
+    memcpy(body, &c->info.id, sizeof(id));
+    reply(c->conn, Enroll, StatusOK, body, sizeof(body));
+    return need + (uint8_t)msg[need - 1];
+  }
+  if (len < sizeof(type) + sizeof(id)) {
+    return 0;
+  }
+  memcpy(&id, msg + sizeof(type), sizeof(id));
+  struct client *peer = client_of(ntohl(id));
+  if (peer == NULL) {
+    printf("fake server: unexpected peer %d\n", ntohl(id));
+    exit(1);
+  }
+  if (type == GetPeerInfo) {
+    reply(c->conn, GetPeerInfo, StatusOK, &peer->info, sizeof(peer->info));
+  } else if (type == NotifyPeer) {
+    reply(peer->conn, NotifyPeer, StatusOK, &c->info, sizeof(c->info));
+    reply(c->conn, NotifyPeer, Delivered, &id, sizeof(id));
+  } else {
+    printf("fake server: unexpected message type %d\n", type);
+    exit(1);
+  }
+  return sizeof(type) + sizeof(id);
+}
+
+static void client_ready(struct client *c) {
+  ssize_t n = recv(c->conn, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+  if (n <= 0) {
+    printf("fake server: client gone\n");
+    exit(1);
+  }
+  c->in_len += n;
+  size_t used;
+  while ((used = serve(c, c->in, c->in_len)) > 0) {
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+  }
+}
+
+static void on_connected(nt_ctx *ctx, const struct peer_info *peer, int sock,
+                         void *user_data) {
+  struct client *c = user_data;
+  c->connected = 1;
+  close(sock);
+}
+
+static void on_failed(nt_ctx *ctx, const struct peer_info *peer, int reason,
+                      void *user_data) {
+  struct client *c = user_data;
+  c->failed = reason;
+}
+
+static void on_enrolled(nt_ctx *ctx, uint32_t id, void *user_data) {}
+
+// runs both contexts and the fake server until done() holds, -1 on timeout
+static int run_until(int (*done)(void), int listener) {
+  int64_t deadline = now_ms() + ATTEMPT_TIMEOUT_MS;
+  while (!done()) {
+    struct pollfd pfds[5] = {{nt_ctx_fd(clients[0].ctx), POLLIN, 0},
+                             {nt_ctx_fd(clients[1].ctx), POLLIN, 0},
+                             {clients[0].conn, POLLIN, 0},
+                             {clients[1].conn, POLLIN, 0},
+                             {listener, POLLIN, 0}};
+    int timeout = nt_ctx_timeout(clients[0].ctx);
+    int t = nt_ctx_timeout(clients[1].ctx);
+    if (timeout < 0 || (t >= 0 && t < timeout)) {
+      timeout = t;
+    }
+    if (timeout < 0 || timeout > 100) {
+      timeout = 100;
+    }
+    if (poll(pfds, 5, timeout) < 0 && errno != EINTR) {
+      return -1;
+    }
+    int i;
+    for (i = 0; i < 2; ++i) {
+      if (clients[i].conn >= 0 && (pfds[2 + i].revents & POLLIN)) {
+        client_ready(&clients[i]);
+      }
+    }
+    if (pfds[4].revents & POLLIN) {
+      // contexts connect in order, the first accepted is the first one
+      struct client *c = clients[0].conn < 0 ? &clients[0] : &clients[1];
+      c->conn = accept(listener, NULL, NULL);
+    }
+    if (nt_ctx_process(clients[0].ctx) < 0 ||
+        nt_ctx_process(clients[1].ctx) < 0) {
+      return -1;
+    }
+    if (now_ms() > deadline) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int both_connected(void) {
+  return clients[0].connected && clients[1].connected;
+}
+
+static int any_failed(void) { return clients[0].failed || clients[1].failed; }
+
+static int attempt_done(void) { return both_connected() || any_failed(); }
+
+static int both_enrolled(void) {
+  return clients[0].conn >= 0 && clients[1].conn >= 0 &&
+         clients[0].info.port != 0 && clients[1].info.port != 0;
+}
+
+// a port nothing listens on right now
+static uint16_t free_port(void) {
+  struct sockaddr_storage addr;
+  socklen_t len = make_sockaddr("127.0.0.1", 0, &addr);
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  bind(fd, (struct sockaddr *)&addr, len);
+  getsockname(fd, (struct sockaddr *)&addr, &len);
+  close(fd);
+  return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+}
+
+// enrolls both contexts as run says, then counts the allocations of the
+// attempts after the warm-up ones, -1 if an attempt failed
+static long count_run(const struct run *run, int listener,
+                      struct sockaddr_storage *server_addr,
+                      socklen_t server_len) {
+  int i;
+  for (i = 0; i < 2; ++i) {
+    struct client *c = &clients[i];
+    struct nt_callbacks callbacks = {on_enrolled, NULL, on_connected,
+                                     on_failed, c};
+    struct nt_config config;
+    memset(&config, 0, sizeof(config));
+    config.punch_server = (struct sockaddr *)server_addr;
+    config.punch_server_len = server_len;
+    config.ttl = 10;
+    config.local_port = free_port();
+    config.max_paths = run->max_paths;
+    memset(c, 0, sizeof(*c));
+    c->conn = -1;
+    c->info.id = htonl(i + 1);
+    c->ctx = nt_ctx_new(&config, &callbacks);
+
+    // both ends see each other at their local ports, as behind a full cone.
+    // The initiator stays one, probing from its single socket, while a
+    // symmetric peer opens a socket for each hole towards it
+    struct peer_info self;
+    char meta[] = "";
+    memset(&self, 0, sizeof(self));
+    self.meta = meta;
+    strcpy(self.ip, "127.0.0.1");
+    self.port = config.local_port;
+    self.type = i == 1 ? run->type : FullCone;
+    if (c->ctx == NULL || nt_enroll(c->ctx, &self) < 0) {
+      printf("%s: failed to enroll\n", run->name);
+      return -1;
+    }
+    // accepted before the next client connects, in order
+    while (c->conn < 0) {
+      c->conn = accept(listener, NULL, NULL);
+    }
+  }
+  if (run_until(both_enrolled, listener) < 0) {
+    printf("%s: enrolling timed out\n", run->name);
+    return -1;
+  }
+
+  long total = 0;
+  for (i = 0; i < WARMUP_ATTEMPTS + COUNTED_ATTEMPTS; ++i) {
+    int counted = i >= WARMUP_ATTEMPTS;
+    clients[0].connected = clients[1].connected = 0;
+    clients[0].failed = clients[1].failed = 0;
+    allocs = 0;
+    counting = counted;
+    if (nt_connect(clients[0].ctx, 2) < 0 ||
+        run_until(attempt_done, listener) < 0 || !both_connected()) {
+      counting = 0;
+      printf("%s: attempt %d failed, reasons %d and %d\n", run->name, i,
+             clients[0].failed, clients[1].failed);
+      return -1;
+    }
+    counting = 0;
+    if (counted) {
+      total += allocs;
+    }
+  }
+  for (i = 0; i < 2; ++i) {
+    nt_ctx_free(clients[i].ctx);
+    close(clients[i].conn);
+  }
+  printf("%s: %d attempts after %d warm-up ones, %ld allocations\n",
+         run->name, COUNTED_ATTEMPTS, WARMUP_ATTEMPTS, total);
+  return total;
+}
+
+int main(void) {
+  struct sockaddr_storage server_addr;
+  socklen_t server_len = make_sockaddr("127.0.0.1", 0, &server_addr);
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&server_addr, server_len) < 0 ||
+      listen(listener, 2) < 0 ||
+      getsockname(listener, (struct sockaddr *)&server_addr, &server_len) <
+          0) {
+    printf("failed to start the fake punch server\n");
+    return 1;
+  }
+
+  size_t i;
+  int failed = 0;
+  for (i = 0; i < sizeof(runs) / sizeof(runs[0]); ++i) {
+    if (count_run(&runs[i], listener, &server_addr, server_len) != 0) {
+      failed = 1;
+    }
+  }
+  close(listener);
+  return failed;
+}
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN (sizeof(max_align_t))
+
+void arena_init(struct arena *a, void *block, size_t size) {
+  a->base = block;
+  a->size = size;
+  a->used = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+  size_t start = (a->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (start > a->size || size > a->size - start) {
+    return NULL;
+  }
+  a->used = start + size;
+  memset(a->base + start, 0, size);
+  return a->base + start;
+}
+
+void arena_reset(struct arena *a) { a->used = 0; }
+
+void arena_pool_init(struct arena_pool *p, size_t block_size, size_t max_free) {
+  p->free_list = NULL;
+  // a free block stores the link to the next one in its first bytes
+  p->block_size = block_size < sizeof(void *) ? sizeof(void *) : block_size;
+  p->max_free = max_free;
+  p->n_free = 0;
+}
+
+void *arena_pool_get(struct arena_pool *p) {
+  void *block = p->free_list;
+  if (block == NULL) {
+    return malloc(p->block_size);
+  }
+  memcpy(&p->free_list, block, sizeof(void *));
+  --p->n_free;
+  return block;
+}
+
+void arena_pool_put(struct arena_pool *p, void *block) {
+  if (p->n_free >= p->max_free) {
+    free(block);
+    return;
+  }
+  memcpy(block, &p->free_list, sizeof(void *));
+  p->free_list = block;
+  ++p->n_free;
+}
+
+void arena_pool_destroy(struct arena_pool *p) {
+  while (p->free_list != NULL) {
+    void *block = p->free_list;
+    memcpy(&p->free_list, block, sizeof(void *));
+    free(block);
+  }
+  p->n_free = 0;
+}
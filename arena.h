@@ -0,0 +1,29 @@
+#include <stddef.h>
+
+// bump allocator over one block, everything allocated from it is released at
+// once by handing the block back
+struct arena {
+  char *base;
+  size_t size;
+  size_t used;
+};
+
+void arena_init(struct arena *a, void *block, size_t size);
+// zeroed memory aligned for any type, NULL once the block is exhausted
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+
+// fixed size blocks recycled through a free list, so that after warming up
+// getting and putting a block never reaches malloc()
+struct arena_pool {
+  void *free_list;
+  size_t block_size;
+  // blocks beyond this many idle ones are returned to the system
+  size_t max_free;
+  size_t n_free;
+};
+
+void arena_pool_init(struct arena_pool *p, size_t block_size, size_t max_free);
+void *arena_pool_get(struct arena_pool *p);
+void arena_pool_put(struct arena_pool *p, void *block);
+void arena_pool_destroy(struct arena_pool *p);
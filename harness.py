@@ -0,0 +1,672 @@
+#!/usr/bin/env python3
+"""harness.py, end to end checks of nat_traversal on a single host.
+
+The real client binaries run against the punch server and a STUN responder
+started here. Peers sit on loopback or in network namespaces joined by veth
+pairs, and the namespace cases need root.
+
+  harness.py ipv6   the IPv6 direct path wins on ::1 and across a netns
+                    pair, and the IPv4 punch takes over when IPv6 is
+                    unreachable. Needs the VERBOSE client, which logs the
+                    path it connected on: make test-ipv6
+  harness.py tunnel UDP round trips, UDP packet rate and TCP throughput
+                    through -L forwards to a peer in a netns, next to the
+                    same traffic sent raw over the veth pair, then
+                    connections reset in the middle of a transfer: make
+                    bench-tunnel
+  harness.py relay  peers in two netns asking for a relay at once, the
+                    direct path held back until the relay connected.
+                    The tunnel has to move to the punched hole once it
+                    connects and keep forwarding, through nat_traversal
+                    and through nat_traversald. Needs the VERBOSE
+                    binaries: make test-relay
+  harness.py failover
+                    peers in and out of a netns keeping the IPv6 direct
+                    path and the IPv4 hole. The path in use is blackholed
+                    towards b, which has to fail over to the other one,
+                    through nat_traversal and through nat_traversald. A
+                    path is given up after a minute of silence. Needs the
+                    VERBOSE binaries: make test-failover
+  harness.py vpn    TCP streams between a netns pair routed through the
+                    TUN interfaces of two peers, one stream per queue, and
+                    the Gbit/s of each queue and core: make bench-vpn.
+                    QUEUES sets the queues, up to 4 by default
+
+NT and PUNCH_SERVER point at the binaries, ./nat_traversal and
+./punch_server by default. Logs are kept in a temporary directory, which
+is printed when a check fails.
+"""
+
+import os
+import re
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+NT = os.environ.get("NT", "./nat_traversal")
+NTD = os.environ.get("NTD", "./nat_traversald")
+PUNCH_SERVER = os.environ.get("PUNCH_SERVER", "./punch_server")
+STUN_PORT = 3478
+CONNECT_TIMEOUT = 15
+
+logs = tempfile.mkdtemp(prefix="nt_harness.")
+procs = []
+namespaces = []
+
+
+def stun_responder(family):
+    """answers binding requests with the address they came from, in a
+    MAPPED-ADDRESS"""
+    s = socket.socket(family, socket.SOCK_DGRAM)
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if family == socket.AF_INET6:
+        s.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 1)
+        s.bind(("::", STUN_PORT))
+    else:
+        s.bind(("0.0.0.0", STUN_PORT))
+
+    def serve():
+        while True:
+            data, addr = s.recvfrom(512)
+            if len(data) < 20:
+                continue
+            ip, port = addr[0], addr[1]
+            if family == socket.AF_INET6:
+                body = struct.pack("!HHBBH", 1, 20, 0, 2, port)
+                body += socket.inet_pton(socket.AF_INET6, ip)
+            else:
+                body = struct.pack("!HHBBH", 1, 8, 0, 1, port)
+                body += socket.inet_aton(ip)
+            reply = struct.pack("!HH", 0x0101, len(body)) + data[4:20] + body
+            s.sendto(reply, addr)
+
+    threading.Thread(target=serve, daemon=True).start()
+
+
+def start(name, args, netns=None):
+    """runs args in the background, line buffered into the log name"""
+    cmd = ["stdbuf", "-oL"] + args
+    if netns is not None:
+        cmd = ["ip", "netns", "exec", netns] + cmd
+    log = open(os.path.join(logs, name + ".log"), "wb")
+    p = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+    p.log = log.name
+    procs.append(p)
+    return p
+
+
+def stop_all():
+    for p in procs:
+        if p.poll() is None:
+            p.kill()
+        p.wait()
+    del procs[:]
+
+
+def sh(cmd):
+    subprocess.run(cmd, shell=True, check=True)
+
+
+def add_netns(name):
+    subprocess.run(["ip", "netns", "del", name], stderr=subprocess.DEVNULL)
+    sh("ip netns add %s && ip -n %s link set lo up" % (name, name))
+    namespaces.append(name)
+
+
+def del_netns():
+    for name in namespaces:
+        subprocess.run(["ip", "netns", "del", name])
+    del namespaces[:]
+
+
+def veth(ns, root_name, ns_name, prefix, ip6):
+    """a veth pair from the root namespace into ns, with the addresses
+    prefix.1 and ip6::1 on the root side, prefix.2 and ip6::2 in ns"""
+    sh("ip link add %s type veth peer name %s netns %s"
+       % (root_name, ns_name, ns))
+    sh("ip addr add %s.1/24 dev %s" % (prefix, root_name))
+    sh("ip -6 addr add %s::1/64 dev %s nodad" % (ip6, root_name))
+    sh("ip link set %s up" % root_name)
+    sh("ip -n %s addr add %s.2/24 dev %s" % (ns, prefix, ns_name))
+    sh("ip -n %s -6 addr add %s::2/64 dev %s nodad" % (ns, ip6, ns_name))
+    sh("ip -n %s link set %s up" % (ns, ns_name))
+
+
+def wait_for(p, pattern, timeout=CONNECT_TIMEOUT):
+    """the first match of pattern in the log of p, None on timeout"""
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        with open(p.log, errors="replace") as f:
+            m = re.search(pattern, f.read())
+        if m is not None:
+            return m
+        if p.poll() is not None:
+            return None
+        time.sleep(0.1)
+    return None
+
+
+def start_pair(server, a_args, b_args, a_ns=None, b_ns=None, port=40001,
+               b_server=None):
+    """a punch server, then peer a enrolled and peer b connecting to it.
+    b_server is the server's address from b, server by default"""
+    b_server = b_server or server
+    srv = start("punch_server", [PUNCH_SERVER, "-v"])
+    time.sleep(0.5)
+    a = start("a", [NT, "-s", server, "-H", server, "-p", str(port)] + a_args,
+              a_ns)
+    m = wait_for(srv, r"New peer enrolled map\[ID:(\d+)")
+    if m is None:
+        raise RuntimeError("peer a didn't enroll, logs in " + logs)
+    b = start("b", [NT, "-s", b_server, "-H", b_server, "-p", str(port + 1),
+                    "-d", m.group(1)] + b_args, b_ns)
+    return a, b
+
+
+def echo_endpoints():
+    """echoes TCP on port 7001 and UDP on 7003 until killed"""
+    def tcp_conn(c):
+        while True:
+            d = c.recv(1 << 20)
+            if not d:
+                break
+            c.sendall(d)
+        c.close()
+
+    def tcp():
+        s = socket.socket()
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        s.bind(("0.0.0.0", 7001))
+        s.listen(16)
+        while True:
+            c, _ = s.accept()
+            threading.Thread(target=tcp_conn, args=(c,), daemon=True).start()
+
+    threading.Thread(target=tcp, daemon=True).start()
+    u = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    u.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+    u.bind(("0.0.0.0", 7003))
+    while True:
+        d, a = u.recvfrom(65536)
+        u.sendto(d, a)
+
+
+def udp_echoes(addr, timeout):
+    """whether a datagram to addr comes back within timeout seconds"""
+    u = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    u.settimeout(0.2)
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        u.sendto(b"ping", addr)
+        try:
+            if u.recv(16) == b"ping":
+                return True
+        except socket.timeout:
+            pass
+    return False
+
+
+def udp_rtt(addr, n=2000, size=1000):
+    """mean microseconds of a datagram there and back, one at a time"""
+    u = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    u.settimeout(1)
+    data = b"x" * size
+    t0 = time.time()
+    for i in range(n):
+        u.sendto(data, addr)
+        u.recv(2048)
+    return (time.time() - t0) / n * 1e6
+
+
+def udp_rate(addr, n=200000, size=1200):
+    """datagrams echoed and the rate they were sent at, back to back"""
+    u = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    u.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+    u.settimeout(0.5)
+    got = [0]
+
+    def receive():
+        try:
+            while True:
+                u.recv(2048)
+                got[0] += 1
+        except socket.timeout:
+            pass
+
+    t = threading.Thread(target=receive)
+    t.start()
+    data = b"x" * size
+    t0 = time.time()
+    for i in range(n):
+        u.sendto(data, addr)
+    pps = n / (time.time() - t0)
+    t.join()
+    return got[0] * 100.0 / n, pps
+
+
+def tcp_bulk(addr, size=200 << 20):
+    """MB/s echoed through addr, and whether it all came back intact"""
+    c = socket.create_connection(addr)
+    chunk = os.urandom(1 << 20)
+    got = [0, True]
+
+    def receive():
+        while got[0] < size:
+            d = c.recv(1 << 20)
+            if not d:
+                break
+            off = got[0] % len(chunk)
+            expected = (chunk * 2)[off:off + len(d)]
+            got[1] = got[1] and d == expected
+            got[0] += len(d)
+
+    t = threading.Thread(target=receive)
+    t.start()
+    t0 = time.time()
+    for i in range(size // len(chunk)):
+        c.sendall(chunk)
+    t.join(120)
+    dt = time.time() - t0
+    c.close()
+    return got[0] / dt / 1e6, got[0] == size and got[1]
+
+
+def tcp_churn(addr, conns=2400, threads=8):
+    """connections through addr reset with data in flight, so that flows
+    die while the tunnel still has their frames and events in hand"""
+    linger = struct.pack("ii", 1, 0)
+
+    def churn():
+        for i in range(conns // threads):
+            try:
+                c = socket.create_connection(addr, timeout=2)
+                c.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, linger)
+                c.sendall(b"x" * 200000)
+                if i % 2:
+                    c.recv(1000)
+                c.close()
+            except OSError:
+                pass
+
+    ts = [threading.Thread(target=churn) for _ in range(threads)]
+    for t in ts:
+        t.start()
+    for t in ts:
+        t.join()
+
+
+def sink(port=5001):
+    """reads TCP streams on port and throws them away until killed"""
+    def drain(c):
+        while c.recv(1 << 20):
+            pass
+
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(("0.0.0.0", port))
+    s.listen(64)
+    while True:
+        c, _ = s.accept()
+        threading.Thread(target=drain, args=(c,), daemon=True).start()
+
+
+def source(host, streams, seconds, port=5001):
+    """prints the Gbit/s of streams TCP streams to host, sent for seconds"""
+    chunk = b"x" * (1 << 20)
+    sent = [0] * streams
+
+    def send(i):
+        c = socket.create_connection((host, port))
+        deadline = time.time() + seconds
+        while time.time() < deadline:
+            c.sendall(chunk)
+            sent[i] += len(chunk)
+        c.close()
+
+    threads = [threading.Thread(target=send, args=(i,))
+               for i in range(streams)]
+    t0 = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    print("%d streams: %.3f Gbit/s" % (streams,
+                                       sum(sent) * 8 / (time.time() - t0) / 1e9))
+
+
+failures = 0
+
+
+def check(what, ok):
+    global failures
+    print("%s: %s" % (what, "ok" if ok else "FAILED"))
+    if not ok:
+        failures += 1
+
+
+def connected_from(p):
+    m = wait_for(p, r"connected with peer from (\S+):\d+")
+    return m.group(1) if m is not None else None
+
+
+def test_ipv6():
+    stun_responder(socket.AF_INET)
+
+    # both ends on loopback, the direct path on ::1
+    a, b = start_pair("127.0.0.1", ["-I", "::1"], ["-I", "::1"])
+    check("loopback, ::1 direct path",
+          connected_from(a) == "::1" and connected_from(b) == "::1")
+    stop_all()
+
+    # one end in a namespace, both paths through a veth pair
+    add_netns("nt6")
+    try:
+        veth("nt6", "nt6a", "nt6b", "10.76.0", "fd00:6")
+        a, b = start_pair("10.76.0.1", ["-I", "fd00:6::1"],
+                          ["-I", "fd00:6::2"], b_ns="nt6")
+        check("netns, fd00:6:: direct path",
+              connected_from(a) == "fd00:6::2" and
+              connected_from(b) == "fd00:6::1")
+        stop_all()
+
+        # IPv6 advertised but blackholed, the IPv4 punch wins the race
+        sh("ip -n nt6 -6 route add blackhole fd00:6::1/128")
+        a, b = start_pair("10.76.0.1", ["-I", "fd00:6::1"],
+                          ["-I", "fd00:6::2"], b_ns="nt6")
+        check("netns, IPv6 unreachable, IPv4 punch",
+              connected_from(a) == "10.76.0.2" and
+              connected_from(b) == "10.76.0.1")
+        stop_all()
+    finally:
+        stop_all()
+        del_netns()
+
+
+def bench_tunnel():
+    stun_responder(socket.AF_INET)
+    add_netns("ntt")
+    veth("ntt", "ntta", "nttb", "10.75.0", "fd00:5")
+    start("echo", [sys.executable, __file__, "echo"], "ntt")
+    peers = start_pair("10.75.0.1", ["-T"],
+                       ["-L", "127.0.0.1:7000:127.0.0.1:7001",
+                        "-L", "udp:127.0.0.1:7002:127.0.0.1:7003"],
+                       a_ns="ntt")
+    raw = {"tcp": ("10.75.0.2", 7001), "udp": ("10.75.0.2", 7003)}
+    tunnel = {"tcp": ("127.0.0.1", 7000), "udp": ("127.0.0.1", 7002)}
+    check("tunnel up", udp_echoes(tunnel["udp"], CONNECT_TIMEOUT))
+    if failures:
+        return
+    for name, path in (("raw", raw), ("tunnel", tunnel)):
+        rtt = udp_rtt(path["udp"])
+        echoed, pps = udp_rate(path["udp"])
+        mbps, intact = tcp_bulk(path["tcp"])
+        print("%-6s udp rtt %4.0f us, udp %6.0f pps sent %5.1f%% echoed, "
+              "tcp %5.0f MB/s%s" % (name, rtt, pps, echoed, mbps,
+                                    "" if intact else " CORRUPTED"))
+        check(name + " tcp stream intact", intact)
+    tcp_churn(tunnel["tcp"])
+    time.sleep(1)
+    check("tunnel survives reset connections",
+          all(p.poll() is None for p in peers) and
+          udp_echoes(tunnel["udp"], CONNECT_TIMEOUT))
+
+
+def mac(dev, netns=None):
+    cmd = ["cat", "/sys/class/net/%s/address" % dev]
+    if netns is not None:
+        cmd = ["ip", "netns", "exec", netns] + cmd
+    out = subprocess.run(cmd, capture_output=True, text=True, check=True)
+    return bytes.fromhex(out.stdout.strip().replace(":", ""))
+
+
+def gate(dev_in, dev_out, ns, ns_dev, dst, opened):
+    """forwards the IPv4 frames for dst coming in on dev_in out of dev_out,
+    to ns_dev in ns on the other end, but only once opened is set. The
+    kernel doesn't forward them, ip_forward is off"""
+    r = socket.socket(socket.AF_PACKET, socket.SOCK_RAW, socket.htons(0x800))
+    r.bind((dev_in, 0))
+    w = socket.socket(socket.AF_PACKET, socket.SOCK_RAW)
+    w.bind((dev_out, 0))
+    header = mac(ns_dev, ns) + mac(dev_out)
+    dst = socket.inet_aton(dst)
+
+    def pump():
+        while True:
+            try:
+                frame, addr = r.recvfrom(65536)
+            except OSError:
+                return  # the namespaces are gone
+            if addr[2] != socket.PACKET_HOST or frame[30:34] != dst:
+                continue
+            frame = bytearray(frame)
+            if frame[23] == socket.IPPROTO_UDP:
+                # veth leaves the checksum to the receiver, sent on it would
+                # be wrong. Zero is none for UDP over IPv4
+                udp = 14 + (frame[14] & 0xf) * 4
+                frame[udp + 6:udp + 8] = b"\0\0"
+            opened.wait()
+            w.send(header + frame[12:])
+
+    threading.Thread(target=pump, daemon=True).start()
+
+
+def test_relay():
+    stun_responder(socket.AF_INET)
+    forwarding = open("/proc/sys/net/ipv4/ip_forward").read().strip()
+    add_netns("ntra")
+    add_netns("ntrb")
+    try:
+        # a and b reach each other through this namespace, where the punch
+        # server runs. The probes of the punch are held back until the
+        # relay connected
+        sh("sysctl -qw net.ipv4.ip_forward=0")
+        veth("ntra", "ntraa", "ntrab", "10.71.0", "fd00:71")
+        veth("ntrb", "ntrba", "ntrbb", "10.72.0", "fd00:72")
+        sh("ip -n ntra route add default via 10.71.0.1")
+        sh("ip -n ntrb route add default via 10.72.0.1")
+        opened = threading.Event()
+        gate("ntraa", "ntrba", "ntrb", "ntrbb", "10.72.0.2", opened)
+        gate("ntrba", "ntraa", "ntra", "ntrab", "10.71.0.2", opened)
+        forward = "udp:10.72.0.2:7002:127.0.0.1:7003"
+        relayed = r"relaying to peer"
+        moved = r"tunnel moved to another path"
+
+        def peer_a():
+            srv = start("punch_server", [PUNCH_SERVER, "-v"])
+            time.sleep(0.5)
+            start("echo", [sys.executable, __file__, "echo"], "ntra")
+            a = start("a", [NT, "-s", "10.71.0.1", "-H", "10.71.0.1", "-p",
+                            "40001", "-T", "-r", "0"], "ntra")
+            m = wait_for(srv, r"New peer enrolled map\[ID:(\d+)")
+            if m is None:
+                raise RuntimeError("peer a didn't enroll, logs in " + logs)
+            return a, m.group(1)
+
+        a, peer = peer_a()
+        b = start("b", [NT, "-s", "10.72.0.1", "-H", "10.72.0.1", "-p",
+                        "40002", "-r", "0", "-d", peer, "-L", forward],
+                  "ntrb")
+        check("relayed first",
+              wait_for(a, relayed) is not None and
+              wait_for(b, relayed) is not None)
+        opened.set()
+        check("tunnel moved to the hole",
+              wait_for(a, moved) is not None and
+              wait_for(b, moved) is not None)
+        check("tunnel forwards after the move",
+              udp_echoes(("10.72.0.2", 7002), CONNECT_TIMEOUT))
+        stop_all()
+
+        # the same through nat_traversald on b's side, which passes the
+        # hole on to the client it handed the relay to
+        opened.clear()
+        a, peer = peer_a()
+        path = os.path.join(logs, "ntd.sock")
+        ntd = start("nat_traversald", [NTD, "-s", "10.72.0.1", "-H",
+                                       "10.72.0.1", "-p", "40002", "-r", "0",
+                                       "-S", path], "ntrb")
+        if wait_for(ntd, r"listening on") is None:
+            raise RuntimeError("nat_traversald didn't start, logs in " + logs)
+        c = start("client", [NT, "-x", path, "-d", peer, "-L", forward],
+                  "ntrb")
+        check("daemon relayed first",
+              wait_for(a, relayed) is not None and
+              wait_for(ntd, relayed) is not None)
+        opened.set()
+        check("daemon client moved to the hole",
+              wait_for(c, moved) is not None and wait_for(a, moved) is not None)
+        check("daemon client forwards after the move",
+              udp_echoes(("10.72.0.2", 7002), CONNECT_TIMEOUT))
+    finally:
+        stop_all()
+        del_netns()
+        sh("sysctl -qw net.ipv4.ip_forward=" + forwarding)
+
+
+def test_failover():
+    stun_responder(socket.AF_INET)
+    add_netns("ntf")
+    try:
+        veth("ntf", "ntfa", "ntfb", "10.77.0", "fd00:77")
+        forward = "udp:127.0.0.1:7002:127.0.0.1:7003"
+        moved = r"tunnel moved to another path"
+
+        def break_path(a):
+            # b stops hearing a on the promoted path only, so b is the one
+            # failing over
+            m = wait_for(a, r"connected with peer from (\S+):\d+")
+            ip = "fd00:77::1/128" if ":" in m.group(1) else "10.77.0.1/32"
+            sh("ip -n ntf route add blackhole " + ip)
+
+        a, b = start_pair("10.77.0.1", ["-T", "-k", "2", "-I", "fd00:77::2"],
+                          ["-k", "2", "-I", "fd00:77::1", "-L", forward],
+                          a_ns="ntf")
+        start("echo", [sys.executable, __file__, "echo"], "ntf")
+        check("standby path kept",
+              wait_for(a, r"standby path to peer") is not None and
+              udp_echoes(("127.0.0.1", 7002), CONNECT_TIMEOUT))
+        break_path(a)
+        check("failed over to the standby",
+              wait_for(b, r"failed over to a standby", 90) is not None and
+              wait_for(a, moved) is not None)
+        check("tunnel forwards after failing over",
+              udp_echoes(("127.0.0.1", 7002), CONNECT_TIMEOUT))
+        stop_all()
+        sh("ip -n ntf route flush type blackhole")
+        sh("ip -n ntf -6 route flush type blackhole")
+
+        # the same with nat_traversald in place of b, the client asks it
+        # for the standby
+        srv = start("punch_server", [PUNCH_SERVER, "-v"])
+        time.sleep(0.5)
+        start("echo", [sys.executable, __file__, "echo"], "ntf")
+        a = start("a", [NT, "-s", "10.77.0.1", "-H", "10.77.0.1", "-p",
+                        "40001", "-T", "-k", "2", "-I", "fd00:77::2"], "ntf")
+        m = wait_for(srv, r"New peer enrolled map\[ID:(\d+)")
+        path = os.path.join(logs, "ntd.sock")
+        ntd = start("nat_traversald", [NTD, "-s", "10.77.0.1", "-H",
+                                       "10.77.0.1", "-p", "40002", "-k", "2",
+                                       "-I", "fd00:77::1", "-S", path])
+        if m is None or wait_for(ntd, r"listening on") is None:
+            raise RuntimeError("peers didn't enroll, logs in " + logs)
+        c = start("client", [NT, "-x", path, "-d", m.group(1), "-L",
+                             forward])
+        check("daemon keeps a standby path",
+              wait_for(a, r"standby path to peer") is not None and
+              udp_echoes(("127.0.0.1", 7002), CONNECT_TIMEOUT))
+        break_path(a)
+        check("daemon client failed over to the standby",
+              wait_for(c, r"failed over to a standby", 90) is not None and
+              wait_for(a, moved) is not None)
+        check("daemon client forwards after failing over",
+              udp_echoes(("127.0.0.1", 7002), CONNECT_TIMEOUT))
+    finally:
+        stop_all()
+        del_netns()
+
+
+def busiest_report(p, direction):
+    """the queue lines of the report of p with the most Gbit/s in direction,
+    and that total"""
+    reports, report, last = [], [], -1
+    pattern = r"queue (\d+) cpu (\d+): tx ([\d.]+) Gbit/s .*rx ([\d.]+) Gbit/s"
+    with open(p.log, errors="replace") as f:
+        for line in f:
+            m = re.match(pattern, line)
+            if m is None:
+                continue
+            # queues are printed in order, a lower one starts a new report
+            if int(m.group(1)) <= last:
+                reports.append(report)
+                report = []
+            last = int(m.group(1))
+            gbits = float(m.group(3 if direction == "tx" else 4))
+            report.append((line.strip(), gbits))
+    reports.append(report)
+    best = max(reports, key=lambda r: sum(g for _, g in r))
+    return [line for line, _ in best], sum(g for _, g in best)
+
+
+def bench_vpn():
+    queues = int(os.environ.get("QUEUES", min(4, os.cpu_count())))
+    stun_responder(socket.AF_INET)
+    add_netns("ntva")
+    add_netns("ntvb")
+    a, b = start_pair("127.0.0.1", ["-N", "ntva", "-Q", str(queues)],
+                      ["-N", "ntvb", "-Q", str(queues)])
+    routed = r"routing to the peer through"
+    check("tun interfaces up",
+          wait_for(a, routed) is not None and wait_for(b, routed) is not None)
+    if failures:
+        return
+    # the peers stay here, their interfaces go into the namespaces
+    for i, ns in enumerate(("ntva", "ntvb")):
+        sh("ip link set %s netns %s" % (ns, ns))
+        sh("ip -n %s addr add 10.74.0.%d/24 dev %s" % (ns, i + 1, ns))
+        sh("ip -n %s link set %s up" % (ns, ns))
+    start("sink", [sys.executable, __file__, "sink"], "ntvb")
+    time.sleep(0.5)
+    # the peers report every 5 s, a full report falls inside the streams
+    out = subprocess.run(["ip", "netns", "exec", "ntva", sys.executable,
+                          __file__, "source", "10.74.0.2", str(queues), "12"],
+                         capture_output=True, text=True).stdout
+    print(out.strip())
+    check("streams sent", "Gbit/s" in out)
+    time.sleep(1)
+    for name, p, direction in (("sender", a, "tx"), ("receiver", b, "rx")):
+        lines, total = busiest_report(p, direction)
+        print("%s %s %.3f Gbit/s, per queue:" % (name, direction, total))
+        for line in lines:
+            print("  " + line)
+
+
+def main():
+    if sys.argv[1:] == ["echo"]:
+        echo_endpoints()
+    if sys.argv[1:] == ["sink"]:
+        sink()
+    if len(sys.argv) == 5 and sys.argv[1] == "source":
+        source(sys.argv[2], int(sys.argv[3]), float(sys.argv[4]))
+        return 0
+    tests = {"ipv6": test_ipv6, "tunnel": bench_tunnel, "relay": test_relay,
+             "failover": test_failover, "vpn": bench_vpn}
+    if len(sys.argv) != 2 or sys.argv[1] not in tests:
+        print(__doc__)
+        return 2
+    try:
+        tests[sys.argv[1]]()
+    finally:
+        stop_all()
+        del_netns()
+    if failures:
+        print("logs in", logs)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
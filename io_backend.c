@@ -0,0 +1,114 @@
+#define _GNU_SOURCE // sendmmsg()
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "io_backend.h"
+#include "utils.h"
+
+const char punch_probe = 'c';
+
+static int sync_socket(struct io_backend *io, int domain, int type,
+                       int protocol) {
+  return socket(domain, type, protocol);
+}
+
+static int sync_setsockopt(struct io_backend *io, int fd, int level,
+                           int optname, const void *optval,
+                           socklen_t optlen) {
+  return setsockopt(fd, level, optname, optval, optlen);
+}
+
+static int sync_bind(struct io_backend *io, int fd,
+                     const struct sockaddr *addr, socklen_t addr_len) {
+  return bind(fd, addr, addr_len);
+}
+
+static int sync_connect(struct io_backend *io, int fd,
+                        const struct sockaddr *addr, socklen_t addr_len) {
+  return connect(fd, addr, addr_len);
+}
+
+static ssize_t sync_sendto(struct io_backend *io, int fd, const void *buf,
+                           size_t len, int flags, const struct sockaddr *addr,
+                           socklen_t addr_len) {
+  return sendto(fd, buf, len, flags, addr, addr_len);
+}
+
+static int sync_sendmmsg(struct io_backend *io, int fd, struct mmsghdr *msgs,
+                         unsigned int vlen, int flags) {
+  return sendmmsg(fd, msgs, vlen, flags);
+}
+
+static ssize_t sync_recvfrom(struct io_backend *io, int fd, void *buf,
+                             size_t len, int flags, struct sockaddr *addr,
+                             socklen_t *addr_len) {
+  return recvfrom(fd, buf, len, flags, addr, addr_len);
+}
+
+static int sync_close(struct io_backend *io, int fd) { return close(fd); }
+
+static int sync_punch(struct io_backend *io, int epfd, struct punch_op *ops,
+                      int n) {
+  int i, opened = 0;
+  for (i = 0; i < n; ++i) {
+    struct punch_op *op = &ops[i];
+    op->fd = socket(op->dst.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (op->fd < 0) {
+      op->err = errno;
+      continue;
+    }
+    if (op->ttl > 0) {
+      if (op->dst.ss_family == AF_INET6) {
+        setsockopt(op->fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &op->ttl,
+                   sizeof(op->ttl));
+      } else {
+        setsockopt(op->fd, IPPROTO_IP, IP_TTL, &op->ttl, sizeof(op->ttl));
+      }
+    }
+    if (op->ifname != NULL &&
+        setsockopt(op->fd, SOL_SOCKET, SO_BINDTODEVICE, op->ifname,
+                   strlen(op->ifname))) {
+      op->err = errno;
+      close(op->fd);
+      op->fd = -1;
+      continue;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = op->tag;
+    int sent = sendto(op->fd, &punch_probe, 1, 0,
+                      (struct sockaddr *)&op->dst, op->dst_len);
+    op->sent_ns = wall_ns();
+    if (sent < 0 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, op->fd, &ev)) {
+      op->err = errno;
+      close(op->fd);
+      op->fd = -1;
+      continue;
+    }
+    ++opened;
+  }
+  return opened;
+}
+
+static void sync_destroy(struct io_backend *io) {}
+
+static struct io_backend sync_backend = {
+    .name = "sync",
+    .socket = sync_socket,
+    .setsockopt = sync_setsockopt,
+    .bind = sync_bind,
+    .connect = sync_connect,
+    .sendto = sync_sendto,
+    .sendmmsg = sync_sendmmsg,
+    .recvfrom = sync_recvfrom,
+    .close = sync_close,
+    .punch = sync_punch,
+    .destroy = sync_destroy,
+};
+
+struct io_backend *io_backend_sync(void) { return &sync_backend; }
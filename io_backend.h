@@ -0,0 +1,65 @@
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Socket level I/O of the client goes through a backend, so that the
+ * operations of many holes can be batched when the platform allows it.
+ * Single operations map one to one to syscalls in every backend, only punch()
+ * differs.
+ */
+
+// one hole: a new non-blocking UDP socket that sends one probe to dst and is
+// then armed for readability on an epoll instance
+struct punch_op {
+  struct sockaddr_storage dst;
+  socklen_t dst_len;
+  // ttl of the probe, <= 0 keeps the default
+  int ttl;
+  // interface the socket is bound to, NULL for any
+  const char *ifname;
+  // epoll data of the new socket
+  void *tag;
+  // the new socket, -1 if any step failed
+  int fd;
+  // errno of the failed step
+  int err;
+  // traversal attempt of the hole, for recordings
+  uint32_t attempt;
+  // wall clock time of the probe in nanoseconds, set by punch()
+  int64_t sent_ns;
+};
+
+// glibc declares it with _GNU_SOURCE only
+struct mmsghdr;
+
+struct io_backend {
+  const char *name;
+  int (*socket)(struct io_backend *io, int domain, int type, int protocol);
+  int (*setsockopt)(struct io_backend *io, int fd, int level, int optname,
+                    const void *optval, socklen_t optlen);
+  int (*bind)(struct io_backend *io, int fd, const struct sockaddr *addr,
+              socklen_t addr_len);
+  int (*connect)(struct io_backend *io, int fd, const struct sockaddr *addr,
+                 socklen_t addr_len);
+  ssize_t (*sendto)(struct io_backend *io, int fd, const void *buf, size_t len,
+                    int flags, const struct sockaddr *addr, socklen_t addr_len);
+  // sends vlen datagrams from one socket, returns the number sent
+  int (*sendmmsg)(struct io_backend *io, int fd, struct mmsghdr *msgs,
+                  unsigned int vlen, int flags);
+  ssize_t (*recvfrom)(struct io_backend *io, int fd, void *buf, size_t len,
+                      int flags, struct sockaddr *addr, socklen_t *addr_len);
+  int (*close)(struct io_backend *io, int fd);
+  // performs every op, returns the number of holes opened
+  int (*punch)(struct io_backend *io, int epfd, struct punch_op *ops, int n);
+  void (*destroy)(struct io_backend *io);
+};
+
+// plain blocking syscalls, shared and never destroyed
+struct io_backend *io_backend_sync(void);
+// batches punch() into a few io_uring submissions, NULL if the kernel or the
+// build doesn't support it
+struct io_backend *io_backend_uring(unsigned int entries);
+
+// the one byte probe sent by punch()
+extern const char punch_probe;
@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "io_backend.h"
+#include "utils.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef SOCKET_URING_OP_SETSOCKOPT
+// since linux 6.7, older headers don't know it
+#define SOCKET_URING_OP_SETSOCKOPT 3
+#endif
+
+// holes handled per submission, each takes up to three sqes
+#define URING_CHUNK 64
+
+enum punch_step {
+  STEP_SOCKET,
+  STEP_TTL,
+  STEP_SEND,
+  STEP_EPOLL,
+};
+
+struct uring_backend {
+  struct io_backend base;
+  int ring_fd;
+  unsigned int sq_entries;
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  // sqes filled but not yet submitted
+  unsigned int local_tail;
+  unsigned int pending;
+  // the kernel rejected setsockopt through the ring once, don't try again
+  int no_setsockopt;
+};
+
+// per hole state of one chunk
+struct punch_slot {
+  struct iovec iov;
+  struct msghdr msg;
+  struct epoll_event ev;
+  int ttl_res, send_res, epoll_res;
+};
+
+static struct io_uring_sqe *get_sqe(struct uring_backend *u, uint8_t opcode,
+                                    int fd, uint64_t user_data) {
+  unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+  if (u->local_tail - head >= u->sq_entries) {
+    return NULL;
+  }
+  unsigned int idx = u->local_tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  u->sq_array[idx] = idx;
+  ++u->local_tail;
+  ++u->pending;
+  return sqe;
+}
+
+// submits every pending sqe and waits until wait_nr completions are ready
+static int submit_and_wait(struct uring_backend *u, unsigned int wait_nr) {
+  __atomic_store_n(u->sq_tail, u->local_tail, __ATOMIC_RELEASE);
+  unsigned int to_submit = u->pending;
+  u->pending = 0;
+  for (;;) {
+    int ret = syscall(__NR_io_uring_enter, u->ring_fd, to_submit, wait_nr,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret >= 0) {
+      unsigned int done = ret;
+      to_submit -= done < to_submit ? done : to_submit;
+      if (to_submit == 0) {
+        return 0;
+      }
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+static int next_cqe(struct uring_backend *u, uint64_t *user_data, int *res) {
+  unsigned int head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// submits and collects exactly n completions
+static int run_chunk(struct uring_backend *u, struct punch_op *ops,
+                     struct punch_slot *slots, unsigned int n) {
+  if (submit_and_wait(u, n) < 0) {
+    return -1;
+  }
+  unsigned int done = 0;
+  while (done < n) {
+    uint64_t user_data;
+    int res;
+    if (!next_cqe(u, &user_data, &res)) {
+      if (submit_and_wait(u, n - done) < 0) {
+        return -1;
+      }
+      continue;
+    }
+    ++done;
+    int i = user_data & 0xffffffff;
+    switch (user_data >> 32) {
+    case STEP_SOCKET:
+      ops[i].fd = res >= 0 ? res : -1;
+      ops[i].err = res >= 0 ? 0 : -res;
+      break;
+    case STEP_TTL:
+      slots[i].ttl_res = res;
+      break;
+    case STEP_SEND:
+      slots[i].send_res = res;
+      break;
+    case STEP_EPOLL:
+      slots[i].epoll_res = res;
+      break;
+    }
+  }
+  return 0;
+}
+
+static void set_ttl_sync(struct punch_op *op) {
+  if (op->dst.ss_family == AF_INET6) {
+    setsockopt(op->fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &op->ttl,
+               sizeof(op->ttl));
+  } else {
+    setsockopt(op->fd, IPPROTO_IP, IP_TTL, &op->ttl, sizeof(op->ttl));
+  }
+}
+
+// closes the sockets of a chunk the ring failed in the middle of, the sync
+// fallback opens its own
+static void close_chunk(struct punch_op *ops, int n) {
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (ops[i].fd >= 0) {
+      close(ops[i].fd);
+      ops[i].fd = -1;
+    }
+  }
+}
+
+static int punch_chunk(struct uring_backend *u, int epfd,
+                       struct punch_op *ops, int n) {
+  struct punch_slot slots[URING_CHUNK];
+  int i, opened = 0;
+  uint64_t step;
+
+  // every socket first, the following steps need their descriptors
+  for (i = 0; i < n; ++i) {
+    struct io_uring_sqe *sqe = get_sqe(u, IORING_OP_SOCKET,
+                                       ops[i].dst.ss_family, i);
+    sqe->off = SOCK_DGRAM | SOCK_NONBLOCK;
+    ops[i].fd = -1;
+  }
+  if (run_chunk(u, ops, slots, n) < 0) {
+    close_chunk(ops, n);
+    return -1;
+  }
+  // the device is set with a plain setsockopt(), before the probe goes out
+  for (i = 0; i < n; ++i) {
+    if (ops[i].fd >= 0 && ops[i].ifname != NULL &&
+        setsockopt(ops[i].fd, SOL_SOCKET, SO_BINDTODEVICE, ops[i].ifname,
+                   strlen(ops[i].ifname))) {
+      ops[i].err = errno;
+      close(ops[i].fd);
+      ops[i].fd = -1;
+    }
+  }
+
+  // then one linked ttl -> send -> epoll chain per socket, a failing step
+  // cancels the rest of its chain
+  unsigned int queued = 0;
+  for (i = 0; i < n; ++i) {
+    struct punch_op *op = &ops[i];
+    struct punch_slot *slot = &slots[i];
+    slot->ttl_res = slot->send_res = slot->epoll_res = -ECANCELED;
+    if (op->fd < 0) {
+      continue;
+    }
+
+    if (op->ttl > 0 && !u->no_setsockopt) {
+      step = (uint64_t)STEP_TTL << 32;
+      struct io_uring_sqe *sqe = get_sqe(u, IORING_OP_URING_CMD, op->fd,
+                                         step | i);
+      uint32_t *level_optname = (uint32_t *)&sqe->addr;
+      sqe->cmd_op = SOCKET_URING_OP_SETSOCKOPT;
+      level_optname[0] =
+          op->dst.ss_family == AF_INET6 ? IPPROTO_IPV6 : IPPROTO_IP;
+      level_optname[1] =
+          op->dst.ss_family == AF_INET6 ? IPV6_UNICAST_HOPS : IP_TTL;
+      sqe->addr3 = (uintptr_t)&op->ttl;
+      sqe->file_index = sizeof(op->ttl);
+      sqe->flags = IOSQE_IO_LINK;
+      ++queued;
+    } else {
+      if (op->ttl > 0) {
+        set_ttl_sync(op);
+      }
+      slot->ttl_res = 0;
+    }
+
+    slot->iov.iov_base = (void *)&punch_probe;
+    slot->iov.iov_len = 1;
+    memset(&slot->msg, 0, sizeof(slot->msg));
+    slot->msg.msg_name = &op->dst;
+    slot->msg.msg_namelen = op->dst_len;
+    slot->msg.msg_iov = &slot->iov;
+    slot->msg.msg_iovlen = 1;
+    step = (uint64_t)STEP_SEND << 32;
+    struct io_uring_sqe *sqe = get_sqe(u, IORING_OP_SENDMSG, op->fd, step | i);
+    sqe->addr = (uintptr_t)&slot->msg;
+    sqe->len = 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    slot->ev.events = EPOLLIN;
+    slot->ev.data.ptr = op->tag;
+    step = (uint64_t)STEP_EPOLL << 32;
+    sqe = get_sqe(u, IORING_OP_EPOLL_CTL, epfd, step | i);
+    sqe->addr = (uintptr_t)&slot->ev;
+    sqe->len = EPOLL_CTL_ADD;
+    sqe->off = op->fd;
+    queued += 2;
+  }
+  if (queued > 0 && run_chunk(u, ops, slots, queued) < 0) {
+    close_chunk(ops, n);
+    return -1;
+  }
+  int64_t sent_ns = wall_ns();
+  for (i = 0; i < n; ++i) {
+    ops[i].sent_ns = sent_ns;
+  }
+
+  // finish what the ring couldn't do synchronously
+  for (i = 0; i < n; ++i) {
+    struct punch_op *op = &ops[i];
+    struct punch_slot *slot = &slots[i];
+    if (op->fd < 0) {
+      continue;
+    }
+    if (slot->ttl_res < 0) {
+      if (slot->ttl_res == -EOPNOTSUPP || slot->ttl_res == -EINVAL) {
+        verbose_log("io_uring can't set socket options, using setsockopt()\n");
+        u->no_setsockopt = 1;
+      }
+      set_ttl_sync(op);
+      slot->send_res = sendto(op->fd, &punch_probe, 1, 0,
+                              (struct sockaddr *)&op->dst, op->dst_len);
+      op->sent_ns = wall_ns();
+      if (slot->send_res < 0) {
+        slot->send_res = -errno;
+      }
+    }
+    if (slot->send_res >= 0 && slot->epoll_res < 0) {
+      slot->epoll_res = epoll_ctl(epfd, EPOLL_CTL_ADD, op->fd, &slot->ev)
+                            ? -errno
+                            : 0;
+    }
+    int res = slot->send_res < 0 ? slot->send_res : slot->epoll_res;
+    if (res < 0) {
+      op->err = -res;
+      close(op->fd);
+      op->fd = -1;
+      continue;
+    }
+    ++opened;
+  }
+  return opened;
+}
+
+static int uring_punch(struct io_backend *io, int epfd, struct punch_op *ops,
+                       int n) {
+  struct uring_backend *u = (struct uring_backend *)io;
+  int i, opened = 0;
+  for (i = 0; i < n; i += URING_CHUNK) {
+    int chunk = n - i < URING_CHUNK ? n - i : URING_CHUNK;
+    int res = punch_chunk(u, epfd, ops + i, chunk);
+    if (res < 0) {
+      // the ring is unusable, fall back for the rest
+      return opened + io_backend_sync()->punch(io_backend_sync(), epfd,
+                                               ops + i, n - i);
+    }
+    opened += res;
+  }
+  return opened;
+}
+
+static void uring_destroy(struct io_backend *io) {
+  struct uring_backend *u = (struct uring_backend *)io;
+  if (u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqes_size);
+  }
+  if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_ring_size);
+  }
+  if (u->sq_ring != MAP_FAILED) {
+    munmap(u->sq_ring, u->sq_ring_size);
+  }
+  close(u->ring_fd);
+  free(u);
+}
+
+struct io_backend *io_backend_uring(unsigned int entries) {
+  if (entries < URING_CHUNK * 3) {
+    entries = URING_CHUNK * 3;
+  }
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring_fd < 0) {
+    verbose_log("io_uring is not available: %s\n", strerror(errno));
+    return NULL;
+  }
+
+  struct uring_backend *u = calloc(1, sizeof(struct uring_backend));
+  if (u == NULL) {
+    close(ring_fd);
+    return NULL;
+  }
+  u->base = *io_backend_sync();
+  u->base.name = "io_uring";
+  u->base.punch = uring_punch;
+  u->base.destroy = uring_destroy;
+  u->ring_fd = ring_fd;
+  u->sq_entries = p.sq_entries;
+  u->sq_ring = u->cq_ring = u->sqes = MAP_FAILED;
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size) {
+      u->sq_ring_size = u->cq_ring_size;
+    }
+    u->cq_ring_size = u->sq_ring_size;
+  }
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) {
+    goto error;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring = u->sq_ring;
+  } else {
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) {
+      goto error;
+    }
+  }
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    goto error;
+  }
+
+  char *sq = u->sq_ring, *cq = u->cq_ring;
+  u->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  u->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  u->local_tail = *u->sq_tail;
+
+  return &u->base;
+
+error:
+  uring_destroy(&u->base);
+  return NULL;
+}
+
+#else
+
+struct io_backend *io_backend_uring(unsigned int entries) { return NULL; }
+
+#endif
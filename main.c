@@ -1,41 +1,335 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
-#include <pthread.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "nat_traversal.h"
+#include "nt_daemon.h"
+#include "nt_pcap.h"
+#include "nt_tunnel.h"
+#include "nt_vpn.h"
 #include "utils.h"
 
 #define DEFAULT_SERVER_PORT 9988
 #define MSG_BUF_SIZE 512
 #define STUN_SERVER_RETRIES 3
+#define MAX_PEERS 64
+#define MAX_FORWARDS 32
+#define MAX_VPN_QUEUES 64
+#define MAX_UPLINKS 8
+#define VPN_REPORT_MS 5000
 
 // definition checked against extern declaration
 int verbose = 0;
 
+struct app {
+  uint32_t *peer_ids;
+  int n_peers;
+  char *peer_meta;
+  char *mesh;
+  struct nt_forward *forwards;
+  int n_forwards;
+  // the first connected peer becomes the other end of the tunnel
+  int tunnel_wanted;
+  nt_tunnel *tunnel;
+  // the first connected peer is routed to through the TUN interface instead
+  char *vpn_ifname;
+  int vpn_queues;
+  nt_vpn *vpn;
+  struct nt_vpn_stats vpn_stats[MAX_VPN_QUEUES];
+  int64_t vpn_report_at;
+  // the peer at the other end of the tunnel or the vpn
+  uint32_t peer_id;
+  int done;
+  int exit_code;
+};
+
+static void on_enrolled(nt_ctx *ctx, uint32_t id, void *user_data) {
+  struct app *app = user_data;
+  if (!id) {
+    printf("failed to enroll\n");
+    app->done = 1;
+    app->exit_code = -1;
+    return;
+  }
+  verbose_log("enroll successfully, ID: %d\n", id);
+  char ip[IP_STR_LEN];
+  uint16_t port;
+  if (nt_reflexive_address(ctx, ip, &port) == 0) {
+    verbose_log("seen by the punch server as %s:%d\n", ip, port);
+  }
+
+  int i;
+  for (i = 0; i < app->n_peers; i++) {
+    verbose_log("connecting to peer %d\n", app->peer_ids[i]);
+    nt_connect(ctx, app->peer_ids[i]);
+  }
+
+  if (app->mesh != NULL) {
+    // an empty name picks the group from the meta prefix
+    verbose_log("joining mesh %s\n", app->mesh);
+    nt_join_mesh(ctx, app->mesh[0] != '\0' ? app->mesh : NULL);
+  }
+
+  if (app->peer_meta != NULL) {
+    verbose_log("connecting to peer %s\n", app->peer_meta);
+    nt_connect_from_meta(ctx, app->peer_meta);
+  }
+}
+
+static void on_peer_info(nt_ctx *ctx, const struct peer_info *peer,
+                         void *user_data) {
+  struct app *app = user_data;
+  if (peer == NULL) {
+    app->exit_code = -1;
+  }
+  app->done = 1;
+}
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void start_vpn(struct app *app, int sock) {
+  app->vpn = nt_vpn_start(sock, app->vpn_ifname, app->vpn_queues);
+  if (app->vpn == NULL) {
+    printf("failed to open tun %s\n", app->vpn_ifname);
+    close(sock);
+    return;
+  }
+  printf("routing to the peer through %s, %d queues\n",
+         nt_vpn_ifname(app->vpn), nt_vpn_queues(app->vpn));
+  app->vpn_report_at = now_ms();
+}
+
+// per queue throughput since the last report, the benchmark of the vpn mode
+static void report_vpn(struct app *app) {
+  int64_t now = now_ms();
+  double secs = (now - app->vpn_report_at) / 1000.0;
+  if (secs * 1000 < VPN_REPORT_MS) {
+    return;
+  }
+  int i;
+  for (i = 0; i < nt_vpn_queues(app->vpn); ++i) {
+    struct nt_vpn_stats cur, *last = &app->vpn_stats[i];
+    nt_vpn_stats(app->vpn, i, &cur);
+    if (cur.tx_packets != last->tx_packets ||
+        cur.rx_packets != last->rx_packets) {
+      printf("queue %d cpu %d: tx %.3f Gbit/s %.0f kpps, "
+             "rx %.3f Gbit/s %.0f kpps\n",
+             i, cur.cpu, (cur.tx_bytes - last->tx_bytes) * 8 / secs / 1e9,
+             (cur.tx_packets - last->tx_packets) / secs / 1e3,
+             (cur.rx_bytes - last->rx_bytes) * 8 / secs / 1e9,
+             (cur.rx_packets - last->rx_packets) / secs / 1e3);
+    }
+    *last = cur;
+  }
+  app->vpn_report_at = now;
+}
+
+// the tunnel or the vpn moves to sock, a better path to the same peer
+static void swap_socket(struct app *app, int sock) {
+  if (app->tunnel != NULL) {
+    nt_tunnel_swap(app->tunnel, sock);
+  } else if (app->vpn != NULL) {
+    nt_vpn_swap(app->vpn, sock);
+  } else {
+    close(sock);
+  }
+}
+
+// once the path in use went silent, the tunnel or the vpn moves to a standby
+// path to the same peer, kept by ctx or, without one, by nat_traversald. -1 if
+// there is none
+static int fail_over(struct app *app, nt_ctx *ctx, int ntd, uint32_t peer_id) {
+  int sock = ctx != NULL ? nt_failover(ctx, peer_id)
+                         : ntd_failover(ntd, peer_id);
+  if (sock < 0) {
+    return -1;
+  }
+  printf("peer silent, failed over to a standby path\n");
+  swap_socket(app, sock);
+  return 0;
+}
+
+static void on_connected(nt_ctx *ctx, const struct peer_info *peer, int sock,
+                         void *user_data) {
+  struct app *app = user_data;
+  verbose_log("connected with peer %d\n", peer->id);
+  if (peer->replaces && peer->id == app->peer_id) {
+    // the direct path in place of the relay, or the standby the peer moved
+    // to
+    verbose_log("peer %d moved to another path\n", peer->id);
+    swap_socket(app, sock);
+    return;
+  }
+  if (app->vpn_ifname != NULL && app->vpn == NULL) {
+    app->peer_id = peer->id;
+    start_vpn(app, sock);
+    return;
+  }
+  if (!app->tunnel_wanted || app->tunnel != NULL) {
+    close(sock);
+    return;
+  }
+  app->peer_id = peer->id;
+  app->tunnel = nt_tunnel_new(sock, app->forwards, app->n_forwards);
+  if (app->tunnel == NULL) {
+    printf("failed to set up the tunnel\n");
+    close(sock);
+  }
+}
+
+static void on_failed(nt_ctx *ctx, const struct peer_info *peer, int reason,
+                      void *user_data) {
+  verbose_log("failed to connect to peer %d, reason: %d\n", peer->id, reason);
+}
+
+// the punch server and the tunnel share one loop, returns -1 once either is
+// gone
+static int run_tunnel(nt_ctx *ctx, struct app *app) {
+  nt_tunnel *tunnel = app->tunnel;
+  int timeout = nt_ctx_timeout(ctx);
+  if (timeout < 0 || nt_tunnel_timeout(tunnel) < timeout) {
+    timeout = nt_tunnel_timeout(tunnel);
+  }
+  struct pollfd pfds[2] = {{nt_ctx_fd(ctx), POLLIN, 0},
+                           {nt_tunnel_fd(tunnel), POLLIN, 0}};
+  if (poll(pfds, 2, timeout) < 0 && errno != EINTR) {
+    return -1;
+  }
+  if (nt_ctx_process(ctx) < 0) {
+    return -1;
+  }
+  if (nt_tunnel_process(tunnel) == 0) {
+    return 0;
+  }
+  return fail_over(app, ctx, -1, app->peer_id);
+}
+
+// takes the sockets the daemon sends in place of the one it handed over for
+// peer_id, 0 taking those of any peer. Returns -1 once the daemon is gone,
+// the path in use then goes on alone
+static int daemon_ready(struct app *app, int ntd, uint32_t peer_id,
+                        short revents) {
+  uint32_t id;
+  int sock;
+  while ((revents & POLLIN) && (sock = ntd_swapped(ntd, &id)) >= 0) {
+    if (peer_id != 0 && id != peer_id) {
+      close(sock);
+      continue;
+    }
+    verbose_log("peer %d moved to another path\n", id);
+    swap_socket(app, sock);
+  }
+  return revents & (POLLHUP | POLLERR) ? -1 : ntd;
+}
+
+// a socket from nat_traversald needs no punch server. The first one becomes
+// the vpn or the tunnel, which runs until its peer goes silent on every path
+// the daemon keeps. Better paths the daemon finds later take over
+static void use_daemon_socket(struct app *app, int ntd, uint32_t peer_id,
+                              int sock) {
+  if (app->vpn_ifname != NULL) {
+    start_vpn(app, sock);
+    while (app->vpn != NULL && (nt_vpn_alive(app->vpn) ||
+                                fail_over(app, NULL, ntd, peer_id) == 0)) {
+      struct pollfd pfd = {ntd, POLLIN, 0};
+      if (poll(&pfd, 1, 1000) > 0) {
+        ntd = daemon_ready(app, ntd, peer_id, pfd.revents);
+      }
+      report_vpn(app);
+    }
+    if (app->vpn != NULL) {
+      nt_vpn_stop(app->vpn);
+      app->vpn = NULL;
+    }
+    app->vpn_ifname = NULL;
+    return;
+  }
+  if (!app->tunnel_wanted) {
+    close(sock);
+    return;
+  }
+  app->tunnel_wanted = 0;
+  app->tunnel = nt_tunnel_new(sock, app->forwards, app->n_forwards);
+  if (app->tunnel == NULL) {
+    printf("failed to set up the tunnel\n");
+    close(sock);
+    return;
+  }
+  do {
+    struct pollfd pfds[2] = {{nt_tunnel_fd(app->tunnel), POLLIN, 0},
+                             {ntd, POLLIN, 0}};
+    int n = poll(pfds, 2, nt_tunnel_timeout(app->tunnel));
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    if (n > 0) {
+      ntd = daemon_ready(app, ntd, peer_id, pfds[1].revents);
+    }
+  } while (nt_tunnel_process(app->tunnel) == 0 ||
+           fail_over(app, NULL, ntd, peer_id) == 0);
+  nt_tunnel_free(app->tunnel);
+  app->tunnel = NULL;
+}
+
 int main(int argc, char **argv) {
   char *stun_server = NULL;
-  char local_ip[16] = "0.0.0.0";
+  char local_ip[IP_STR_LEN] = "0.0.0.0";
+  int local_ip_set = 0;
+  char local_ip6[IP_STR_LEN] = {0};
+  int use_ipv6 = 0;
   uint16_t stun_port = DEFAULT_STUN_SERVER_PORT;
   uint16_t local_port = DEFAULT_LOCAL_PORT;
   char *punch_server = NULL;
   char *meta = NULL;
   char *peer_meta = NULL;
-  uint32_t peer_id = 0;
+  char *mesh = NULL;
+  char *daemon_path = NULL;
+  uint32_t peer_ids[MAX_PEERS];
+  int n_peers = 0;
+  int max_attempts = 0;
+  int max_paths = 1;
+  int pool_size = 0;
+  int relay_after_ms = -1;
   int ttl = 10;
   int get_info = 0;
+  int io_uring = 0;
+  int udp = 0;
   int get_info_from_meta = 0;
+  struct nt_forward forwards[MAX_FORWARDS];
+  int n_forwards = 0;
+  int tunnel_wanted = 0;
+  char *vpn_ifname = NULL;
+  int vpn_queues = 0;
+  char *pcap_path = NULL;
 
   static char usage[] =
       "usage: [-h] [-H STUN_HOST] [-t ttl] [-P STUN_PORT] [-s punch server] "
-      "[-d id] [-i SOURCE_IP] [-p SOURCE_PORT] [-v verbose]\n";
+      "[-d id, repeatable] [-c concurrent attempts] [-k paths kept] "
+      "[-b sockets mapped ahead] [-r relay after ms, 0 at once] "
+      "[-i SOURCE_IP] [-p SOURCE_PORT] [-g mesh group] "
+      "[-6 detect IPv6 address] [-I IPv6 address] [-U use io_uring] "
+      "[-u UDP rendezvous] "
+      "[-x connect through nat_traversald at path] "
+      "[-L [udp:][listen_ip:]port:target_ip:port forward from here] "
+      "[-R [udp:][listen_ip:]port:target_ip:port forward from the peer] "
+      "[-T serve forwards of the peer] "
+      "[-N route to the peer through tun ifname] [-Q tun queues] "
+      "[-w record packets to pcapng file] [-v verbose]\n";
   int opt;
-  while ((opt = getopt(argc, argv, "H:h:I:t:P:p:s:m:o:d:i:vzZ")) != -1) {
+  while ((opt = getopt(
+              argc, argv,
+              "H:h:I:t:P:p:s:m:o:d:c:k:b:r:g:i:x:L:R:N:Q:w:TvzZ6Uu")) != -1) {
     switch (opt) {
     case 'h':
       printf("%s", usage);
@@ -68,10 +362,73 @@ int main(int argc, char **argv) {
       peer_meta = optarg;
       break;
     case 'd':
-      peer_id = atoi(optarg);
+      if (n_peers == MAX_PEERS) {
+        printf("at most %d peers\n", MAX_PEERS);
+        return -1;
+      }
+      peer_ids[n_peers++] = atoi(optarg);
+      break;
+    case 'c':
+      max_attempts = atoi(optarg);
+      break;
+    case 'k':
+      max_paths = atoi(optarg);
+      break;
+    case 'b':
+      pool_size = atoi(optarg);
+      break;
+    case 'r':
+      relay_after_ms = atoi(optarg);
+      break;
+    case 'g':
+      mesh = optarg;
+      break;
+    case 'x':
+      daemon_path = optarg;
+      break;
+    case 'L':
+    case 'R':
+      if (n_forwards == MAX_FORWARDS) {
+        printf("at most %d forwards\n", MAX_FORWARDS);
+        return -1;
+      }
+      if (nt_parse_forward(optarg, opt == 'R', &forwards[n_forwards]) < 0) {
+        printf("invalid forward %s\n", optarg);
+        return -1;
+      }
+      n_forwards++;
+      tunnel_wanted = 1;
+      break;
+    case 'T':
+      tunnel_wanted = 1;
+      break;
+    case 'N':
+      vpn_ifname = optarg;
+      break;
+    case 'Q':
+      vpn_queues = atoi(optarg);
+      break;
+    case 'w':
+      pcap_path = optarg;
       break;
     case 'i':
-      strncpy(local_ip, optarg, 16);
+      strncpy(local_ip, optarg, IP_STR_LEN - 1);
+      local_ip_set = 1;
+      break;
+    case 'I':
+      // advertise the given address for the direct path without asking STUN,
+      // e.g. ::1 when testing on loopback
+      strncpy(local_ip6, optarg, IP_STR_LEN - 1);
+      use_ipv6 = 1;
+      break;
+    case '6':
+      use_ipv6 = 1;
+      break;
+    case 'U':
+      io_uring = 1;
+      break;
+    case 'u':
+      udp = 1;
       break;
     case 'v':
       verbose = 1;
@@ -85,74 +442,154 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (vpn_ifname != NULL && tunnel_wanted) {
+    printf("-N can't be combined with -L, -R or -T\n");
+    return -1;
+  }
+  if (pcap_path != NULL) {
+    if (nt_pcap_open(pcap_path) < 0) {
+      printf("failed to open %s\n", pcap_path);
+      return -1;
+    }
+    // whatever way main() ends, the recording is flushed
+    atexit(nt_pcap_close);
+  }
+
+  struct app app;
+  memset(&app, 0, sizeof(app));
+  app.forwards = forwards;
+  app.n_forwards = n_forwards;
+  app.tunnel_wanted = tunnel_wanted;
+  app.vpn_ifname = vpn_ifname;
+  app.vpn_queues = vpn_queues;
+
+  if (daemon_path != NULL) {
+    // the daemon already enrolled this host, only the sockets come from it
+    int ntd = ntd_open(daemon_path);
+    if (ntd < 0) {
+      printf("failed to reach nat_traversald at %s\n", daemon_path);
+      return -1;
+    }
+    int i, reason = 0;
+    for (i = 0; i < n_peers; i++) {
+      int sock = ntd_connect(ntd, peer_ids[i], &reason);
+      if (sock < 0) {
+        printf("failed to connect to peer %d, reason: %d\n", peer_ids[i],
+               reason);
+        continue;
+      }
+      printf("connected with peer %d\n", peer_ids[i]);
+      use_daemon_socket(&app, ntd, peer_ids[i], sock);
+    }
+    if (peer_meta != NULL) {
+      int sock = ntd_connect_from_meta(ntd, peer_meta, &reason);
+      printf(sock < 0 ? "failed to connect to peer %s\n"
+                      : "connected with peer %s\n",
+             peer_meta);
+      if (sock >= 0) {
+        use_daemon_socket(&app, ntd, 0, sock);
+      }
+    }
+    close(ntd);
+    return 0;
+  }
+
   if (punch_server == NULL) {
     printf("please specify punch server\n");
     return -1;
   }
 
-  struct sockaddr_in server_addr;
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_addr.s_addr = inet_addr(punch_server);
-  server_addr.sin_port = htons(DEFAULT_SERVER_PORT);
-
-  if (get_info) {
-    client cli;
-    struct peer_info peer;
-    int res = init(server_addr, &cli);
+  struct sockaddr_storage server_addr;
+  socklen_t server_addr_len =
+      make_sockaddr(punch_server, DEFAULT_SERVER_PORT, &server_addr);
+  if (!server_addr_len) {
+    printf("invalid punch server address %s\n", punch_server);
+    return -1;
+  }
 
-    if (res) {
-      printf("init punch server socket failed\n");
-      return res;
-    }
+  nt_ctx *ctx = NULL;
+  struct nt_callbacks callbacks = {on_enrolled, on_peer_info, on_connected,
+                                   on_failed, &app};
+  struct nt_config config;
+  config.punch_server = (struct sockaddr *)&server_addr;
+  config.punch_server_len = server_addr_len;
+  config.ttl = ttl;
+  config.local_port = local_port;
+  config.local_port6 = local_port;
+  config.io_uring = io_uring;
+  config.udp = udp;
+  // unless limited, every target punches at once with its share of sockets
+  config.max_attempts = max_attempts ? max_attempts : n_peers;
+  config.max_sockets = 0;
+  config.max_paths = max_paths;
+  config.ifname = NULL;
+  config.pool_size = pool_size;
+  config.stun_server = NULL;
+  config.stun_server_len = 0;
+  config.relay = relay_after_ms >= 0;
+  config.relay_after_ms = relay_after_ms;
 
-    if (!peer_id) {
+  if (get_info || get_info_from_meta) {
+    if (get_info && !n_peers) {
       printf("failed to get peer_id\n");
       return -1;
     }
-
-    int n = get_peer_info(&cli, peer_id, &peer);
-    if (n) {
-      verbose_log("get_peer_info() returned %d\n", n);
-      printf("failed to get info of remote peer\n");
+    if (get_info_from_meta && peer_meta == NULL) {
+      printf("failed to get peer_meta\n");
       return -1;
     }
-    return 0;
-  }
-
-  if (get_info_from_meta) {
-    client cli;
-    struct peer_info peer;
-    int res = init(server_addr, &cli);
 
-    if (res) {
+    ctx = nt_ctx_new(&config, &callbacks);
+    if (ctx == NULL) {
       printf("init punch server socket failed\n");
-      return res;
+      return -1;
     }
 
-    if (peer_meta == NULL) {
-      printf("failed to get peer_meta\n");
-      return -1;
+    int n = get_info ? nt_get_peer_info(ctx, peer_ids[0])
+                     : nt_get_peer_info_from_meta(ctx, peer_meta);
+    while (n == 0 && !app.done) {
+      n = nt_ctx_run(ctx, -1);
     }
-    int n = get_peer_info_from_meta(&cli, peer_meta, &peer);
-    if (n) {
+    nt_ctx_free(ctx);
+    if (n || app.exit_code) {
       printf("failed to get info of remote peer\n");
       return -1;
     }
     return 0;
   }
 
-  char ext_ip[16] = {0};
+  char ext_ip[IP_STR_LEN] = {0};
   uint16_t ext_port = 0;
 
-  // TODO we should try another STUN server if failed
+  // every uplink is classified at once unless -i picks one. The least
+  // restrictive NAT, and the closest of equals, is enrolled and punched from
+  struct nat_candidate uplinks[MAX_UPLINKS];
+  int n_uplinks = 0;
+  if (!local_ip_set) {
+    n_uplinks = detect_nat_candidates(stun_server, stun_port, local_port,
+                                      uplinks, MAX_UPLINKS);
+  }
   int i;
-  nat_type type;
-  for (i = 0; i < STUN_SERVER_RETRIES; i++) {
+  nat_type type = 0;
+  for (i = 0; i < n_uplinks && n_uplinks > 1; i++) {
+    printf("uplink %s %s: %s, %s:%d, rtt %d ms%s\n", uplinks[i].ifname,
+           uplinks[i].local_ip, get_nat_desc(uplinks[i].type),
+           uplinks[i].ext_ip, uplinks[i].ext_port, uplinks[i].rtt_ms,
+           i == 0 ? ", used" : "");
+  }
+  if (n_uplinks > 0) {
+    strcpy(ext_ip, uplinks[0].ext_ip);
+    ext_port = uplinks[0].ext_port;
+    type = uplinks[0].type;
+    if (n_uplinks > 1) {
+      config.ifname = uplinks[0].ifname;
+    }
+  }
+
+  // TODO we should try another STUN server if failed
+  for (i = 0; i < STUN_SERVER_RETRIES && type == 0; i++) {
     type = detect_nat_type(stun_server, stun_port, local_ip, local_port, ext_ip,
                            &ext_port);
-    if (type != 0) {
-      break;
-    }
   }
 
   if (!ext_port) {
@@ -160,56 +597,80 @@ int main(int argc, char **argv) {
   }
 
   verbose_log("nat detect got ip: %s, port %d\n", ext_ip, ext_port);
+  // the pool is mapped through the server the NAT was classified with
+  struct sockaddr_storage stun_addr;
+  if (pool_size > 0) {
+    config.stun_server_len =
+        stun_server_address(stun_server, stun_port, AF_INET, &stun_addr);
+    if (config.stun_server_len) {
+      config.stun_server = (struct sockaddr *)&stun_addr;
+    }
+  }
   struct peer_info self;
-  self.meta = malloc(32);
+  char self_meta[UINT8_MAX + 1] = {0};
+  memset(&self, 0, sizeof(self));
+  self.meta = self_meta;
   strcpy(self.ip, ext_ip);
   self.port = ext_port;
   self.type = type;
-  /* printf("first %s %ld\n", meta, strlen(meta)); */
+
+  // the IPv6 direct path binds the same local port as the IPv4 socket
+  if (local_ip6[0] != '\0') {
+    strcpy(self.ip6, local_ip6);
+    self.port6 = local_port;
+  } else if (use_ipv6) {
+    if (stun_get_mapped_address(stun_server, stun_port, "::", local_port,
+                                self.ip6, &self.port6)) {
+      printf("no ipv6 connectivity, only ipv4 is used\n");
+      self.ip6[0] = '\0';
+      self.port6 = 0;
+    }
+  }
+  verbose_log("ipv6 direct path: [%s]:%d\n", self.ip6, self.port6);
   if (meta != NULL) {
-    strcpy(self.meta, meta);
+    strncpy(self.meta, meta, UINT8_MAX);
   } else {
     gen_random_string(self.meta, 20);
   }
-  /* printf("first %s %ld\n", self.meta, strlen(self.meta)); */
-
-  /* strncpy(self.meta, meta, strlen(meta)); */
-  /* printf(""); */
-
-  /* printf("second %s %ld\n", meta, strlen(meta)); */
 
-  client c;
-  c.type = type;
-  c.ttl = ttl;
-  /* printf("third %s %ld\n", self.meta, strlen(self.meta)); */
-
-  if (enroll(self, server_addr, &c) < 0) {
+  ctx = nt_ctx_new(&config, &callbacks);
+  if (ctx == NULL || nt_enroll(ctx, &self) < 0) {
     printf("failed to enroll\n");
 
     return -1;
   }
-  verbose_log("enroll successfully, ID: %d\n", c.id);
-
-  if (peer_id) {
-    verbose_log("connecting to peer %d\n", peer_id);
-    if (connect_to_peer(&c, peer_id) < 0) {
-      verbose_log("failed to connect to peer %d\n", peer_id);
+  app.peer_ids = peer_ids;
+  app.n_peers = n_peers;
+  app.peer_meta = peer_meta;
+  app.mesh = mesh;
 
-      return -1;
+  // serve notifications until the punch server goes away
+  while (!app.done) {
+    int n;
+    if (app.tunnel != NULL) {
+      n = run_tunnel(ctx, &app);
+    } else if (app.vpn != NULL) {
+      n = nt_ctx_run(ctx, 1000);
+      report_vpn(&app);
+      if (!nt_vpn_alive(app.vpn) &&
+          fail_over(&app, ctx, -1, app.peer_id) < 0) {
+        printf("peer silent, vpn closed\n");
+        break;
+      }
+    } else {
+      n = nt_ctx_run(ctx, -1);
     }
-  }
-
-  if (peer_meta != NULL) {
-    verbose_log("connecting to peer %s\n", peer_meta);
-    if (connect_to_peer_from_meta(&c, peer_meta) < 0) {
-      verbose_log("failed to connect to peer %s\n", peer_meta);
-
-      return -1;
+    if (n < 0) {
+      break;
     }
   }
+  if (app.tunnel != NULL) {
+    nt_tunnel_free(app.tunnel);
+  }
+  if (app.vpn != NULL) {
+    nt_vpn_stop(app.vpn);
+  }
+  nt_ctx_free(ctx);
 
-  pthread_t tid = wait_for_command(&c.sfd);
-
-  pthread_join(tid, NULL);
-  return 0;
+  return app.exit_code;
 }
@@ -1,18 +1,25 @@
+#define _GNU_SOURCE // sendmmsg()
 #include <arpa/inet.h>
 #include <errno.h>
-#include <math.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
-#include <pthread.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
+#include "io_backend.h"
 #include "nat_traversal.h"
+#include "nt_pcap.h"
+#include "port_gen.h"
 #include "utils.h"
 
 #define MAX_PORT 65535
@@ -20,185 +27,900 @@
 #define NUM_OF_PORTS 700
 
 #define MSG_BUF_SIZE 512
+// RFC 8305 connection attempt delay, the head start given to the IPv6 direct
+// path before IPv4 hole punching joins the race
+#define HAPPY_EYEBALLS_DELAY_MS 250
+// spacing between holes to avoid flooding protection
+#define PUNCH_INTERVAL_MS 100
+#define WAIT_FOR_PEER_MS (100 * 1000)
+#define ENROLL_TIMEOUT_MS (10 * 1000)
+// longest RetryAfter honored before the jitter is added
+#define MAX_ENROLL_WAIT_MS (60 * 1000)
+// TCP: how long a lost punch server is reconnected to resume the enrollment
+#define RESUME_TIMEOUT_MS (60 * 1000)
+// UDP rendezvous: unanswered requests are sent again with backoff
+#define RETRANSMIT_MS 500
+#define MAX_RETRANSMITS 5
+#define KEEPALIVE_MS (15 * 1000)
+// the server is given up after this long without a datagram from it
+#define SERVER_TIMEOUT_MS (4 * KEEPALIVE_MS)
+#define MAX_EVENTS 64
+// holes opened by one backend punch() call, across all sessions
+#define MAX_PUNCH_BATCH 128
+// submission queue size of the io_uring backend
+#define URING_ENTRIES 256
+// idle session blocks kept for reuse
+#define MAX_IDLE_SESSIONS 64
+// default limit of traversals punching or waiting at the same time
+#define DEFAULT_MAX_ATTEMPTS 16
+// descriptors left to the application when the budget follows RLIMIT_NOFILE
+#define FD_RESERVE 64
+// peers whose last traversal is remembered for a fast reconnect
+#define RESUME_CACHE_SIZE 64
+// NATs drop idle mappings after a few minutes, older outcomes are ignored
+#define RESUME_MAX_AGE_MS (5 * 60 * 1000)
+// ports probed on each side of the remembered one
+#define RESUME_SPREAD 4
+// the remembered holes get this long before the full traversal takes over
+#define RESUME_WAIT_MS 1000
+// paths one traversal may keep, the best carries the data, the rest stand by
+#define MAX_PATHS 8
+// responsive holes are measured this long before the best is promoted
+#define SELECT_WINDOW_MS 200
+#define PATH_PROBE_INTERVAL_MS 20
+// the responder promotes its own best if the initiator's choice doesn't come
+#define SELECT_GRACE_MS 300
+// standbys of all peers kept by a context
+#define MAX_STANDBYS 64
+// standbys are probed every KEEPALIVE_MS and closed once silent this long
+#define STANDBY_TIMEOUT_MS (4 * KEEPALIVE_MS)
+// sockets kept mapped ahead of the traversals, see nt_config.pool_size
+#define MAX_POOL 16
+// peers whose port hints wait for their traversal to begin
+#define MAX_HINTS 16
+// hints older than this are left out, the mappings have moved on
+#define HINT_MAX_AGE_MS (10 * 1000)
+// ports probed on each side of a hinted one
+#define HINT_SPREAD 8
+// relay binds go out every RETRANSMIT_MS until both halves are bound, for at
+// most this long
+#define RELAY_BIND_TIMEOUT_MS (10 * 1000)
+
+enum session_state {
+  S_LOOKUP, // waiting for the peer info from the punch server
+  S_QUEUED, // waiting for a free attempt slot
+  S_DIRECT, // IPv6 direct path alone, before IPv4 holes join the race
+  S_PUNCH,  // opening one hole every PUNCH_INTERVAL_MS, or spraying probes
+  S_WAIT,   // all holes opened, waiting for the peer
+  S_DONE,
+};
+
+typedef struct nt_session nt_session;
+
+enum strategy {
+  STRATEGY_HOLES, // one socket per port
+  STRATEGY_SPRAY, // one socket sends to every port
+  STRATEGY_RENDEZVOUS,
+};
+
+// the outcome of the last traversal to a peer, keyed by meta, or by id for
+// peers enrolled without one
+struct resume_entry {
+  uint32_t peer_id;
+  char meta[UINT8_MAX + 1];
+  char ip[IP_STR_LEN];
+  // the peer's mapping that answered and our socket's port
+  uint16_t remote_port;
+  uint16_t local_port;
+  int ttl;
+  enum strategy strategy;
+  int64_t seen_at; // 0 if the entry is free
+};
+
+// registered with epoll, session is NULL for the punch server connection,
+// for standbys and for pooled sockets
+struct watch {
+  int fd;
+  nt_session *session;
+};
+
+// in-band message on holes while their paths are measured, and on standbys.
+// Anything else is data of the peer
+struct path_msg {
+  char magic[3];
+  uint8_t type;
+  uint32_t seq;
+  int64_t sent_at; // sender's clock, echoed back
+} __attribute__((packed));
+
+enum path_msg_type {
+  PATH_PROBE = 1,
+  PATH_ECHO = 2,
+  // the initiator carries the data over this path
+  PATH_SELECT = 3,
+};
+
+// binds our socket to our half of a relay, answered with the same bytes and
+// whether the peer's half is bound
+struct relay_msg {
+  char magic[3];
+  char token[RELAY_TOKEN_LEN];
+  uint8_t ready; // only in answers
+} __attribute__((packed));
+
+// a hole that heard from the peer, and the peer's address it heard from
+struct path {
+  int fd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  int sent;
+  int answered;
+  int64_t rtt_sum;
+};
+
+// a path connected to the peer but not carrying data, kept warm for failover
+struct standby {
+  struct watch w; // fd -1 if the slot is free
+  struct peer_info peer;
+  char meta[UINT8_MAX + 1];
+  int rtt; // -1 if never measured
+  int64_t last_heard;
+};
+
+// a socket opened before any traversal, mapped through the STUN server and
+// kept warm by asking again every KEEPALIVE_MS
+struct pooled {
+  struct watch w; // fd -1 if the slot is free
+  // the request in flight, retransmitted as is until answered
+  char req[sizeof(StunHeader)];
+  size_t req_len;
+  uint16_t ext_port; // 0 until answered
+  // requests unanswered in a row
+  int retries;
+  int64_t next_at; // next request, or when the free slot is opened again
+};
+
+// ports the pool of a peer was mapped to, kept until the traversal to the
+// peer begins
+struct port_hint {
+  uint32_t peer_id;
+  uint16_t ports[MAX_POOL];
+  int n_ports;
+  int64_t at; // 0 if the slot is free
+};
+
+// one traversal attempt, or a plain lookup. The session and everything it
+// allocates live in one arena block that goes back to the pool when the
+// attempt ends
+struct nt_session {
+  nt_session *next;
+  struct arena arena;
+  enum session_state state;
+  int initiator;
+  int lookup_only;
+  // started by the server for a mesh, the result is reported back
+  int mesh;
+  // rand_r() state of the attempt, seeded from the context
+  unsigned int seed;
+  // ttl of the initiator's probes
+  int ttl;
+  // number of the traversal in the context, tags its packets in recordings
+  uint32_t attempt;
+  // only the ports of the last traversal to the peer are punched, the full
+  // traversal follows if none answers
+  int resumed;
+  struct peer_info peer;
+  char meta[UINT8_MAX + 1];
+  struct sockaddr_storage peer_addr;
+  socklen_t peer_addr_len;
+  // ports of the peer to punch, drawn one by one. Every hole aims at the
+  // published port instead when one_port is set
+  struct port_gen ports;
+  int one_port;
+  // holes to open, and opened so far
+  int n_ports;
+  int next_port;
+  // holes[0] is the IPv6 direct path if direct is set
+  struct watch *holes;
+  int n_holes;
+  int direct;
+  // one socket sends to every port instead of one socket per port
+  int spray;
+  int spray_fd;
+  // probes go out of the UDP rendezvous socket, the mapping the server saw
+  int rendezvous;
+  int notified;
+  // the server acknowledged the notification
+  int delivered;
+  // requests sent again over UDP
+  int retries;
+  int64_t wait_until;
+  // holes answered, their paths are measured until select_until while the
+  // traversal goes on
+  int selecting;
+  struct path paths[MAX_PATHS];
+  int n_paths;
+  int64_t select_until;
+  int64_t select_at; // next round of probes
+  // relay fallback: the initiator asks for a relay at relay_at, then both
+  // sides bind their half from the relay socket until relay_until. relayed
+  // once the relay socket went to the application, a hole may still replace
+  // it
+  struct watch relay;
+  char relay_token[RELAY_TOKEN_LEN];
+  int relay_retries;
+  int relayed;
+  int64_t relay_at; // -1 if no relay timer is armed
+  int64_t relay_until;
+  int64_t deadline; // -1 if no timer is armed
+};
+
+// the session, then the holes of up to NUM_OF_PORTS ports plus the IPv6 direct
+// path, with room for alignment
+#define SESSION_ARENA_SIZE                                                     \
+  (sizeof(nt_session) + (NUM_OF_PORTS + 1) * sizeof(struct watch) + 64)
+
+struct nt_ctx {
+  int epfd;
+  struct io_backend *io;
+  struct watch control;
+  int connected;
+  struct nt_callbacks cb;
+  int ttl;
+  uint16_t local_port;
+  uint16_t local_port6;
+  // uplink of the IPv4 sockets, empty for any
+  char ifname[IFNAME_LEN];
+  nat_type nat_type;
+  char ip6[IP_STR_LEN];
+  uint32_t id;
+  int64_t enroll_deadline;
+  // UDP rendezvous state, control.fd is then the datagram socket
+  int udp;
+  struct sockaddr_storage server_addr;
+  socklen_t server_addr_len;
+  char enroll_msg[MSG_BUF_SIZE];
+  size_t enroll_len;
+  int enroll_retries;
+  int64_t enroll_retry;
+  // RetryAfter replies in a row, widening the jitter of the next one
+  int enroll_deferrals;
+  // handed out with the id, reclaims both once the server forgot the
+  // enrollment or restarted. Resume is sent instead of the enroll while
+  // resuming
+  char token[RESUME_TOKEN_LEN];
+  int resumable;
+  int resuming;
+  // TCP: the punch server is connected again at reconnect_at, until
+  // RESUME_TIMEOUT_MS after it was lost at lost_at
+  int64_t reconnect_at;
+  int64_t lost_at;
+  int reconnects;
+  int64_t keepalive_at;
+  int64_t last_heard;
+  char reflexive_ip[IP_STR_LEN];
+  uint16_t reflexive_port;
+  // JoinMesh request, kept to join again after enrolling again
+  char mesh_msg[UINT8_MAX + 3];
+  size_t mesh_len;
+  int mesh_retries;
+  int64_t mesh_retry;
+  // rand_r() state seeding the attempts, contexts never share the global
+  // rand() seed
+  unsigned int seed;
+  // budget: attempts past max_attempts are queued, each attempt opens at
+  // most holes_per_attempt sockets
+  int max_attempts;
+  int holes_per_attempt;
+  // traversals begun so far
+  uint32_t attempts;
+  // paths kept per traversal, 1 connects the first hole that answers
+  int max_paths;
+  // -1 if the initiator never asks for a relay
+  int relay_after_ms;
+  struct standby standbys[MAX_STANDBYS];
+  int64_t standby_at; // next probe of the standbys, -1 if there are none
+  struct resume_entry resume[RESUME_CACHE_SIZE];
+  struct pooled pool[MAX_POOL];
+  int pool_size;
+  struct sockaddr_storage stun_addr;
+  socklen_t stun_addr_len;
+  int64_t pool_at; // next round of the pool, -1 while it is off
+  struct port_hint hints[MAX_HINTS];
+  // scratch of spray_holes(), one probe per port
+  struct mmsghdr spray_msgs[NUM_OF_PORTS];
+  struct sockaddr_storage spray_dsts[NUM_OF_PORTS];
+  // pending bytes to and from the punch server
+  char out[MSG_BUF_SIZE * 4];
+  size_t out_len;
+  char in[MSG_BUF_SIZE];
+  size_t in_len;
+  // in creation order
+  nt_session *sessions;
+  struct arena_pool session_pool;
+};
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-// file scope variables
-static int ports[MAX_PORT - MIN_PORT];
-
-static int send_to_punch_server(client *c) {
-  verbose_log("sending %ld bytes of data to punch server\n",
-              c->msg_buf - c->buf);
-  hex_dump(NULL, c->buf, c->msg_buf - c->buf);
-  int n = send(c->sfd, c->buf, c->msg_buf - c->buf, 0);
-  c->msg_buf = c->buf;
-  if (n == -1) {
-    verbose_log("send to punch server, error number: %d, error: %s\n", errno,
-                strerror(errno));
-    return n;
+static void update_control_events(nt_ctx *ctx) {
+  if (ctx->udp) {
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  if (!ctx->connected || ctx->out_len > 0) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.ptr = &ctx->control;
+  epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, ctx->control.fd, &ev);
+}
+
+static int flush_to_punch_server(nt_ctx *ctx) {
+  size_t sent = 0;
+  while (sent < ctx->out_len) {
+    ssize_t n = send(ctx->control.fd, ctx->out + sent, ctx->out_len - sent,
+                     MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      verbose_log("send to punch server, error number: %d, error: %s\n",
+                  errno, strerror(errno));
+      return -1;
+    }
+    sent += n;
   }
+  memmove(ctx->out, ctx->out + sent, ctx->out_len - sent);
+  ctx->out_len -= sent;
+  update_control_events(ctx);
   return 0;
 }
 
-int get_peer_info(client *cli, uint32_t peer_id, struct peer_info *peer) {
-  cli->msg_buf = cli->buf;
-  cli->msg_buf = encode16(cli->msg_buf, GetPeerInfo);
-  cli->msg_buf = encode32(cli->msg_buf, peer_id);
-  return send_get_peer_info_request(cli, peer);
+static int send_to_punch_server(nt_ctx *ctx, char *buf, size_t len) {
+  verbose_log("sending %ld bytes of data to punch server\n", len);
+  verbose_dump(NULL, buf, len);
+  if (ctx->udp && ctx->control.fd >= 0) {
+    // one datagram per message, the timers send lost requests again
+    if (ctx->io->sendto(ctx->io, ctx->control.fd, buf, len, 0,
+                        (struct sockaddr *)&ctx->server_addr,
+                        ctx->server_addr_len) < 0) {
+      verbose_log("send to punch server, error: %s\n", strerror(errno));
+    }
+    return 0;
+  }
+  if (ctx->control.fd < 0 || ctx->out_len + len > sizeof(ctx->out)) {
+    return -1;
+  }
+  memcpy(ctx->out + ctx->out_len, buf, len);
+  ctx->out_len += len;
+  if (!ctx->connected) {
+    // flushed once the connection is established
+    return 0;
+  }
+  return flush_to_punch_server(ctx);
+}
+
+static nt_session *new_session(nt_ctx *ctx) {
+  void *block = arena_pool_get(&ctx->session_pool);
+  if (block == NULL) {
+    return NULL;
+  }
+  struct arena arena;
+  arena_init(&arena, block, SESSION_ARENA_SIZE);
+  nt_session *s = arena_alloc(&arena, sizeof(nt_session));
+  s->arena = arena;
+  s->deadline = -1;
+  s->relay.fd = -1;
+  s->relay_at = -1;
+  s->peer.meta = s->meta;
+
+  nt_session **tail = &ctx->sessions;
+  while (*tail != NULL) {
+    tail = &(*tail)->next;
+  }
+  *tail = s;
+  return s;
+}
+
+static void close_holes(nt_ctx *ctx, nt_session *s, int keep_fd) {
+  int i;
+  for (i = 0; i < s->n_holes; ++i) {
+    if (s->holes[i].fd >= 0 && s->holes[i].fd != keep_fd) {
+      ctx->io->close(ctx->io, s->holes[i].fd);
+    }
+    s->holes[i].fd = -1;
+  }
 }
 
-int get_peer_info_from_meta(client *cli, char peer_meta[21],
-                            struct peer_info *peer) {
-  cli->msg_buf = cli->buf;
-  cli->msg_buf = encode16(cli->msg_buf, GetPeerInfoFromMeta);
-  cli->msg_buf = encode8(cli->msg_buf, (uint8_t)strlen(peer_meta));
-  cli->msg_buf = encode(cli->msg_buf, peer_meta, strlen(peer_meta));
-  return send_get_peer_info_request(cli, peer);
+static void finish_session(nt_ctx *ctx, nt_session *s, int keep_fd) {
+  close_holes(ctx, s, keep_fd);
+  if (s->relay.fd >= 0) {
+    ctx->io->close(ctx->io, s->relay.fd);
+    s->relay.fd = -1;
+  }
+  s->relay_at = -1;
+  if (keep_fd >= 0) {
+    // handed to the application, its watch goes with the session
+    epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, keep_fd, NULL);
+  }
+  s->state = S_DONE;
+  s->deadline = -1;
 }
 
-int recv_peer_info(int fd, struct peer_info *peer) {
-  struct my_peer_info peer_i;
-  int n_bytes;
-  n_bytes = recv(fd, (void *)&peer_i, sizeof(struct my_peer_info), 0);
-  if (n_bytes <= 0) {
-    return -1;
+static void report_mesh(nt_ctx *ctx, nt_session *s, uint8_t result) {
+  if (!s->mesh) {
+    return;
   }
-  if (n_bytes == 1) {
-    // offline or error
-    verbose_log("It seems peer has gone offline\n");
-    return 1;
+  char buf[8];
+  char *p = buf;
+  p = encode16(p, MeshResult);
+  p = encode32(p, s->peer.id);
+  p = encode8(p, result);
+  send_to_punch_server(ctx, buf, p - buf);
+}
+
+static void fail_session(nt_ctx *ctx, nt_session *s, int reason) {
+  finish_session(ctx, s, -1);
+  if (s->relayed) {
+    verbose_log("no direct path to peer %d, staying on the relay\n",
+                s->peer.id);
+    return;
+  }
+  report_mesh(ctx, s, reason);
+  if (s->lookup_only) {
+    if (ctx->cb.on_peer_info) {
+      ctx->cb.on_peer_info(ctx, NULL, ctx->cb.user_data);
+    }
+  } else if (ctx->cb.on_failed) {
+    ctx->cb.on_failed(ctx, &s->peer, reason, ctx->cb.user_data);
+  }
+}
+
+static void reap_sessions(nt_ctx *ctx) {
+  nt_session **p = &ctx->sessions;
+  while (*p != NULL) {
+    nt_session *s = *p;
+    if (s->state == S_DONE) {
+      *p = s->next;
+      arena_pool_put(&ctx->session_pool, s->arena.base);
+    } else {
+      p = &s->next;
+    }
   }
-  verbose_log(
-      "Dumping %d bytes of data received, should have dumped %ld bytes\n",
-      n_bytes, sizeof(struct my_peer_info));
-  hex_dump(NULL, &peer_i, n_bytes);
+}
+
+static int decode_peer_info(const char *buf, struct peer_info *peer) {
+  struct my_peer_info peer_i;
+  memcpy(&peer_i, buf, sizeof(peer_i));
+
   peer->id = ntohl(peer_i.id);
   verbose_log("The ip got is %s\n", peer_i.ip);
-  strcpy(peer->ip, peer_i.ip);
+  strncpy(peer->ip, peer_i.ip, IP_STR_LEN - 1);
+  peer->ip[IP_STR_LEN - 1] = '\0';
   peer->port = ntohs(peer_i.port);
   peer->type = ntohs(peer_i.type);
-  verbose_log("Peer info got, id: %d, ip: %s, port: %d, type: %s, len: %d\n",
+  strncpy(peer->ip6, peer_i.ip6, IP_STR_LEN - 1);
+  peer->ip6[IP_STR_LEN - 1] = '\0';
+  peer->port6 = ntohs(peer_i.port6);
+  memcpy(peer->meta, buf + sizeof(peer_i), peer_i.len);
+  peer->meta[peer_i.len] = '\0';
+  verbose_log("Peer info got, id: %d, ip: %s, port: %d, type: %s, ip6: %s, "
+              "port6: %d, meta: %s\n",
               peer->id, peer->ip, peer->port, get_nat_desc(peer->type),
-              peer_i.len);
-  peer->meta = malloc(peer_i.len);
-  int m_bytes = recv(fd, (void *)peer->meta, peer_i.len, 0);
-  if (m_bytes <= 0) {
-    verbose_log("failed to get meta, error: %s\n", strerror(errno));
+              peer->ip6, peer->port6, peer->meta);
+  return 0;
+}
+
+static void set_port(struct sockaddr_storage *addr, uint16_t port) {
+  if (addr->ss_family == AF_INET6) {
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+  } else {
+    ((struct sockaddr_in *)addr)->sin_port = htons(port);
+  }
+}
+
+// IPv4 sockets go out the uplink whose NAT was enrolled
+static int bind_device(nt_ctx *ctx, int fd, int family) {
+  if (family != AF_INET || ctx->ifname[0] == '\0') {
+    return 0;
+  }
+  return ctx->io->setsockopt(ctx->io, fd, SOL_SOCKET, SO_BINDTODEVICE,
+                             ctx->ifname, strlen(ctx->ifname));
+}
+
+static void set_ttl(nt_ctx *ctx, int fd, int family, int ttl) {
+  if (family == AF_INET6) {
+    ctx->io->setsockopt(ctx->io, fd, IPPROTO_IPV6, IPV6_UNICAST_HOPS, &ttl,
+                        sizeof(ttl));
+  } else {
+    ctx->io->setsockopt(ctx->io, fd, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
+  }
+}
+
+// the sockets are non-blocking, a full send buffer fails right away
+static int send_dummy_udp_packet(nt_ctx *ctx, int fd,
+                                 struct sockaddr_storage *addr,
+                                 socklen_t addr_len) {
+  return ctx->io->sendto(ctx->io, fd, &punch_probe, 1, 0,
+                         (struct sockaddr *)addr, addr_len);
+}
+
+static int add_hole(nt_ctx *ctx, nt_session *s, int fd) {
+  struct watch *w = &s->holes[s->n_holes];
+  w->fd = fd;
+  w->session = s;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = w;
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    ctx->io->close(ctx->io, fd);
+    w->fd = -1;
     return -1;
   }
-  verbose_log("meta is %s\n", peer->meta);
-  n_bytes += m_bytes;
-  hex_dump(NULL, peer, n_bytes);
-  return n_bytes;
+  ++s->n_holes;
+  return 0;
+}
+
+static int rand_below(unsigned int *seed, int n) {
+  // reject the tail of the range to avoid modulo bias
+  int limit = RAND_MAX - RAND_MAX % n;
+  int r;
+  do {
+    r = rand_r(seed);
+  } while (r >= limit);
+  return r % n;
+}
+
+// the next port of the peer to probe, drawn from gen
+static uint16_t peer_port(const nt_session *s, struct port_gen *gen) {
+  return s->one_port ? s->peer.port : port_gen_next(gen);
+}
+
+static void notify_peer(nt_ctx *ctx, uint32_t peer_id) {
+  char buf[16];
+  char *p = buf;
+  p = encode16(p, NotifyPeer);
+  p = encode32(p, peer_id);
+  send_to_punch_server(ctx, buf, p - buf);
 }
 
-int send_get_peer_info_request(client *cli, struct peer_info *peer) {
-  if (-1 == send_to_punch_server(cli)) {
+// open our half of the IPv6 direct path: bind the advertised port and send one
+// probe to the peer, so that stateful firewalls on both sides let the peer's
+// probe in. There is no NAT on the way, so the probe uses the default hop
+// limit. Returns the socket, or -1 if either side has no IPv6 address.
+static int start_direct_ipv6(nt_ctx *ctx, struct peer_info *peer) {
+  if (ctx->ip6[0] == '\0' || peer->ip6[0] == '\0') {
     return -1;
   }
-  if (recv_peer_info(cli->sfd, peer) > 0) {
-    return 0;
+
+  struct sockaddr_storage local_addr, peer_addr;
+  socklen_t local_len = make_sockaddr("::", ctx->local_port6, &local_addr);
+  socklen_t peer_len = make_sockaddr(peer->ip6, peer->port6, &peer_addr);
+  if (!peer_len || peer_addr.ss_family != AF_INET6) {
+    verbose_log("invalid ipv6 address of peer: %s\n", peer->ip6);
+    return -1;
   }
-  return -1;
-}
 
-static int send_dummy_udp_packet(int fd, struct sockaddr_in addr) {
-  char dummy = 'c';
-
-  struct timeval tv = {5, 0};
-  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof(tv));
-
-  return sendto(fd, &dummy, 1, 0, (struct sockaddr *)&addr, sizeof(addr));
-}
-
-static int punch_hole(struct sockaddr_in peer_addr, int ttl) {
-  int hole = socket(AF_INET, SOCK_DGRAM, 0);
-  if (hole != -1) {
-    // struct sockaddr_in local_addr;
-    // local_addr.sin_family = AF_INET;
-    // local_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    // local_addr.sin_port = htons(DEFAULT_LOCAL_PORT + 1);
-    // int reuse_addr = 1;
-    // setsockopt(hole, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse_addr,
-    // sizeof(reuse_addr)); if (bind(hole, (struct sockaddr *)&local_addr,
-    // sizeof(local_addr))) {
-    //    if (errno == EADDRINUSE) {
-    //        verbose_log("addr already in use, try another port\n");
-    //        return -1;
-    //    }
-    //}
-
-    /* TODO we can use traceroute to get the number of hops to the peer
-     * to make sure this packet woudn't reach the peer but get through the NAT
-     * in front of itself
-     */
-    setsockopt(hole, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
-
-    // send short ttl packets to avoid triggering flooding protection of NAT in
-    // front of peer
-    if (send_dummy_udp_packet(hole, peer_addr) < 0) {
-      return -1;
-    }
+  struct io_backend *io = ctx->io;
+  int sock = io->socket(io, AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  int on = 1;
+  io->setsockopt(io, sock, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+  io->setsockopt(io, sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (io->bind(io, sock, (struct sockaddr *)&local_addr, local_len) ||
+      send_dummy_udp_packet(ctx, sock, &peer_addr, peer_len) < 0) {
+    verbose_log("failed to open ipv6 direct path, error: %s\n",
+                strerror(errno));
+    io->close(io, sock);
+    return -1;
   }
+  verbose_log("ipv6 direct probe sent to [%s]:%d\n", peer->ip6, peer->port6);
 
-  return hole;
+  return sock;
 }
 
-static int wait_for_peer(int *socks, int sock_num, struct timeval *timeout) {
-  fd_set fds;
-  int max_fd = 0;
-  FD_ZERO(&fds);
+// NATs of these types keep one external mapping per local socket, whatever
+// the destination
+static int keeps_mapping(nat_type type) {
+  return type >= OpenInternet && type <= RestricPortNAT;
+}
+
+// when our NAT keeps one mapping per socket, a single socket bound to the port
+// we enrolled with can hold every hole, the peer's probes are aimed at its
+// published mapping
+static int open_spray_socket(nt_ctx *ctx, nt_session *s) {
+  struct io_backend *io = ctx->io;
+  struct sockaddr_storage local_addr;
+  socklen_t local_len =
+      make_sockaddr(s->peer_addr.ss_family == AF_INET6 ? "::" : "0.0.0.0",
+                    ctx->local_port, &local_addr);
+  int sock = io->socket(io, s->peer_addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK,
+                        0);
+  if (sock < 0) {
+    return -1;
+  }
+  int on = 1;
+  io->setsockopt(io, sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind_device(ctx, sock, s->peer_addr.ss_family) ||
+      io->bind(io, sock, (struct sockaddr *)&local_addr, local_len)) {
+    verbose_log("failed to bind port %d, error: %s\n", ctx->local_port,
+                strerror(errno));
+    io->close(io, sock);
+    return -1;
+  }
+  if (s->initiator && s->ttl > 0) {
+    set_ttl(ctx, sock, s->peer_addr.ss_family, s->ttl);
+  }
+  return sock;
+}
+
+static enum strategy strategy_of(const nt_session *s) {
+  if (s->rendezvous) {
+    return STRATEGY_RENDEZVOUS;
+  }
+  return s->spray ? STRATEGY_SPRAY : STRATEGY_HOLES;
+}
 
+static struct resume_entry *find_resume(nt_ctx *ctx, const nt_session *s) {
   int i;
-  for (i = 0; i < sock_num; ++i) {
-    FD_SET(socks[i], &fds);
-    if (socks[i] > max_fd) {
-      max_fd = socks[i];
+  for (i = 0; i < RESUME_CACHE_SIZE; ++i) {
+    struct resume_entry *e = &ctx->resume[i];
+    if (e->seen_at == 0) {
+      continue;
+    }
+    if (e->meta[0] != '\0' ? strcmp(e->meta, s->meta) == 0
+                            : e->peer_id == s->peer.id) {
+      return e;
     }
   }
-  int ret = select(max_fd + 1, &fds, NULL, NULL, timeout);
+  return NULL;
+}
 
-  int index = -1;
-  if (ret > 0) {
-    for (i = 0; i < sock_num; ++i) {
-      if (FD_ISSET(socks[i], &fds)) {
-        index = i;
-        break;
-      }
+// remembers the hole that connected, over the oldest entry if the cache is full
+static void save_resume(nt_ctx *ctx, const nt_session *s, int sock,
+                        const struct sockaddr_storage *from) {
+  struct sockaddr_in local;
+  socklen_t local_len = sizeof(local);
+  if (from->ss_family != AF_INET ||
+      getsockname(sock, (struct sockaddr *)&local, &local_len)) {
+    return; // the IPv6 direct path needs no traversal
+  }
+  struct resume_entry *e = find_resume(ctx, s);
+  int i;
+  for (i = 0; e == NULL && i < RESUME_CACHE_SIZE; ++i) {
+    if (i == 0 || ctx->resume[i].seen_at < e->seen_at) {
+      e = &ctx->resume[i];
     }
-  } else {
-    // timeout or error
   }
+  e->peer_id = s->peer.id;
+  strcpy(e->meta, s->meta);
+  strcpy(e->ip, s->peer.ip);
+  e->remote_port = ntohs(((const struct sockaddr_in *)from)->sin_port);
+  e->local_port = ntohs(local.sin_port);
+  e->ttl = s->ttl;
+  e->strategy = strategy_of(s);
+  e->seen_at = now_ms();
+}
 
-  // one of the fds is ready, close others
-  if (index != -1) {
-    for (i = 0; i < sock_num; ++i) {
-      if (index != i) {
-        close(socks[i]);
+// the remembered port first, then its neighbours: NATs allocating ports in
+// sequence give the peer a mapping next to the last one. With one_port, new
+// sockets of ours are all aimed at the one mapping of the peer
+static void resume_ports(nt_session *s, const struct resume_entry *e) {
+  port_gen_init(&s->ports, MIN_PORT, MAX_PORT, s->seed);
+  s->n_ports = port_gen_window(&s->ports, e->remote_port, RESUME_SPREAD);
+}
+
+// the first remembered hole binds the local port that connected last time,
+// our NAT may still hold its mapping towards the peer
+static void open_resumed_hole(nt_ctx *ctx, nt_session *s, uint16_t port) {
+  struct io_backend *io = ctx->io;
+  struct sockaddr_storage local_addr;
+  socklen_t local_len = make_sockaddr("0.0.0.0", port, &local_addr);
+  int sock = io->socket(io, AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) {
+    return;
+  }
+  int on = 1;
+  io->setsockopt(io, sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind_device(ctx, sock, AF_INET) ||
+      io->bind(io, sock, (struct sockaddr *)&local_addr, local_len)) {
+    // taken since, the punch opens it from any port
+    io->close(io, sock);
+    return;
+  }
+  if (s->initiator && s->ttl > 0) {
+    set_ttl(ctx, sock, AF_INET, s->ttl);
+  }
+  struct port_gen gen = s->ports;
+  set_port(&s->peer_addr, peer_port(s, &gen));
+  if (send_dummy_udp_packet(ctx, sock, &s->peer_addr, s->peer_addr_len) < 0) {
+    io->close(io, sock);
+    return;
+  }
+  s->ports = gen;
+  ++s->next_port;
+  add_hole(ctx, s, sock);
+}
+
+static int64_t backoff(int retries) {
+  return (int64_t)RETRANSMIT_MS << (retries < 4 ? retries : 4);
+}
+
+static int is_pooled(nt_ctx *ctx, const struct watch *w) {
+  uintptr_t p = (uintptr_t)w;
+  return p >= (uintptr_t)ctx->pool && p < (uintptr_t)(ctx->pool + MAX_POOL);
+}
+
+static int open_pooled(nt_ctx *ctx, struct pooled *p) {
+  struct io_backend *io = ctx->io;
+  int sock = io->socket(io, AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &p->w;
+  if (bind_device(ctx, sock, AF_INET) ||
+      epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, sock, &ev)) {
+    io->close(io, sock);
+    return -1;
+  }
+  p->w.fd = sock;
+  p->w.session = NULL;
+  p->ext_port = 0;
+  p->retries = 0;
+  return 0;
+}
+
+static void drop_pooled(nt_ctx *ctx, struct pooled *p) {
+  ctx->io->close(ctx->io, p->w.fd);
+  p->w.fd = -1;
+}
+
+static void send_pool_request(nt_ctx *ctx, struct pooled *p, int64_t now) {
+  if (p->retries == 0) {
+    p->req_len = stun_binding_request(p->req);
+  }
+  ctx->io->sendto(ctx->io, p->w.fd, p->req, p->req_len, 0,
+                  (struct sockaddr *)&ctx->stun_addr, ctx->stun_addr_len);
+  ++p->retries;
+  p->next_at = now + (p->ext_port ? KEEPALIVE_MS : backoff(p->retries));
+}
+
+// opens the free slots, sends the requests that are due and closes the
+// sockets whose requests go unanswered, they are opened again later
+static void refresh_pool(nt_ctx *ctx) {
+  int64_t now = now_ms();
+  int i;
+  ctx->pool_at = -1;
+  for (i = 0; i < ctx->pool_size; ++i) {
+    struct pooled *p = &ctx->pool[i];
+    if (p->next_at <= now) {
+      if (p->w.fd >= 0 && p->retries == MAX_RETRANSMITS) {
+        verbose_log("pooled socket %d unanswered, closed\n", p->w.fd);
+        drop_pooled(ctx, p);
+        p->next_at = now + KEEPALIVE_MS;
+      } else if (p->w.fd >= 0 || open_pooled(ctx, p) == 0) {
+        send_pool_request(ctx, p, now);
+      } else {
+        p->next_at = now + KEEPALIVE_MS;
       }
     }
-
-    return socks[index];
+    if (ctx->pool_at < 0 || p->next_at < ctx->pool_at) {
+      ctx->pool_at = p->next_at;
+    }
   }
+}
 
-  return -1;
+static void pool_ready(nt_ctx *ctx, struct pooled *p) {
+  char buf[MAX_STUN_MESSAGE_LENGTH];
+  struct sockaddr_storage from;
+  socklen_t from_len = sizeof(from);
+  ssize_t len = ctx->io->recvfrom(ctx->io, p->w.fd, buf, sizeof(buf), 0,
+                                  (struct sockaddr *)&from, &from_len);
+  uint16_t port = len > 0 ? stun_mapped_port(p->req, buf, len) : 0;
+  if (port == 0) {
+    return; // not the response to the request in flight
+  }
+  if (port != p->ext_port) {
+    verbose_log("pooled socket %d mapped to port %d\n", p->w.fd, port);
+  }
+  p->ext_port = port;
+  p->retries = 0;
 }
 
-static void shuffle(int *num, int len) {
-  srand(time(NULL));
+// the first holes of an attempt are pooled sockets, aimed at the first ports
+// of the peer. Our symmetric NAT maps them close to the ports the STUN server
+// saw, which are hinted to the peer. Returns the number of holes taken
+static int take_pooled(nt_ctx *ctx, nt_session *s) {
+  char buf[MSG_BUF_SIZE];
+  char *p = buf + sizeof(uint16_t) + sizeof(uint32_t) + 1;
+  int i, n = 0;
+  if (s->resumed || s->peer_addr.ss_family != AF_INET) {
+    return 0;
+  }
+  int64_t now = now_ms();
+  for (i = 0; i < ctx->pool_size && s->next_port < s->n_ports; ++i) {
+    struct pooled *pl = &ctx->pool[i];
+    if (pl->w.fd < 0 || pl->ext_port == 0) {
+      continue;
+    }
+    // the slot is opened again right away
+    int fd = pl->w.fd;
+    pl->w.fd = -1;
+    pl->next_at = now;
+    ctx->pool_at = now;
+    epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, NULL);
+    if (s->initiator && s->ttl > 0) {
+      set_ttl(ctx, fd, AF_INET, s->ttl);
+    }
+    struct port_gen gen = s->ports;
+    set_port(&s->peer_addr, peer_port(s, &gen));
+    if (send_dummy_udp_packet(ctx, fd, &s->peer_addr, s->peer_addr_len) < 0) {
+      ctx->io->close(ctx->io, fd);
+      continue;
+    }
+    s->ports = gen;
+    ++s->next_port;
+    if (add_hole(ctx, s, fd) == 0) {
+      p = encode16(p, pl->ext_port);
+      ++n;
+    }
+  }
+  if (n > 0) {
+    char *q = encode16(buf, PortHint);
+    q = encode32(q, s->peer.id);
+    encode8(q, n);
+    verbose_log("%d pooled holes, their ports hinted to peer %d\n", n,
+                s->peer.id);
+    send_to_punch_server(ctx, buf, p - buf);
+  }
+  return n;
+}
 
-  // Fisher-Yates shuffle algorithm
-  int i, r, temp;
-  for (i = len - 1; i > 0; i--) {
-    r = rand() % i;
+// windows around the hinted ports are drawn first. Returns the number of
+// ports they add
+static int apply_hint(nt_session *s, const uint16_t *ports, int n) {
+  int i, added = 0;
+  for (i = 0; i < n && !s->one_port; ++i) {
+    int k = port_gen_window(&s->ports, ports[i], HINT_SPREAD);
+    if (k < 0) {
+      break;
+    }
+    added += k;
+  }
+  return added;
+}
 
-    temp = num[i];
-    num[i] = num[r];
-    num[r] = temp;
+static struct port_hint *find_hint(nt_ctx *ctx, uint32_t peer_id) {
+  int i;
+  for (i = 0; i < MAX_HINTS; ++i) {
+    if (ctx->hints[i].at != 0 && ctx->hints[i].peer_id == peer_id) {
+      return &ctx->hints[i];
+    }
   }
+  return NULL;
 }
 
-static int connect_to_symmetric_nat(client *c, struct peer_info remote_peer) {
-  // TODO choose port prediction strategy
+static int active_attempts(nt_ctx *ctx) {
+  int n = 0;
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if (s->state == S_DIRECT || s->state == S_PUNCH || s->state == S_WAIT) {
+      ++n;
+    }
+  }
+  return n;
+}
 
+static void begin_traversal(nt_ctx *ctx, nt_session *s) {
   /*
    * according to birthday paradox, probability that port randomly chosen from
    * [1024, 65535] will collide with another one chosen by the same way is p(n)
@@ -211,274 +933,1933 @@ static int connect_to_symmetric_nat(client *c, struct peer_info remote_peer) {
    * which makes the probalility decline dramatically.
    * Moreover, symmetric NATs don't really allocate ports randomly.
    */
-  struct sockaddr_in peer_addr;
-
-  peer_addr.sin_family = AF_INET;
-  peer_addr.sin_addr.s_addr = inet_addr(remote_peer.ip);
-
-  int *holes = malloc(NUM_OF_PORTS * sizeof(int));
-  shuffle(ports, MAX_PORT - MIN_PORT + 1);
-
-  int i = 0;
-  for (; i < NUM_OF_PORTS;) {
-    uint16_t port = ports[i];
-    if (port != remote_peer.port) { // exclude the used one
-      peer_addr.sin_port = htons(port);
-
-      if ((holes[i] = punch_hole(peer_addr, c->ttl)) < 0) {
-        // NAT in front of us wound't tolerate too many ports used by one
-        // application
-        verbose_log("failed to punch hole, error: %s\n", strerror(errno));
-        break;
-      }
-      // sleep for a while to avoid flooding protection
-      usleep(1000 * 100);
-      ++i;
+  s->peer_addr_len = make_sockaddr(s->peer.ip, 0, &s->peer_addr);
+  // one extra slot for the IPv6 direct path, kept when a missed resumption
+  // starts over
+  if (s->holes == NULL) {
+    s->holes =
+        arena_alloc(&s->arena, (NUM_OF_PORTS + 1) * sizeof(struct watch));
+  }
+  if (!s->peer_addr_len || s->holes == NULL) {
+    verbose_log("invalid address of peer: %s\n", s->peer.ip);
+    fail_session(ctx, s, NT_ERR_SOCKET);
+    return;
+  }
+  s->attempt = ++ctx->attempts;
+  nt_pcap_attempt(s->attempt);
+  if (s->initiator && ctx->relay_after_ms >= 0 && s->relay_retries == 0 &&
+      s->relay_at < 0 && !s->relayed) {
+    s->relay_at = now_ms() + ctx->relay_after_ms;
+  }
+  s->retries = 0;
+  s->ttl = ctx->ttl;
+  // a permutation of the port range keyed by the attempt, without the used
+  // port
+  port_gen_init(&s->ports, MIN_PORT, MAX_PORT, s->seed);
+  port_gen_exclude(&s->ports, s->peer.port);
+  s->one_port = 0;
+  s->n_ports = NUM_OF_PORTS;
+
+  // strategy from the pair of NAT types:
+  //   we keep one mapping: one socket, one batch of probes to all ports
+  //   the peer keeps one mapping: every probe goes to its published port
+  //   both symmetric: one socket per random port
+  if (keeps_mapping(s->peer.type)) {
+    s->one_port = 1;
+    s->n_ports = 1;
+  }
+  s->spray_fd = -1;
+  if (keeps_mapping(ctx->nat_type)) {
+    if (ctx->udp && ctx->server_addr.ss_family == s->peer_addr.ss_family) {
+      // the server published the mapping of the rendezvous socket
+      s->rendezvous = 1;
     } else {
-      ports[i] = ports[1000];
-      continue;
+      s->spray_fd = open_spray_socket(ctx, s);
     }
   }
+  if (s->rendezvous || s->spray_fd >= 0) {
+    verbose_log("punching from a single socket, %d ports\n", s->n_ports);
+    s->spray = 1;
+  } else if (keeps_mapping(s->peer.type)) {
+    // each socket of our symmetric NAT gets a new mapping, all aimed at the
+    // one port of the peer
+    s->n_ports = NUM_OF_PORTS;
+  }
+  if (!s->spray && s->n_ports > ctx->holes_per_attempt) {
+    // the share of the descriptor budget, one NAT mapping per socket
+    s->n_ports = ctx->holes_per_attempt;
+  }
 
-  // hole punched, notify remote peer via punch server
-  c->msg_buf = encode16(c->msg_buf, NotifyPeer);
-  c->msg_buf = encode32(c->msg_buf, remote_peer.id);
-  send_to_punch_server(c);
-
-  struct timeval timeout = {100, 0};
-  int fd = wait_for_peer(holes, i, &timeout);
-  if (fd > 0) {
-    on_connected(fd);
-  } else {
-    int j = 0;
-    for (; j < i; ++j) {
-      close(holes[j]);
+  // a reconnect first tries what worked last time, as long as the peer and
+  // the strategy are the same
+  struct resume_entry *e = find_resume(ctx, s);
+  if (e != NULL && now_ms() - e->seen_at < RESUME_MAX_AGE_MS &&
+      strcmp(e->ip, s->peer.ip) == 0 && e->strategy == strategy_of(s) &&
+      s->n_ports > 1) {
+    verbose_log("resuming peer %d at port %d from port %d\n", s->peer.id,
+                e->remote_port, e->local_port);
+    s->resumed = 1;
+    s->ttl = e->ttl;
+    resume_ports(s, e);
+    if (s->spray_fd >= 0 && s->initiator && s->ttl > 0) {
+      // the socket was opened with the configured ttl
+      set_ttl(ctx, s->spray_fd, AF_INET, s->ttl);
+    } else if (!s->spray) {
+      open_resumed_hole(ctx, s, e->local_port);
     }
-    verbose_log("timout, not connected\n");
+  }
+  // the peer's pool was mapped before our traversal began
+  struct port_hint *h = find_hint(ctx, s->peer.id);
+  if (h != NULL) {
+    if (now_ms() - h->at < HINT_MAX_AGE_MS) {
+      apply_hint(s, h->ports, h->n_ports);
+    }
+    h->at = 0;
   }
 
-  return 0;
+  // happy eyeballs: when both sides have IPv6 the peer is notified right away
+  // so that its direct probe races against the IPv4 holes, whichever socket
+  // becomes readable first takes the session
+  int direct = start_direct_ipv6(ctx, &s->peer);
+  if (direct >= 0 && add_hole(ctx, s, direct) == 0) {
+    s->direct = 1;
+    if (s->initiator) {
+      notify_peer(ctx, s->peer.id);
+      s->notified = 1;
+    }
+    s->state = S_DIRECT;
+    s->deadline = now_ms() + HAPPY_EYEBALLS_DELAY_MS;
+  } else {
+    s->state = S_PUNCH;
+    s->deadline = now_ms();
+  }
+  if (s->spray && !s->rendezvous && add_hole(ctx, s, s->spray_fd)) {
+    s->spray = 0;
+  }
+  nt_pcap_attempt(0);
 }
 
-void try_connect_to_peer(struct peer_info peer) {
-  verbose_log("recved command, ready to connect to %s:%d\n", peer.ip,
-              peer.port);
+static void start_traversal(nt_ctx *ctx, nt_session *s) {
+  s->seed = rand_r(&ctx->seed);
+  if (active_attempts(ctx) >= ctx->max_attempts) {
+    verbose_log("%d attempts running, peer %d queued\n", ctx->max_attempts,
+                s->peer.id);
+    s->state = S_QUEUED;
+    s->deadline = -1;
+    return;
+  }
+  begin_traversal(ctx, s);
+}
 
-  struct sockaddr_in peer_addr;
+// queued attempts take the slots freed by finished ones, oldest first
+static void start_queued(nt_ctx *ctx) {
+  int free_slots = ctx->max_attempts - active_attempts(ctx);
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL && free_slots > 0; s = s->next) {
+    if (s->state == S_QUEUED) {
+      begin_traversal(ctx, s);
+      --free_slots;
+    }
+  }
+}
 
-  peer_addr.sin_family = AF_INET;
-  peer_addr.sin_addr.s_addr = inet_addr(peer.ip);
+// fills op with the next hole of the session, returns 0 once every port is
+// used. The initiator opens ttl limited holes that die before reaching the
+// peer's NAT, the other side probes with full ttl packets that should get
+// through one of them
+static int prepare_hole(nt_ctx *ctx, nt_session *s, struct punch_op *op) {
+  if (s->next_port == s->n_ports) {
+    return 0;
+  }
 
-  int sock_array[NUM_OF_PORTS];
-  int i = 0;
+  uint16_t port = peer_port(s, &s->ports);
+  if (port == 0) {
+    return 0;
+  }
+  set_port(&s->peer_addr, port);
+  ++s->next_port;
+  op->dst = s->peer_addr;
+  op->dst_len = s->peer_addr_len;
+  /* TODO we can use traceroute to get the number of hops to the peer
+   * to make sure this packet woudn't reach the peer but get through the NAT
+   * in front of itself
+   */
+  op->ttl = s->initiator ? s->ttl : 0;
+  op->ifname = s->peer_addr.ss_family == AF_INET && ctx->ifname[0] != '\0'
+                   ? ctx->ifname
+                   : NULL;
+  // the backend registers the socket with this watch, which becomes the next
+  // hole if the punch succeeds
+  s->holes[s->n_holes].session = s;
+  op->tag = &s->holes[s->n_holes];
+  op->attempt = s->attempt;
+  op->fd = -1;
+  op->err = 0;
+  return 1;
+}
 
-  shuffle(ports, MAX_PORT - MIN_PORT + 1);
-  // send probe packets, check if connected with peer, if yes, stop probing
-  for (; i < NUM_OF_PORTS;) {
-    if (ports[i] == peer.port) {
-      ports[i] = ports[1000]; // TODO
-      continue;
-    }
-    if ((sock_array[i] = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-      verbose_log("failed to create socket, send %d probe packets\n", i);
-      break;
-    }
+static void finish_punching(nt_ctx *ctx, nt_session *s) {
+  if (s->n_holes == 0 && !s->rendezvous) {
+    fail_session(ctx, s, NT_ERR_SOCKET);
+    return;
+  }
 
-    peer_addr.sin_port = htons(ports[i]);
+  // hole punched, notify remote peer via punch server
+  if (s->initiator && !s->notified) {
+    notify_peer(ctx, s->peer.id);
+    s->notified = 1;
+  }
+  verbose_log("holes punched, waiting for peer\n");
+  s->state = S_WAIT;
+  s->wait_until = now_ms() + (s->resumed ? RESUME_WAIT_MS : WAIT_FOR_PEER_MS);
+  s->deadline = s->wait_until;
+  if (ctx->udp && s->notified && !s->delivered) {
+    s->deadline = now_ms() + RETRANSMIT_MS;
+  }
+}
 
-    // let OS choose available ports
-    if (send_dummy_udp_packet(sock_array[i], peer_addr) < 0) {
-      verbose_log("may trigger flooding protection\n");
+// sends a probe to every remaining port from the single socket, in one
+// sendmmsg() unless the socket buffer fills up
+static void spray_holes(nt_ctx *ctx, nt_session *s) {
+  struct iovec iov = {(void *)&punch_probe, 1};
+  // drawn from a copy, the ports the socket buffer can't take are drawn again
+  // next time
+  struct port_gen gen = s->ports;
+  int i, n;
+  for (n = 0; s->next_port + n < s->n_ports; ++n) {
+    uint16_t port = peer_port(s, &gen);
+    if (port == 0) {
       break;
     }
+    ctx->spray_dsts[n] = s->peer_addr;
+    set_port(&ctx->spray_dsts[n], port);
+    struct msghdr *msg = &ctx->spray_msgs[n].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &ctx->spray_dsts[n];
+    msg->msg_namelen = s->peer_addr_len;
+    msg->msg_iov = &iov;
+    msg->msg_iovlen = 1;
+  }
 
-    // wait for a while
-    struct timeval tv = {0, 1000 * 100};
-    int fd = wait_for_peer(sock_array, ++i, &tv);
-    if (fd > 0) {
-      // connected
-      on_connected(fd);
-
-      // TODO
+  int fd = s->rendezvous ? ctx->control.fd : s->spray_fd;
+  int family = s->peer_addr.ss_family;
+  // the rendezvous socket also talks to the server, its ttl is only lowered
+  // for the probes
+  int ttl = s->rendezvous && s->initiator ? s->ttl : 0;
+  if (ttl > 0) {
+    set_ttl(ctx, fd, family, ttl);
+  }
+  int sent = ctx->io->sendmmsg(ctx->io, fd, ctx->spray_msgs, n, 0);
+  if (ttl > 0) {
+    set_ttl(ctx, fd, family, -1);
+  }
+  if (sent < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      verbose_log("failed to spray probes, error: %s\n", strerror(errno));
+      finish_punching(ctx, s);
       return;
     }
+    sent = 0;
+  }
+  for (i = 0; i < sent; ++i) {
+    peer_port(s, &s->ports);
   }
+  s->next_port += sent;
+  if (s->next_port == s->n_ports || sent == n) {
+    finish_punching(ctx, s);
+    return;
+  }
+  // the rest once the socket buffer drains
+  s->deadline = now_ms() + PUNCH_INTERVAL_MS;
+}
 
-  verbose_log("holes punched, waiting for peer\n");
-  struct timeval tv = {100, 0};
-  int fd = wait_for_peer(sock_array, i, &tv);
-  if (fd > 0) {
-    on_connected(fd);
+static void hole_punched(nt_ctx *ctx, nt_session *s, struct punch_op *op) {
+  if (op->fd >= 0) {
+    s->holes[s->n_holes++].fd = op->fd;
+    // the few remembered holes go out back to back
+    s->deadline = now_ms() + (s->resumed ? 0 : PUNCH_INTERVAL_MS);
+    return;
+  }
+  // NAT in front of us wound't tolerate too many ports used by one
+  // application
+  verbose_log("failed to punch hole, error: %s\n", strerror(op->err));
+  finish_punching(ctx, s);
+}
+
+static int send_lookup(nt_ctx *ctx, nt_session *s) {
+  char buf[MSG_BUF_SIZE];
+  char *p = buf;
+  if (s->meta[0] != '\0') {
+    size_t meta_len = strlen(s->meta);
+    p = encode16(p, GetPeerInfoFromMeta);
+    p = encode8(p, (uint8_t)meta_len);
+    p = encode(p, s->meta, meta_len);
   } else {
-    int j = 0;
-    for (j = 0; j < i; ++j) {
-      close(sock_array[j]);
-    }
+    p = encode16(p, GetPeerInfo);
+    p = encode32(p, s->peer.id);
   }
+  return send_to_punch_server(ctx, buf, p - buf);
 }
 
-// run in another thread
-static void *server_notify_handler(void *data) {
-  int server_sock = *(int *)data;
-  struct peer_info peer;
+// none of the remembered holes answered: the entry is dropped and the attempt
+// starts over with the full traversal, notifying the peer again
+static void resume_missed(nt_ctx *ctx, nt_session *s) {
+  verbose_log("resuming peer %d missed, full traversal\n", s->peer.id);
+  struct resume_entry *e = find_resume(ctx, s);
+  if (e != NULL) {
+    e->seen_at = 0;
+  }
+  close_holes(ctx, s, -1);
+  s->n_holes = 0;
+  s->next_port = 0;
+  s->direct = 0;
+  s->spray = 0;
+  s->rendezvous = 0;
+  s->notified = 0;
+  s->delivered = 0;
+  s->resumed = 0;
+  s->selecting = 0;
+  s->n_paths = 0;
+  begin_traversal(ctx, s);
+}
 
-  // wait for notification
-  verbose_log("waiting for notification...\n");
-  for (;;) {
-    struct peer_info peer;
-    if (recv_peer_info(server_sock, &peer) > 0) {
+static void session_timer(nt_ctx *ctx, nt_session *s) {
+  int64_t now = now_ms();
+  switch (s->state) {
+  case S_LOOKUP:
+    // only armed over UDP
+    if (s->retries++ == MAX_RETRANSMITS) {
+      verbose_log("no reply to lookup\n");
+      fail_session(ctx, s, NT_ERR_TIMEOUT);
+      break;
+    }
+    send_lookup(ctx, s);
+    s->deadline = now + backoff(s->retries);
+    break;
+  case S_WAIT:
+    if (now < s->wait_until) {
+      // the notification is not acknowledged yet
+      if (!s->delivered && s->retries++ < MAX_RETRANSMITS) {
+        notify_peer(ctx, s->peer.id);
+      }
+      s->deadline = s->wait_until;
+      if (!s->delivered && s->retries < MAX_RETRANSMITS &&
+          now + backoff(s->retries) < s->wait_until) {
+        s->deadline = now + backoff(s->retries);
+      }
+      break;
+    }
+    if (s->resumed) {
+      resume_missed(ctx, s);
       break;
     }
+    verbose_log("timout, not connected\n");
+    fail_session(ctx, s, NT_ERR_TIMEOUT);
+    break;
+  default:
+    break;
   }
+}
 
-  verbose_log("recved command, ready to connect to %s:%d\n", peer.ip,
-              peer.port);
+// reply to the first packet of the peer so that its side becomes readable too,
+// then pin the socket to the peer
+static int pin_to_peer(nt_ctx *ctx, int sock,
+                       struct sockaddr_storage *remote_addr,
+                       socklen_t fromlen) {
+  char ip[IP_STR_LEN];
+  verbose_log("connected with peer from %s:%d\n", ip,
+              sockaddr_ntop((struct sockaddr *)remote_addr, ip, sizeof(ip)));
 
-  try_connect_to_peer(peer);
-  return NULL;
+  // restore the ttl
+  set_ttl(ctx, sock, remote_addr->ss_family, 64);
+  ctx->io->sendto(ctx->io, sock, "hello, peer", strlen("hello, peer"), 0,
+                  (struct sockaddr *)remote_addr, fromlen);
+  return ctx->io->connect(ctx->io, sock, (struct sockaddr *)remote_addr,
+                          fromlen);
 }
 
-int init(struct sockaddr_in punch_server, client *c) {
-  int server_sock = socket(AF_INET, SOCK_STREAM, 0);
-
-  int res = connect(server_sock, (struct sockaddr *)&punch_server,
-                    sizeof(punch_server));
-  if (res < 0) {
-    verbose_log("failed to connect to punch server: %d, port: %d\n",
-                punch_server.sin_addr.s_addr, punch_server.sin_port);
-    verbose_log("code: %d, error: %s\n", res, strerror(errno));
-    return res;
+static int same_address(const struct sockaddr_storage *a,
+                        const struct sockaddr_storage *b, int with_port) {
+  if (a->ss_family != b->ss_family) {
+    return 0;
   }
-  c->sfd = server_sock;
-  return 0;
+  if (a->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+    return !memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) &&
+           (!with_port || a6->sin6_port == b6->sin6_port);
+  }
+  const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+  const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+  return a4->sin_addr.s_addr == b4->sin_addr.s_addr &&
+         (!with_port || a4->sin_port == b4->sin_port);
 }
 
-int enroll(struct peer_info self, struct sockaddr_in punch_server, client *c) {
-  verbose_log("enrolling, meta: %s, ip: %s, port: %d, nat type: %s\n",
-              self.meta, self.ip, self.port, get_nat_desc(self.type));
-
-  int i, temp;
-  for (i = 0, temp = MIN_PORT; temp <= MAX_PORT; i++, temp++) {
-    ports[i] = temp;
+// sessions running side by side share the local port, so a late probe of one
+// peer may land on a hole punched for another
+static int from_peer(nt_session *s, const struct sockaddr_storage *from) {
+  if (from->ss_family == AF_INET6) {
+    struct sockaddr_storage direct;
+    return s->peer.ip6[0] != '\0' &&
+           make_sockaddr(s->peer.ip6, s->peer.port6, &direct) &&
+           same_address(&direct, from, 1);
   }
-
-  int res = init(punch_server, c);
-  if (res != 0) {
-    verbose_log("failed to connect to punch server\n");
-    return res;
+  if (!same_address(&s->peer_addr, from, 0)) {
+    return 0;
   }
+  // a peer keeping its mapping answers from the published port only
+  return !keeps_mapping(s->peer.type) ||
+         ntohs(((const struct sockaddr_in *)from)->sin_port) == s->peer.port;
+}
 
-  c->msg_buf = c->buf;
-  c->msg_buf = encode16(c->msg_buf, Enroll);
-  c->msg_buf = encode(c->msg_buf, self.ip, 16);
-  c->msg_buf = encode16(c->msg_buf, self.port);
-  c->msg_buf = encode16(c->msg_buf, self.type);
-  c->msg_buf = encode8(c->msg_buf, (uint8_t)strlen(self.meta));
-  c->msg_buf = encode(c->msg_buf, self.meta, strlen(self.meta));
-
-  if (-1 == send_to_punch_server(c)) {
-    verbose_log("sending to punch server failed\n");
-    return -1;
+// spray sockets of all sessions share the local port and the kernel hands a
+// datagram to any one of them, so it is matched to its session by source
+static nt_session *spray_session_of(nt_ctx *ctx,
+                                    const struct sockaddr_storage *from) {
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if ((s->state == S_PUNCH || s->state == S_WAIT) && s->spray &&
+        !s->rendezvous && from_peer(s, from)) {
+      return s;
+    }
   }
+  return NULL;
+}
 
-  // wait for server reply to get own ID
-  uint32_t peer_id = 0;
-  struct timeval tv;
-  tv.tv_sec = 10;
-  tv.tv_usec = 0;
-  setsockopt(c->sfd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv));
-  int n = recv(c->sfd, &peer_id, sizeof(uint32_t), 0);
-  if (n != sizeof(uint32_t)) {
-    return -1;
+static void peer_datagram(nt_ctx *ctx, nt_session *s, int sock,
+                          struct sockaddr_storage *from, socklen_t fromlen,
+                          const char *buf, ssize_t len);
+
+// a probe reached the socket of another session on the shared port, the
+// socket of its own session has the same mapping and takes the datagram
+static void spray_datagram(nt_ctx *ctx, struct sockaddr_storage *from,
+                           socklen_t fromlen, const char *buf, ssize_t len) {
+  nt_session *s = spray_session_of(ctx, from);
+  if (s == NULL) {
+    char ip[IP_STR_LEN];
+    verbose_log("datagram for another session from %s:%d\n", ip,
+                sockaddr_ntop((struct sockaddr *)from, ip, sizeof(ip)));
+    return;
   }
+  peer_datagram(ctx, s, s->spray_fd, from, fromlen, buf, len);
+}
 
-  c->id = ntohl(peer_id);
-  verbose_log("enrolled, id: %d\n", c->id);
+// the socket becomes the connection of the session. Datagrams queued on a
+// spray socket before it was pinned may be for other sessions, they are
+// passed on before the socket is handed over
+static void connect_session(nt_ctx *ctx, nt_session *s, int sock,
+                            struct sockaddr_storage *from, socklen_t fromlen) {
+  int shared = s->spray && sock == s->spray_fd;
+  if (pin_to_peer(ctx, sock, from, fromlen) < 0) {
+    return;
+  }
+  save_resume(ctx, s, sock, from);
+  // one of the fds is ready, close others
+  finish_session(ctx, s, sock);
+  while (shared) {
+    char buf[MSG_BUF_SIZE];
+    struct sockaddr_storage queued;
+    socklen_t queued_len = sizeof(queued);
+    ssize_t n = ctx->io->recvfrom(ctx->io, sock, buf, sizeof(buf), 0,
+                                  (struct sockaddr *)&queued, &queued_len);
+    if (n < 0) {
+      break;
+    }
+    if (!same_address(&queued, from, 1)) {
+      spray_datagram(ctx, &queued, queued_len, buf, n);
+    }
+  }
 
-  return 0;
+  report_mesh(ctx, s, 0);
+  if (ctx->cb.on_connected) {
+    s->peer.replaces = s->relayed;
+    ctx->cb.on_connected(ctx, &s->peer, sock, ctx->cb.user_data);
+  } else {
+    ctx->io->close(ctx->io, sock);
+  }
 }
 
-pthread_t wait_for_command(int *server_sock) {
-  // wait for command from punch server in another thread
-  pthread_t thread_id;
-  pthread_create(&thread_id, NULL, server_notify_handler, (void *)server_sock);
+static int path_msg_type(const char *buf, ssize_t len) {
+  const struct path_msg *msg = (const struct path_msg *)buf;
+  if (len != sizeof(*msg) || memcmp(msg->magic, "ntp", 3)) {
+    return 0;
+  }
+  return msg->type;
+}
 
-  return thread_id;
+// addr is NULL on a connected socket
+static void send_path_msg(nt_ctx *ctx, int fd, uint8_t type, uint32_t seq,
+                          int64_t sent_at, struct sockaddr_storage *addr,
+                          socklen_t addr_len) {
+  struct path_msg msg;
+  memcpy(msg.magic, "ntp", 3);
+  msg.type = type;
+  msg.seq = seq;
+  msg.sent_at = sent_at;
+  ctx->io->sendto(ctx->io, fd, &msg, sizeof(msg), 0, (struct sockaddr *)addr,
+                  addr_len);
 }
 
-void on_connected(int sock) {
-  char buf[MSG_BUF_SIZE] = {0};
-  struct sockaddr_in remote_addr;
-  socklen_t fromlen = sizeof remote_addr;
-  recvfrom(sock, buf, MSG_BUF_SIZE, 0, (struct sockaddr *)&remote_addr,
-           &fromlen);
-  verbose_log("recv %s\n", buf);
+// the path of the hole, added if the hole is new. A hole keeps the first
+// address of the peer it heard from, -1 for another one or if no room is left
+static int add_path(nt_ctx *ctx, nt_session *s, int fd,
+                    const struct sockaddr_storage *from, socklen_t fromlen) {
+  int i;
+  for (i = 0; i < s->n_paths; ++i) {
+    if (s->paths[i].fd == fd) {
+      return same_address(&s->paths[i].addr, from, 1) ? i : -1;
+    }
+  }
+  if (s->n_paths == ctx->max_paths) {
+    return -1;
+  }
+  struct path *p = &s->paths[s->n_paths];
+  memset(p, 0, sizeof(*p));
+  p->fd = fd;
+  p->addr = *from;
+  p->addr_len = fromlen;
+  // the initiator's holes were ttl limited, the probes must get through
+  set_ttl(ctx, fd, from->ss_family, 64);
+  return s->n_paths++;
+}
 
-  verbose_log("connected with peer from %s:%d\n",
-              inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
+// fewest lost probes first, then the lowest mean rtt. The first path if
+// nothing was measured
+static int best_path(nt_session *s) {
+  int i, best = 0;
+  for (i = 1; i < s->n_paths; ++i) {
+    struct path *p = &s->paths[i], *b = &s->paths[best];
+    if (p->answered > b->answered ||
+        (p->answered == b->answered && p->answered > 0 &&
+         p->rtt_sum * b->answered < b->rtt_sum * p->answered)) {
+      best = i;
+    }
+  }
+  return best;
+}
 
-  // restore the ttl
-  int ttl = 64;
-  setsockopt(sock, IPPROTO_IP, IP_TTL, &ttl, sizeof(ttl));
-  sendto(sock, "hello, peer", strlen("hello, peer"), 0,
-         (struct sockaddr *)&remote_addr, sizeof(remote_addr));
-}
-
-int real_connect_to_peer(client *cli, struct peer_info *peer) {
-  verbose_log("connecting to id: %d, meta: %s, ip: %s, port %d, nat type: %s\n",
-              peer->id, peer->meta, peer->ip, peer->port,
-              get_nat_desc(peer->type));
-
-  return connect_to_symmetric_nat(cli, *peer);
-  // choose less restricted peer as initiator
-  /* switch(peer.type) { */
-  /*     case OpenInternet: */
-  /*         // todo */
-  /*         break; */
-  /*     case FullCone: */
-  /*         break; */
-  /*     case RestricNAT: */
-  /*         // todo */
-  /*         break; */
-  /*     case RestricPortNAT: */
-  /*         // todo  */
-  /*         break; */
-  /*     case SymmetricNAT: */
-  /*         if (cli->type == SymmetricNAT) { */
-  /*           connect_to_symmetric_nat_from_meta(cli, peer_meta, peer); */
-  /*         } */
-  /*         else { */
-  /*             // todo */
-  /*         } */
-  /*         break; */
-  /*     default: */
-  /*         verbose_log("unknown nat type\n"); */
-  /*         return -1; */
-  /*         // log */
-  /* } */
-
-  /* return 0; */
-}
-
-int connect_to_peer(client *cli, uint32_t peer_id) {
-  struct peer_info peer;
-  int n = get_peer_info(cli, peer_id, &peer);
-  if (n) {
-    verbose_log("get_peer_info() return %d\n", n);
-    verbose_log("failed to get info of remote peer\n");
+static void drop_standby(nt_ctx *ctx, struct standby *sb) {
+  ctx->io->close(ctx->io, sb->w.fd);
+  sb->w.fd = -1;
+}
+
+// the path stays connected to the peer, its hole is detached from the session
+static void add_standby(nt_ctx *ctx, nt_session *s, struct path *p) {
+  struct standby *sb = NULL;
+  int i;
+  for (i = 0; i < MAX_STANDBYS && sb == NULL; ++i) {
+    if (ctx->standbys[i].w.fd < 0) {
+      sb = &ctx->standbys[i];
+    }
+  }
+  for (i = 0; i < s->n_holes && s->holes[i].fd != p->fd; ++i) {
+  }
+  if (sb == NULL || i == s->n_holes ||
+      ctx->io->connect(ctx->io, p->fd, (struct sockaddr *)&p->addr,
+                       p->addr_len)) {
+    return; // closed with the other holes
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &sb->w;
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, p->fd, &ev)) {
+    return;
+  }
+  s->holes[i].fd = -1;
+  sb->w.fd = p->fd;
+  sb->w.session = NULL;
+  sb->peer = s->peer;
+  sb->peer.meta = sb->meta;
+  strcpy(sb->meta, s->meta);
+  sb->rtt = p->answered ? (int)(p->rtt_sum / p->answered) : -1;
+  sb->last_heard = now_ms();
+  if (ctx->standby_at < 0) {
+    ctx->standby_at = now_ms() + KEEPALIVE_MS;
+  }
+  verbose_log("standby path to peer %d, rtt %d ms\n", s->peer.id, sb->rtt);
+}
+
+// the best path takes the session, the other measured ones stand by and
+// replace the standbys of an earlier connection to the peer
+static void promote_path(nt_ctx *ctx, nt_session *s, int best) {
+  struct path *p = &s->paths[best];
+  int i;
+  verbose_log("%d paths to peer %d, promoting one with %d/%d answers\n",
+              s->n_paths, s->peer.id, p->answered, p->sent);
+  if (s->initiator) {
+    // the responder carries its data over the same path
+    for (i = 0; i < 3; ++i) {
+      send_path_msg(ctx, p->fd, PATH_SELECT, i, 0, &p->addr, p->addr_len);
+    }
+  }
+  for (i = 0; i < MAX_STANDBYS; ++i) {
+    if (ctx->standbys[i].w.fd >= 0 &&
+        ctx->standbys[i].peer.id == s->peer.id) {
+      drop_standby(ctx, &ctx->standbys[i]);
+    }
+  }
+  for (i = 0; i < s->n_paths; ++i) {
+    if (i != best) {
+      add_standby(ctx, s, &s->paths[i]);
+    }
+  }
+  connect_session(ctx, s, p->fd, &p->addr, p->addr_len);
+}
+
+// probes every path, or promotes the best once the window is over
+static void select_timer(nt_ctx *ctx, nt_session *s) {
+  int64_t now = now_ms();
+  if (now >= s->select_until) {
+    promote_path(ctx, s, best_path(s));
+    return;
+  }
+  int i;
+  for (i = 0; i < s->n_paths; ++i) {
+    struct path *p = &s->paths[i];
+    send_path_msg(ctx, p->fd, PATH_PROBE, p->sent++, now, &p->addr,
+                  p->addr_len);
+  }
+  s->select_at = now + PATH_PROBE_INTERVAL_MS;
+  if (s->select_at > s->select_until) {
+    s->select_at = s->select_until;
+  }
+}
+
+// a datagram of the peer on one of the holes. With a single path the hole
+// connects right away, otherwise every hole that answers within the window
+// is measured
+static void peer_datagram(nt_ctx *ctx, nt_session *s, int sock,
+                          struct sockaddr_storage *from, socklen_t fromlen,
+                          const char *buf, ssize_t len) {
+  if (ctx->max_paths <= 1) {
+    connect_session(ctx, s, sock, from, fromlen);
+    return;
+  }
+  const struct path_msg *msg = (const struct path_msg *)buf;
+  int type = path_msg_type(buf, len);
+  int i = add_path(ctx, s, sock, from, fromlen);
+  if (type == PATH_PROBE) {
+    send_path_msg(ctx, sock, PATH_ECHO, msg->seq, msg->sent_at, from, fromlen);
+  } else if (type == PATH_ECHO && i >= 0) {
+    ++s->paths[i].answered;
+    s->paths[i].rtt_sum += now_ms() - msg->sent_at;
+  } else if (type == PATH_SELECT && i >= 0 && !s->initiator) {
+    promote_path(ctx, s, i);
+    return;
+  }
+  if (!s->selecting && s->n_paths > 0) {
+    s->selecting = 1;
+    s->select_until = now_ms() + SELECT_WINDOW_MS;
+    if (!s->initiator) {
+      s->select_until += SELECT_GRACE_MS;
+    }
+    s->select_at = now_ms();
+    if (s->state == S_DIRECT) {
+      // the IPv4 holes join the window instead of waiting for the head start
+      s->state = S_PUNCH;
+      s->deadline = now_ms();
+    }
+  }
+}
+
+static void hole_ready(nt_ctx *ctx, struct watch *w) {
+  nt_session *s = w->session;
+  if (s->state == S_DONE || w->fd < 0) {
+    return;
+  }
+
+  int sock = w->fd;
+  char buf[MSG_BUF_SIZE] = {0};
+  struct sockaddr_storage remote_addr;
+  socklen_t fromlen = sizeof(remote_addr);
+  ssize_t n = ctx->io->recvfrom(ctx->io, sock, buf, MSG_BUF_SIZE - 1, 0,
+                                (struct sockaddr *)&remote_addr, &fromlen);
+  if (n < 0) {
+    return;
+  }
+  if (!from_peer(s, &remote_addr)) {
+    if (sock == s->spray_fd) {
+      spray_datagram(ctx, &remote_addr, fromlen, buf, n);
+    } else {
+      char ip[IP_STR_LEN];
+      verbose_log(
+          "datagram for another session from %s:%d\n", ip,
+          sockaddr_ntop((struct sockaddr *)&remote_addr, ip, sizeof(ip)));
+    }
+    return;
+  }
+  if (!path_msg_type(buf, n)) {
+    verbose_log("recv %s\n", buf);
+  }
+  peer_datagram(ctx, s, sock, &remote_addr, fromlen, buf, n);
+}
+
+// standbys answer probes, and become the connection once the peer's data
+// shows up on them
+static void standby_ready(nt_ctx *ctx, struct standby *sb) {
+  char buf[sizeof(struct path_msg)];
+  ssize_t n = recv(sb->w.fd, buf, sizeof(buf), MSG_PEEK);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      drop_standby(ctx, sb); // refused, the peer closed it
+    }
+    return;
+  }
+  sb->last_heard = now_ms();
+  int type = path_msg_type(buf, n);
+  if (type == 0) {
+    // the peer failed over, its data stays queued for the application
+    verbose_log("peer %d moved to a standby path\n", sb->peer.id);
+    int sock = sb->w.fd;
+    epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, sock, NULL);
+    sb->w.fd = -1;
+    if (ctx->cb.on_connected) {
+      sb->peer.replaces = 1;
+      ctx->cb.on_connected(ctx, &sb->peer, sock, ctx->cb.user_data);
+    } else {
+      ctx->io->close(ctx->io, sock);
+    }
+    return;
+  }
+  recv(sb->w.fd, buf, sizeof(buf), 0);
+  const struct path_msg *msg = (const struct path_msg *)buf;
+  if (type == PATH_PROBE) {
+    send_path_msg(ctx, sb->w.fd, PATH_ECHO, msg->seq, msg->sent_at, NULL, 0);
+  } else if (type == PATH_ECHO) {
+    sb->rtt = (int)(now_ms() - msg->sent_at);
+  }
+}
+
+// keeps the mappings of the standbys, closes those the peer gave up
+static void probe_standbys(nt_ctx *ctx) {
+  int64_t now = now_ms();
+  int i, left = 0;
+  for (i = 0; i < MAX_STANDBYS; ++i) {
+    struct standby *sb = &ctx->standbys[i];
+    if (sb->w.fd < 0) {
+      continue;
+    }
+    if (now - sb->last_heard > STANDBY_TIMEOUT_MS) {
+      verbose_log("standby path to peer %d silent, closed\n", sb->peer.id);
+      drop_standby(ctx, sb);
+      continue;
+    }
+    send_path_msg(ctx, sb->w.fd, PATH_PROBE, 0, now, NULL, 0);
+    ++left;
+  }
+  ctx->standby_at = left ? now + KEEPALIVE_MS : -1;
+}
+
+static void send_relay_bind(nt_ctx *ctx, nt_session *s) {
+  struct relay_msg msg;
+  memcpy(msg.magic, "NTR", 3);
+  memcpy(msg.token, s->relay_token, RELAY_TOKEN_LEN);
+  send(s->relay.fd, &msg, sizeof(msg) - 1, 0);
+}
+
+// our half of the relay is on the punch server's host, at port
+static void open_relay(nt_ctx *ctx, nt_session *s, uint16_t port,
+                       const char *token) {
+  if (s->relay.fd >= 0 || s->relayed || s->state == S_DONE) {
+    return; // offered twice
+  }
+  struct sockaddr_storage addr = ctx->server_addr;
+  set_port(&addr, port);
+  struct io_backend *io = ctx->io;
+  int sock = io->socket(io, addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) {
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &s->relay;
+  if (bind_device(ctx, sock, addr.ss_family) ||
+      io->connect(io, sock, (struct sockaddr *)&addr, ctx->server_addr_len) ||
+      epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, sock, &ev)) {
+    verbose_log("failed to open relay socket, error: %s\n", strerror(errno));
+    io->close(io, sock);
+    return;
+  }
+  s->relay.fd = sock;
+  s->relay.session = s;
+  memcpy(s->relay_token, token, RELAY_TOKEN_LEN);
+  verbose_log("relay to peer %d at port %d\n", s->peer.id, port);
+  send_relay_bind(ctx, s);
+  s->relay_until = now_ms() + RELAY_BIND_TIMEOUT_MS;
+  s->relay_at = now_ms() + RETRANSMIT_MS;
+}
+
+static void send_relay_alloc(nt_ctx *ctx, nt_session *s) {
+  char buf[8];
+  char *p = buf;
+  p = encode16(p, RelayAlloc);
+  p = encode32(p, s->peer.id);
+  send_to_punch_server(ctx, buf, p - buf);
+}
+
+// the initiator asks for the relay, again over UDP until answered. Both
+// sides then bind their half until told the peer's half is bound too
+static void relay_timer(nt_ctx *ctx, nt_session *s) {
+  int64_t now = now_ms();
+  if (s->relay.fd < 0) {
+    if (s->relay_retries++ == MAX_RETRANSMITS) {
+      verbose_log("no relay to peer %d\n", s->peer.id);
+      s->relay_at = -1;
+      return;
+    }
+    verbose_log("no hole to peer %d yet, asking for a relay\n", s->peer.id);
+    send_relay_alloc(ctx, s);
+    s->relay_at = ctx->udp ? now + backoff(s->relay_retries) : -1;
+    return;
+  }
+  if (now >= s->relay_until) {
+    verbose_log("relay to peer %d not bound, closed\n", s->peer.id);
+    ctx->io->close(ctx->io, s->relay.fd);
+    s->relay.fd = -1;
+    s->relay_at = -1;
+    return;
+  }
+  send_relay_bind(ctx, s);
+  s->relay_at = now + RETRANSMIT_MS;
+}
+
+// the relay goes to the application, the punch goes on to replace it
+static void relay_connected(nt_ctx *ctx, nt_session *s) {
+  int sock = s->relay.fd;
+  epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, sock, NULL);
+  s->relay.fd = -1;
+  s->relay_at = -1;
+  s->relayed = 1;
+  verbose_log("relaying to peer %d\n", s->peer.id);
+  // the pair is connected as far as the mesh goes
+  report_mesh(ctx, s, 0);
+  s->mesh = 0;
+  if (ctx->cb.on_connected) {
+    s->peer.replaces = 0;
+    ctx->cb.on_connected(ctx, &s->peer, sock, ctx->cb.user_data);
+  } else {
+    ctx->io->close(ctx->io, sock);
+  }
+}
+
+// answers to our binds, or the peer's data once both halves are bound. The
+// data is left queued for the application
+static void relay_ready(nt_ctx *ctx, nt_session *s) {
+  struct relay_msg msg;
+  ssize_t n = recv(s->relay.fd, &msg, sizeof(msg), MSG_PEEK | MSG_TRUNC);
+  if (n < 0) {
+    recv(s->relay.fd, &msg, sizeof(msg), 0); // a pending error
+    return;
+  }
+  if (n == sizeof(msg) && memcmp(msg.magic, "NTR", 3) == 0 &&
+      memcmp(msg.token, s->relay_token, RELAY_TOKEN_LEN) == 0) {
+    recv(s->relay.fd, &msg, sizeof(msg), 0);
+    if (!msg.ready) {
+      return; // the peer's bind follows
+    }
+  }
+  relay_connected(ctx, s);
+}
+
+// replies are matched by the requested key, over UDP they may come late,
+// twice or not at all
+static nt_session *find_lookup(nt_ctx *ctx, uint16_t type, uint32_t id,
+                               const char *meta) {
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if (s->state != S_LOOKUP) {
+      continue;
+    }
+    if (type == GetPeerInfo ? s->meta[0] == '\0' && s->peer.id == id
+                            : strcmp(s->meta, meta) == 0) {
+      return s;
+    }
+  }
+  return NULL;
+}
 
+static void set_peer(nt_session *s, const struct peer_info *peer) {
+  s->peer = *peer;
+  s->peer.meta = s->meta;
+  s->peer.initiator = s->initiator;
+  strcpy(s->meta, peer->meta);
+}
+
+// the token lets the server follow us to a new address
+static void send_keepalive(nt_ctx *ctx) {
+  char buf[16 + RESUME_TOKEN_LEN];
+  char *p = buf;
+  p = encode16(p, Keepalive);
+  p = encode32(p, ctx->id);
+  p = encode(p, ctx->token, RESUME_TOKEN_LEN);
+  send_to_punch_server(ctx, buf, p - buf);
+  ctx->keepalive_at = now_ms() + KEEPALIVE_MS;
+}
+
+static int send_enroll(nt_ctx *ctx) {
+  char buf[16 + RESUME_TOKEN_LEN];
+  char *msg = ctx->enroll_msg;
+  size_t len = ctx->enroll_len;
+  if (ctx->resuming) {
+    char *p = buf;
+    p = encode16(p, Resume);
+    p = encode32(p, ctx->id);
+    p = encode(p, ctx->token, RESUME_TOKEN_LEN);
+    msg = buf;
+    len = p - buf;
+  }
+  if (-1 == send_to_punch_server(ctx, msg, len)) {
     return -1;
   }
-  return real_connect_to_peer(cli, &peer);
+  ctx->enroll_retry =
+      ctx->udp ? now_ms() + backoff(ctx->enroll_retries++) : -1;
+  return 0;
 }
 
-int connect_to_peer_from_meta(client *cli, char *peer_meta) {
+// the server asked to come back later, in the turn it handed out. A random
+// quarter of the wait, doubling with every refusal in a row, spreads clients
+// given the same turn
+static void defer_enroll(nt_ctx *ctx, const char *body) {
+  uint32_t wait;
+  memcpy(&wait, body, sizeof(wait));
+  wait = ntohl(wait);
+  if (wait == 0) {
+    wait = RETRANSMIT_MS;
+  } else if (wait > MAX_ENROLL_WAIT_MS) {
+    wait = MAX_ENROLL_WAIT_MS;
+  }
+  int shift = ctx->enroll_deferrals < 4 ? ctx->enroll_deferrals : 4;
+  ++ctx->enroll_deferrals;
+  int64_t delay = wait + rand_below(&ctx->seed, (int)(wait << shift) / 4 + 1);
+  verbose_log("punch server busy, enrolling again in %ld ms\n", delay);
+  ctx->enroll_retries = 0;
+  ctx->enroll_retry = now_ms() + delay;
+  // a refusal is an answer, the deadline only covers silence
+  ctx->enroll_deadline = ctx->enroll_retry + ENROLL_TIMEOUT_MS;
+}
+
+static int send_join(nt_ctx *ctx) {
+  if (-1 == send_to_punch_server(ctx, ctx->mesh_msg, ctx->mesh_len)) {
+    return -1;
+  }
+  if (ctx->udp && ctx->mesh_retries++ < MAX_RETRANSMITS) {
+    ctx->mesh_retry = now_ms() + backoff(ctx->mesh_retries);
+  } else {
+    ctx->mesh_retry = -1;
+  }
+  return 0;
+}
+
+// applied to the running attempt to the peer, or kept for the next one.
+// Probes already sprayed go out again to the hinted windows
+static void port_hint_received(nt_ctx *ctx, const char *body) {
+  uint32_t id;
+  uint16_t ports[MAX_POOL];
+  int i, n = (uint8_t)body[sizeof(id)];
+  memcpy(&id, body, sizeof(id));
+  id = ntohl(id);
+  if (n > MAX_POOL) {
+    n = MAX_POOL;
+  }
+  for (i = 0; i < n; ++i) {
+    memcpy(&ports[i], body + sizeof(id) + 1 + i * sizeof(ports[i]),
+           sizeof(ports[i]));
+    ports[i] = ntohs(ports[i]);
+  }
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if ((s->state == S_DIRECT || s->state == S_PUNCH || s->state == S_WAIT) &&
+        s->peer.id == id) {
+      break;
+    }
+  }
+  if (s != NULL) {
+    int added = apply_hint(s, ports, n);
+    verbose_log("peer %d hinted %d ports, %d to probe\n", id, n, added);
+    if (added > 0 && s->spray && s->state == S_WAIT) {
+      s->n_ports = s->next_port + added;
+      s->state = S_PUNCH;
+      s->deadline = now_ms();
+    }
+    return;
+  }
+  // over the oldest hint if there is no free slot
+  struct port_hint *h = find_hint(ctx, id);
+  if (h == NULL) {
+    h = &ctx->hints[0];
+    for (i = 1; i < MAX_HINTS; ++i) {
+      if (ctx->hints[i].at < h->at) {
+        h = &ctx->hints[i];
+      }
+    }
+  }
+  h->peer_id = id;
+  memcpy(h->ports, ports, n * sizeof(ports[0]));
+  h->n_ports = n;
+  h->at = now_ms();
+}
+
+static void handle_message(nt_ctx *ctx, uint16_t type, uint8_t status,
+                           const char *body) {
+  nt_session *s;
+  uint32_t id;
+  uint16_t port;
   struct peer_info peer;
-  int n = get_peer_info_from_meta(cli, peer_meta, &peer);
-  if (n) {
-    verbose_log("get_peer_info() return %d\n", n);
-    verbose_log("failed to get info of remote peer\n");
+  char meta[UINT8_MAX + 1];
+  peer.meta = meta;
+
+  switch (type) {
+  case Resume:
+  case Enroll:
+    if (ctx->enroll_deadline < 0 || (type == Resume) != ctx->resuming) {
+      // answer to a retransmission
+      break;
+    }
+    if (status == RetryAfter) {
+      defer_enroll(ctx, body);
+      break;
+    }
+    if (status != StatusOK) {
+      // the record is gone, enrolling again hands out a new id
+      verbose_log("resuming id %d refused, enrolling again\n", ctx->id);
+      ctx->id = 0;
+      ctx->resumable = 0;
+      ctx->resuming = 0;
+      ctx->enroll_retries = 0;
+      send_enroll(ctx);
+      break;
+    }
+    memcpy(&id, body, sizeof(id));
+    ctx->id = ntohl(id);
+    memcpy(ctx->token, body + sizeof(id), RESUME_TOKEN_LEN);
+    ctx->resumable = 1;
+    ctx->resuming = 0;
+    ctx->lost_at = -1;
+    ctx->reconnects = 0;
+    ctx->enroll_deadline = -1;
+    ctx->enroll_retry = -1;
+    ctx->enroll_deferrals = 0;
+    body += sizeof(id) + RESUME_TOKEN_LEN;
+    if (ctx->udp) {
+      memcpy(ctx->reflexive_ip, body, IP_STR_LEN);
+      ctx->reflexive_ip[IP_STR_LEN - 1] = '\0';
+      memcpy(&ctx->reflexive_port, body + IP_STR_LEN, sizeof(uint16_t));
+      ctx->reflexive_port = ntohs(ctx->reflexive_port);
+      ctx->keepalive_at = now_ms() + KEEPALIVE_MS;
+      verbose_log("reflexive address: %s:%d\n", ctx->reflexive_ip,
+                  ctx->reflexive_port);
+    }
+    verbose_log("%s, id: %d\n", type == Resume ? "resumed" : "enrolled",
+                ctx->id);
+    if (ctx->mesh_len > 0) {
+      // enrolled again, the new id joins the mesh too
+      ctx->mesh_retries = 0;
+      send_join(ctx);
+    }
+    // a resumed id is the one the caller already has
+    if (type == Enroll && ctx->cb.on_enrolled) {
+      ctx->cb.on_enrolled(ctx, ctx->id, ctx->cb.user_data);
+    }
+    break;
+  case GetPeerInfo:
+  case GetPeerInfoFromMeta:
+    if (status != StatusOK) {
+      if (type == GetPeerInfo) {
+        memcpy(&id, body, sizeof(id));
+        id = ntohl(id);
+      } else {
+        memcpy(meta, body + 1, (uint8_t)body[0]);
+        meta[(uint8_t)body[0]] = '\0';
+      }
+      if ((s = find_lookup(ctx, type, id, meta)) != NULL) {
+        verbose_log("It seems peer has gone offline\n");
+        fail_session(ctx, s, NT_ERR_LOOKUP);
+      }
+      break;
+    }
+    decode_peer_info(body, &peer);
+    if ((s = find_lookup(ctx, type, peer.id, peer.meta)) == NULL) {
+      verbose_log("unexpected peer info\n");
+      break;
+    }
+    set_peer(s, &peer);
+    if (s->lookup_only) {
+      finish_session(ctx, s, -1);
+      if (ctx->cb.on_peer_info) {
+        ctx->cb.on_peer_info(ctx, &s->peer, ctx->cb.user_data);
+      }
+      break;
+    }
+    verbose_log(
+        "connecting to id: %d, meta: %s, ip: %s, port %d, nat type: %s\n",
+        s->peer.id, s->peer.meta, s->peer.ip, s->peer.port,
+        get_nat_desc(s->peer.type));
+    start_traversal(ctx, s);
+    break;
+  case NotifyPeer:
+  case NotifyPeerFromMeta:
+    if (status == Delivered) {
+      memcpy(&id, body, sizeof(id));
+      id = ntohl(id);
+      for (s = ctx->sessions; s != NULL; s = s->next) {
+        if (s->initiator && s->peer.id == id) {
+          s->delivered = 1;
+        }
+      }
+      break;
+    }
+    if (status != StatusOK) {
+      // our notification didn't reach the peer
+      memcpy(&id, body, sizeof(id));
+      id = ntohl(id);
+      verbose_log("peer %d is offline, notification dropped\n", id);
+      for (s = ctx->sessions; s != NULL; s = s->next) {
+        if (s->initiator && s->state != S_DONE && s->peer.id == id) {
+          fail_session(ctx, s, NT_ERR_LOOKUP);
+        }
+      }
+      break;
+    }
+    decode_peer_info(body, &peer);
+    for (s = ctx->sessions; s != NULL; s = s->next) {
+      if (!s->initiator && s->state != S_DONE && s->peer.id == peer.id) {
+        break; // retransmitted by the peer
+      }
+    }
+    if (s != NULL || (s = new_session(ctx)) == NULL) {
+      break;
+    }
+    set_peer(s, &peer);
+    verbose_log("recved command, ready to connect to %s:%d\n", s->peer.ip,
+                s->peer.port);
+    start_traversal(ctx, s);
+    break;
+  case JoinMesh:
+    ctx->mesh_retry = -1;
+    memcpy(meta, body + 1, (uint8_t)body[0]);
+    meta[(uint8_t)body[0]] = '\0';
+    verbose_log(status == StatusOK ? "joined mesh %s\n"
+                                   : "failed to join mesh %s\n",
+                meta);
+    break;
+  case MeshConnect:
+    decode_peer_info(body, &peer);
+    for (s = ctx->sessions; s != NULL; s = s->next) {
+      if (s->state != S_DONE && s->peer.id == peer.id) {
+        break; // already connecting, either way round
+      }
+    }
+    if (s != NULL || (s = new_session(ctx)) == NULL) {
+      break;
+    }
+    s->initiator = 1;
+    s->mesh = 1;
+    set_peer(s, &peer);
+    verbose_log("mesh pair, connecting to %d\n", s->peer.id);
+    start_traversal(ctx, s);
+    break;
+  case PortHint:
+    port_hint_received(ctx, body);
+    break;
+  case RelayAlloc:
+    memcpy(&id, body, sizeof(id));
+    id = ntohl(id);
+    for (s = ctx->sessions; s != NULL; s = s->next) {
+      if (s->initiator && s->state != S_DONE && s->peer.id == id) {
+        break;
+      }
+    }
+    if (s == NULL || s->relay_retries == 0 || s->relay.fd >= 0 ||
+        s->relayed) {
+      break; // answer to a retransmission
+    }
+    if (status != StatusOK) {
+      verbose_log("relay to peer %d refused\n", id);
+      s->relay_at = -1;
+      break;
+    }
+    memcpy(&port, body + sizeof(id), sizeof(port));
+    open_relay(ctx, s, ntohs(port), body + sizeof(id) + sizeof(port));
+    break;
+  case RelayOffer:
+    // the peer asked for a relay, its traversal may not have notified us
+    // yet
+    decode_peer_info(body + sizeof(uint16_t) + RELAY_TOKEN_LEN, &peer);
+    for (s = ctx->sessions; s != NULL; s = s->next) {
+      if (!s->initiator && s->state != S_DONE && s->peer.id == peer.id) {
+        break;
+      }
+    }
+    if (s == NULL && (s = new_session(ctx)) != NULL) {
+      set_peer(s, &peer);
+      start_traversal(ctx, s);
+    }
+    if (s != NULL) {
+      memcpy(&port, body, sizeof(port));
+      open_relay(ctx, s, ntohs(port), body + sizeof(port));
+    }
+    break;
+  case Keepalive:
+    if (status != StatusOK && ctx->enroll_deadline < 0) {
+      // the server forgot us, keepalives resume with the id it hands back
+      // or with a new one
+      verbose_log("registration expired, %s\n",
+                  ctx->resumable ? "resuming" : "enrolling again");
+      ctx->resuming = ctx->resumable;
+      if (!ctx->resuming) {
+        ctx->id = 0;
+      }
+      ctx->keepalive_at = -1;
+      ctx->enroll_retries = 0;
+      ctx->enroll_deadline = now_ms() + ENROLL_TIMEOUT_MS;
+      send_enroll(ctx);
+    }
+    break;
+  }
+}
+
+// every message from the server is the message type, a status byte and a
+// body whose size follows from the two
+static int parse_control_input(nt_ctx *ctx) {
+  for (;;) {
+    if (ctx->in_len < 3) {
+      return 0;
+    }
+    uint16_t type;
+    memcpy(&type, ctx->in, sizeof(type));
+    type = ntohs(type);
+    uint8_t status = ctx->in[2];
+
+    size_t need = 3;
+    if (type == Keepalive) {
+      // no body
+    } else if (type == JoinMesh ||
+               (status != StatusOK && type == GetPeerInfoFromMeta)) {
+      // the requested meta
+      need += 1;
+      if (ctx->in_len >= need) {
+        need += (uint8_t)ctx->in[3];
+      }
+    } else if (status != StatusOK) {
+      // the requested id
+      // or the milliseconds to wait
+      if (type == NotifyPeer || type == NotifyPeerFromMeta ||
+          type == GetPeerInfo || type == Resume || type == RelayAlloc ||
+          status == RetryAfter) {
+        need += sizeof(uint32_t);
+      }
+    } else if (type == Enroll || type == Resume) {
+      need += sizeof(uint32_t) + RESUME_TOKEN_LEN;
+      if (ctx->udp) {
+        need += IP_STR_LEN + sizeof(uint16_t);
+      }
+    } else if (type == RelayAlloc) {
+      // the peer id, the port and token of our half
+      need += sizeof(uint32_t) + sizeof(uint16_t) + RELAY_TOKEN_LEN;
+    } else if (type == RelayOffer) {
+      need += sizeof(uint16_t) + RELAY_TOKEN_LEN + sizeof(struct my_peer_info);
+      if (ctx->in_len >= need) {
+        need += ((struct my_peer_info *)(ctx->in + need -
+                                         sizeof(struct my_peer_info)))
+                    ->len;
+      }
+    } else if (type == PortHint) {
+      // the sender's id and the count of ports
+      need += sizeof(uint32_t) + 1;
+      if (ctx->in_len >= need) {
+        need += (uint8_t)ctx->in[need - 1] * sizeof(uint16_t);
+      }
+    } else if (type == GetPeerInfo || type == GetPeerInfoFromMeta ||
+               type == NotifyPeer || type == MeshConnect) {
+      need += sizeof(struct my_peer_info);
+      if (ctx->in_len >= need) {
+        need += ((struct my_peer_info *)(ctx->in + 3))->len;
+      }
+    } else {
+      verbose_log("unknown message type %d from punch server\n", type);
+      return -1;
+    }
+    if (need > sizeof(ctx->in)) {
+      verbose_log("message type %d of %zu bytes from punch server too long\n",
+                  type, need);
+      return -1;
+    }
+    if (ctx->in_len < need) {
+      return 0;
+    }
+
+    verbose_log("Dumping %ld bytes of data received\n", need);
+    verbose_dump(NULL, ctx->in, need);
+    handle_message(ctx, type, status, ctx->in + 3);
+
+    memmove(ctx->in, ctx->in + need, ctx->in_len - need);
+    ctx->in_len -= need;
+  }
+}
+
+// the UDP control socket, bound to the port the server publishes
+static int open_rendezvous(nt_ctx *ctx) {
+  struct sockaddr_storage local_addr;
+  socklen_t local_len = make_sockaddr(
+      ctx->server_addr.ss_family == AF_INET6 ? "::" : "0.0.0.0",
+      ctx->local_port, &local_addr);
+  struct io_backend *io = ctx->io;
+  int sock = io->socket(io, ctx->server_addr.ss_family,
+                        SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &ctx->control;
+  if (bind_device(ctx, sock, ctx->server_addr.ss_family) ||
+      bind(sock, (struct sockaddr *)&local_addr, local_len) ||
+      epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, sock, &ev)) {
+    verbose_log("failed to open rendezvous socket, error: %s\n",
+                strerror(errno));
+    io->close(io, sock);
     return -1;
   }
-  return real_connect_to_peer(cli, &peer);
+  ctx->control.fd = sock;
+  return 0;
+}
+
+// a probe of the peer reached the rendezvous socket. The socket becomes the
+// connection, a new one bound to the same port takes over the control
+// channel, the connected socket keeps getting the peer's datagrams only
+static void rendezvous_datagram(nt_ctx *ctx, struct sockaddr_storage *from,
+                                socklen_t fromlen, ssize_t n);
+
+static void rendezvous_probe(nt_ctx *ctx, struct sockaddr_storage *from,
+                             socklen_t fromlen) {
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if (s->rendezvous && s->state != S_DONE && from_peer(s, from)) {
+      break;
+    }
+  }
+  if (s == NULL) {
+    char ip[IP_STR_LEN];
+    verbose_log("stray datagram on the rendezvous socket from %s:%d\n", ip,
+                sockaddr_ntop((struct sockaddr *)from, ip, sizeof(ip)));
+    return;
+  }
+
+  int sock = ctx->control.fd;
+  epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, sock, NULL);
+  ctx->control.fd = -1;
+  // the new socket is bound before the old one is pinned, so that the port
+  // is never left without a socket taking other peers' probes
+  if (open_rendezvous(ctx) == 0 && ctx->id != 0) {
+    send_keepalive(ctx);
+  }
+  int pinned = pin_to_peer(ctx, sock, from, fromlen);
+  if (pinned < 0) {
+    ctx->io->close(ctx->io, sock);
+    return;
+  }
+  finish_session(ctx, s, -1);
+  // datagrams queued before the connect, from the server or other peers
+  // probing the same mapping, still belong to the control channel
+  for (;;) {
+    struct sockaddr_storage queued;
+    socklen_t queued_len = sizeof(queued);
+    ssize_t n = ctx->io->recvfrom(ctx->io, sock, ctx->in, sizeof(ctx->in), 0,
+                                  (struct sockaddr *)&queued, &queued_len);
+    if (n < 0) {
+      break;
+    }
+    if (!same_address(&queued, from, 1)) {
+      rendezvous_datagram(ctx, &queued, queued_len, n);
+    }
+  }
+  report_mesh(ctx, s, 0);
+  if (ctx->cb.on_connected) {
+    s->peer.replaces = s->relayed;
+    ctx->cb.on_connected(ctx, &s->peer, sock, ctx->cb.user_data);
+  } else {
+    ctx->io->close(ctx->io, sock);
+  }
+}
+
+// datagrams from the server carry one message each, the others are probes
+// of peers aimed at the published mapping
+static void rendezvous_datagram(nt_ctx *ctx, struct sockaddr_storage *from,
+                                socklen_t fromlen, ssize_t n) {
+  if (!same_address(from, &ctx->server_addr, 1)) {
+    rendezvous_probe(ctx, from, fromlen);
+    return;
+  }
+  ctx->last_heard = now_ms();
+  ctx->in_len = n;
+  parse_control_input(ctx);
+  // a truncated message is dropped with its datagram
+  ctx->in_len = 0;
+}
+
+static int rendezvous_ready(nt_ctx *ctx) {
+  while (ctx->control.fd >= 0) {
+    struct sockaddr_storage from;
+    socklen_t fromlen = sizeof(from);
+    ssize_t n =
+        ctx->io->recvfrom(ctx->io, ctx->control.fd, ctx->in, sizeof(ctx->in),
+                          0, (struct sockaddr *)&from, &fromlen);
+    if (n < 0) {
+      return 0;
+    }
+    rendezvous_datagram(ctx, &from, fromlen, n);
+  }
+  return -1;
+}
+
+static int control_ready(nt_ctx *ctx, uint32_t events) {
+  if (ctx->udp) {
+    return rendezvous_ready(ctx);
+  }
+  if (!ctx->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(ctx->control.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err) {
+      verbose_log("failed to connect to punch server, error: %s\n",
+                  strerror(err));
+      return -1;
+    }
+    ctx->connected = 1;
+  }
+  if (ctx->connected && (events & EPOLLOUT)) {
+    if (flush_to_punch_server(ctx) < 0) {
+      return -1;
+    }
+  }
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    ssize_t n = recv(ctx->control.fd, ctx->in + ctx->in_len,
+                     sizeof(ctx->in) - ctx->in_len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      verbose_log("connection to punch server lost\n");
+      return -1;
+    }
+    if (n > 0) {
+      ctx->in_len += n;
+      return parse_control_input(ctx);
+    }
+  }
+  return 0;
+}
+
+// the TCP control connection, established in the background
+static int open_control(nt_ctx *ctx) {
+  ctx->connected = 0;
+  ctx->in_len = 0;
+  ctx->out_len = 0;
+  ctx->control.fd =
+      socket(ctx->server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (ctx->control.fd < 0) {
+    return -1;
+  }
+
+  if (connect(ctx->control.fd, (struct sockaddr *)&ctx->server_addr,
+              ctx->server_addr_len) == 0) {
+    ctx->connected = 1;
+  } else if (errno != EINPROGRESS) {
+    char ip[IP_STR_LEN];
+    verbose_log("failed to connect to punch server: %s, port: %d\n", ip,
+                sockaddr_ntop((struct sockaddr *)&ctx->server_addr, ip,
+                              sizeof(ip)));
+    verbose_log("error: %s\n", strerror(errno));
+    close(ctx->control.fd);
+    ctx->control.fd = -1;
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.ptr = &ctx->control;
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->control.fd, &ev)) {
+    close(ctx->control.fd);
+    ctx->control.fd = -1;
+    return -1;
+  }
+  update_control_events(ctx);
+  return 0;
+}
+
+static void server_lost(nt_ctx *ctx) {
+  if (ctx->control.fd >= 0) {
+    close(ctx->control.fd);
+  }
+  ctx->control.fd = -1;
+  ctx->connected = 0;
+
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if (s->state != S_DONE) {
+      fail_session(ctx, s, NT_ERR_SERVER);
+    }
+  }
+  int64_t now = now_ms();
+  if (!ctx->udp && ctx->resumable) {
+    if (ctx->lost_at < 0) {
+      ctx->lost_at = now;
+    }
+    if (now - ctx->lost_at < RESUME_TIMEOUT_MS) {
+      // a restarting server is reconnected to by all of its clients at
+      // once, the jitter spreads them
+      int64_t delay = backoff(ctx->reconnects) / 2 +
+                      rand_below(&ctx->seed, backoff(ctx->reconnects));
+      verbose_log("reconnecting to punch server in %ld ms\n", delay);
+      ctx->reconnect_at = now + delay;
+      ctx->enroll_deadline = -1;
+      ctx->enroll_retry = -1;
+      ctx->keepalive_at = -1;
+      return;
+    }
+    verbose_log("punch server gone for good\n");
+  }
+  if (ctx->enroll_deadline >= 0) {
+    ctx->enroll_deadline = -1;
+    if (ctx->cb.on_enrolled) {
+      ctx->cb.on_enrolled(ctx, 0, ctx->cb.user_data);
+    }
+  }
+}
+
+// due holes of every session go to the backend in one batch, sessions that
+// don't fit stay due for the next round
+static void run_timers(nt_ctx *ctx) {
+  struct punch_op ops[MAX_PUNCH_BATCH];
+  nt_session *batch[MAX_PUNCH_BATCH];
+  int i, n = 0;
+  int64_t now = now_ms();
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if (s->state != S_DONE && s->selecting && s->select_at <= now) {
+      select_timer(ctx, s);
+    }
+    if (s->state != S_DONE && s->relay_at >= 0 && s->relay_at <= now) {
+      relay_timer(ctx, s);
+    }
+    if (s->state == S_DONE || s->deadline < 0 || s->deadline > now) {
+      continue;
+    }
+    if (s->state == S_DIRECT) {
+      s->state = S_PUNCH;
+    }
+    if (s->state != S_PUNCH) {
+      session_timer(ctx, s);
+    } else if (s->spray) {
+      spray_holes(ctx, s);
+    } else if (s->next_port == 0 && take_pooled(ctx, s) > 0) {
+      // the pooled holes went out at once, the others follow at the usual
+      // pace
+      s->deadline = now + PUNCH_INTERVAL_MS;
+    } else if (n < MAX_PUNCH_BATCH) {
+      if (prepare_hole(ctx, s, &ops[n])) {
+        batch[n++] = s;
+      } else {
+        finish_punching(ctx, s);
+      }
+    }
+  }
+  if (n > 0) {
+    ctx->io->punch(ctx->io, ctx->epfd, ops, n);
+    for (i = 0; i < n; ++i) {
+      hole_punched(ctx, batch[i], &ops[i]);
+    }
+  }
+  if (ctx->enroll_deadline >= 0 && ctx->enroll_deadline <= now) {
+    verbose_log("no reply to enroll request\n");
+    ctx->enroll_deadline = -1;
+    ctx->enroll_retry = -1;
+    if (ctx->cb.on_enrolled) {
+      ctx->cb.on_enrolled(ctx, 0, ctx->cb.user_data);
+    }
+  }
+  if (ctx->reconnect_at >= 0 && ctx->reconnect_at <= now) {
+    ctx->reconnect_at = -1;
+    ++ctx->reconnects;
+    if (open_control(ctx) < 0) {
+      server_lost(ctx);
+    } else {
+      ctx->resuming = 1;
+      ctx->enroll_retries = 0;
+      ctx->enroll_deadline = now + ENROLL_TIMEOUT_MS;
+      send_enroll(ctx);
+    }
+  }
+  if (ctx->enroll_retry >= 0 && ctx->enroll_retry <= now) {
+    send_enroll(ctx);
+  }
+  if (ctx->keepalive_at >= 0 && ctx->keepalive_at <= now) {
+    send_keepalive(ctx);
+  }
+  if (ctx->mesh_retry >= 0 && ctx->mesh_retry <= now) {
+    send_join(ctx);
+  }
+  if (ctx->standby_at >= 0 && ctx->standby_at <= now) {
+    probe_standbys(ctx);
+  }
+  if (ctx->pool_at >= 0 && ctx->pool_at <= now) {
+    refresh_pool(ctx);
+  }
+}
+
+nt_ctx *nt_ctx_new(const struct nt_config *config,
+                   const struct nt_callbacks *callbacks) {
+  nt_ctx *ctx = calloc(1, sizeof(nt_ctx));
+  if (ctx == NULL) {
+    return NULL;
+  }
+  ctx->control.fd = -1;
+  ctx->enroll_deadline = -1;
+  ctx->enroll_retry = -1;
+  ctx->reconnect_at = -1;
+  ctx->lost_at = -1;
+  ctx->keepalive_at = -1;
+  ctx->mesh_retry = -1;
+  ctx->standby_at = -1;
+  ctx->pool_at = -1;
+  ctx->ttl = config->ttl;
+  ctx->local_port = config->local_port;
+  ctx->local_port6 = config->local_port6;
+  if (config->ifname != NULL) {
+    snprintf(ctx->ifname, sizeof(ctx->ifname), "%s", config->ifname);
+  }
+  ctx->nat_type = Error;
+  ctx->io = config->io_uring ? io_backend_uring(URING_ENTRIES) : NULL;
+  if (ctx->io == NULL) {
+    ctx->io = io_backend_sync();
+  }
+  ctx->io = nt_pcap_wrap(ctx->io);
+  verbose_log("using %s I/O backend\n", ctx->io->name);
+  if (callbacks != NULL) {
+    ctx->cb = *callbacks;
+  }
+  ctx->seed = time(NULL) ^ getpid() ^ (uintptr_t)ctx;
+  ctx->max_attempts =
+      config->max_attempts > 0 ? config->max_attempts : DEFAULT_MAX_ATTEMPTS;
+  if (config->pool_size > 0 && config->stun_server != NULL &&
+      config->stun_server->sa_family == AF_INET) {
+    ctx->pool_size =
+        config->pool_size < MAX_POOL ? config->pool_size : MAX_POOL;
+    memcpy(&ctx->stun_addr, config->stun_server, config->stun_server_len);
+    ctx->stun_addr_len = config->stun_server_len;
+  }
+  int max_sockets = config->max_sockets;
+  struct rlimit limit;
+  if (max_sockets <= 0 && getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY) {
+    max_sockets = limit.rlim_cur <= FD_RESERVE ? 1
+                  : limit.rlim_cur > INT_MAX   ? INT_MAX
+                                               : limit.rlim_cur - FD_RESERVE;
+  }
+  if (max_sockets <= 0) {
+    // no limit known
+    ctx->holes_per_attempt = NUM_OF_PORTS;
+  } else {
+    // the pool holds its sockets between attempts, what is left is still
+    // shared out, one hole each at least
+    max_sockets -= ctx->pool_size;
+    if (max_sockets < 1) {
+      max_sockets = 1;
+    }
+    ctx->holes_per_attempt = max_sockets / ctx->max_attempts;
+    if (ctx->holes_per_attempt > NUM_OF_PORTS) {
+      ctx->holes_per_attempt = NUM_OF_PORTS;
+    } else if (ctx->holes_per_attempt < 1) {
+      ctx->holes_per_attempt = 1;
+    }
+  }
+  verbose_log("%d attempts at a time, %d holes each\n", ctx->max_attempts,
+              ctx->holes_per_attempt);
+  ctx->relay_after_ms = -1;
+  if (config->relay) {
+    ctx->relay_after_ms =
+        config->relay_after_ms > 0 ? config->relay_after_ms : 0;
+  }
+  ctx->max_paths = config->max_paths < 1           ? 1
+                   : config->max_paths > MAX_PATHS ? MAX_PATHS
+                                                   : config->max_paths;
+  arena_pool_init(&ctx->session_pool, SESSION_ARENA_SIZE, MAX_IDLE_SESSIONS);
+
+  int i;
+  for (i = 0; i < MAX_STANDBYS; ++i) {
+    ctx->standbys[i].w.fd = -1;
+  }
+  for (i = 0; i < MAX_POOL; ++i) {
+    ctx->pool[i].w.fd = -1;
+  }
+
+  ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (ctx->epfd < 0) {
+    goto error;
+  }
+  memcpy(&ctx->server_addr, config->punch_server, config->punch_server_len);
+  ctx->server_addr_len = config->punch_server_len;
+  if (config->udp) {
+    ctx->udp = 1;
+    ctx->connected = 1;
+    ctx->last_heard = now_ms();
+    if (open_rendezvous(ctx)) {
+      goto error;
+    }
+    return ctx;
+  }
+
+  if (open_control(ctx)) {
+    goto error;
+  }
+  return ctx;
+
+error:
+  if (ctx->control.fd >= 0) {
+    close(ctx->control.fd);
+  }
+  if (ctx->epfd >= 0) {
+    close(ctx->epfd);
+  }
+  ctx->io->destroy(ctx->io);
+  free(ctx);
+  return NULL;
+}
+
+void nt_ctx_free(nt_ctx *ctx) {
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    finish_session(ctx, s, -1);
+  }
+  reap_sessions(ctx);
+  arena_pool_destroy(&ctx->session_pool);
+  int i;
+  for (i = 0; i < MAX_STANDBYS; ++i) {
+    if (ctx->standbys[i].w.fd >= 0) {
+      drop_standby(ctx, &ctx->standbys[i]);
+    }
+  }
+  for (i = 0; i < MAX_POOL; ++i) {
+    if (ctx->pool[i].w.fd >= 0) {
+      drop_pooled(ctx, &ctx->pool[i]);
+    }
+  }
+  if (ctx->control.fd >= 0) {
+    close(ctx->control.fd);
+  }
+  close(ctx->epfd);
+  ctx->io->destroy(ctx->io);
+  free(ctx);
+}
+
+int nt_ctx_fd(nt_ctx *ctx) { return ctx->epfd; }
+
+int nt_ctx_timeout(nt_ctx *ctx) {
+  int64_t timers[] = {ctx->enroll_deadline, ctx->enroll_retry,
+                      ctx->keepalive_at, ctx->mesh_retry,
+                      ctx->standby_at, ctx->reconnect_at, ctx->pool_at};
+  int64_t next = -1;
+  size_t i;
+  for (i = 0; i < sizeof(timers) / sizeof(timers[0]); ++i) {
+    if (timers[i] >= 0 && (next < 0 || timers[i] < next)) {
+      next = timers[i];
+    }
+  }
+  nt_session *s;
+  for (s = ctx->sessions; s != NULL; s = s->next) {
+    if (s->deadline >= 0 && (next < 0 || s->deadline < next)) {
+      next = s->deadline;
+    }
+    if (s->selecting && (next < 0 || s->select_at < next)) {
+      next = s->select_at;
+    }
+    if (s->relay_at >= 0 && (next < 0 || s->relay_at < next)) {
+      next = s->relay_at;
+    }
+  }
+  if (next < 0) {
+    return -1;
+  }
+  int64_t now = now_ms();
+  return next > now ? (int)(next - now) : 0;
+}
+
+int nt_ctx_process(nt_ctx *ctx) {
+  if (ctx->control.fd < 0 && ctx->reconnect_at < 0) {
+    return -1;
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(ctx->epfd, events, MAX_EVENTS, 0);
+  int i;
+  for (i = 0; i < n; ++i) {
+    struct watch *w = events[i].data.ptr;
+    if (w == &ctx->control) {
+      if (ctx->control.fd >= 0 && control_ready(ctx, events[i].events) < 0) {
+        server_lost(ctx);
+      }
+    } else if (is_pooled(ctx, w)) {
+      pool_ready(ctx, (struct pooled *)w);
+    } else if (w->session == NULL) {
+      standby_ready(ctx, (struct standby *)w);
+    } else if (w == &w->session->relay) {
+      relay_ready(ctx, w->session);
+    } else {
+      hole_ready(ctx, w);
+    }
+  }
+
+  run_timers(ctx);
+  start_queued(ctx);
+  if (ctx->udp && ctx->control.fd >= 0 && ctx->id != 0 &&
+      now_ms() - ctx->last_heard > SERVER_TIMEOUT_MS) {
+    verbose_log("punch server silent, giving up\n");
+    server_lost(ctx);
+  }
+  reap_sessions(ctx);
+
+  return ctx->control.fd < 0 && ctx->reconnect_at < 0 ? -1 : 0;
+}
+
+int nt_ctx_run(nt_ctx *ctx, int timeout_ms) {
+  int timeout = nt_ctx_timeout(ctx);
+  if (timeout_ms >= 0 && (timeout < 0 || timeout_ms < timeout)) {
+    timeout = timeout_ms;
+  }
+  struct pollfd pfd = {ctx->epfd, POLLIN, 0};
+  if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+    return -1;
+  }
+  return nt_ctx_process(ctx);
+}
+
+int nt_enroll(nt_ctx *ctx, const struct peer_info *self) {
+  verbose_log("enrolling, meta: %s, ip: %s, port: %d, nat type: %s\n",
+              self->meta, self->ip, self->port, get_nat_desc(self->type));
+
+  size_t meta_len = strlen(self->meta);
+  if (meta_len > UINT8_MAX) {
+    return -1;
+  }
+  strcpy(ctx->ip6, self->ip6);
+  ctx->nat_type = self->type;
+  // a NAT keeping one mapping per socket has its holes punched from the
+  // enrolled port, a symmetric one gets new sockets mapped ahead
+  if (ctx->pool_size > 0 && !keeps_mapping(ctx->nat_type) &&
+      ctx->pool_at < 0) {
+    ctx->pool_at = now_ms();
+  }
+
+  char buf[MSG_BUF_SIZE];
+  char *p = buf;
+  p = encode16(p, Enroll);
+  p = encode(p, self->ip, IP_STR_LEN);
+  p = encode16(p, self->port);
+  p = encode16(p, self->type);
+  p = encode(p, self->ip6, IP_STR_LEN);
+  p = encode16(p, self->port6);
+  p = encode8(p, (uint8_t)meta_len);
+  p = encode(p, self->meta, meta_len);
+
+  // kept for retransmissions and enrolling again after expiry
+  memcpy(ctx->enroll_msg, buf, p - buf);
+  ctx->enroll_len = p - buf;
+  ctx->enroll_retries = 0;
+  if (-1 == send_enroll(ctx)) {
+    verbose_log("sending to punch server failed\n");
+    return -1;
+  }
+
+  // wait for server reply to get own ID
+  ctx->enroll_deadline = now_ms() + ENROLL_TIMEOUT_MS;
+  return 0;
+}
+
+static int lookup(nt_ctx *ctx, uint32_t peer_id, const char *peer_meta,
+                  int lookup_only) {
+  size_t meta_len = peer_meta != NULL ? strlen(peer_meta) : 0;
+  if (meta_len > UINT8_MAX) {
+    return -1;
+  }
+
+  nt_session *s = new_session(ctx);
+  if (s == NULL) {
+    return -1;
+  }
+  s->state = S_LOOKUP;
+  s->initiator = 1;
+  s->lookup_only = lookup_only;
+  s->peer.id = peer_id;
+  s->peer.initiator = 1;
+  memcpy(s->meta, peer_meta != NULL ? peer_meta : "", meta_len + 1);
+
+  if (-1 == send_lookup(ctx, s)) {
+    // never answered, drop it without a callback
+    finish_session(ctx, s, -1);
+    return -1;
+  }
+  if (ctx->udp) {
+    s->deadline = now_ms() + backoff(0);
+  }
+  return 0;
+}
+
+int nt_get_peer_info(nt_ctx *ctx, uint32_t peer_id) {
+  return lookup(ctx, peer_id, NULL, 1);
+}
+
+int nt_get_peer_info_from_meta(nt_ctx *ctx, const char *peer_meta) {
+  return lookup(ctx, 0, peer_meta, 1);
+}
+
+int nt_connect(nt_ctx *ctx, uint32_t peer_id) {
+  return lookup(ctx, peer_id, NULL, 0);
+}
+
+int nt_connect_from_meta(nt_ctx *ctx, const char *peer_meta) {
+  return lookup(ctx, 0, peer_meta, 0);
+}
+
+int nt_join_mesh(nt_ctx *ctx, const char *group) {
+  size_t len = group != NULL ? strlen(group) : 0;
+  if (len > UINT8_MAX) {
+    return -1;
+  }
+  char *p = ctx->mesh_msg;
+  p = encode16(p, JoinMesh);
+  p = encode8(p, (uint8_t)len);
+  p = encode(p, group, len);
+  ctx->mesh_len = p - ctx->mesh_msg;
+  ctx->mesh_retries = 0;
+  return send_join(ctx);
+}
+
+int nt_failover(nt_ctx *ctx, uint32_t peer_id) {
+  struct standby *best = NULL;
+  int i;
+  for (i = 0; i < MAX_STANDBYS; ++i) {
+    struct standby *sb = &ctx->standbys[i];
+    if (sb->w.fd >= 0 && sb->peer.id == peer_id &&
+        (best == NULL ||
+         (sb->rtt >= 0 && (best->rtt < 0 || sb->rtt < best->rtt)))) {
+      best = sb;
+    }
+  }
+  if (best == NULL) {
+    return -1;
+  }
+  int sock = best->w.fd;
+  epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, sock, NULL);
+  best->w.fd = -1;
+  verbose_log("failing over to a standby path of peer %d\n", peer_id);
+  return sock;
+}
+
+int nt_reflexive_address(nt_ctx *ctx, char *ip, uint16_t *port) {
+  if (ctx->reflexive_port == 0) {
+    return -1;
+  }
+  strcpy(ip, ctx->reflexive_ip);
+  *port = ctx->reflexive_port;
+  return 0;
 }
@@ -1,38 +1,45 @@
 #include <stdint.h>
+#include <sys/socket.h>
 
 #include "nat_type.h"
 
-typedef struct client client;
-struct client {
-  int sfd;
-  uint32_t id;
-  char buf[128];
-  // use a stack-based buffer to prevent memory allocation every time
-  char *msg_buf;
-  nat_type type;
-  char ext_ip[16];
-  uint16_t ext_port;
-  // ttl of hole punching packets,
-  // it should be greater than the number of hops between host to NAT of own
-  // side and less than the number of hops between host to NAT of remote side,
-  // so that the hole punching packets just die in the way
-  int ttl;
-};
+/*
+ * libnattraversal, a non-blocking client of the punch server.
+ *
+ * All state lives in an opaque context, so several contexts, each enrolled as
+ * a peer of its own, can be driven from one thread. A context never blocks and
+ * spawns no threads: the embedding event loop watches the file descriptor
+ * returned by nt_ctx_fd() for readability, wakes up no later than
+ * nt_ctx_timeout() milliseconds, and calls nt_ctx_process() in both cases.
+ * Results are reported through callbacks invoked from nt_ctx_process().
+ */
+
+typedef struct nt_ctx nt_ctx;
 
 struct my_peer_info {
   uint32_t id;
-  char ip[16];
+  char ip[IP_STR_LEN];
   uint16_t port;
   uint16_t type;
+  char ip6[IP_STR_LEN];
+  uint16_t port6;
   uint8_t len;
 } __attribute__((packed));
 
 struct peer_info {
   uint32_t id;
-  char ip[16];
+  char ip[IP_STR_LEN];
   uint16_t port;
   uint16_t type;
+  char ip6[IP_STR_LEN];
+  uint16_t port6;
   char *meta;
+  // in callbacks, set if this side started the traversal
+  int initiator;
+  // in on_connected, set if the socket replaces the one passed before for
+  // this peer: the direct path taking over from a relay, or the standby path
+  // the peer failed over to
+  int replaces;
 };
 
 enum msg_type {
@@ -41,17 +48,155 @@ enum msg_type {
   NotifyPeer = 0x03,
   GetPeerInfoFromMeta = 0x04,
   NotifyPeerFromMeta = 0x05,
+  // UDP rendezvous only, keeps the mapping and the registration alive
+  Keepalive = 0x06,
+  // joins a group whose members the server connects pairwise
+  JoinMesh = 0x07,
+  // pushed by the server, starts the traversal of a mesh pair
+  MeshConnect = 0x08,
+  // the outcome of a mesh pair, 0 or an nt_error
+  MeshResult = 0x09,
+  // reclaims the id and record of an earlier enroll with its token, answered
+  // like Enroll, or with PeerOffline and the id once the record is gone
+  Resume = 0x0a,
+  // ports the pooled sockets of a peer were mapped to, the peer id, a count
+  // and the ports. Passed on by the server with the sender's id, best effort
+  PortHint = 0x0b,
+  // asks for a relay to the peer id, answered with the id, the port of our
+  // half of the relay and its token
+  RelayAlloc = 0x0c,
+  // pushed with the port and token of our half and the record of the peer
+  // that asked
+  RelayOffer = 0x0d,
+};
+
+// size of the token binding a peer to its half of a relay
+#define RELAY_TOKEN_LEN 8
+
+// size of the resume token following the id in Enroll and Resume replies
+#define RESUME_TOKEN_LEN 16
+
+// status byte following the message type in every message from the server
+enum reply_status {
+  StatusOK = 0,
+  PeerOffline = 1,
+  PeerError = 2,
+  // the notification was passed on to the peer, followed by the peer id
+  Delivered = 3,
+  // the server is shedding enrollments, followed by the milliseconds to wait
+  // before enrolling again
+  RetryAfter = 4,
 };
 
-// public functions
-int enroll(struct peer_info self, struct sockaddr_in punch_server, client *c);
-pthread_t wait_for_command(int *server_sock);
-int connect_to_peer(client *cli, uint32_t peer_id);
-int connect_to_peer_from_meta(client *cli, char *peer_meta);
-void on_connected(int sock);
-int get_peer_info(client *cli, uint32_t peer_id, struct peer_info *peer);
-int get_peer_info_from_meta(client *cli, char *peer_meta,
-                            struct peer_info *peer);
-int init(struct sockaddr_in punch_server, client *c);
+// reasons passed to on_failed
+enum nt_error {
+  NT_ERR_LOOKUP = 1, // peer unknown to or offline at the punch server
+  NT_ERR_TIMEOUT,    // no hole answered before the deadline
+  NT_ERR_SOCKET,     // no socket could be opened towards the peer
+  NT_ERR_SERVER,     // connection to the punch server lost
+};
+
+struct nt_config {
+  const struct sockaddr *punch_server;
+  socklen_t punch_server_len;
+  // ttl of hole punching packets,
+  // it should be greater than the number of hops between host to NAT of own
+  // side and less than the number of hops between host to NAT of remote side,
+  // so that the hole punching packets just die in the way
+  int ttl;
+  // local port whose mapping was enrolled, holes are punched from it when
+  // the own NAT keeps one mapping per socket
+  uint16_t local_port;
+  // local port the IPv6 direct path binds to, used only if the enrolled peer
+  // info carries an IPv6 address
+  uint16_t local_port6;
+  // batch hole punching through io_uring, plain syscalls are used if the
+  // kernel doesn't support it
+  int io_uring;
+  // talk to the punch server over UDP from local_port instead of TCP, the
+  // server then publishes the address it observes for that port, which is
+  // the mapping holes are punched through when the own NAT is a cone
+  int udp;
+  // traversals punching at the same time, later ones wait for a free slot,
+  // 0 for the default
+  int max_attempts;
+  // sockets, and so NAT mappings, all attempts may hold together, shared
+  // evenly between max_attempts. 0 follows RLIMIT_NOFILE
+  int max_sockets;
+  // holes kept per traversal. Above 1, every hole that answers shortly after
+  // the first is measured, the best one is connected and the others stand by
+  // for nt_failover(). 0 or 1 connects the first hole that answers
+  int max_paths;
+  // interface whose NAT was enrolled, see detect_nat_candidates(). Every
+  // IPv4 socket of the context is bound to it with SO_BINDTODEVICE, so that
+  // holes go out the same uplink. NULL leaves the route to the kernel
+  const char *ifname;
+  // IPv4 sockets opened ahead of any traversal and mapped through the STUN
+  // server, kept warm with binding requests. The first holes of an attempt
+  // are taken from them, without the socket setup, and their mapped ports
+  // are hinted to the peer. Only used when the own NAT is symmetric, 0 or a
+  // NULL stun_server disables the pool
+  int pool_size;
+  const struct sockaddr *stun_server;
+  socklen_t stun_server_len;
+  // once relay_after_ms have passed without a hole answering, the initiator
+  // asks the punch server for a relay, 0 asks right away. The relay socket
+  // is passed to on_connected while the punch goes on, a hole answering
+  // later is passed again to take over. Peers take up offered relays
+  // whatever their own setting
+  int relay;
+  int relay_after_ms;
+};
+
+// peer and meta passed to callbacks are only valid during the call
+struct nt_callbacks {
+  // id is 0 if enrolling failed
+  void (*on_enrolled)(nt_ctx *ctx, uint32_t id, void *user_data);
+  // reply to nt_get_peer_info(), peer is NULL if the peer is unknown
+  void (*on_peer_info)(nt_ctx *ctx, const struct peer_info *peer,
+                       void *user_data);
+  // sock is a UDP socket connected to the peer, owned by the callee. Called
+  // again with a standby path once the peer fails over to it, and with the
+  // direct path when it replaces a relay
+  void (*on_connected)(nt_ctx *ctx, const struct peer_info *peer, int sock,
+                       void *user_data);
+  void (*on_failed)(nt_ctx *ctx, const struct peer_info *peer, int reason,
+                    void *user_data);
+  void *user_data;
+};
+
+// returns NULL if the punch server can't be reached
+nt_ctx *nt_ctx_new(const struct nt_config *config,
+                   const struct nt_callbacks *callbacks);
+// closes every socket still owned by the context
+void nt_ctx_free(nt_ctx *ctx);
+// a single pollable descriptor covering every socket of the context
+int nt_ctx_fd(nt_ctx *ctx);
+// milliseconds until the next timer expires, -1 if no timer is pending
+int nt_ctx_timeout(nt_ctx *ctx);
+// handles ready sockets and expired timers, returns -1 once the connection to
+// the punch server is lost. An enrolled context first reconnects for a while
+// and resumes its id, traversals in flight fail with NT_ERR_SERVER meanwhile
+int nt_ctx_process(nt_ctx *ctx);
+// convenience for callers without an event loop: waits at most timeout_ms
+// (-1 for no limit) for the context to become ready, then processes it
+int nt_ctx_run(nt_ctx *ctx, int timeout_ms);
+
+// requests are queued and complete through the callbacks
+int nt_enroll(nt_ctx *ctx, const struct peer_info *self);
+int nt_get_peer_info(nt_ctx *ctx, uint32_t peer_id);
+int nt_get_peer_info_from_meta(nt_ctx *ctx, const char *peer_meta);
+int nt_connect(nt_ctx *ctx, uint32_t peer_id);
+int nt_connect_from_meta(nt_ctx *ctx, const char *peer_meta);
+// joins the mesh named group, or the one named by the own meta up to its last
+// '/' if group is NULL. The server then starts a traversal to every other
+// member, results come through on_connected and on_failed
+int nt_join_mesh(nt_ctx *ctx, const char *group);
+// a standby path to the peer, connected and owned by the caller, the one with
+// the lowest rtt first. Returns -1 if none is left
+int nt_failover(nt_ctx *ctx, uint32_t peer_id);
+// the address the punch server saw the enroll come from, only known when
+// enrolled over UDP. Returns -1 if unknown
+int nt_reflexive_address(nt_ctx *ctx, char *ip, uint16_t *port);
+
 void hex_dump(char *desc, void *addr, int len);
-int send_get_peer_info_request(client *cli, struct peer_info *peer);
@@ -0,0 +1,588 @@
+#define _GNU_SOURCE // accept4()
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "nat_traversal.h"
+#include "nt_daemon.h"
+#include "utils.h"
+
+/*
+ * nat_traversald, one NAT detection, enrollment and punch server connection
+ * per host. Local applications connect to the Unix socket, see nt_daemon.h,
+ * and get connected UDP sockets handed over with SCM_RIGHTS.
+ */
+
+#define DEFAULT_SERVER_PORT 9988
+#define STUN_SERVER_RETRIES 3
+#define MAX_EVENTS 64
+#define MAX_UPLINKS 8
+
+// definition checked against extern declaration
+int verbose = 0;
+
+// a request waiting for its traversal, or an application waiting in accept
+struct pending {
+  struct pending *next;
+  // -1 once the application left while the traversal was running, which
+  // still holds the peer and closes the socket it ends with
+  int client;
+  // the traversal is running. The peer takes one notification from us at a
+  // time, so further requests for it wait for the running one
+  int started;
+  struct ntd_request req;
+};
+
+// a peer handed to a client, which gets the sockets replacing it
+struct handed {
+  struct handed *next;
+  int client;
+  uint32_t peer_id;
+};
+
+struct daemon {
+  nt_ctx *ctx;
+  int epfd;
+  int listen_fd;
+  uint32_t id;
+  // in arrival order
+  struct pending *pending;
+  struct handed *handed;
+};
+
+// the reply, with the socket if there is one, the daemon's copy is closed
+static void reply(int client, uint8_t op, int32_t status, uint32_t peer_id,
+                  int fd) {
+  struct ntd_reply r = {status, peer_id, op};
+  struct iovec iov = {&r, sizeof(r)};
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  if (sendmsg(client, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+    verbose_log("failed to reply to client %d, error: %s\n", client,
+                strerror(errno));
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+static int same_peer(const struct ntd_request *a, const struct ntd_request *b) {
+  return a->op == b->op && (a->op == NTD_CONNECT ? a->peer_id == b->peer_id
+                                                 : !strcmp(a->meta, b->meta));
+}
+
+static int start(struct daemon *d, struct pending *p) {
+  p->started = 1;
+  if (p->req.op == NTD_CONNECT) {
+    return nt_connect(d->ctx, p->req.peer_id);
+  }
+  return nt_connect_from_meta(d->ctx, p->req.meta);
+}
+
+// starts the next request waiting for the same peer as done, those that
+// can't be started are answered with an error
+static void start_next(struct daemon *d, const struct pending *done) {
+  struct pending **p = &d->pending;
+  while (*p != NULL) {
+    if ((*p)->started || !same_peer(&(*p)->req, &done->req)) {
+      p = &(*p)->next;
+      continue;
+    }
+    if (start(d, *p) == 0) {
+      return;
+    }
+    struct pending *failed = *p;
+    *p = failed->next;
+    reply(failed->client, failed->req.op, NT_ERR_SERVER, failed->req.peer_id,
+          -1);
+    free(failed);
+  }
+}
+
+static int matches(const struct pending *p, const struct peer_info *peer) {
+  if (!p->started) {
+    return 0;
+  }
+  switch (p->req.op) {
+  case NTD_CONNECT:
+    return p->req.peer_id == peer->id;
+  case NTD_CONNECT_META:
+    return strcmp(p->req.meta, peer->meta) == 0;
+  default:
+    return 0;
+  }
+}
+
+// takes the oldest request the traversal answers if we started it, the
+// oldest accept if the peer did
+static struct pending *take(struct daemon *d, const struct peer_info *peer) {
+  struct pending **p;
+  for (p = &d->pending; *p != NULL; p = &(*p)->next) {
+    if (peer->initiator ? matches(*p, peer) : (*p)->req.op == NTD_ACCEPT) {
+      struct pending *found = *p;
+      *p = found->next;
+      return found;
+    }
+  }
+  return NULL;
+}
+
+// remembers the client now holding peer_id, in place of any before it
+static void hand(struct daemon *d, int client, uint32_t peer_id) {
+  struct handed **h = &d->handed;
+  while (*h != NULL && (*h)->peer_id != peer_id) {
+    h = &(*h)->next;
+  }
+  if (*h == NULL) {
+    *h = calloc(1, sizeof(**h));
+    if (*h == NULL) {
+      return;
+    }
+    (*h)->peer_id = peer_id;
+  }
+  (*h)->client = client;
+}
+
+// a standby path to a peer handed to client, 0 taking the first one, which
+// the context keeps warm after the traversal
+static void fail_over(struct daemon *d, int client, uint32_t peer_id) {
+  struct handed *h = d->handed;
+  while (h != NULL && (h->client != client ||
+                       (peer_id != 0 && h->peer_id != peer_id))) {
+    h = h->next;
+  }
+  int sock = h != NULL ? nt_failover(d->ctx, h->peer_id) : -1;
+  if (sock >= 0) {
+    verbose_log("client %d failed over to a standby path of peer %d\n",
+                client, h->peer_id);
+  }
+  reply(client, NTD_FAILOVER, sock >= 0 ? 0 : NT_ERR_SOCKET,
+        h != NULL ? h->peer_id : peer_id, sock);
+}
+
+static void on_enrolled(nt_ctx *ctx, uint32_t id, void *user_data) {
+  struct daemon *d = user_data;
+  d->id = id;
+  if (!id) {
+    printf("failed to enroll\n");
+    return;
+  }
+  printf("enrolled, ID: %d\n", id);
+}
+
+static void on_peer_info(nt_ctx *ctx, const struct peer_info *peer,
+                         void *user_data) {}
+
+static void on_connected(nt_ctx *ctx, const struct peer_info *peer, int sock,
+                         void *user_data) {
+  struct daemon *d = user_data;
+  if (peer->replaces) {
+    // a better path for a peer already handed over, its client moves to it
+    struct handed *h = d->handed;
+    while (h != NULL && h->peer_id != peer->id) {
+      h = h->next;
+    }
+    if (h == NULL) {
+      close(sock);
+      return;
+    }
+    verbose_log("peer %d moved, new path sent to client %d\n", peer->id,
+                h->client);
+    reply(h->client, NTD_SWAP, 0, peer->id, sock);
+    return;
+  }
+  struct pending *p = take(d, peer);
+  if (p == NULL || p->client < 0) {
+    verbose_log("nobody takes peer %d, connection dropped\n", peer->id);
+    close(sock);
+  } else {
+    verbose_log("peer %d handed to client %d\n", peer->id, p->client);
+    hand(d, p->client, peer->id);
+    reply(p->client, p->req.op, 0, peer->id, sock);
+  }
+  if (p != NULL) {
+    start_next(d, p);
+    free(p);
+  }
+}
+
+static void on_failed(nt_ctx *ctx, const struct peer_info *peer, int reason,
+                      void *user_data) {
+  struct daemon *d = user_data;
+  struct pending *p = peer->initiator ? take(d, peer) : NULL;
+  if (p != NULL) {
+    if (p->client >= 0) {
+      reply(p->client, p->req.op, reason, peer->id, -1);
+    }
+    start_next(d, p);
+    free(p);
+  }
+}
+
+static void drop_client(struct daemon *d, int client) {
+  struct pending **p = &d->pending;
+  while (*p != NULL) {
+    if ((*p)->client == client && (*p)->started) {
+      // its traversal still completes, unclaimed
+      (*p)->client = -1;
+      p = &(*p)->next;
+    } else if ((*p)->client == client) {
+      struct pending *gone = *p;
+      *p = gone->next;
+      free(gone);
+    } else {
+      p = &(*p)->next;
+    }
+  }
+  struct handed **h = &d->handed;
+  while (*h != NULL) {
+    if ((*h)->client == client) {
+      struct handed *gone = *h;
+      *h = gone->next;
+      free(gone);
+    } else {
+      h = &(*h)->next;
+    }
+  }
+  epoll_ctl(d->epfd, EPOLL_CTL_DEL, client, NULL);
+  close(client);
+}
+
+static void client_ready(struct daemon *d, int client) {
+  struct pending *p = calloc(1, sizeof(*p));
+  if (p == NULL) {
+    return;
+  }
+  ssize_t n = recv(client, &p->req, sizeof(p->req), MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    free(p);
+    return;
+  }
+  if (n != sizeof(p->req)) {
+    free(p);
+    drop_client(d, client);
+    return;
+  }
+  p->client = client;
+  p->req.meta[UINT8_MAX] = '\0';
+  if (p->req.op == NTD_FAILOVER) {
+    // answered at once, the standby is there or not
+    fail_over(d, client, p->req.peer_id);
+    free(p);
+    return;
+  }
+
+  int busy = 0;
+  struct pending **tail = &d->pending;
+  while (*tail != NULL) {
+    busy |= (*tail)->started && same_peer(&(*tail)->req, &p->req);
+    tail = &(*tail)->next;
+  }
+  int ret = 0;
+  if (d->id == 0 || (p->req.op != NTD_CONNECT &&
+                     p->req.op != NTD_CONNECT_META &&
+                     p->req.op != NTD_ACCEPT)) {
+    ret = -1;
+  } else if (p->req.op != NTD_ACCEPT && !busy) {
+    ret = start(d, p);
+  }
+  if (ret < 0) {
+    reply(client, p->req.op, NT_ERR_SERVER, p->req.peer_id, -1);
+    free(p);
+    return;
+  }
+  // appended, requests for the same peer are served in order
+  *tail = p;
+}
+
+static int listen_unix(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  // left behind by a previous run
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(sock, SOMAXCONN)) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static int add_fd(int epfd, int fd) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int main(int argc, char **argv) {
+  char *stun_server = NULL;
+  char local_ip[IP_STR_LEN] = "0.0.0.0";
+  int local_ip_set = 0;
+  char local_ip6[IP_STR_LEN] = {0};
+  int use_ipv6 = 0;
+  uint16_t stun_port = DEFAULT_STUN_SERVER_PORT;
+  uint16_t local_port = DEFAULT_LOCAL_PORT;
+  char *punch_server = NULL;
+  char *meta = NULL;
+  char *path = NTD_DEFAULT_PATH;
+  int ttl = 10;
+  int io_uring = 0;
+  int udp = 0;
+  int max_paths = 1;
+  int pool_size = 0;
+  int relay_after_ms = -1;
+
+  static char usage[] =
+      "usage: [-h] [-H STUN_HOST] [-t ttl] [-P STUN_PORT] [-s punch server] "
+      "[-i SOURCE_IP] [-p SOURCE_PORT] [-m meta] [-S unix socket path] "
+      "[-k paths kept] [-b sockets mapped ahead] "
+      "[-r relay after ms, 0 at once] [-6 detect IPv6 address] "
+      "[-I IPv6 address] [-U use io_uring] [-u UDP rendezvous] [-v verbose]\n";
+  int opt;
+  while ((opt = getopt(argc, argv, "H:h:t:P:p:s:m:i:I:S:k:b:r:vUu6")) != -1) {
+    switch (opt) {
+    case 'h':
+      printf("%s", usage);
+      break;
+    case 'H':
+      stun_server = optarg;
+      break;
+    case 't':
+      ttl = atoi(optarg);
+      break;
+    case 'P':
+      stun_port = atoi(optarg);
+      break;
+    case 'p':
+      local_port = atoi(optarg);
+      break;
+    case 's':
+      punch_server = optarg;
+      break;
+    case 'm':
+      meta = optarg;
+      break;
+    case 'i':
+      strncpy(local_ip, optarg, IP_STR_LEN - 1);
+      local_ip_set = 1;
+      break;
+    case 'I':
+      // advertised for the direct path without asking STUN, as the client
+      strncpy(local_ip6, optarg, IP_STR_LEN - 1);
+      use_ipv6 = 1;
+      break;
+    case '6':
+      use_ipv6 = 1;
+      break;
+    case 'S':
+      path = optarg;
+      break;
+    case 'U':
+      io_uring = 1;
+      break;
+    case 'k':
+      max_paths = atoi(optarg);
+      break;
+    case 'b':
+      pool_size = atoi(optarg);
+      break;
+    case 'r':
+      relay_after_ms = atoi(optarg);
+      break;
+    case 'u':
+      udp = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case '?':
+    default:
+      printf("invalid option: %c\n", opt);
+      printf("%s", usage);
+
+      return -1;
+    }
+  }
+
+  if (punch_server == NULL) {
+    printf("please specify punch server\n");
+    return -1;
+  }
+  struct sockaddr_storage server_addr;
+  socklen_t server_addr_len =
+      make_sockaddr(punch_server, DEFAULT_SERVER_PORT, &server_addr);
+  if (!server_addr_len) {
+    printf("invalid punch server address %s\n", punch_server);
+    return -1;
+  }
+
+  // classified once for every application on the host, on every uplink
+  // unless -i picks one
+  char ext_ip[IP_STR_LEN] = {0};
+  uint16_t ext_port = 0;
+  nat_type type = 0;
+  struct nat_candidate uplinks[MAX_UPLINKS];
+  int n_uplinks = 0;
+  if (!local_ip_set) {
+    n_uplinks = detect_nat_candidates(stun_server, stun_port, local_port,
+                                      uplinks, MAX_UPLINKS);
+  }
+  if (n_uplinks > 0) {
+    strcpy(ext_ip, uplinks[0].ext_ip);
+    ext_port = uplinks[0].ext_port;
+    type = uplinks[0].type;
+  }
+  int i;
+  for (i = 0; i < STUN_SERVER_RETRIES && type == 0; i++) {
+    type = detect_nat_type(stun_server, stun_port, local_ip, local_port, ext_ip,
+                           &ext_port);
+  }
+  if (!ext_port) {
+    printf("failed to detect nat type\n");
+    return -1;
+  }
+  verbose_log("nat detect got ip: %s, port %d\n", ext_ip, ext_port);
+
+  struct peer_info self;
+  char self_meta[UINT8_MAX + 1] = {0};
+  memset(&self, 0, sizeof(self));
+  self.meta = self_meta;
+  strcpy(self.ip, ext_ip);
+  self.port = ext_port;
+  self.type = type;
+  // the IPv6 direct path, which -k keeps as a standby for nt_failover() when
+  // an IPv4 hole wins
+  if (local_ip6[0] != '\0') {
+    strcpy(self.ip6, local_ip6);
+    self.port6 = local_port;
+  } else if (use_ipv6 &&
+             stun_get_mapped_address(stun_server, stun_port, "::", local_port,
+                                     self.ip6, &self.port6)) {
+    printf("no ipv6 connectivity, only ipv4 is used\n");
+    self.ip6[0] = '\0';
+    self.port6 = 0;
+  }
+  if (meta != NULL) {
+    strncpy(self.meta, meta, UINT8_MAX);
+  } else {
+    gen_random_string(self.meta, 20);
+  }
+
+  struct daemon d;
+  memset(&d, 0, sizeof(d));
+  struct nt_callbacks callbacks = {on_enrolled, on_peer_info, on_connected,
+                                   on_failed, &d};
+  struct nt_config config;
+  memset(&config, 0, sizeof(config));
+  config.punch_server = (struct sockaddr *)&server_addr;
+  config.punch_server_len = server_addr_len;
+  config.ttl = ttl;
+  config.local_port = local_port;
+  config.local_port6 = local_port;
+  config.io_uring = io_uring;
+  config.udp = udp;
+  config.max_paths = max_paths;
+  config.relay = relay_after_ms >= 0;
+  config.relay_after_ms = relay_after_ms;
+  if (n_uplinks > 1) {
+    config.ifname = uplinks[0].ifname;
+    printf("%d uplinks, using %s\n", n_uplinks, uplinks[0].ifname);
+  }
+  // between requests the pool keeps sockets mapped for the next traversals
+  struct sockaddr_storage stun_addr;
+  if (pool_size > 0) {
+    config.pool_size = pool_size;
+    config.stun_server_len =
+        stun_server_address(stun_server, stun_port, AF_INET, &stun_addr);
+    if (config.stun_server_len) {
+      config.stun_server = (struct sockaddr *)&stun_addr;
+    }
+  }
+
+  d.ctx = nt_ctx_new(&config, &callbacks);
+  if (d.ctx == NULL || nt_enroll(d.ctx, &self) < 0) {
+    printf("failed to enroll\n");
+    return -1;
+  }
+  d.epfd = epoll_create1(EPOLL_CLOEXEC);
+  d.listen_fd = listen_unix(path);
+  if (d.epfd < 0 || d.listen_fd < 0 || add_fd(d.epfd, d.listen_fd) ||
+      add_fd(d.epfd, nt_ctx_fd(d.ctx))) {
+    printf("failed to listen on %s, error: %s\n", path, strerror(errno));
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  printf("listening on %s\n", path);
+
+  // serve applications until the punch server goes away
+  for (;;) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(d.epfd, events, MAX_EVENTS, nt_ctx_timeout(d.ctx));
+    for (i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == d.listen_fd) {
+        int client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client >= 0 && add_fd(d.epfd, client)) {
+          close(client);
+        }
+      } else if (fd != nt_ctx_fd(d.ctx)) {
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+          drop_client(&d, fd);
+        } else {
+          client_ready(&d, fd);
+        }
+      }
+    }
+    if (nt_ctx_process(d.ctx) < 0) {
+      break;
+    }
+  }
+
+  printf("connection to punch server lost\n");
+  while (d.pending != NULL) {
+    struct pending *p = d.pending;
+    d.pending = p->next;
+    if (p->client >= 0) {
+      reply(p->client, p->req.op, NT_ERR_SERVER, p->req.peer_id, -1);
+    }
+    free(p);
+  }
+  while (d.handed != NULL) {
+    struct handed *h = d.handed;
+    d.handed = h->next;
+    free(h);
+  }
+  nt_ctx_free(d.ctx);
+  unlink(path);
+  return -1;
+}
@@ -1,7 +1,10 @@
 #include <arpa/inet.h>
 #include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,10 +13,20 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "io_backend.h"
 #include "nat_type.h"
+#include "nt_pcap.h"
 #include "utils.h"
 
-#define MAX_RETRIES_NUM 3
+// retransmissions follow RFC 5389, the first one after the rto of the server
+// and then twice as late each time, but never more than STUN_MAX_RTO_MS
+#define STUN_MAX_SENDS 5
+#define STUN_INITIAL_RTO_MS 500
+#define STUN_MIN_RTO_MS 50
+#define STUN_MAX_RTO_MS 3000
+#define STUN_RTT_SERVERS 32
+// under $HOME, unless stun_rtt_file() says otherwise
+#define STUN_RTT_FILE ".nat_traversal_stun_rtt"
 
 // use public stun servers to detect port allocation rule
 static char *stun_servers[] = {"stun.avigora.com",
@@ -173,6 +186,24 @@ static char *stun_servers[] = {"stun.avigora.com",
                                "stun.zoiper.com",
                                "stun1.faktortel.com.au"};
 
+// smoothed rtt of a STUN server as in RFC 6298, in microseconds
+struct stun_rtt {
+  char ip[IP_STR_LEN];
+  uint16_t port;
+  int64_t srtt;
+  int64_t rttvar;
+  time_t seen_at;
+};
+
+static struct stun_rtt rtts[STUN_RTT_SERVERS];
+// uplinks are classified by threads of their own
+static pthread_mutex_t rtts_lock = PTHREAD_MUTEX_INITIALIZER;
+static int rtts_loaded;
+// samples taken since the file was last written
+static int rtts_dirty;
+static int rtt_file_set;
+static char rtt_path[256];
+
 static const char *nat_types[] = {
     "blocked",        "open internet",        "full cone",
     "restricted NAT", "port-restricted cone", "symmetric NAT",
@@ -239,12 +270,36 @@ static int stun_parse_atr_addr(char *body, unsigned int hdrLen,
     // Note:  addr.ipv4 is stored in host byte order
     return 0;
   } else if (result->family == IPv6Family) {
-    printf("ipv6 is not implemented yet");
+    if (hdrLen != 20) {
+      return -1;
+    }
+    // Note:  addr.ipv6 is kept in network byte order
+    memcpy(&result->addr.ipv6, body, sizeof(UInt128));
+    return 0;
   }
 
   return -1;
 }
 
+static void stun_addr_ntop(const StunAtrAddress *addr, char *buf, size_t len) {
+  if (addr->family == IPv6Family) {
+    inet_ntop(AF_INET6, &addr->addr.ipv6, buf, len);
+  } else {
+    struct in_addr in = {htonl(addr->addr.ipv4)};
+    inet_ntop(AF_INET, &in, buf, len);
+  }
+}
+
+static int stun_addr_equal(const StunAtrAddress *a, const StunAtrAddress *b) {
+  if (a->family != b->family || a->port != b->port) {
+    return 0;
+  }
+  if (a->family == IPv6Family) {
+    return !memcmp(&a->addr.ipv6, &b->addr.ipv6, sizeof(UInt128));
+  }
+  return a->addr.ipv4 == b->addr.ipv4;
+}
+
 void gen_random_string(char *s, const int len) {
   srand(time(NULL));
   const char alphanum[] = "0123456789"
@@ -258,77 +313,261 @@ void gen_random_string(char *s, const int len) {
   s[len] = '\0';
 }
 
-static int send_bind_request(int sock, const char *remote_host,
-                             uint16_t remote_port, uint32_t change_ip,
-                             uint32_t change_port, StunAtrAddress *addr_array) {
-  char *buf = malloc(MAX_STUN_MESSAGE_LENGTH);
-  char *ptr = buf;
+void stun_rtt_file(const char *path) {
+  rtt_file_set = 1;
+  rtt_path[0] = '\0';
+  if (path != NULL) {
+    snprintf(rtt_path, sizeof(rtt_path), "%s", path);
+  }
+  rtts_loaded = 0;
+  rtts_dirty = 0;
+  memset(rtts, 0, sizeof(rtts));
+}
+
+static const char *rtt_file(void) {
+  if (!rtt_file_set) {
+    const char *home = getenv("HOME");
+    rtt_file_set = 1;
+    if (home != NULL) {
+      snprintf(rtt_path, sizeof(rtt_path), "%s/%s", home, STUN_RTT_FILE);
+    }
+  }
+  return rtt_path[0] ? rtt_path : NULL;
+}
+
+static void load_rtts(void) {
+  rtts_loaded = 1;
+  const char *path = rtt_file();
+  FILE *f = path != NULL ? fopen(path, "r") : NULL;
+  if (f == NULL) {
+    return;
+  }
+  int i = 0;
+  long long srtt, rttvar, seen_at;
+  unsigned int port;
+  while (i < STUN_RTT_SERVERS &&
+         fscanf(f, "%45s %u %lld %lld %lld", rtts[i].ip, &port, &srtt, &rttvar,
+                &seen_at) == 5) {
+    rtts[i].port = port;
+    rtts[i].srtt = srtt;
+    rtts[i].rttvar = rttvar;
+    rtts[i].seen_at = seen_at;
+    ++i;
+  }
+  fclose(f);
+}
+
+// writes the estimates once a detection is over. Other processes share the
+// file, so a new one is renamed over it rather than truncated
+static void save_rtts(void) {
+  pthread_mutex_lock(&rtts_lock);
+  const char *path = rtt_file();
+  if (!rtts_dirty || path == NULL) {
+    goto unlock;
+  }
+  rtts_dirty = 0;
+  char tmp[sizeof(rtt_path) + 16];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    goto unlock;
+  }
+  int i;
+  for (i = 0; i < STUN_RTT_SERVERS; ++i) {
+    if (rtts[i].port != 0) {
+      fprintf(f, "%s %u %lld %lld %lld\n", rtts[i].ip, rtts[i].port,
+              (long long)rtts[i].srtt, (long long)rtts[i].rttvar,
+              (long long)rtts[i].seen_at);
+    }
+  }
+  if (fclose(f) || rename(tmp, path)) {
+    unlink(tmp);
+  }
+unlock:
+  pthread_mutex_unlock(&rtts_lock);
+}
+
+// the slot of the server, a new one replaces the least recently seen. Called
+// with rtts_lock held
+static struct stun_rtt *rtt_slot(const char *ip, uint16_t port) {
+  if (!rtts_loaded) {
+    load_rtts();
+  }
+  struct stun_rtt *found = &rtts[0];
+  int i;
+  for (i = 0; i < STUN_RTT_SERVERS; ++i) {
+    if (rtts[i].port == port && !strcmp(rtts[i].ip, ip)) {
+      return &rtts[i];
+    }
+    if (rtts[i].seen_at < found->seen_at) {
+      found = &rtts[i];
+    }
+  }
+  memset(found, 0, sizeof(*found));
+  strcpy(found->ip, ip);
+  found->port = port;
+  return found;
+}
+
+// a copy of the estimate of the server, the slot may go to another server
+// while the test runs
+static void find_rtt(const struct sockaddr *addr, struct stun_rtt *r) {
+  char ip[IP_STR_LEN];
+  uint16_t port = sockaddr_ntop(addr, ip, sizeof(ip));
+  pthread_mutex_lock(&rtts_lock);
+  *r = *rtt_slot(ip, port);
+  pthread_mutex_unlock(&rtts_lock);
+}
+
+static int rto_ms(const struct stun_rtt *r) {
+  int64_t srtt = r->srtt, rttvar = r->rttvar;
+  if (srtt == 0) {
+    return STUN_INITIAL_RTO_MS;
+  }
+  int rto = (srtt + 4 * rttvar) / 1000;
+  if (rto < STUN_MIN_RTO_MS) {
+    return STUN_MIN_RTO_MS;
+  }
+  return rto < STUN_MAX_RTO_MS ? rto : STUN_MAX_RTO_MS;
+}
+
+// folds the sample into the estimate of the server of r, looked up again,
+// and copies the result to r
+static void update_rtt(struct stun_rtt *copy, int64_t sample) {
+  pthread_mutex_lock(&rtts_lock);
+  struct stun_rtt *r = rtt_slot(copy->ip, copy->port);
+  if (r->srtt == 0) {
+    r->srtt = sample;
+    r->rttvar = sample / 2;
+  } else {
+    int64_t delta = r->srtt > sample ? r->srtt - sample : sample - r->srtt;
+    r->rttvar = (3 * r->rttvar + delta) / 4;
+    r->srtt = (7 * r->srtt + sample) / 8;
+  }
+  if (r->srtt == 0) {
+    r->srtt = 1;
+  }
+  r->seen_at = time(NULL);
+  *copy = *r;
+  rtts_dirty = 1;
+  pthread_mutex_unlock(&rtts_lock);
+}
+
+static int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// one binding request. Tests run together on one socket and are told apart by
+// their transaction IDs
+struct stun_test {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  // the NAT may rightly drop the response to a negative test, it is given up
+  // an rto after a positive test of the same run is answered
+  int negative;
+  char req[MAX_STUN_MESSAGE_LENGTH];
+  size_t req_len;
+  struct stun_rtt rtt;
+  int sends;
+  int wait_ms;
+  int64_t first_sent;
+  // of the response to the first send, 0 if it was retransmitted
+  int64_t rtt_us;
+  // the next retransmission, or when the test is given up
+  int64_t next_at;
+  int deadline_set;
+  // 1 answered, -1 given up or unparsable, 0 still running
+  int done;
+  // 0 for mapped addr, 1 for changed addr
+  StunAtrAddress result[2];
+};
+
+// a binding request asking the server to answer from another ip and port
+// when change is set. Returns its length
+static size_t encode_request(char *req, uint32_t change) {
+  char *ptr = req;
 
   StunHeader h;
   h.msgType = BindRequest;
 
-  gen_random_string((char *)&h.magicCookieAndTid, 16);
+  // gen_random_string() repeats within a second, the serial keeps responses
+  // to earlier transactions from matching this one
+  static uint32_t serial;
+  gen_random_string((char *)&h.magicCookieAndTid, 15);
+  h.magicCookieAndTid.longpart[3] =
+      htonl(__atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED));
 
   ptr = encode16(ptr, h.msgType);
   char *lengthp = ptr;
   ptr = encode16(ptr, 0);
   ptr = encode(ptr, (const char *)&h.id, sizeof(h.id));
 
-  if (change_ip || change_port) {
-    ptr = encodeAtrUInt32(ptr, ChangeRequest, change_ip | change_port);
+  if (change) {
+    ptr = encodeAtrUInt32(ptr, ChangeRequest, change);
 
     // length of stun body
-    encode16(lengthp, ptr - buf - sizeof(StunHeader));
+    encode16(lengthp, ptr - req - sizeof(StunHeader));
   }
+  return ptr - req;
+}
 
-  struct hostent *server = gethostbyname(remote_host);
-  if (server == NULL) {
-    fprintf(stderr, "no such host, %s\n", remote_host);
-    free(buf);
-
-    return -1;
+// the server has to be reached with the same address family as the socket
+static socklen_t resolve_server(const char *remote_host, uint16_t remote_port,
+                                int family, struct sockaddr_storage *addr) {
+  struct addrinfo hints, *server;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = family;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(remote_host, NULL, &hints, &server) != 0) {
+    return 0;
   }
-  struct sockaddr_in remote_addr;
-
-  remote_addr.sin_family = AF_INET;
-  memcpy(&remote_addr.sin_addr.s_addr, server->h_addr_list[0],
-         server->h_length);
-  remote_addr.sin_port = htons(remote_port);
-
-  int retries;
-  for (retries = 0; retries < MAX_RETRIES_NUM; retries++) {
-    if (-1 == sendto(sock, buf, ptr - buf, 0, (struct sockaddr *)&remote_addr,
-                     sizeof(remote_addr))) {
-      // sendto() barely failed
-      free(buf);
-
-      return -1;
-    }
-
-    socklen_t fromlen = sizeof remote_addr;
-
-    struct timeval tv;
-    tv.tv_sec = 3;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv));
-
-    if (recvfrom(sock, buf, 512, 0, (struct sockaddr *)&remote_addr,
-                 &fromlen) <= 0) {
-      if (errno != EAGAIN || errno != EWOULDBLOCK) {
-        free(buf);
+  socklen_t len = server->ai_addrlen;
+  memcpy(addr, server->ai_addr, server->ai_addrlen);
+  freeaddrinfo(server);
+  if (family == AF_INET6) {
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(remote_port);
+  } else {
+    ((struct sockaddr_in *)addr)->sin_port = htons(remote_port);
+  }
+  return len;
+}
 
-        return -1;
-      }
-      // timout, retry
-    } else {
-      // got response
-      break;
-    }
+static int prepare_test(struct stun_test *t, int family,
+                        const char *remote_host, uint16_t remote_port,
+                        uint32_t change, int negative) {
+  memset(t, 0, sizeof(*t));
+  t->negative = negative;
+  t->req_len = encode_request(t->req, change);
+  t->addr_len = resolve_server(remote_host, remote_port, family, &t->addr);
+  if (!t->addr_len) {
+    fprintf(stderr, "no such host, %s\n", remote_host);
+    return -1;
   }
+  find_rtt((struct sockaddr *)&t->addr, &t->rtt);
+  return 0;
+}
 
-  if (retries == MAX_RETRIES_NUM)
+static int send_test(int sock, struct stun_test *t, int64_t now) {
+  struct io_backend *io = nt_pcap_wrap(io_backend_sync());
+  if (-1 == io->sendto(io, sock, t->req, t->req_len, 0,
+                       (struct sockaddr *)&t->addr, t->addr_len)) {
+    // sendto() barely failed
     return -1;
+  }
+  if (t->sends++ == 0) {
+    t->first_sent = now;
+    t->wait_ms = rto_ms(&t->rtt);
+  } else {
+    t->wait_ms =
+        t->wait_ms * 2 < STUN_MAX_RTO_MS ? t->wait_ms * 2 : STUN_MAX_RTO_MS;
+  }
+  t->next_at = now + (int64_t)t->wait_ms * 1000;
+  return 0;
+}
 
+static int parse_response(char *buf, size_t len, StunAtrAddress *addr_array) {
   StunHeader reply_header;
   memcpy(&reply_header, buf, sizeof(StunHeader));
 
@@ -343,6 +582,9 @@ static int send_bind_request(int sock, const char *remote_host,
     unsigned int attrLenPad;
     int atrType;
 
+    if (size > len - sizeof(StunHeader)) {
+      return -1;
+    }
     while (size > 0) {
       attr = (StunAtrHdr *)(body);
 
@@ -353,8 +595,6 @@ static int send_bind_request(int sock, const char *remote_host,
       atrType = ntohs(attr->type);
 
       if (attrLen + attrLenPad + 4 > size) {
-        free(buf);
-
         return -1;
       }
 
@@ -364,15 +604,11 @@ static int send_bind_request(int sock, const char *remote_host,
       switch (atrType) {
       case MappedAddress:
         if (stun_parse_atr_addr(body, attrLen, addr_array)) {
-          free(buf);
-
           return -1;
         }
         break;
       case ChangedAddress:
         if (stun_parse_atr_addr(body, attrLen, addr_array + 1)) {
-          free(buf);
-
           return -1;
         }
         break;
@@ -385,64 +621,301 @@ static int send_bind_request(int sock, const char *remote_host,
     }
   }
 
-  free(buf);
+  return 0;
+}
+
+// waits until deadline for a response to one of the running tests, stray and
+// late packets of other transactions are dropped. Returns the index of the
+// answered test, n on timeout and -1 on errors
+static int recv_response(int sock, struct stun_test *tests, int n,
+                         int64_t deadline) {
+  struct io_backend *io = nt_pcap_wrap(io_backend_sync());
+  char buf[MAX_STUN_MESSAGE_LENGTH];
+  for (;;) {
+    int64_t left = deadline - now_us();
+    if (left <= 0) {
+      return n;
+    }
+    struct timeval tv;
+    tv.tv_sec = left / 1000000;
+    tv.tv_usec = left % 1000000;
+    io->setsockopt(io, sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv,
+                   sizeof(tv));
+
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+    ssize_t len = io->recvfrom(io, sock, buf, sizeof(buf), 0,
+                               (struct sockaddr *)&from, &from_len);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    int i;
+    for (i = 0; (size_t)len >= sizeof(StunHeader) && i < n; ++i) {
+      if (tests[i].done == 0 && !memcmp(buf + 4, tests[i].req + 4, 16)) {
+        tests[i].done = parse_response(buf, len, tests[i].result) ? -1 : 1;
+        return i;
+      }
+    }
+    verbose_log("dropping %zd bytes, not a response to a test\n", len);
+  }
+}
+
+// runs the tests in parallel. Positive tests are retransmitted as in RFC 5389,
+// from the rto of their server and twice as late each time, negative ones
+// along with them until a positive test is answered. Its rtt then sets a
+// short deadline for the negative tests, which aren't waited for any longer
+static int run_tests(int sock, struct stun_test *tests, int n) {
+  int64_t now = now_us();
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (send_test(sock, &tests[i], now) < 0) {
+      return -1;
+    }
+  }
+  for (;;) {
+    int64_t next = 0;
+    int positive = 0;
+    for (i = 0; i < n; ++i) {
+      if (tests[i].done == 0 && (next == 0 || tests[i].next_at < next)) {
+        next = tests[i].next_at;
+      }
+      positive += tests[i].done == 0 && !tests[i].negative;
+    }
+    if (next == 0) {
+      return 0;
+    }
+    int answered = recv_response(sock, tests, n, next);
+    if (answered < 0) {
+      return -1;
+    }
+    now = now_us();
+    if (answered < n) {
+      struct stun_test *t = &tests[answered];
+      if (t->negative || t->done < 0) {
+        continue;
+      }
+      // Karn's algorithm, the response to a retransmission can't be timed
+      if (t->sends == 1) {
+        t->rtt_us = now - t->first_sent;
+        update_rtt(&t->rtt, t->rtt_us);
+      }
+      for (i = 0; i < n; ++i) {
+        // sent once more, so that a single lost packet doesn't decide it
+        if (tests[i].done == 0 && tests[i].negative &&
+            !tests[i].deadline_set) {
+          if (send_test(sock, &tests[i], now) < 0) {
+            return -1;
+          }
+          tests[i].deadline_set = 1;
+          tests[i].next_at = now + (int64_t)rto_ms(&t->rtt) * 1000;
+        }
+      }
+      continue;
+    }
+    for (i = 0; i < n; ++i) {
+      struct stun_test *t = &tests[i];
+      if (t->done != 0 || t->next_at > now) {
+        continue;
+      }
+      if (t->deadline_set || t->sends == STUN_MAX_SENDS ||
+          (t->negative && positive == 0)) {
+        verbose_log("no response to test %d after %d requests\n", i,
+                    t->sends);
+        t->done = -1;
+      } else if (send_test(sock, t, now) < 0) {
+        return -1;
+      }
+    }
+  }
+}
 
+static int send_bind_request(int sock, int family, const char *remote_host,
+                             uint16_t remote_port, uint32_t change_ip,
+                             uint32_t change_port, StunAtrAddress *addr_array) {
+  struct stun_test t;
+  if (prepare_test(&t, family, remote_host, remote_port,
+                   change_ip | change_port, 0) ||
+      run_tests(sock, &t, 1) || t.done != 1) {
+    return -1;
+  }
+  memcpy(addr_array, t.result, sizeof(t.result));
   return 0;
 }
 
 const char *get_nat_desc(nat_type type) { return nat_types[type]; }
 
-nat_type detect_nat_type(char *stun_host, uint16_t stun_port,
-                         const char *local_ip, uint16_t local_port,
-                         char *ext_ip, uint16_t *ext_port) {
+static char *pick_stun_server(char *stun_host) {
   if (stun_host == NULL) {
     srand(time(NULL));
     int i = rand() % (sizeof(stun_servers) / sizeof(stun_servers[0]) - 1);
     verbose_log("Using the %dth stun server %s\n", i, stun_servers[i]);
     stun_host = stun_servers[i];
   }
-  uint32_t mapped_ip = 0;
-  uint16_t mapped_port = 0;
-  int s = socket(AF_INET, SOCK_DGRAM, 0);
-  if (s <= 0) {
-    return Error;
+  return stun_host;
+}
+
+socklen_t stun_server_address(char *stun_host, uint16_t stun_port, int family,
+                              struct sockaddr_storage *addr) {
+  return resolve_server(pick_stun_server(stun_host), stun_port, family, addr);
+}
+
+size_t stun_binding_request(char *req) { return encode_request(req, 0); }
+
+uint16_t stun_mapped_port(const char *req, char *buf, size_t len) {
+  StunAtrAddress result[2];
+  memset(result, 0, sizeof(result));
+  if (len < sizeof(StunHeader) || memcmp(buf + 4, req + 4, 16) ||
+      parse_response(buf, len, result)) {
+    return 0;
   }
+  return result[0].port;
+}
 
-  nat_type nat_type;
+// create a UDP socket bound to local_ip:local_port, and to the interface
+// ifname unless it is NULL. The address family follows local_ip, returns -1 on
+// failure
+static int open_stun_socket(const char *local_ip, const char *ifname,
+                            uint16_t local_port, int *family) {
+  struct sockaddr_storage local_addr;
+  socklen_t local_addr_len = make_sockaddr(local_ip, local_port, &local_addr);
+  if (!local_addr_len) {
+    printf("invalid local address %s\n", local_ip);
+    return -1;
+  }
+  *family = local_addr.ss_family;
 
-  int reuse_addr = 1;
-  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse_addr,
-             sizeof(reuse_addr));
+  struct io_backend *io = nt_pcap_wrap(io_backend_sync());
+  int s = io->socket(io, *family, SOCK_DGRAM, 0);
+  if (s < 0) {
+    return -1;
+  }
 
-  struct sockaddr_in local_addr;
-  local_addr.sin_family = AF_INET;
-  local_addr.sin_addr.s_addr = inet_addr(local_ip);
+  int reuse_addr = 1;
+  io->setsockopt(io, s, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse_addr,
+                 sizeof(reuse_addr));
+  if (*family == AF_INET6) {
+    // keep the IPv4 port free for the IPv4 socket bound to the same port
+    int v6only = 1;
+    io->setsockopt(io, s, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+  }
+  // without the privilege, the source address alone picks the uplink where
+  // the routing policy follows it
+  if (ifname != NULL && io->setsockopt(io, s, SOL_SOCKET, SO_BINDTODEVICE,
+                                       ifname, strlen(ifname))) {
+    verbose_log("failed to bind to %s, error: %s\n", ifname, strerror(errno));
+  }
 
-  local_addr.sin_port = htons(local_port);
-  if (bind(s, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
+  if (io->bind(io, s, (struct sockaddr *)&local_addr, local_addr_len)) {
     if (errno == EADDRINUSE) {
       printf("addr in use, try another port\n");
-      nat_type = Error;
-      goto cleanup_sock;
+      io->close(io, s);
+      return -1;
     }
   }
+  return s;
+}
 
-  // 0 for mapped addr, 1 for changed addr
-  StunAtrAddress bind_result[2];
+int stun_get_mapped_address(char *stun_host, uint16_t stun_port,
+                            const char *local_ip, uint16_t local_port,
+                            char *ext_ip, uint16_t *ext_port) {
+  stun_host = pick_stun_server(stun_host);
+
+  int family;
+  struct io_backend *io = nt_pcap_wrap(io_backend_sync());
+  int s = open_stun_socket(local_ip, NULL, local_port, &family);
+  if (s < 0) {
+    return -1;
+  }
 
+  StunAtrAddress bind_result[2];
   memset(bind_result, 0, sizeof(StunAtrAddress) * 2);
-  if (send_bind_request(s, stun_host, stun_port, 0, 0, bind_result)) {
+  int res = send_bind_request(s, family, stun_host, stun_port, 0, 0,
+                              bind_result);
+  io->close(io, s);
+  save_rtts();
+  if (res || bind_result[0].port == 0) {
+    return -1;
+  }
+
+  stun_addr_ntop(&bind_result[0], ext_ip, IP_STR_LEN);
+  *ext_port = bind_result[0].port;
+  return 0;
+}
+
+// whether the mapped ip is our own: local_ip itself, or the address of any
+// interface when bound to the wildcard
+static int is_local_ip(const char *local_ip, const char *mapped_ip) {
+  if (!strcmp(local_ip, mapped_ip)) {
+    return 1;
+  }
+  if (strcmp(local_ip, "0.0.0.0") && strcmp(local_ip, "::")) {
+    return 0;
+  }
+  struct ifaddrs *ifs, *ifa;
+  if (getifaddrs(&ifs)) {
+    return 0;
+  }
+  int found = 0;
+  for (ifa = ifs; ifa != NULL && !found; ifa = ifa->ifa_next) {
+    char ip[IP_STR_LEN];
+    if (ifa->ifa_addr != NULL && (ifa->ifa_addr->sa_family == AF_INET ||
+                                  ifa->ifa_addr->sa_family == AF_INET6)) {
+      sockaddr_ntop(ifa->ifa_addr, ip, sizeof(ip));
+      found = !strcmp(ip, mapped_ip);
+    }
+  }
+  freeifaddrs(ifs);
+  return found;
+}
+
+// the classification from one socket, rtt_ms may be NULL
+static nat_type classify(char *stun_host, uint16_t stun_port,
+                         const char *local_ip, const char *ifname,
+                         uint16_t local_port, char *ext_ip, uint16_t *ext_port,
+                         int *rtt_ms) {
+  int family;
+  struct io_backend *io = nt_pcap_wrap(io_backend_sync());
+  int s = open_stun_socket(local_ip, ifname, local_port, &family);
+  if (s < 0) {
+    return Error;
+  }
+
+  nat_type nat_type;
+  StunAtrAddress mapped;
+  memset(&mapped, 0, sizeof(mapped));
+
+  /*
+   * the tests of RFC 3489 that don't depend on each other go out at once:
+   * the binding request, the one answered from the changed ip and port, and
+   * the one answered from the changed port only. The last two are negative,
+   * the NAT may drop their responses, so they are given up shortly after the
+   * binding request is answered
+   */
+  enum { TEST_BINDING, TEST_CHANGE_IP_PORT, TEST_CHANGE_PORT, N_TESTS };
+  struct stun_test tests[N_TESTS];
+  if (prepare_test(&tests[TEST_BINDING], family, stun_host, stun_port, 0, 0) ||
+      prepare_test(&tests[TEST_CHANGE_IP_PORT], family, stun_host, stun_port,
+                   ChangeIpFlag | ChangePortFlag, 1) ||
+      prepare_test(&tests[TEST_CHANGE_PORT], family, stun_host, stun_port,
+                   ChangePortFlag, 1) ||
+      run_tests(s, tests, N_TESTS) || tests[TEST_BINDING].done != 1) {
     nat_type = Blocked;
     goto cleanup_sock;
   }
 
-  mapped_ip = bind_result[0].addr.ipv4; // in host byte order
-  mapped_port = bind_result[0].port;
-  uint32_t changed_ip = bind_result[1].addr.ipv4;
-  uint16_t changed_port = bind_result[1].port;
+  mapped = tests[TEST_BINDING].result[0];
+  StunAtrAddress changed = tests[TEST_BINDING].result[1];
+  if (rtt_ms != NULL) {
+    *rtt_ms = tests[TEST_BINDING].rtt_us > 0
+                  ? (tests[TEST_BINDING].rtt_us + 999) / 1000
+                  : -1;
+  }
 
-  struct in_addr mapped_addr;
-  mapped_addr.s_addr = htonl(mapped_ip);
+  char mapped_ip[IP_STR_LEN];
+  stun_addr_ntop(&mapped, mapped_ip, sizeof(mapped_ip));
 
   /*
    * it's complicated to get the RECEIVER address of UDP packet,
@@ -451,59 +924,135 @@ nat_type detect_nat_type(char *stun_host, uint16_t stun_port,
    * some information about the incoming packets
    */
 
-  /* TODO use getifaddrs() to get interface address,
-   * then compare it with mapped address to determine
-   * if it's open Internet
-   */
-
-  if (!strcmp(local_ip, inet_ntoa(mapped_addr))) {
+  if (is_local_ip(local_ip, mapped_ip)) {
     nat_type = OpenInternet;
     goto cleanup_sock;
-  } else {
-    if (changed_ip != 0 && changed_port != 0) {
-      if (send_bind_request(s, stun_host, stun_port, ChangeIpFlag,
-                            ChangePortFlag, bind_result)) {
-        struct in_addr addr = {htonl(changed_ip)};
-        char *alt_host = inet_ntoa(addr);
-
-        memset(bind_result, 0, sizeof(StunAtrAddress) * 2);
-
-        if (send_bind_request(s, alt_host, changed_port, 0, 0, bind_result)) {
-          printf("failed to send request to alterative server\n");
-          nat_type = Error;
-          goto cleanup_sock;
-        }
-
-        if (mapped_ip != bind_result[0].addr.ipv4 ||
-            mapped_port != bind_result[0].port) {
-          nat_type = SymmetricNAT;
-          goto cleanup_sock;
-        }
+  }
+  if (changed.family == 0 || changed.port == 0) {
+    printf("no alterative server, can't detect nat type\n");
+    nat_type = Error;
+    goto cleanup_sock;
+  }
+  if (tests[TEST_CHANGE_IP_PORT].done == 1) {
+    nat_type = FullCone;
+    goto cleanup_sock;
+  }
 
-        if (send_bind_request(s, alt_host, changed_port, 0, ChangePortFlag,
-                              bind_result)) {
-          nat_type = RestricPortNAT;
-          goto cleanup_sock;
-        }
+  // only now, a request to the changed address earlier would have let the
+  // response from there through a restricted NAT
+  char alt_host[IP_STR_LEN];
+  stun_addr_ntop(&changed, alt_host, sizeof(alt_host));
+  StunAtrAddress bind_result[2];
+  memset(bind_result, 0, sizeof(StunAtrAddress) * 2);
+  if (send_bind_request(s, family, alt_host, changed.port, 0, 0,
+                        bind_result)) {
+    printf("failed to send request to alterative server\n");
+    nat_type = Error;
+    goto cleanup_sock;
+  }
 
-        nat_type = RestricNAT;
-        goto cleanup_sock;
-      } else {
-        nat_type = FullCone;
-        goto cleanup_sock;
-      }
-    } else {
-      printf("no alterative server, can't detect nat type\n");
-      nat_type = Error;
-      goto cleanup_sock;
-    }
+  if (!stun_addr_equal(&mapped, &bind_result[0])) {
+    nat_type = SymmetricNAT;
+  } else if (tests[TEST_CHANGE_PORT].done == 1) {
+    nat_type = RestricNAT;
+  } else {
+    nat_type = RestricPortNAT;
   }
+
 cleanup_sock:
-  close(s);
-  struct in_addr ext_addr;
-  ext_addr.s_addr = htonl(mapped_ip);
-  strcpy(ext_ip, inet_ntoa(ext_addr));
-  *ext_port = mapped_port;
+  io->close(io, s);
+  if (mapped.family != 0) {
+    stun_addr_ntop(&mapped, ext_ip, IP_STR_LEN);
+  } else {
+    strcpy(ext_ip, family == AF_INET6 ? "::" : "0.0.0.0");
+  }
+  *ext_port = mapped.port;
 
   return nat_type;
 }
+
+nat_type detect_nat_type(char *stun_host, uint16_t stun_port,
+                         const char *local_ip, uint16_t local_port,
+                         char *ext_ip, uint16_t *ext_port) {
+  nat_type type = classify(pick_stun_server(stun_host), stun_port, local_ip,
+                           NULL, local_port, ext_ip, ext_port, NULL);
+  save_rtts();
+  return type;
+}
+
+struct uplink {
+  pthread_t thread;
+  char *stun_host;
+  uint16_t stun_port;
+  uint16_t local_port;
+  struct nat_candidate c;
+};
+
+static void *classify_uplink(void *arg) {
+  struct uplink *u = arg;
+  u->c.type = classify(u->stun_host, u->stun_port, u->c.local_ip, u->c.ifname,
+                       u->local_port, u->c.ext_ip, &u->c.ext_port,
+                       &u->c.rtt_ms);
+  return NULL;
+}
+
+// nat_type lists NATs from the least restrictive, an unknown rtt goes last
+static int compare_candidates(const void *a, const void *b) {
+  const struct nat_candidate *x = a, *y = b;
+  if (x->type != y->type) {
+    return x->type < y->type ? -1 : 1;
+  }
+  if (x->rtt_ms < 0 || y->rtt_ms < 0) {
+    return (x->rtt_ms < 0) - (y->rtt_ms < 0);
+  }
+  return x->rtt_ms - y->rtt_ms;
+}
+
+int detect_nat_candidates(char *stun_host, uint16_t stun_port,
+                          uint16_t local_port,
+                          struct nat_candidate *candidates, int max) {
+  struct ifaddrs *ifs, *ifa;
+  if (max <= 0 || getifaddrs(&ifs)) {
+    return -1;
+  }
+  struct uplink *uplinks = calloc(max, sizeof(*uplinks));
+  if (uplinks == NULL) {
+    freeifaddrs(ifs);
+    return -1;
+  }
+  // every uplink asks the same server, so that their rtts compare
+  stun_host = pick_stun_server(stun_host);
+  int i, n = 0;
+  for (ifa = ifs; ifa != NULL && n < max; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET ||
+        !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK)) {
+      continue;
+    }
+    struct uplink *u = &uplinks[n];
+    u->stun_host = stun_host;
+    u->stun_port = stun_port;
+    u->local_port = local_port;
+    snprintf(u->c.ifname, sizeof(u->c.ifname), "%s", ifa->ifa_name);
+    sockaddr_ntop(ifa->ifa_addr, u->c.local_ip, sizeof(u->c.local_ip));
+    if (pthread_create(&u->thread, NULL, classify_uplink, u) == 0) {
+      ++n;
+    }
+  }
+  freeifaddrs(ifs);
+
+  int found = 0;
+  for (i = 0; i < n; ++i) {
+    pthread_join(uplinks[i].thread, NULL);
+    struct nat_candidate *c = &uplinks[i].c;
+    verbose_log("uplink %s %s: %s, %s:%d, rtt %d ms\n", c->ifname,
+                c->local_ip, get_nat_desc(c->type), c->ext_ip, c->ext_port,
+                c->rtt_ms);
+    if (c->type != Blocked && c->type != Error) {
+      candidates[found++] = *c;
+    }
+  }
+  free(uplinks);
+  save_rtts();
+  qsort(candidates, found, sizeof(*candidates), compare_candidates);
+  return found;
+}
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <sys/socket.h>
 
 typedef enum {
     Blocked,
@@ -13,6 +14,10 @@ typedef enum {
 #define DEFAULT_STUN_SERVER_PORT 3478
 #define DEFAULT_LOCAL_PORT 34780
 #define MAX_STUN_MESSAGE_LENGTH 512
+// large enough for a textual IPv6 address, same as INET6_ADDRSTRLEN
+#define IP_STR_LEN 46
+// same as IFNAMSIZ
+#define IFNAME_LEN 16
 
 // const static constants cannot be used in case label
 #define MappedAddress 0x0001
@@ -79,7 +84,44 @@ char* encode32(char* buf, uint32_t data);
 char* encode(char* buf, const char* data, unsigned int length);
 extern int verbose;
 
+// the address family of the detection follows local_host, ext_ip should have
+// room for IP_STR_LEN bytes
 nat_type detect_nat_type(char* stun_host, uint16_t stun_port, const char* local_host, uint16_t local_port, char* ext_ip, uint16_t* ext_port);
+// a single binding request, used to learn the mapped address without
+// classifying the NAT, returns 0 on success
+int stun_get_mapped_address(char* stun_host, uint16_t stun_port, const char* local_host, uint16_t local_port, char* ext_ip, uint16_t* ext_port);
+
+// the NAT behind one uplink of the host
+struct nat_candidate {
+    char ifname[IFNAME_LEN];
+    char local_ip[IP_STR_LEN];
+    char ext_ip[IP_STR_LEN];
+    uint16_t ext_port;
+    nat_type type;
+    // of the binding request, -1 if it had to be retransmitted
+    int rtt_ms;
+};
+
+// classifies the NAT of every IPv4 interface that is up, loopback aside, all
+// at once, each from a socket bound to the interface with SO_BINDTODEVICE.
+// Fills at most max candidates, the least restrictive NAT first and the
+// lowest rtt among equals, Blocked and Error ones are left out. Returns their
+// number, -1 if the interfaces can't be listed
+int detect_nat_candidates(char* stun_host, uint16_t stun_port, uint16_t local_port, struct nat_candidate* candidates, int max);
+
+// the address of the STUN server in family, a public one picked at random
+// when stun_host is NULL. Returns its length, 0 if it can't be resolved
+socklen_t stun_server_address(char* stun_host, uint16_t stun_port, int family, struct sockaddr_storage* addr);
+// for callers running their own sockets: a binding request written to req,
+// which needs room for a StunHeader, and the mapped port of a response to
+// it, 0 if buf is something else. Returns the length of the request
+size_t stun_binding_request(char* req);
+uint16_t stun_mapped_port(const char* req, char* buf, size_t len);
+
+// retransmissions of binding requests start at the rto estimated from the
+// rtts of earlier requests to the server, kept in path between runs.
+// $HOME/.nat_traversal_stun_rtt by default, NULL keeps them in memory only
+void stun_rtt_file(const char* path);
 
 const char* get_nat_desc(nat_type type);
 void gen_random_string(char *s, const int len);
@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "nt_daemon.h"
+#include "utils.h"
+
+int ntd_open(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path != NULL ? path : NTD_DEFAULT_PATH,
+          sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+    verbose_log("failed to reach nat_traversald at %s, error: %s\n",
+                addr.sun_path, strerror(errno));
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// the reply and the socket passed with it, *fd is -1 if none came
+static int recv_reply(int ntd, struct ntd_reply *reply, int *fd, int flags) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {reply, sizeof(*reply)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  *fd = -1;
+  ssize_t n;
+  do {
+    n = recvmsg(ntd, &msg, MSG_CMSG_CLOEXEC | flags);
+  } while (n < 0 && errno == EINTR);
+  if (n != sizeof(*reply)) {
+    return -1;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+  return 0;
+}
+
+static int request(int ntd, const struct ntd_request *req, uint32_t *peer_id,
+                   int *reason) {
+  if (send(ntd, req, sizeof(*req), MSG_NOSIGNAL) != sizeof(*req)) {
+    return -1;
+  }
+  struct ntd_reply reply;
+  int fd;
+  for (;;) {
+    if (recv_reply(ntd, &reply, &fd, 0) < 0) {
+      return -1;
+    }
+    if (reply.op != NTD_SWAP) {
+      break;
+    }
+    verbose_log("path change for peer %d dropped\n", reply.peer_id);
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  if (reply.status != 0 && fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  if (reason != NULL) {
+    *reason = reply.status;
+  }
+  if (peer_id != NULL) {
+    *peer_id = reply.peer_id;
+  }
+  return fd;
+}
+
+int ntd_connect(int ntd, uint32_t peer_id, int *reason) {
+  struct ntd_request req;
+  memset(&req, 0, sizeof(req));
+  req.op = NTD_CONNECT;
+  req.peer_id = peer_id;
+  return request(ntd, &req, NULL, reason);
+}
+
+int ntd_connect_from_meta(int ntd, const char *peer_meta, int *reason) {
+  struct ntd_request req;
+  memset(&req, 0, sizeof(req));
+  if (strlen(peer_meta) > UINT8_MAX) {
+    return -1;
+  }
+  req.op = NTD_CONNECT_META;
+  strcpy(req.meta, peer_meta);
+  return request(ntd, &req, NULL, reason);
+}
+
+int ntd_accept(int ntd, uint32_t *peer_id) {
+  struct ntd_request req;
+  memset(&req, 0, sizeof(req));
+  req.op = NTD_ACCEPT;
+  return request(ntd, &req, peer_id, NULL);
+}
+
+int ntd_failover(int ntd, uint32_t peer_id) {
+  struct ntd_request req;
+  memset(&req, 0, sizeof(req));
+  req.op = NTD_FAILOVER;
+  req.peer_id = peer_id;
+  return request(ntd, &req, NULL, NULL);
+}
+
+int ntd_swapped(int ntd, uint32_t *peer_id) {
+  struct ntd_reply reply;
+  int fd;
+  while (recv_reply(ntd, &reply, &fd, MSG_DONTWAIT) == 0) {
+    if (reply.op == NTD_SWAP && reply.status == 0 && fd >= 0) {
+      *peer_id = reply.peer_id;
+      return fd;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  return -1;
+}
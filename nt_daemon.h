@@ -0,0 +1,54 @@
+#include <stdint.h>
+
+/*
+ * nat_traversald detects the NAT, enrolls and keeps the connection to the
+ * punch server once per host. Local applications ask it for peers over a
+ * Unix socket and get back UDP sockets already connected to them, passed with
+ * SCM_RIGHTS.
+ *
+ * Every request and reply is one SOCK_SEQPACKET message. The helpers below
+ * block, one request at a time per daemon connection. Between replies the
+ * daemon sends NTD_SWAP messages unasked, with a better socket to a peer it
+ * handed over before: the direct path once a relayed one was punched.
+ */
+
+#define NTD_DEFAULT_PATH "/tmp/nat_traversald.sock"
+
+enum ntd_op {
+  NTD_CONNECT = 1,      // traverse to peer_id
+  NTD_CONNECT_META = 2, // traverse to the peer enrolled with meta
+  NTD_ACCEPT = 3,       // take the next connection a peer starts to this host
+  NTD_SWAP = 4,         // from the daemon, a socket in place of peer_id's
+  NTD_FAILOVER = 5,     // a standby path to peer_id, see nt_failover()
+};
+
+struct ntd_request {
+  uint8_t op;
+  uint32_t peer_id;
+  char meta[UINT8_MAX + 1];
+};
+
+struct ntd_reply {
+  // 0 with the socket attached, otherwise an nt_error
+  int32_t status;
+  uint32_t peer_id;
+  // the request answered, or NTD_SWAP
+  uint8_t op;
+};
+
+// connects to the daemon listening at path, NULL for NTD_DEFAULT_PATH
+int ntd_open(const char *path);
+// a UDP socket connected to the peer, -1 if the traversal failed. *reason, if
+// not NULL, gets the nt_error then
+int ntd_connect(int ntd, uint32_t peer_id, int *reason);
+int ntd_connect_from_meta(int ntd, const char *peer_meta, int *reason);
+// waits for a peer to connect to this host, *peer_id gets its id
+int ntd_accept(int ntd, uint32_t *peer_id);
+// a standby path to a peer the daemon handed to this connection, once the one
+// in use went silent. peer_id 0 takes the peer of a connection that holds
+// one. -1 if the daemon keeps none, the daemon needs -k for standbys
+int ntd_failover(int ntd, uint32_t peer_id);
+// a socket the daemon sent to replace the one it handed over for *peer_id,
+// -1 if none is waiting. Doesn't block, poll ntd for POLLIN. Swaps coming
+// while a request waits for its reply are dropped, the old path still works
+int ntd_swapped(int ntd, uint32_t *peer_id);
@@ -0,0 +1,685 @@
+#define _GNU_SOURCE // struct mmsghdr
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_backend.h"
+#include "nt_pcap.h"
+#include "utils.h"
+
+// records in flight, a power of two
+#define RING_SLOTS 4096
+// bytes of payload kept per datagram, probes and path messages fit
+#define SNAPLEN 256
+// sockets with a descriptor above this are recorded without attempt or ttl
+#define MAX_FDS 65536
+#define FLUSH_INTERVAL_NS (10 * 1000 * 1000)
+
+// pcapng blocks and options
+#define SHB_TYPE 0x0a0d0d0a
+#define IDB_TYPE 1
+#define EPB_TYPE 6
+#define LINKTYPE_RAW 101
+#define OPT_COMMENT 1
+#define OPT_EPB_FLAGS 2
+#define OPT_IF_TSRESOL 9
+#define EPB_INBOUND 1
+#define EPB_OUTBOUND 2
+
+// addresses of a socket the recorder has, and those a record still lacks
+#define ADDR_LOCAL 1
+#define ADDR_PEER 2
+
+struct record {
+  // the slot is free for the producer at position seq, and holds the record
+  // of position seq - 1 for the writer
+  uint64_t seq;
+  int64_t ns;
+  int fd;
+  uint32_t attempt;
+  int ttl; // -1 if unknown
+  // of the fd_info when recorded, ADDR_* the writer looks up
+  uint32_t gen;
+  uint8_t missing;
+  uint8_t out;
+  uint8_t family;
+  uint8_t local[16];
+  uint8_t peer[16];
+  uint16_t local_port; // network byte order
+  uint16_t peer_port;
+  uint16_t len;
+  uint16_t caplen;
+  char data[SNAPLEN];
+};
+
+// what the recorder knows of a socket. The addresses are learned at bind
+// and connect time, so that recording a datagram takes no syscall
+struct fd_info {
+  uint32_t attempt;
+  int ttl; // set with setsockopt(), -1 for the default
+  // bumped whenever the descriptor may hold another socket
+  uint32_t gen;
+  uint8_t known; // ADDR_*
+  uint8_t family;
+  uint16_t local_port; // network byte order
+  uint16_t peer_port;
+  uint8_t local[16];
+  uint8_t peer[16];
+};
+
+struct recorder {
+  FILE *f;
+  pthread_t thread;
+  int stop;
+  // next position of producers and of the writer
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  // producers between enter() and leave(), close waits for them before it
+  // frees the ring and fds
+  int in_flight;
+  struct record *ring;
+  struct fd_info *fds;
+};
+
+static struct recorder rec;
+static int recording;
+static __thread uint32_t current_attempt;
+
+struct pcap_backend {
+  struct io_backend base;
+  struct io_backend *inner;
+};
+
+// 0 once recording stopped, otherwise the ring and fds stay until leave()
+static int enter(void) {
+  if (!__atomic_load_n(&recording, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+  __atomic_add_fetch(&rec.in_flight, 1, __ATOMIC_SEQ_CST);
+  // checked again, close may have missed the count
+  if (!__atomic_load_n(&recording, __ATOMIC_SEQ_CST)) {
+    __atomic_sub_fetch(&rec.in_flight, 1, __ATOMIC_RELEASE);
+    return 0;
+  }
+  return 1;
+}
+
+static void leave(void) {
+  __atomic_sub_fetch(&rec.in_flight, 1, __ATOMIC_RELEASE);
+}
+
+static struct fd_info *fd_info(int fd) {
+  return fd >= 0 && fd < MAX_FDS ? &rec.fds[fd] : NULL;
+}
+
+// the ip and port of addr, 0 if its family isn't family
+static int split_addr(const struct sockaddr *addr, int family, uint8_t *ip,
+                      uint16_t *port) {
+  if (addr == NULL || addr->sa_family != family) {
+    return 0;
+  }
+  if (family == AF_INET6) {
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)addr;
+    memcpy(ip, &a->sin6_addr, 16);
+    *port = a->sin6_port;
+  } else {
+    const struct sockaddr_in *a = (const struct sockaddr_in *)addr;
+    memcpy(ip, &a->sin_addr, 4);
+    *port = a->sin_port;
+  }
+  return 1;
+}
+
+// a free slot, NULL once the writer falls a whole ring behind
+static struct record *claim(uint64_t *pos) {
+  uint64_t p = __atomic_load_n(&rec.head, __ATOMIC_RELAXED);
+  for (;;) {
+    struct record *r = &rec.ring[p & (RING_SLOTS - 1)];
+    int64_t diff =
+        (int64_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - p);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&rec.head, &p, p + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos = p;
+        return r;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      p = __atomic_load_n(&rec.head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// peer is NULL on a connected socket, the addresses come from fd_info
+static void record(int out, int fd, int64_t ns, int ttl,
+                   const struct sockaddr *peer, const struct iovec *iov,
+                   size_t iovlen, size_t len) {
+  if (!enter()) {
+    return;
+  }
+  uint64_t pos;
+  struct record *r = claim(&pos);
+  if (r == NULL) {
+    __atomic_add_fetch(&rec.dropped, 1, __ATOMIC_RELAXED);
+    leave();
+    return;
+  }
+  struct fd_info *info = fd_info(fd);
+  uint8_t known = info != NULL ? info->known : 0;
+  r->ns = ns;
+  r->fd = fd;
+  r->attempt = info != NULL ? info->attempt : 0;
+  r->ttl = ttl >= 0 ? ttl : out && info != NULL ? info->ttl : -1;
+  r->gen = info != NULL ? __atomic_load_n(&info->gen, __ATOMIC_RELAXED) : 0;
+  r->missing = 0;
+  r->out = out;
+  r->family = peer != NULL ? peer->sa_family
+              : known   ? info->family
+                        : AF_INET;
+  r->family = r->family == AF_INET6 ? AF_INET6 : AF_INET;
+  memset(r->local, 0, sizeof(r->local));
+  memset(r->peer, 0, sizeof(r->peer));
+  r->local_port = r->peer_port = 0;
+  if ((known & ADDR_LOCAL) && info->family == r->family) {
+    memcpy(r->local, info->local, sizeof(r->local));
+    r->local_port = info->local_port;
+  } else {
+    r->missing |= ADDR_LOCAL;
+  }
+  if (peer != NULL) {
+    split_addr(peer, r->family, r->peer, &r->peer_port);
+  } else if ((known & ADDR_PEER) && info->family == r->family) {
+    memcpy(r->peer, info->peer, sizeof(r->peer));
+    r->peer_port = info->peer_port;
+  } else {
+    r->missing |= ADDR_PEER;
+  }
+  r->len = len > UINT16_MAX ? UINT16_MAX : len;
+  r->caplen = 0;
+  size_t i;
+  for (i = 0; i < iovlen && r->caplen < len && r->caplen < SNAPLEN; ++i) {
+    size_t n = iov[i].iov_len;
+    if (n > len - r->caplen) {
+      n = len - r->caplen;
+    }
+    if (n > SNAPLEN - r->caplen) {
+      n = SNAPLEN - r->caplen;
+    }
+    memcpy(r->data + r->caplen, iov[i].iov_base, n);
+    r->caplen += n;
+  }
+  __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+  leave();
+}
+
+static void record_buf(int out, int fd, int ttl, const struct sockaddr *peer,
+                       const void *buf, size_t len) {
+  struct iovec iov = {(void *)buf, len};
+  record(out, fd, wall_ns(), ttl, peer, &iov, 1, len);
+}
+
+static void put32(FILE *f, uint32_t v) { fwrite(&v, sizeof(v), 1, f); }
+
+static void put_option(FILE *f, uint16_t code, const void *value,
+                       uint16_t len) {
+  static const char pad[4];
+  uint16_t hdr[2] = {code, len};
+  fwrite(hdr, sizeof(hdr), 1, f);
+  if (len > 0) {
+    fwrite(value, 1, len, f);
+    fwrite(pad, 1, -len & 3, f);
+  }
+}
+
+static void write_header(FILE *f) {
+  // section header: byte order magic, version 1.0, unknown section length
+  put32(f, SHB_TYPE);
+  put32(f, 28);
+  put32(f, 0x1a2b3c4d);
+  put32(f, 1);
+  put32(f, 0xffffffff);
+  put32(f, 0xffffffff);
+  put32(f, 28);
+  // one interface of raw IP packets, timestamps in nanoseconds
+  uint8_t tsresol = 9;
+  put32(f, IDB_TYPE);
+  put32(f, 32);
+  put32(f, LINKTYPE_RAW);
+  put32(f, 0);
+  put_option(f, OPT_IF_TSRESOL, &tsresol, 1);
+  put_option(f, 0, NULL, 0);
+  put32(f, 32);
+}
+
+static uint16_t ip_checksum(const uint8_t *hdr, size_t len) {
+  uint32_t sum = 0;
+  size_t i;
+  for (i = 0; i < len; i += 2) {
+    sum += hdr[i] << 8 | hdr[i + 1];
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return htons(~sum);
+}
+
+// the addresses the sending thread didn't have, a punch socket gets its port
+// with the probe. Looked up here, off the burst, as long as the descriptor
+// still holds the socket of the record
+static void resolve(struct record *r) {
+  struct fd_info *info = fd_info(r->fd);
+  if (info == NULL || __atomic_load_n(&info->gen, __ATOMIC_ACQUIRE) != r->gen) {
+    return;
+  }
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if ((r->missing & ADDR_PEER) &&
+      getpeername(r->fd, (struct sockaddr *)&addr, &len) == 0 &&
+      split_addr((struct sockaddr *)&addr, addr.ss_family, r->peer,
+                 &r->peer_port)) {
+    r->family = addr.ss_family;
+  }
+  len = sizeof(addr);
+  if (r->missing & ADDR_LOCAL) {
+    getsockname(r->fd, (struct sockaddr *)&addr, &len);
+    split_addr((struct sockaddr *)&addr, r->family, r->local, &r->local_port);
+  }
+  if (__atomic_load_n(&info->gen, __ATOMIC_ACQUIRE) != r->gen) {
+    // closed meanwhile, what was looked up may belong to another socket
+    if (r->missing & ADDR_PEER) {
+      memset(r->peer, 0, sizeof(r->peer));
+      r->peer_port = 0;
+    }
+    if (r->missing & ADDR_LOCAL) {
+      memset(r->local, 0, sizeof(r->local));
+      r->local_port = 0;
+    }
+  }
+}
+
+// the packet as the wire would have it: IP header, UDP header, payload
+static size_t build_packet(const struct record *r, uint8_t *pkt) {
+  const uint8_t *src = r->out ? r->local : r->peer;
+  const uint8_t *dst = r->out ? r->peer : r->local;
+  uint16_t sport = r->out ? r->local_port : r->peer_port;
+  uint16_t dport = r->out ? r->peer_port : r->local_port;
+  uint8_t ttl = r->ttl >= 0 ? r->ttl : 64;
+  uint16_t udp_len = htons(8 + r->len);
+  size_t ip_len;
+  if (r->family == AF_INET6) {
+    ip_len = 40;
+    memset(pkt, 0, ip_len);
+    pkt[0] = 0x60;
+    memcpy(pkt + 4, &udp_len, 2);
+    pkt[6] = IPPROTO_UDP;
+    pkt[7] = ttl;
+    memcpy(pkt + 8, src, 16);
+    memcpy(pkt + 24, dst, 16);
+  } else {
+    ip_len = 20;
+    uint16_t total = htons(20 + 8 + r->len);
+    memset(pkt, 0, ip_len);
+    pkt[0] = 0x45;
+    memcpy(pkt + 2, &total, 2);
+    pkt[8] = ttl;
+    pkt[9] = IPPROTO_UDP;
+    memcpy(pkt + 12, src, 4);
+    memcpy(pkt + 16, dst, 4);
+    uint16_t sum = ip_checksum(pkt, ip_len);
+    memcpy(pkt + 10, &sum, 2);
+  }
+  uint8_t *udp = pkt + ip_len;
+  memcpy(udp, &sport, 2);
+  memcpy(udp + 2, &dport, 2);
+  memcpy(udp + 4, &udp_len, 2);
+  memset(udp + 6, 0, 2);
+  memcpy(udp + 8, r->data, r->caplen);
+  return ip_len + 8 + r->caplen;
+}
+
+static void write_record(FILE *f, const struct record *r) {
+  static const char pad[4];
+  uint8_t pkt[40 + 8 + SNAPLEN];
+  if (r->missing) {
+    resolve((struct record *)r);
+  }
+  size_t caplen = build_packet(r, pkt);
+  size_t origlen = caplen - r->caplen + r->len;
+  char comment[64];
+  int comment_len;
+  if (r->ttl >= 0) {
+    comment_len =
+        snprintf(comment, sizeof(comment), "sock=%d attempt=%u ttl=%d",
+                 r->fd, r->attempt, r->ttl);
+  } else {
+    comment_len = snprintf(comment, sizeof(comment), "sock=%d attempt=%u",
+                           r->fd, r->attempt);
+  }
+  uint32_t flags = r->out ? EPB_OUTBOUND : EPB_INBOUND;
+  uint32_t total = 28 + ((caplen + 3) & ~3) + 4 + 4 + 4 +
+                   ((comment_len + 3) & ~3) + 4 + 4;
+  put32(f, EPB_TYPE);
+  put32(f, total);
+  put32(f, 0);
+  put32(f, (uint64_t)r->ns >> 32);
+  put32(f, (uint32_t)r->ns);
+  put32(f, caplen);
+  put32(f, origlen);
+  fwrite(pkt, 1, caplen, f);
+  fwrite(pad, 1, -caplen & 3, f);
+  put_option(f, OPT_EPB_FLAGS, &flags, sizeof(flags));
+  put_option(f, OPT_COMMENT, comment, comment_len);
+  put_option(f, 0, NULL, 0);
+  put32(f, total);
+}
+
+// writes the committed records, returns how many
+static int drain(void) {
+  int n = 0;
+  for (;;) {
+    struct record *r = &rec.ring[rec.tail & (RING_SLOTS - 1)];
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != rec.tail + 1) {
+      return n;
+    }
+    write_record(rec.f, r);
+    __atomic_store_n(&r->seq, rec.tail + RING_SLOTS, __ATOMIC_RELEASE);
+    ++rec.tail;
+    ++n;
+  }
+}
+
+static void *flush_loop(void *arg) {
+  struct timespec interval = {0, FLUSH_INTERVAL_NS};
+  for (;;) {
+    int stop = __atomic_load_n(&rec.stop, __ATOMIC_ACQUIRE);
+    if (drain() > 0) {
+      continue;
+    }
+    fflush(rec.f);
+    if (stop) {
+      return NULL;
+    }
+    nanosleep(&interval, NULL);
+  }
+}
+
+int nt_pcap_open(const char *path) {
+  if (recording) {
+    return -1;
+  }
+  memset(&rec, 0, sizeof(rec));
+  rec.ring = calloc(RING_SLOTS, sizeof(struct record));
+  rec.fds = malloc(MAX_FDS * sizeof(struct fd_info));
+  rec.f = fopen(path, "wb");
+  if (rec.ring == NULL || rec.fds == NULL || rec.f == NULL) {
+    goto error;
+  }
+  int i;
+  for (i = 0; i < RING_SLOTS; ++i) {
+    rec.ring[i].seq = i;
+  }
+  for (i = 0; i < MAX_FDS; ++i) {
+    memset(&rec.fds[i], 0, sizeof(rec.fds[i]));
+    rec.fds[i].ttl = -1;
+  }
+  write_header(rec.f);
+  if (pthread_create(&rec.thread, NULL, flush_loop, NULL)) {
+    goto error;
+  }
+  __atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+  return 0;
+
+error:
+  if (rec.f != NULL) {
+    fclose(rec.f);
+  }
+  free(rec.ring);
+  free(rec.fds);
+  return -1;
+}
+
+void nt_pcap_close(void) {
+  if (!recording) {
+    return;
+  }
+  __atomic_store_n(&recording, 0, __ATOMIC_SEQ_CST);
+  // records already claimed are committed before the writer stops
+  struct timespec pause = {0, 1000 * 1000};
+  while (__atomic_load_n(&rec.in_flight, __ATOMIC_SEQ_CST) > 0) {
+    nanosleep(&pause, NULL);
+  }
+  __atomic_store_n(&rec.stop, 1, __ATOMIC_RELEASE);
+  pthread_join(rec.thread, NULL);
+  if (rec.dropped > 0) {
+    verbose_log("pcap: %llu packets dropped\n",
+                (unsigned long long)rec.dropped);
+  }
+  fclose(rec.f);
+  free(rec.ring);
+  free(rec.fds);
+}
+
+void nt_pcap_attempt(uint32_t attempt) { current_attempt = attempt; }
+
+// the ttl of received datagrams comes with them
+static void enable_recv_ttl(int fd) {
+  int on = 1;
+  setsockopt(fd, IPPROTO_IP, IP_RECVTTL, &on, sizeof(on));
+  setsockopt(fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on));
+}
+
+static void track(int fd, uint32_t attempt, int ttl) {
+  enable_recv_ttl(fd);
+  if (!enter()) {
+    return;
+  }
+  struct fd_info *info = fd_info(fd);
+  if (info != NULL) {
+    info->attempt = attempt;
+    info->ttl = ttl;
+    info->known = 0;
+    __atomic_add_fetch(&info->gen, 1, __ATOMIC_RELEASE);
+  }
+  leave();
+}
+
+// the local address of a socket just bound or connected, and the peer it
+// was connected to
+static void learn(int fd, const struct sockaddr *peer) {
+  struct sockaddr_storage local;
+  socklen_t len = sizeof(local);
+  if (!enter()) {
+    return;
+  }
+  struct fd_info *info = fd_info(fd);
+  if (info != NULL &&
+      getsockname(fd, (struct sockaddr *)&local, &len) == 0 &&
+      split_addr((struct sockaddr *)&local, local.ss_family, info->local,
+                 &info->local_port)) {
+    info->family = local.ss_family;
+    info->known = ADDR_LOCAL;
+    if (peer != NULL &&
+        split_addr(peer, info->family, info->peer, &info->peer_port)) {
+      info->known |= ADDR_PEER;
+    }
+  }
+  leave();
+}
+
+static struct io_backend *inner(struct io_backend *io) {
+  return ((struct pcap_backend *)io)->inner;
+}
+
+static int pcap_socket(struct io_backend *io, int domain, int type,
+                       int protocol) {
+  int fd = inner(io)->socket(inner(io), domain, type, protocol);
+  if (fd >= 0) {
+    track(fd, current_attempt, -1);
+  }
+  return fd;
+}
+
+static int pcap_setsockopt(struct io_backend *io, int fd, int level,
+                           int optname, const void *optval,
+                           socklen_t optlen) {
+  int res = inner(io)->setsockopt(inner(io), fd, level, optname, optval,
+                                  optlen);
+  if (res == 0 && optlen == sizeof(int) &&
+      ((level == IPPROTO_IP && optname == IP_TTL) ||
+       (level == IPPROTO_IPV6 && optname == IPV6_UNICAST_HOPS)) &&
+      enter()) {
+    struct fd_info *info = fd_info(fd);
+    if (info != NULL) {
+      info->ttl = *(const int *)optval;
+    }
+    leave();
+  }
+  return res;
+}
+
+static int pcap_bind(struct io_backend *io, int fd,
+                     const struct sockaddr *addr, socklen_t addr_len) {
+  int res = inner(io)->bind(inner(io), fd, addr, addr_len);
+  if (res == 0) {
+    learn(fd, NULL);
+  }
+  return res;
+}
+
+static int pcap_connect(struct io_backend *io, int fd,
+                        const struct sockaddr *addr, socklen_t addr_len) {
+  int res = inner(io)->connect(inner(io), fd, addr, addr_len);
+  if (res == 0) {
+    learn(fd, addr);
+  }
+  return res;
+}
+
+static ssize_t pcap_sendto(struct io_backend *io, int fd, const void *buf,
+                           size_t len, int flags, const struct sockaddr *addr,
+                           socklen_t addr_len) {
+  ssize_t n = inner(io)->sendto(inner(io), fd, buf, len, flags, addr,
+                                addr_len);
+  if (n >= 0) {
+    record_buf(1, fd, -1, addr, buf, n);
+  }
+  return n;
+}
+
+static int pcap_sendmmsg(struct io_backend *io, int fd, struct mmsghdr *msgs,
+                         unsigned int vlen, int flags) {
+  int n = inner(io)->sendmmsg(inner(io), fd, msgs, vlen, flags);
+  // the batch leaves in one syscall, its datagrams share the timestamp
+  int64_t ns = wall_ns();
+  int i;
+  for (i = 0; i < n; ++i) {
+    struct msghdr *msg = &msgs[i].msg_hdr;
+    record(1, fd, ns, -1, msg->msg_name, msg->msg_iov, msg->msg_iovlen,
+           msgs[i].msg_len);
+  }
+  return n;
+}
+
+// recvmsg() in place of the backend's recvfrom(), for the ttl
+static ssize_t pcap_recvfrom(struct io_backend *io, int fd, void *buf,
+                             size_t len, int flags, struct sockaddr *addr,
+                             socklen_t *addr_len) {
+  struct iovec iov = {buf, len};
+  char control[CMSG_SPACE(sizeof(int)) * 2];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = addr_len != NULL ? *addr_len : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(fd, &msg, flags);
+  if (n < 0) {
+    return n;
+  }
+  if (addr_len != NULL) {
+    *addr_len = msg.msg_namelen;
+  }
+  int ttl = -1;
+  struct cmsghdr *c;
+  for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+    if ((c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_TTL) ||
+        (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_HOPLIMIT)) {
+      memcpy(&ttl, CMSG_DATA(c), sizeof(ttl));
+    }
+  }
+  struct iovec data = {buf, (size_t)n < len ? (size_t)n : len};
+  record(0, fd, wall_ns(), ttl, addr, &data, 1, n);
+  return n;
+}
+
+static int pcap_close(struct io_backend *io, int fd) {
+  track(fd, 0, -1);
+  return inner(io)->close(inner(io), fd);
+}
+
+static int pcap_punch(struct io_backend *io, int epfd, struct punch_op *ops,
+                      int n) {
+  int opened = inner(io)->punch(inner(io), epfd, ops, n);
+  int i;
+  for (i = 0; i < n; ++i) {
+    struct punch_op *op = &ops[i];
+    if (op->fd < 0) {
+      continue;
+    }
+    track(op->fd, op->attempt, op->ttl > 0 ? op->ttl : -1);
+    struct iovec iov = {(void *)&punch_probe, 1};
+    record(1, op->fd, op->sent_ns, -1, (struct sockaddr *)&op->dst, &iov, 1,
+           1);
+  }
+  return opened;
+}
+
+static void pcap_destroy(struct io_backend *io) {
+  struct pcap_backend *p = (struct pcap_backend *)io;
+  p->inner->destroy(p->inner);
+  if (p->inner != io_backend_sync()) {
+    free(p);
+  }
+}
+
+static const struct io_backend pcap_ops = {
+    .name = "pcap",
+    .socket = pcap_socket,
+    .setsockopt = pcap_setsockopt,
+    .bind = pcap_bind,
+    .connect = pcap_connect,
+    .sendto = pcap_sendto,
+    .sendmmsg = pcap_sendmmsg,
+    .recvfrom = pcap_recvfrom,
+    .close = pcap_close,
+    .punch = pcap_punch,
+    .destroy = pcap_destroy,
+};
+
+struct io_backend *nt_pcap_wrap(struct io_backend *io) {
+  // the shared sync backend gets a shared wrapper, it is never destroyed
+  static struct pcap_backend sync_wrapper;
+  if (!recording) {
+    return io;
+  }
+  struct pcap_backend *p;
+  if (io == io_backend_sync()) {
+    p = &sync_wrapper;
+  } else if ((p = malloc(sizeof(*p))) == NULL) {
+    return io;
+  }
+  p->base = pcap_ops;
+  p->base.name = io->name;
+  p->inner = io;
+  return &p->base;
+}
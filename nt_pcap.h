@@ -0,0 +1,24 @@
+#include <stdint.h>
+
+/*
+ * Packet recorder for debugging traversals. Every datagram the client sends
+ * or receives through an I/O backend, STUN tests, punch probes and path
+ * messages alike, is written to a pcapng file with a nanosecond timestamp,
+ * behind a made up IP and UDP header carrying the TTL. The socket, the
+ * attempt and the TTL are in the comment of each packet. Records go through a
+ * lock-free ring to a background thread that writes them out, a full ring
+ * drops records rather than slow the burst down.
+ */
+
+struct io_backend;
+
+// starts recording to path, returns -1 if it can't be created
+int nt_pcap_open(const char *path);
+// writes what is left and closes the file, records other threads are in the
+// middle of are finished first
+void nt_pcap_close(void);
+// a backend recording the I/O of io, or io itself when not recording. The
+// wrapper takes io over, destroying it destroys io too
+struct io_backend *nt_pcap_wrap(struct io_backend *io);
+// sockets this thread opens from now on belong to attempt, 0 for none
+void nt_pcap_attempt(uint32_t attempt);
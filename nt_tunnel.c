@@ -0,0 +1,1253 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg()
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "nt_tunnel.h"
+#include "utils.h"
+
+// datagrams moved per recvmmsg() and sendmmsg()
+#define TUN_BATCH 64
+// largest frame on the hole, header included
+#define TUN_MTU 1400
+#define TUN_MAX_FORWARDS 32
+// segments of a stream in flight, a power of two
+#define TUN_WINDOW 128
+#define TUN_INITIAL_RTO_MS 200
+#define TUN_MIN_RTO_MS 20
+#define TUN_MAX_RTO_MS 2000
+// timers of streams and announcements are checked this often while pending
+#define TUN_TICK_MS 10
+#define TUN_ANNOUNCE_MS 200
+#define TUN_KEEPALIVE_MS 10000
+// the peer is gone after this long without a frame
+#define TUN_DEAD_MS 60000
+// a stream is reset after this long without its data being acknowledged
+#define TUN_STREAM_DEAD_MS 30000
+#define TUN_UDP_IDLE_MS (5 * 60 * 1000)
+// duplicate acks that make the sender go back before its rto
+#define TUN_DUP_ACKS 3
+// socket buffers of the hole, room for the windows of many streams
+#define TUN_SOCK_BUF (4 << 20)
+#define TUN_FLOW_BUCKETS 1024
+#define MAX_EVENTS 64
+
+enum tun_type {
+  TUN_FORWARD = 1, // announces a forward of the sender
+  TUN_FORWARD_ACK,
+  TUN_UDP,  // one datagram of a flow
+  TUN_OPEN, // seq 0 of a stream, the receiver connects to the target
+  TUN_DATA,
+  TUN_FIN,
+  TUN_ACK,
+  TUN_RST,
+  TUN_PING,
+};
+
+// the forward was declared by the sender of the frame
+#define TUN_F_FWD_MINE 1
+// the flow was opened by the sender of the frame
+#define TUN_F_FLOW_MINE 2
+// on an ack, the receiver dropped segments it can take now
+#define TUN_F_RESEND 4
+
+// every frame starts with it, numbers in network byte order. Streams number
+// segments, not bytes, ack is the next segment expected
+struct tun_hdr {
+  char magic[3];
+  uint8_t type;
+  uint8_t flags;
+  uint8_t forward;
+  uint32_t flow;
+  uint32_t seq;
+  uint32_t ack;
+} __attribute__((packed));
+
+#define TUN_HDR sizeof(struct tun_hdr)
+#define TUN_PAYLOAD (TUN_MTU - TUN_HDR)
+// segments filled by one read of a connection
+#define TUN_READ_SEGMENTS 16
+
+struct tun_forward_msg {
+  uint8_t remote;
+  uint8_t proto;
+  char listen_ip[INET6_ADDRSTRLEN];
+  uint16_t listen_port;
+  char target_ip[INET6_ADDRSTRLEN];
+  uint16_t target_port;
+} __attribute__((packed));
+
+// W_DEAD is a flow freed while a batch of events may still name it
+enum watch_kind { W_TUNNEL, W_LISTENER, W_FLOW, W_DEAD };
+
+// epoll data of every descriptor of the tunnel
+struct tun_watch {
+  enum watch_kind kind;
+  void *obj;
+};
+
+struct fwd {
+  struct tun_watch w;
+  struct nt_forward spec;
+  int mine;
+  int index;
+  int used;
+  // the listener when this side listens, otherwise -1
+  int fd;
+  struct sockaddr_storage target;
+  socklen_t target_len;
+  int acked;
+  int64_t announced_at;
+};
+
+struct segment {
+  int64_t sent_at;
+  int retransmitted;
+  // frame length, header included
+  size_t len;
+  char buf[TUN_MTU];
+};
+
+struct flow {
+  struct tun_watch w;
+  struct flow *next;
+  struct flow *next_addr;
+  struct fwd *fwd;
+  uint32_t id;
+  int mine;
+  // the TCP connection or the UDP socket to the target, -1 for UDP flows of a
+  // listener here, which are told apart by client
+  int fd;
+  struct sockaddr_storage client;
+  socklen_t client_len;
+  int64_t active_at;
+
+  // streams only
+  int connecting;
+  int reading;
+  int local_eof;
+  int fin_rcvd;
+  struct segment *tx;
+  uint32_t tx_base;
+  uint32_t tx_next;
+  int rto_ms;
+  int64_t srtt;
+  int64_t rto_at;
+  int64_t progress_at;
+  int dup_acks;
+  uint32_t rx_next;
+  int ack_due;
+  // an in-order segment was dropped for want of room in the connection
+  int dropped;
+  char ack_frame[TUN_HDR];
+  // the rest of a segment the connection didn't take at once
+  char pend[TUN_PAYLOAD];
+  size_t pend_off;
+  size_t pend_len;
+};
+
+struct nt_tunnel {
+  int sock;
+  int epfd;
+  struct tun_watch w;
+  struct fwd mine[TUN_MAX_FORWARDS];
+  struct fwd theirs[TUN_MAX_FORWARDS];
+  int n_mine;
+  struct flow *flows[TUN_FLOW_BUCKETS];
+  struct flow *by_addr[TUN_FLOW_BUCKETS];
+  struct arena_pool flow_pool;
+  // freed flows, back to the pool after the events that may name them
+  struct flow *dead;
+  uint32_t next_flow;
+  int64_t heard_at;
+  int64_t sent_at;
+
+  // frames to the peer, sent with one sendmmsg()
+  struct mmsghdr out[TUN_BATCH];
+  struct iovec out_iov[TUN_BATCH];
+  int n_out;
+  // datagrams to one local socket
+  struct mmsghdr local[TUN_BATCH];
+  struct iovec local_iov[TUN_BATCH];
+  int n_local;
+  int local_fd;
+
+  // receive buffers, payloads land right behind the room for a header so
+  // that they are passed on without copies
+  struct mmsghdr in[TUN_BATCH];
+  struct iovec in_iov[TUN_BATCH];
+  struct sockaddr_storage in_addr[TUN_BATCH];
+  char in_buf[TUN_BATCH][TUN_MTU];
+  // flows owing an ack after a batch
+  struct flow *acks[TUN_BATCH];
+  int n_acks;
+  // consecutive segments of one stream, written to its connection at once
+  // straight from the receive buffers
+  struct flow *gather;
+  struct iovec gather_iov[TUN_BATCH];
+  int n_gather;
+};
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// splits at the last ':' outside brackets, strips the brackets of an IPv6
+// address
+static char *split_last(char *s) {
+  int depth = 0;
+  char *last = NULL, *p;
+  for (p = s; *p; ++p) {
+    if (*p == '[') {
+      ++depth;
+    } else if (*p == ']') {
+      --depth;
+    } else if (*p == ':' && depth == 0) {
+      last = p;
+    }
+  }
+  if (last != NULL) {
+    *last = '\0';
+    return last + 1;
+  }
+  return NULL;
+}
+
+static int copy_ip(char *dst, const char *src) {
+  size_t len = strlen(src);
+  if (len >= 2 && src[0] == '[' && src[len - 1] == ']') {
+    ++src;
+    len -= 2;
+  }
+  if (len == 0 || len >= INET6_ADDRSTRLEN) {
+    return -1;
+  }
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+  return 0;
+}
+
+int nt_parse_forward(const char *spec, int remote, struct nt_forward *fwd) {
+  char buf[4 * INET6_ADDRSTRLEN];
+  memset(fwd, 0, sizeof(*fwd));
+  fwd->remote = remote;
+  fwd->proto = IPPROTO_TCP;
+  if (!strncmp(spec, "udp:", 4)) {
+    fwd->proto = IPPROTO_UDP;
+    spec += 4;
+  } else if (!strncmp(spec, "tcp:", 4)) {
+    spec += 4;
+  }
+  if (strlen(spec) >= sizeof(buf)) {
+    return -1;
+  }
+  strcpy(buf, spec);
+
+  char *target_port = split_last(buf);
+  char *target_ip = target_port != NULL ? split_last(buf) : NULL;
+  if (target_ip == NULL) {
+    return -1;
+  }
+  char *listen_port = split_last(buf);
+  if (listen_port == NULL) {
+    listen_port = buf;
+    strcpy(fwd->listen_ip, "127.0.0.1");
+  } else if (copy_ip(fwd->listen_ip, buf) < 0) {
+    return -1;
+  }
+  if (copy_ip(fwd->target_ip, target_ip) < 0) {
+    return -1;
+  }
+  fwd->listen_port = atoi(listen_port);
+  fwd->target_port = atoi(target_port);
+  if (!fwd->listen_port || !fwd->target_port) {
+    return -1;
+  }
+  struct sockaddr_storage addr;
+  if (!make_sockaddr(fwd->listen_ip, 0, &addr) ||
+      !make_sockaddr(fwd->target_ip, 0, &addr)) {
+    return -1;
+  }
+  return 0;
+}
+
+static void watch(nt_tunnel *t, int fd, uint32_t events, struct tun_watch *w,
+                  int op) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = w;
+  epoll_ctl(t->epfd, op, fd, &ev);
+}
+
+static void flush_out(nt_tunnel *t) {
+  int sent = 0;
+  while (sent < t->n_out) {
+    int n = sendmmsg(t->sock, t->out + sent, t->n_out - sent, 0);
+    if (n <= 0) {
+      // a full socket buffer drops the frames like the path would, streams
+      // send them again
+      verbose_log("tunnel dropped %d frames\n", t->n_out - sent);
+      break;
+    }
+    sent += n;
+  }
+  if (t->n_out > 0) {
+    t->sent_at = now_ms();
+  }
+  t->n_out = 0;
+}
+
+// the frame has to stay valid until flush_out()
+static void queue_out(nt_tunnel *t, void *frame, size_t len) {
+  if (t->n_out == TUN_BATCH) {
+    flush_out(t);
+  }
+  t->out_iov[t->n_out].iov_base = frame;
+  t->out_iov[t->n_out].iov_len = len;
+  memset(&t->out[t->n_out].msg_hdr, 0, sizeof(struct msghdr));
+  t->out[t->n_out].msg_hdr.msg_iov = &t->out_iov[t->n_out];
+  t->out[t->n_out].msg_hdr.msg_iovlen = 1;
+  ++t->n_out;
+}
+
+static void flush_local(nt_tunnel *t) {
+  int sent = 0;
+  while (sent < t->n_local) {
+    int n = sendmmsg(t->local_fd, t->local + sent, t->n_local - sent, 0);
+    if (n <= 0) {
+      break;
+    }
+    sent += n;
+  }
+  t->n_local = 0;
+}
+
+// a datagram to a local socket, to addr unless the socket is connected
+static void queue_local(nt_tunnel *t, int fd, void *buf, size_t len,
+                        struct sockaddr_storage *addr, socklen_t addr_len) {
+  if (t->n_local == TUN_BATCH || (t->n_local > 0 && t->local_fd != fd)) {
+    flush_local(t);
+  }
+  t->local_fd = fd;
+  t->local_iov[t->n_local].iov_base = buf;
+  t->local_iov[t->n_local].iov_len = len;
+  struct msghdr *m = &t->local[t->n_local].msg_hdr;
+  memset(m, 0, sizeof(*m));
+  m->msg_iov = &t->local_iov[t->n_local];
+  m->msg_iovlen = 1;
+  m->msg_name = addr;
+  m->msg_namelen = addr_len;
+  ++t->n_local;
+}
+
+static void fill_hdr(char *buf, uint8_t type, const struct flow *f,
+                     uint32_t seq, uint32_t ack) {
+  struct tun_hdr *h = (struct tun_hdr *)buf;
+  memcpy(h->magic, "ntt", 3);
+  h->type = type;
+  h->flags = (f->fwd->mine ? TUN_F_FWD_MINE : 0) |
+             (f->mine ? TUN_F_FLOW_MINE : 0);
+  h->forward = f->fwd->index;
+  h->flow = htonl(f->id);
+  h->seq = htonl(seq);
+  h->ack = htonl(ack);
+}
+
+static void send_ctl(nt_tunnel *t, uint8_t type, uint8_t flags, uint8_t index,
+                     uint32_t flow, const void *payload, size_t len) {
+  char buf[TUN_MTU];
+  struct tun_hdr *h = (struct tun_hdr *)buf;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, "ntt", 3);
+  h->type = type;
+  h->flags = flags;
+  h->forward = index;
+  h->flow = htonl(flow);
+  memcpy(buf + TUN_HDR, payload, len);
+  flush_out(t);
+  send(t->sock, buf, TUN_HDR + len, 0);
+  t->sent_at = now_ms();
+}
+
+static unsigned int flow_bucket(uint32_t id, int mine) {
+  return (id * 2654435761u + mine) % TUN_FLOW_BUCKETS;
+}
+
+static unsigned int addr_bucket(const struct sockaddr_storage *addr,
+                                socklen_t len) {
+  uint32_t h = 2166136261u;
+  const unsigned char *p = (const unsigned char *)addr;
+  socklen_t i;
+  for (i = 0; i < len; ++i) {
+    h = (h ^ p[i]) * 16777619u;
+  }
+  return h % TUN_FLOW_BUCKETS;
+}
+
+static struct flow *find_flow(nt_tunnel *t, uint32_t id, int mine) {
+  struct flow *f;
+  for (f = t->flows[flow_bucket(id, mine)]; f != NULL; f = f->next) {
+    if (f->id == id && f->mine == mine) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+static struct flow *find_client(nt_tunnel *t, struct fwd *fwd,
+                                struct sockaddr_storage *addr,
+                                socklen_t len) {
+  struct flow *f;
+  for (f = t->by_addr[addr_bucket(addr, len)]; f != NULL; f = f->next_addr) {
+    if (f->fwd == fwd && f->client_len == len &&
+        !memcmp(&f->client, addr, len)) {
+      return f;
+    }
+  }
+  return NULL;
+}
+
+static struct flow *new_flow(nt_tunnel *t, struct fwd *fwd, uint32_t id,
+                             int mine, int fd) {
+  struct flow *f = arena_pool_get(&t->flow_pool);
+  if (f == NULL) {
+    return NULL;
+  }
+  memset(f, 0, sizeof(*f));
+  f->w.kind = W_FLOW;
+  f->w.obj = f;
+  f->fwd = fwd;
+  f->id = id;
+  f->mine = mine;
+  f->fd = fd;
+  f->active_at = now_ms();
+  f->rto_ms = TUN_INITIAL_RTO_MS;
+  if (fwd->spec.proto == IPPROTO_TCP) {
+    f->tx = malloc(TUN_WINDOW * sizeof(struct segment));
+    if (f->tx == NULL) {
+      arena_pool_put(&t->flow_pool, f);
+      return NULL;
+    }
+  }
+  unsigned int b = flow_bucket(id, mine);
+  f->next = t->flows[b];
+  t->flows[b] = f;
+  return f;
+}
+
+static void free_flow(nt_tunnel *t, struct flow *f) {
+  // queued frames may point into the flow
+  flush_out(t);
+  struct flow **p;
+  for (p = &t->flows[flow_bucket(f->id, f->mine)]; *p != NULL;
+       p = &(*p)->next) {
+    if (*p == f) {
+      *p = f->next;
+      break;
+    }
+  }
+  if (f->client_len > 0) {
+    for (p = &t->by_addr[addr_bucket(&f->client, f->client_len)]; *p != NULL;
+         p = &(*p)->next_addr) {
+      if (*p == f) {
+        *p = f->next_addr;
+        break;
+      }
+    }
+  }
+  int i;
+  for (i = 0; i < t->n_acks; ++i) {
+    if (t->acks[i] == f) {
+      t->acks[i] = NULL;
+    }
+  }
+  if (t->gather == f) {
+    t->gather = NULL;
+    t->n_gather = 0;
+  }
+  if (f->fd >= 0) {
+    close(f->fd);
+    f->fd = -1;
+  }
+  free(f->tx);
+  f->tx = NULL;
+  f->w.kind = W_DEAD;
+  f->next = t->dead;
+  t->dead = f;
+}
+
+static void reap_flows(nt_tunnel *t) {
+  struct flow *f;
+  while ((f = t->dead) != NULL) {
+    t->dead = f->next;
+    arena_pool_put(&t->flow_pool, f);
+  }
+}
+
+static void reset_flow(nt_tunnel *t, struct flow *f) {
+  char buf[TUN_HDR];
+  fill_hdr(buf, TUN_RST, f, 0, 0);
+  flush_out(t);
+  send(t->sock, buf, sizeof(buf), 0);
+  free_flow(t, f);
+}
+
+static int open_socket(int family, int type) {
+  return socket(family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+static int open_listener(nt_tunnel *t, struct fwd *fwd) {
+  struct sockaddr_storage addr;
+  socklen_t len =
+      make_sockaddr(fwd->spec.listen_ip, fwd->spec.listen_port, &addr);
+  int udp = fwd->spec.proto == IPPROTO_UDP;
+  fwd->fd = open_socket(addr.ss_family, udp ? SOCK_DGRAM : SOCK_STREAM);
+  if (fwd->fd < 0) {
+    return -1;
+  }
+  int reuse = 1;
+  setsockopt(fwd->fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (bind(fwd->fd, (struct sockaddr *)&addr, len) ||
+      (!udp && listen(fwd->fd, SOMAXCONN))) {
+    verbose_log("failed to listen on %s:%d\n", fwd->spec.listen_ip,
+                fwd->spec.listen_port);
+    close(fwd->fd);
+    fwd->fd = -1;
+    return -1;
+  }
+  fwd->w.kind = W_LISTENER;
+  fwd->w.obj = fwd;
+  watch(t, fwd->fd, EPOLLIN, &fwd->w, EPOLL_CTL_ADD);
+  return 0;
+}
+
+// sets up a forward of either side: this side listens, or connects to the
+// target once a flow of the peer shows up
+static int setup_forward(nt_tunnel *t, struct fwd *fwd) {
+  int listens = fwd->mine ? !fwd->spec.remote : fwd->spec.remote;
+  fwd->used = 1;
+  fwd->fd = -1;
+  if (listens) {
+    return open_listener(t, fwd);
+  }
+  fwd->target_len = make_sockaddr(fwd->spec.target_ip, fwd->spec.target_port,
+                                  &fwd->target);
+  return fwd->target_len ? 0 : -1;
+}
+
+static void announce(nt_tunnel *t, struct fwd *fwd) {
+  struct tun_forward_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.remote = fwd->spec.remote;
+  msg.proto = fwd->spec.proto;
+  strcpy(msg.listen_ip, fwd->spec.listen_ip);
+  msg.listen_port = htons(fwd->spec.listen_port);
+  strcpy(msg.target_ip, fwd->spec.target_ip);
+  msg.target_port = htons(fwd->spec.target_port);
+  send_ctl(t, TUN_FORWARD, TUN_F_FWD_MINE, fwd->index, 0, &msg, sizeof(msg));
+  fwd->announced_at = now_ms();
+}
+
+static void setup_sock(int sock) {
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  int buf_size = TUN_SOCK_BUF;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+}
+
+nt_tunnel *nt_tunnel_new(int sock, const struct nt_forward *forwards, int n) {
+  if (n > TUN_MAX_FORWARDS) {
+    return NULL;
+  }
+  nt_tunnel *t = calloc(1, sizeof(*t));
+  if (t == NULL) {
+    return NULL;
+  }
+  t->sock = sock;
+  t->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (t->epfd < 0) {
+    free(t);
+    return NULL;
+  }
+  setup_sock(sock);
+  arena_pool_init(&t->flow_pool, sizeof(struct flow), 256);
+  t->w.kind = W_TUNNEL;
+  t->w.obj = t;
+  watch(t, sock, EPOLLIN, &t->w, EPOLL_CTL_ADD);
+  t->heard_at = now_ms();
+
+  int i;
+  for (i = 0; i < TUN_BATCH; ++i) {
+    t->in_iov[i].iov_base = t->in_buf[i];
+    t->in_iov[i].iov_len = TUN_MTU;
+  }
+  for (i = 0; i < n; ++i) {
+    struct fwd *fwd = &t->mine[i];
+    fwd->spec = forwards[i];
+    fwd->mine = 1;
+    fwd->index = i;
+    if (setup_forward(t, fwd) < 0) {
+      nt_tunnel_free(t);
+      return NULL;
+    }
+    announce(t, fwd);
+  }
+  t->n_mine = n;
+  return t;
+}
+
+void nt_tunnel_free(nt_tunnel *t) {
+  int i;
+  struct flow *f;
+  for (i = 0; i < TUN_FLOW_BUCKETS; ++i) {
+    while ((f = t->flows[i]) != NULL) {
+      free_flow(t, f);
+    }
+  }
+  reap_flows(t);
+  for (i = 0; i < TUN_MAX_FORWARDS; ++i) {
+    if (t->mine[i].used && t->mine[i].fd >= 0) {
+      close(t->mine[i].fd);
+    }
+    if (t->theirs[i].used && t->theirs[i].fd >= 0) {
+      close(t->theirs[i].fd);
+    }
+  }
+  arena_pool_destroy(&t->flow_pool);
+  close(t->epfd);
+  close(t->sock);
+  free(t);
+}
+
+int nt_tunnel_fd(nt_tunnel *t) { return t->epfd; }
+
+void nt_tunnel_swap(nt_tunnel *t, int sock) {
+  // frames already queued go out the old path
+  flush_out(t);
+  epoll_ctl(t->epfd, EPOLL_CTL_DEL, t->sock, NULL);
+  close(t->sock);
+  t->sock = sock;
+  setup_sock(sock);
+  watch(t, sock, EPOLLIN, &t->w, EPOLL_CTL_ADD);
+  t->heard_at = now_ms();
+  verbose_log("tunnel moved to another path\n");
+  // the first frame on a standby tells the peer to move too
+  send_ctl(t, TUN_PING, 0, 0, 0, NULL, 0);
+}
+
+// read the connection while the window has room
+static void set_reading(nt_tunnel *t, struct flow *f) {
+  if (f->local_eof && f->fin_rcvd && f->pend_len == 0) {
+    // closed both ways, a hung up socket would be ready forever
+    epoll_ctl(t->epfd, EPOLL_CTL_DEL, f->fd, NULL);
+    return;
+  }
+  int reading = !f->connecting && !f->local_eof &&
+                f->tx_next - f->tx_base < TUN_WINDOW;
+  int writing = f->connecting || f->pend_len > 0 || f->dropped;
+  watch(t, f->fd, (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0), &f->w,
+        EPOLL_CTL_MOD);
+  f->reading = reading;
+}
+
+// sends the next segment of the stream, payload already in place
+static void send_segment(nt_tunnel *t, struct flow *f, uint8_t type,
+                         size_t len) {
+  struct segment *seg = &f->tx[f->tx_next % TUN_WINDOW];
+  int64_t now = now_ms();
+  fill_hdr(seg->buf, type, f, f->tx_next, f->rx_next);
+  seg->len = TUN_HDR + len;
+  seg->sent_at = now;
+  seg->retransmitted = 0;
+  if (f->tx_base == f->tx_next) {
+    f->rto_at = now + f->rto_ms;
+    f->progress_at = now;
+  }
+  ++f->tx_next;
+  f->ack_due = 0;
+  queue_out(t, seg->buf, seg->len);
+}
+
+// reads right into the free segments of the window, several per call
+static void read_stream(nt_tunnel *t, struct flow *f) {
+  while (!f->local_eof && f->tx_next - f->tx_base < TUN_WINDOW) {
+    struct iovec iov[TUN_READ_SEGMENTS];
+    uint32_t room = TUN_WINDOW - (f->tx_next - f->tx_base);
+    int i, n_iov = room < TUN_READ_SEGMENTS ? room : TUN_READ_SEGMENTS;
+    for (i = 0; i < n_iov; ++i) {
+      iov[i].iov_base = f->tx[(f->tx_next + i) % TUN_WINDOW].buf + TUN_HDR;
+      iov[i].iov_len = TUN_PAYLOAD;
+    }
+    ssize_t n = readv(f->fd, iov, n_iov);
+    if (n > 0) {
+      while (n > 0) {
+        size_t len = n < TUN_PAYLOAD ? n : TUN_PAYLOAD;
+        send_segment(t, f, TUN_DATA, len);
+        n -= len;
+      }
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n < 0) {
+      reset_flow(t, f);
+      return;
+    }
+    f->local_eof = 1;
+    send_segment(t, f, TUN_FIN, 0);
+  }
+  f->active_at = now_ms();
+  if (f->reading != (!f->local_eof && f->tx_next - f->tx_base < TUN_WINDOW)) {
+    set_reading(t, f);
+  }
+}
+
+// go-back-n: every unacknowledged segment again, the rto doubled unless the
+// peer asked for them
+static void retransmit(nt_tunnel *t, struct flow *f, int64_t now,
+                       int backoff) {
+  uint32_t seq;
+  for (seq = f->tx_base; seq != f->tx_next; ++seq) {
+    struct segment *seg = &f->tx[seq % TUN_WINDOW];
+    ((struct tun_hdr *)seg->buf)->ack = htonl(f->rx_next);
+    seg->retransmitted = 1;
+    queue_out(t, seg->buf, seg->len);
+  }
+  if (backoff) {
+    f->rto_ms = f->rto_ms * 2 < TUN_MAX_RTO_MS ? f->rto_ms * 2
+                                               : TUN_MAX_RTO_MS;
+  }
+  f->rto_at = now + f->rto_ms;
+}
+
+static void rto_update(struct flow *f, int64_t sample) {
+  f->srtt = f->srtt ? (7 * f->srtt + sample) / 8 : sample;
+  f->rto_ms = 2 * f->srtt + TUN_MIN_RTO_MS;
+  if (f->rto_ms > TUN_MAX_RTO_MS) {
+    f->rto_ms = TUN_MAX_RTO_MS;
+  }
+}
+
+// the stream is done once both sides finished and everything is acknowledged
+static int stream_done(struct flow *f) {
+  return f->local_eof && f->fin_rcvd && f->tx_base == f->tx_next &&
+         f->pend_len == 0;
+}
+
+// returns -1 if the flow was freed
+static int stream_ack(nt_tunnel *t, struct flow *f, uint32_t ack) {
+  if ((int32_t)(ack - f->tx_base) <= 0 ||
+      (int32_t)(ack - f->tx_next) > 0) {
+    return 0;
+  }
+  int64_t now = now_ms();
+  struct segment *last = &f->tx[(ack - 1) % TUN_WINDOW];
+  if (!last->retransmitted) {
+    rto_update(f, now - last->sent_at);
+  }
+  f->tx_base = ack;
+  f->dup_acks = 0;
+  f->progress_at = now;
+  f->rto_at = f->tx_base != f->tx_next ? now + f->rto_ms : 0;
+  if (stream_done(f)) {
+    free_flow(t, f);
+    return -1;
+  }
+  if (!f->reading && !f->connecting && !f->local_eof) {
+    read_stream(t, f);
+  }
+  return 0;
+}
+
+// a lost segment shows up as acks repeating the same number, the receiver
+// drops everything after it
+static void stream_ack_frame(nt_tunnel *t, struct flow *f,
+                             struct tun_hdr *h) {
+  uint32_t ack = ntohl(h->ack);
+  if (ack != f->tx_base || f->tx_base == f->tx_next) {
+    stream_ack(t, f, ack);
+    return;
+  }
+  if ((h->flags & TUN_F_RESEND) || ++f->dup_acks == TUN_DUP_ACKS) {
+    retransmit(t, f, now_ms(), 0);
+  }
+}
+
+static void owe_ack(nt_tunnel *t, struct flow *f) {
+  if (!f->ack_due) {
+    f->ack_due = 1;
+    t->acks[t->n_acks++] = f;
+  }
+}
+
+static int connect_target(struct fwd *fwd, int type) {
+  int fd = open_socket(fwd->target.ss_family, type);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&fwd->target, fwd->target_len) &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// writes the gathered segments, keeps the first one the connection didn't
+// take completely and drops the others for the peer to resend. Returns -1 if
+// the flow was reset
+static int flush_gather(nt_tunnel *t) {
+  struct flow *f = t->gather;
+  int n_iov = t->n_gather;
+  t->gather = NULL;
+  t->n_gather = 0;
+  if (f == NULL) {
+    return 0;
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = t->gather_iov;
+  msg.msg_iovlen = n_iov;
+  ssize_t n = sendmsg(f->fd, &msg, MSG_NOSIGNAL);
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    reset_flow(t, f);
+    return -1;
+  }
+  int i = 0;
+  for (; n > 0 && (size_t)n >= t->gather_iov[i].iov_len; ++i) {
+    n -= t->gather_iov[i].iov_len;
+  }
+  if (i == n_iov) {
+    return 0;
+  }
+  if (n < 0) {
+    n = 0;
+  }
+  f->pend_off = 0;
+  f->pend_len = t->gather_iov[i].iov_len - n;
+  memcpy(f->pend, (char *)t->gather_iov[i].iov_base + n, f->pend_len);
+  if (i + 1 < n_iov) {
+    f->rx_next -= n_iov - i - 1;
+    f->dropped = 1;
+  }
+  set_reading(t, f);
+  return 0;
+}
+
+// a segment of a stream, in order or dropped
+static void stream_input(nt_tunnel *t, struct fwd *fwd, struct tun_hdr *h,
+                         char *payload, size_t len, int mine) {
+  uint32_t id = ntohl(h->flow);
+  uint32_t seq = ntohl(h->seq);
+  struct flow *f = find_flow(t, id, mine);
+  if (f == NULL) {
+    if (h->type != TUN_OPEN || mine || fwd->target_len == 0) {
+      if (h->type != TUN_OPEN) {
+        send_ctl(t, TUN_RST, h->flags & TUN_F_FWD_MINE ? 0 : TUN_F_FWD_MINE,
+                 h->forward, id, NULL, 0);
+      }
+      return;
+    }
+    int fd = connect_target(fwd, SOCK_STREAM);
+    f = fd >= 0 ? new_flow(t, fwd, id, 0, fd) : NULL;
+    if (f == NULL) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      send_ctl(t, TUN_RST, fwd->mine ? TUN_F_FWD_MINE : 0, fwd->index, id,
+               NULL, 0);
+      return;
+    }
+    f->connecting = 1;
+    watch(t, fd, EPOLLOUT, &f->w, EPOLL_CTL_ADD);
+  }
+  f->active_at = now_ms();
+  if (stream_ack(t, f, ntohl(h->ack)) < 0) {
+    return;
+  }
+  if (seq != f->rx_next) {
+    // a duplicate, or ahead of a lost one
+    owe_ack(t, f);
+    return;
+  }
+  struct flow *gathered = t->gather;
+  if (gathered != NULL && (gathered != f || h->type != TUN_DATA)) {
+    if (flush_gather(t) < 0 && gathered == f) {
+      return;
+    }
+  }
+  if (h->type == TUN_DATA) {
+    if (f->connecting || f->pend_len > 0 || f->dropped) {
+      f->dropped = 1;
+      return;
+    }
+    // taken for now, flush_gather() gives back what the connection refuses
+    t->gather = f;
+    t->gather_iov[t->n_gather].iov_base = payload;
+    t->gather_iov[t->n_gather].iov_len = len;
+    ++t->n_gather;
+  } else if (h->type == TUN_FIN) {
+    if (f->connecting || f->pend_len > 0 || f->dropped) {
+      f->dropped = 1;
+      return;
+    }
+    shutdown(f->fd, SHUT_WR);
+    f->fin_rcvd = 1;
+    set_reading(t, f);
+  }
+  ++f->rx_next;
+  owe_ack(t, f);
+}
+
+// asks the peer for the segments dropped since the connection is writable
+// again, instead of waiting for its rto
+static void request_resend(nt_tunnel *t, struct flow *f) {
+  f->dropped = 0;
+  f->ack_due = 0;
+  fill_hdr(f->ack_frame, TUN_ACK, f, 0, f->rx_next);
+  ((struct tun_hdr *)f->ack_frame)->flags |= TUN_F_RESEND;
+  queue_out(t, f->ack_frame, TUN_HDR);
+}
+
+static void send_acks(nt_tunnel *t) {
+  int i;
+  for (i = 0; i < t->n_acks; ++i) {
+    struct flow *f = t->acks[i];
+    if (f == NULL || !f->ack_due) {
+      continue;
+    }
+    f->ack_due = 0;
+    fill_hdr(f->ack_frame, TUN_ACK, f, 0, f->rx_next);
+    queue_out(t, f->ack_frame, TUN_HDR);
+  }
+  // a stream that got the last fin goes once the ack of it is out
+  flush_out(t);
+  for (i = 0; i < t->n_acks; ++i) {
+    if (t->acks[i] != NULL && stream_done(t->acks[i])) {
+      free_flow(t, t->acks[i]);
+    }
+  }
+  t->n_acks = 0;
+}
+
+static void forward_input(nt_tunnel *t, struct tun_hdr *h, char *payload,
+                          size_t len) {
+  if (len < sizeof(struct tun_forward_msg) || h->forward >= TUN_MAX_FORWARDS) {
+    return;
+  }
+  struct fwd *fwd = &t->theirs[h->forward];
+  if (!fwd->used) {
+    struct tun_forward_msg msg;
+    memcpy(&msg, payload, sizeof(msg));
+    msg.listen_ip[INET6_ADDRSTRLEN - 1] = '\0';
+    msg.target_ip[INET6_ADDRSTRLEN - 1] = '\0';
+    fwd->spec.remote = msg.remote;
+    fwd->spec.proto = msg.proto;
+    strcpy(fwd->spec.listen_ip, msg.listen_ip);
+    fwd->spec.listen_port = ntohs(msg.listen_port);
+    strcpy(fwd->spec.target_ip, msg.target_ip);
+    fwd->spec.target_port = ntohs(msg.target_port);
+    fwd->index = h->forward;
+    if (setup_forward(t, fwd) < 0) {
+      verbose_log("failed to set up forward %d of the peer\n", h->forward);
+      return;
+    }
+    verbose_log("forward %d of the peer: %s:%d to %s:%d\n", h->forward,
+                fwd->spec.listen_ip, fwd->spec.listen_port,
+                fwd->spec.target_ip, fwd->spec.target_port);
+  }
+  send_ctl(t, TUN_FORWARD_ACK, 0, h->forward, 0, NULL, 0);
+}
+
+static void udp_input(nt_tunnel *t, struct fwd *fwd, struct tun_hdr *h,
+                      char *payload, size_t len, int mine) {
+  uint32_t id = ntohl(h->flow);
+  struct flow *f = find_flow(t, id, mine);
+  if (f == NULL) {
+    if (mine || fwd->target_len == 0) {
+      return;
+    }
+    int fd = connect_target(fwd, SOCK_DGRAM);
+    f = fd >= 0 ? new_flow(t, fwd, id, 0, fd) : NULL;
+    if (f == NULL) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      return;
+    }
+    watch(t, fd, EPOLLIN, &f->w, EPOLL_CTL_ADD);
+  }
+  f->active_at = now_ms();
+  if (f->fd >= 0) {
+    queue_local(t, f->fd, payload, len, NULL, 0);
+  } else {
+    queue_local(t, fwd->fd, payload, len, &f->client, f->client_len);
+  }
+}
+
+static void tunnel_ready(nt_tunnel *t) {
+  int rounds;
+  for (rounds = 0; rounds < 16; ++rounds) {
+    int i;
+    for (i = 0; i < TUN_BATCH; ++i) {
+      memset(&t->in[i].msg_hdr, 0, sizeof(struct msghdr));
+      t->in[i].msg_hdr.msg_iov = &t->in_iov[i];
+      t->in[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(t->sock, t->in, TUN_BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+      break;
+    }
+    t->heard_at = now_ms();
+    for (i = 0; i < n; ++i) {
+      char *buf = t->in_buf[i];
+      size_t len = t->in[i].msg_len;
+      struct tun_hdr *h = (struct tun_hdr *)buf;
+      // path probes and late punch messages share the socket
+      if (len < TUN_HDR || memcmp(h->magic, "ntt", 3)) {
+        continue;
+      }
+      if (h->type == TUN_FORWARD) {
+        forward_input(t, h, buf + TUN_HDR, len - TUN_HDR);
+        continue;
+      }
+      if (h->type == TUN_FORWARD_ACK) {
+        if (h->forward < t->n_mine) {
+          t->mine[h->forward].acked = 1;
+        }
+        continue;
+      }
+      if (h->type == TUN_PING || h->forward >= TUN_MAX_FORWARDS) {
+        continue;
+      }
+      // the sender's forward and flow are the other side's here
+      struct fwd *fwd = h->flags & TUN_F_FWD_MINE ? &t->theirs[h->forward]
+                                                  : &t->mine[h->forward];
+      int mine = !(h->flags & TUN_F_FLOW_MINE);
+      if (!fwd->used) {
+        continue;
+      }
+      if (h->type == TUN_UDP) {
+        udp_input(t, fwd, h, buf + TUN_HDR, len - TUN_HDR, mine);
+      } else if (h->type == TUN_RST) {
+        struct flow *f = find_flow(t, ntohl(h->flow), mine);
+        if (f != NULL) {
+          free_flow(t, f);
+        }
+      } else if (h->type == TUN_ACK) {
+        struct flow *f = find_flow(t, ntohl(h->flow), mine);
+        if (f != NULL && f->tx != NULL) {
+          stream_ack_frame(t, f, h);
+        }
+      } else {
+        stream_input(t, fwd, h, buf + TUN_HDR, len - TUN_HDR, mine);
+      }
+    }
+    // the receive buffers are reused by the next round
+    flush_gather(t);
+    flush_local(t);
+    send_acks(t);
+    if (n < TUN_BATCH) {
+      break;
+    }
+  }
+}
+
+// datagrams of local clients, or of the target of flows of the peer
+static void udp_ready(nt_tunnel *t, struct fwd *fwd, struct flow *from) {
+  int fd = from != NULL ? from->fd : fwd->fd;
+  int rounds;
+  for (rounds = 0; rounds < 16; ++rounds) {
+    int i;
+    for (i = 0; i < TUN_BATCH; ++i) {
+      t->in_iov[i].iov_base = t->in_buf[i] + TUN_HDR;
+      t->in_iov[i].iov_len = TUN_PAYLOAD;
+      memset(&t->in[i].msg_hdr, 0, sizeof(struct msghdr));
+      t->in[i].msg_hdr.msg_iov = &t->in_iov[i];
+      t->in[i].msg_hdr.msg_iovlen = 1;
+      t->in[i].msg_hdr.msg_name = &t->in_addr[i];
+      t->in[i].msg_hdr.msg_namelen = sizeof(t->in_addr[i]);
+    }
+    int n = recvmmsg(fd, t->in, TUN_BATCH, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; ++i) {
+      struct flow *f = from;
+      if (f == NULL) {
+        socklen_t len = t->in[i].msg_hdr.msg_namelen;
+        f = find_client(t, fwd, &t->in_addr[i], len);
+        if (f == NULL) {
+          f = new_flow(t, fwd, ++t->next_flow, 1, -1);
+          if (f == NULL) {
+            continue;
+          }
+          memcpy(&f->client, &t->in_addr[i], len);
+          f->client_len = len;
+          unsigned int b = addr_bucket(&f->client, len);
+          f->next_addr = t->by_addr[b];
+          t->by_addr[b] = f;
+        }
+      }
+      f->active_at = now_ms();
+      fill_hdr(t->in_buf[i], TUN_UDP, f, 0, 0);
+      queue_out(t, t->in_buf[i], TUN_HDR + t->in[i].msg_len);
+    }
+    flush_out(t);
+    for (i = 0; i < TUN_BATCH; ++i) {
+      t->in_iov[i].iov_base = t->in_buf[i];
+      t->in_iov[i].iov_len = TUN_MTU;
+    }
+    if (n < TUN_BATCH) {
+      break;
+    }
+  }
+}
+
+static void listener_ready(nt_tunnel *t, struct fwd *fwd) {
+  if (fwd->spec.proto == IPPROTO_UDP) {
+    udp_ready(t, fwd, NULL);
+    return;
+  }
+  for (;;) {
+    int fd = accept4(fwd->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    struct flow *f = new_flow(t, fwd, ++t->next_flow, 1, fd);
+    if (f == NULL) {
+      close(fd);
+      continue;
+    }
+    watch(t, fd, EPOLLIN, &f->w, EPOLL_CTL_ADD);
+    f->reading = 1;
+    send_segment(t, f, TUN_OPEN, 0);
+    read_stream(t, f);
+  }
+}
+
+static void flow_ready(nt_tunnel *t, struct flow *f, uint32_t events) {
+  if (f->tx == NULL) {
+    udp_ready(t, f->fwd, f);
+    return;
+  }
+  if (f->connecting) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err || (events & (EPOLLERR | EPOLLHUP))) {
+      reset_flow(t, f);
+      return;
+    }
+    f->connecting = 0;
+    if (f->dropped) {
+      request_resend(t, f);
+    }
+    set_reading(t, f);
+    return;
+  }
+  if ((events & EPOLLOUT) && f->pend_len > 0) {
+    ssize_t n = send(f->fd, f->pend + f->pend_off, f->pend_len, MSG_NOSIGNAL);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      reset_flow(t, f);
+      return;
+    }
+    if (n > 0) {
+      f->pend_off += n;
+      f->pend_len -= n;
+    }
+    if (f->pend_len == 0) {
+      set_reading(t, f);
+    }
+  } else if ((events & EPOLLOUT) && f->dropped) {
+    request_resend(t, f);
+    set_reading(t, f);
+  }
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    read_stream(t, f);
+  }
+}
+
+static void run_timers(nt_tunnel *t, int64_t now) {
+  int i;
+  for (i = 0; i < t->n_mine; ++i) {
+    if (!t->mine[i].acked && now - t->mine[i].announced_at >= TUN_ANNOUNCE_MS) {
+      announce(t, &t->mine[i]);
+    }
+  }
+  for (i = 0; i < TUN_FLOW_BUCKETS; ++i) {
+    struct flow *f = t->flows[i], *next;
+    for (; f != NULL; f = next) {
+      next = f->next;
+      if (f->tx == NULL) {
+        if (now - f->active_at > TUN_UDP_IDLE_MS) {
+          free_flow(t, f);
+        }
+        continue;
+      }
+      if (f->tx_base == f->tx_next) {
+        continue;
+      }
+      if (now - f->progress_at > TUN_STREAM_DEAD_MS) {
+        reset_flow(t, f);
+      } else if (now >= f->rto_at) {
+        retransmit(t, f, now, 1);
+      }
+    }
+  }
+  flush_out(t);
+  if (now - t->sent_at >= TUN_KEEPALIVE_MS) {
+    send_ctl(t, TUN_PING, 0, 0, 0, NULL, 0);
+  }
+}
+
+int nt_tunnel_timeout(nt_tunnel *t) {
+  int i;
+  for (i = 0; i < t->n_mine; ++i) {
+    if (!t->mine[i].acked) {
+      return TUN_TICK_MS;
+    }
+  }
+  for (i = 0; i < TUN_FLOW_BUCKETS; ++i) {
+    struct flow *f;
+    for (f = t->flows[i]; f != NULL; f = f->next) {
+      if (f->tx != NULL && f->tx_base != f->tx_next) {
+        return TUN_TICK_MS;
+      }
+    }
+  }
+  return 1000;
+}
+
+int nt_tunnel_process(nt_tunnel *t) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(t->epfd, events, MAX_EVENTS, 0);
+  int i;
+  for (i = 0; i < n; ++i) {
+    struct tun_watch *w = events[i].data.ptr;
+    if (w->kind == W_TUNNEL) {
+      tunnel_ready(t);
+    } else if (w->kind == W_LISTENER) {
+      listener_ready(t, w->obj);
+    } else if (w->kind == W_FLOW) {
+      flow_ready(t, w->obj, events[i].events);
+    }
+  }
+  flush_out(t);
+  int64_t now = now_ms();
+  run_timers(t, now);
+  reap_flows(t);
+  if (now - t->heard_at > TUN_DEAD_MS) {
+    verbose_log("tunnel peer silent for %d s\n", TUN_DEAD_MS / 1000);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include <netinet/in.h>
+#include <stdint.h>
+
+/*
+ * Port forwarding over the UDP socket of a traversal. Both ends of the punched
+ * path run a tunnel; forwards declared by either end are announced to the
+ * other one. UDP datagrams and TCP streams of any number of local flows are
+ * multiplexed over the single hole, TCP with in-order delivery and
+ * retransmissions of its own.
+ *
+ * Like nt_ctx, a tunnel never blocks: watch nt_tunnel_fd() for readability,
+ * wake up after nt_tunnel_timeout() milliseconds and call nt_tunnel_process().
+ */
+
+typedef struct nt_tunnel nt_tunnel;
+
+struct nt_forward {
+  // 0 listens here and connects to target from the peer (-L), 1 listens on
+  // the peer and connects to target from here (-R)
+  int remote;
+  // IPPROTO_TCP or IPPROTO_UDP
+  int proto;
+  char listen_ip[INET6_ADDRSTRLEN];
+  uint16_t listen_port;
+  char target_ip[INET6_ADDRSTRLEN];
+  uint16_t target_port;
+};
+
+// parses "[udp:|tcp:][listen_ip:]listen_port:target_ip:target_port" like ssh
+// does, IPv6 addresses in brackets. Returns -1 if spec is malformed
+int nt_parse_forward(const char *spec, int remote, struct nt_forward *fwd);
+
+// takes over sock, a UDP socket connected to the peer. The forwards are
+// copied, n may be 0 to only serve the forwards of the peer
+nt_tunnel *nt_tunnel_new(int sock, const struct nt_forward *forwards, int n);
+void nt_tunnel_free(nt_tunnel *t);
+int nt_tunnel_fd(nt_tunnel *t);
+// takes over sock, another UDP socket connected to the same peer, and closes
+// the one in use. Flows carry on, streams send again what the old path lost
+void nt_tunnel_swap(nt_tunnel *t, int sock);
+// milliseconds until the next retransmission or keepalive is due
+int nt_tunnel_timeout(nt_tunnel *t);
+// moves every ready datagram and stream, returns -1 once the peer has been
+// silent for too long
+int nt_tunnel_process(nt_tunnel *t);
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE // recvmmsg(), sendmmsg(), pthread_setaffinity_np()
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nt_vpn.h"
+#include "utils.h"
+
+// packets moved per read loop, recvmmsg() and sendmmsg()
+#define VPN_BATCH 64
+// mtu of the interface, a packet and its header fit the path like the
+// frames of nt_tunnel
+#define VPN_MTU 1396
+#define VPN_HDR 4
+#define VPN_MAX_QUEUES 64
+#define VPN_KEEPALIVE_MS 10000
+#define VPN_DEAD_MS 60000
+// socket buffers of the hole, shared by every queue
+#define VPN_SOCK_BUF (4 << 20)
+
+enum vpn_type {
+  VPN_DATA = 1,
+  VPN_PING,
+};
+
+enum { EV_TUN, EV_SOCK, EV_STOP };
+
+struct vpn_queue {
+  nt_vpn *vpn;
+  int index;
+  int cpu;
+  int fd;
+  // of the worker, nt_vpn_swap() adds the new socket to it
+  int epfd;
+  pthread_t thread;
+  int started;
+  // written by the worker only, read by nt_vpn_stats()
+  uint64_t tx_packets;
+  uint64_t tx_bytes;
+  uint64_t rx_packets;
+  uint64_t rx_bytes;
+
+  // packets are read right behind the room for the header and written
+  // straight from the receive buffers
+  struct mmsghdr tx[VPN_BATCH];
+  struct iovec tx_iov[VPN_BATCH];
+  char tx_buf[VPN_BATCH][VPN_HDR + VPN_MTU];
+  struct mmsghdr rx[VPN_BATCH];
+  struct iovec rx_iov[VPN_BATCH];
+  char rx_buf[VPN_BATCH][VPN_HDR + VPN_MTU];
+};
+
+struct nt_vpn {
+  int sock;
+  int stop_fd;
+  char ifname[IFNAMSIZ];
+  int n_queues;
+  int64_t heard_at;
+  int64_t sent_at;
+  struct vpn_queue *queues[VPN_MAX_QUEUES];
+};
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// every queue attaches to the interface by name, the first one creates it
+static int open_queue(char *ifname) {
+  int fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE;
+  strcpy(ifr.ifr_name, ifname);
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    verbose_log("failed to open tun %s: %s\n", ifname, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  strcpy(ifname, ifr.ifr_name);
+  return fd;
+}
+
+static void set_mtu(const char *ifname) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strcpy(ifr.ifr_name, ifname);
+  ifr.ifr_mtu = VPN_MTU;
+  if (fd < 0 || ioctl(fd, SIOCSIFMTU, &ifr) < 0) {
+    verbose_log("failed to set the mtu of %s\n", ifname);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+static void send_ping(nt_vpn *vpn) {
+  char buf[VPN_HDR] = {'n', 't', 'v', VPN_PING};
+  send(vpn->sock, buf, sizeof(buf), 0);
+  __atomic_store_n(&vpn->sent_at, now_ms(), __ATOMIC_RELAXED);
+}
+
+// packets of this queue to the peer, a full socket buffer drops them like a
+// full link would
+static void from_tun(struct vpn_queue *q) {
+  nt_vpn *vpn = q->vpn;
+  int rounds;
+  for (rounds = 0; rounds < 16; ++rounds) {
+    int n;
+    for (n = 0; n < VPN_BATCH; ++n) {
+      ssize_t len = read(q->fd, q->tx_buf[n] + VPN_HDR, VPN_MTU);
+      if (len <= 0) {
+        break;
+      }
+      q->tx_iov[n].iov_len = VPN_HDR + len;
+    }
+    if (n == 0) {
+      return;
+    }
+    int sent = 0;
+    while (sent < n) {
+      int k = sendmmsg(vpn->sock, q->tx + sent, n - sent, 0);
+      if (k <= 0) {
+        break;
+      }
+      sent += k;
+    }
+    // the dropped rest of the batch isn't counted
+    uint64_t bytes = 0;
+    int i;
+    for (i = 0; i < sent; ++i) {
+      bytes += q->tx_iov[i].iov_len - VPN_HDR;
+    }
+    __atomic_add_fetch(&q->tx_packets, sent, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&q->tx_bytes, bytes, __ATOMIC_RELAXED);
+    if (n < VPN_BATCH) {
+      break;
+    }
+  }
+  __atomic_store_n(&vpn->sent_at, now_ms(), __ATOMIC_RELAXED);
+}
+
+// packets of the peer out of this queue, whichever worker got woken up
+static void from_peer(struct vpn_queue *q) {
+  nt_vpn *vpn = q->vpn;
+  int rounds;
+  for (rounds = 0; rounds < 16; ++rounds) {
+    int n = recvmmsg(vpn->sock, q->rx, VPN_BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+      return;
+    }
+    __atomic_store_n(&vpn->heard_at, now_ms(), __ATOMIC_RELAXED);
+    int i, packets = 0;
+    uint64_t bytes = 0;
+    for (i = 0; i < n; ++i) {
+      size_t len = q->rx[i].msg_len;
+      const char *buf = q->rx_buf[i];
+      // late punch and path messages share the socket
+      if (len <= VPN_HDR || memcmp(buf, "ntv", 3) || buf[3] != VPN_DATA) {
+        continue;
+      }
+      if (write(q->fd, buf + VPN_HDR, len - VPN_HDR) > 0) {
+        ++packets;
+        bytes += len - VPN_HDR;
+      }
+    }
+    __atomic_add_fetch(&q->rx_packets, packets, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&q->rx_bytes, bytes, __ATOMIC_RELAXED);
+    if (n < VPN_BATCH) {
+      return;
+    }
+  }
+}
+
+// one worker per datagram of the peer instead of all of them
+static void watch_sock(struct vpn_queue *q) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.u32 = EV_SOCK;
+  epoll_ctl(q->epfd, EPOLL_CTL_ADD, q->vpn->sock, &ev);
+}
+
+static void *run_queue(void *arg) {
+  struct vpn_queue *q = arg;
+  nt_vpn *vpn = q->vpn;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(q->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  int epfd = q->epfd;
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u32 = EV_TUN;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, q->fd, &ev);
+  ev.data.u32 = EV_STOP;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, vpn->stop_fd, &ev);
+  watch_sock(q);
+
+  for (;;) {
+    struct epoll_event events[3];
+    int i, n = epoll_wait(epfd, events, 3, 1000);
+    for (i = 0; i < n; ++i) {
+      if (events[i].data.u32 == EV_STOP) {
+        return NULL;
+      }
+      if (events[i].data.u32 == EV_TUN) {
+        from_tun(q);
+      } else {
+        from_peer(q);
+      }
+    }
+    if (q->index == 0 &&
+        now_ms() - __atomic_load_n(&vpn->sent_at, __ATOMIC_RELAXED) >=
+            VPN_KEEPALIVE_MS) {
+      send_ping(vpn);
+    }
+  }
+}
+
+static struct vpn_queue *new_queue(nt_vpn *vpn, int index, int fd) {
+  struct vpn_queue *q = calloc(1, sizeof(*q));
+  if (q == NULL) {
+    return NULL;
+  }
+  q->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (q->epfd < 0) {
+    free(q);
+    return NULL;
+  }
+  q->vpn = vpn;
+  q->index = index;
+  q->cpu = index % sysconf(_SC_NPROCESSORS_ONLN);
+  q->fd = fd;
+  int i;
+  for (i = 0; i < VPN_BATCH; ++i) {
+    memcpy(q->tx_buf[i], "ntv", 3);
+    q->tx_buf[i][3] = VPN_DATA;
+    q->tx_iov[i].iov_base = q->tx_buf[i];
+    q->tx[i].msg_hdr.msg_iov = &q->tx_iov[i];
+    q->tx[i].msg_hdr.msg_iovlen = 1;
+    q->rx_iov[i].iov_base = q->rx_buf[i];
+    q->rx_iov[i].iov_len = sizeof(q->rx_buf[i]);
+    q->rx[i].msg_hdr.msg_iov = &q->rx_iov[i];
+    q->rx[i].msg_hdr.msg_iovlen = 1;
+  }
+  return q;
+}
+
+static void setup_sock(int sock) {
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  int buf_size = VPN_SOCK_BUF;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+}
+
+nt_vpn *nt_vpn_start(int sock, const char *ifname, int queues) {
+  if (queues <= 0) {
+    queues = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (queues > VPN_MAX_QUEUES) {
+    queues = VPN_MAX_QUEUES;
+  }
+  nt_vpn *vpn = calloc(1, sizeof(*vpn));
+  if (vpn == NULL) {
+    return NULL;
+  }
+  vpn->sock = sock;
+  vpn->heard_at = vpn->sent_at = now_ms();
+  strncpy(vpn->ifname, ifname, IFNAMSIZ - 1);
+  vpn->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (vpn->stop_fd < 0) {
+    free(vpn);
+    return NULL;
+  }
+  setup_sock(sock);
+
+  int i;
+  for (i = 0; i < queues; ++i) {
+    int fd = open_queue(vpn->ifname);
+    if (fd < 0) {
+      break;
+    }
+    vpn->queues[i] = new_queue(vpn, i, fd);
+    if (vpn->queues[i] == NULL) {
+      close(fd);
+      break;
+    }
+    vpn->n_queues = i + 1;
+  }
+  if (vpn->n_queues < queues) {
+    nt_vpn_stop(vpn);
+    return NULL;
+  }
+  set_mtu(vpn->ifname);
+  for (i = 0; i < vpn->n_queues; ++i) {
+    struct vpn_queue *q = vpn->queues[i];
+    if (pthread_create(&q->thread, NULL, run_queue, q)) {
+      nt_vpn_stop(vpn);
+      return NULL;
+    }
+    q->started = 1;
+  }
+  verbose_log("vpn on %s, %d queues\n", vpn->ifname, vpn->n_queues);
+  return vpn;
+}
+
+void nt_vpn_stop(nt_vpn *vpn) {
+  uint64_t one = 1;
+  if (write(vpn->stop_fd, &one, sizeof(one)) < 0) {
+    verbose_log("failed to stop the vpn workers\n");
+  }
+  int i;
+  for (i = 0; i < vpn->n_queues; ++i) {
+    struct vpn_queue *q = vpn->queues[i];
+    if (q->started) {
+      pthread_join(q->thread, NULL);
+    }
+    close(q->fd);
+    close(q->epfd);
+    free(q);
+  }
+  close(vpn->stop_fd);
+  close(vpn->sock);
+  free(vpn);
+}
+
+void nt_vpn_swap(nt_vpn *vpn, int sock) {
+  setup_sock(sock);
+  // the workers go on with the same descriptor, which holds the new socket
+  // from now on. Closing the old one took it out of their epoll sets
+  if (dup3(sock, vpn->sock, O_CLOEXEC) < 0) {
+    verbose_log("failed to swap the vpn socket: %s\n", strerror(errno));
+    close(sock);
+    return;
+  }
+  close(sock);
+  int i;
+  for (i = 0; i < vpn->n_queues; ++i) {
+    watch_sock(vpn->queues[i]);
+  }
+  __atomic_store_n(&vpn->heard_at, now_ms(), __ATOMIC_RELAXED);
+  verbose_log("vpn moved to another path\n");
+  // the first packet on a standby tells the peer to move too
+  send_ping(vpn);
+}
+
+const char *nt_vpn_ifname(nt_vpn *vpn) { return vpn->ifname; }
+
+int nt_vpn_queues(nt_vpn *vpn) { return vpn->n_queues; }
+
+void nt_vpn_stats(nt_vpn *vpn, int queue, struct nt_vpn_stats *stats) {
+  struct vpn_queue *q = vpn->queues[queue];
+  stats->cpu = q->cpu;
+  stats->tx_packets = __atomic_load_n(&q->tx_packets, __ATOMIC_RELAXED);
+  stats->tx_bytes = __atomic_load_n(&q->tx_bytes, __ATOMIC_RELAXED);
+  stats->rx_packets = __atomic_load_n(&q->rx_packets, __ATOMIC_RELAXED);
+  stats->rx_bytes = __atomic_load_n(&q->rx_bytes, __ATOMIC_RELAXED);
+}
+
+int nt_vpn_alive(nt_vpn *vpn) {
+  return now_ms() - __atomic_load_n(&vpn->heard_at, __ATOMIC_RELAXED) <
+         VPN_DEAD_MS;
+}
@@ -0,0 +1,36 @@
+#include <stdint.h>
+
+/*
+ * Layer 3 VPN over the UDP socket of a traversal. The socket is attached to a
+ * TUN interface opened with IFF_MULTI_QUEUE, one worker thread per queue,
+ * each pinned to its own core. A worker moves the packets the kernel steers
+ * to its queue to the peer in sendmmsg() batches, and takes its turn on the
+ * shared socket to write recvmmsg() batches of the peer's packets out of its
+ * queue. Addresses and routes of the interface are left to `ip`.
+ */
+
+typedef struct nt_vpn nt_vpn;
+
+struct nt_vpn_stats {
+  int cpu;
+  uint64_t tx_packets;
+  uint64_t tx_bytes;
+  uint64_t rx_packets;
+  uint64_t rx_bytes;
+};
+
+// takes over sock, a UDP socket connected to the peer. ifname may be empty
+// for the kernel to pick a name, queues 0 for one per online core. Returns
+// NULL if the interface can't be opened
+nt_vpn *nt_vpn_start(int sock, const char *ifname, int queues);
+// stops the workers, closes the interface and the socket
+void nt_vpn_stop(nt_vpn *vpn);
+// takes over sock, another UDP socket connected to the same peer, in place of
+// the one in use, which is closed. The workers keep running
+void nt_vpn_swap(nt_vpn *vpn, int sock);
+const char *nt_vpn_ifname(nt_vpn *vpn);
+int nt_vpn_queues(nt_vpn *vpn);
+// counters of one queue since the start, tx towards the peer
+void nt_vpn_stats(nt_vpn *vpn, int queue, struct nt_vpn_stats *stats);
+// 0 once nothing came from the peer for a minute
+int nt_vpn_alive(nt_vpn *vpn);
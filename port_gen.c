@@ -0,0 +1,136 @@
+#include <string.h>
+
+#include "port_gen.h"
+
+// splitmix64, expands the key into round keys
+static uint64_t next_key(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// the finalizer of murmur3
+static uint32_t mix(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x85ebca6b;
+  x ^= x >> 13;
+  x *= 0xc2b2ae35;
+  return x ^ (x >> 16);
+}
+
+void port_gen_init(struct port_gen *g, uint16_t min, uint16_t max,
+                   uint64_t key) {
+  memset(g, 0, sizeof(*g));
+  g->min = min;
+  g->size = max >= min ? (uint32_t)max - min + 1 : 0;
+  // the smallest square power of two covering the range, the cycle walk
+  // then takes four steps at worst on average
+  g->half_bits = 1;
+  while ((1u << (2 * g->half_bits)) < g->size) {
+    ++g->half_bits;
+  }
+  int i;
+  for (i = 0; i < PORT_GEN_ROUNDS; ++i) {
+    g->round_keys[i] = next_key(&key);
+  }
+}
+
+static uint32_t feistel(const struct port_gen *g, uint32_t x) {
+  uint32_t mask = (1u << g->half_bits) - 1;
+  uint32_t left = x >> g->half_bits, right = x & mask;
+  int i;
+  for (i = 0; i < PORT_GEN_ROUNDS; ++i) {
+    uint32_t next = left ^ (mix(right ^ g->round_keys[i]) & mask);
+    left = right;
+    right = next;
+  }
+  return left << g->half_bits | right;
+}
+
+// a bijection of [0, size): values past the range are encrypted again until
+// they fall back into it
+static uint32_t permute(const struct port_gen *g, uint32_t i) {
+  do {
+    i = feistel(g, i);
+  } while (i >= g->size);
+  return i;
+}
+
+static int in_range(const struct port_gen *g, int port) {
+  return port >= g->min && (uint32_t)(port - g->min) < g->size;
+}
+
+static int excluded(const struct port_gen *g, int port) {
+  int i;
+  for (i = 0; i < g->n_excluded; ++i) {
+    if (g->excluded[i] == port) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// whether one of the first n windows holds the port
+static int in_windows(const struct port_gen *g, int port, int n) {
+  int i;
+  for (i = 0; i < n; ++i) {
+    int d = port - g->windows[i].center;
+    if (d >= -g->windows[i].spread && d <= g->windows[i].spread) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// whether the window draws the port, rather than an earlier one or nobody
+static int window_draws(const struct port_gen *g, int window, int port) {
+  return in_range(g, port) && !excluded(g, port) &&
+         !in_windows(g, port, window);
+}
+
+int port_gen_window(struct port_gen *g, uint16_t center, uint16_t spread) {
+  if (g->n_windows == PORT_GEN_WINDOWS) {
+    return -1;
+  }
+  int n = 0, port;
+  for (port = center - spread; port <= center + spread; ++port) {
+    n += window_draws(g, g->n_windows, port);
+  }
+  g->windows[g->n_windows].center = center;
+  g->windows[g->n_windows].spread = spread;
+  ++g->n_windows;
+  return n;
+}
+
+int port_gen_exclude(struct port_gen *g, uint16_t port) {
+  if (g->n_excluded == PORT_GEN_EXCLUDED) {
+    return -1;
+  }
+  g->excluded[g->n_excluded++] = port;
+  return 0;
+}
+
+uint16_t port_gen_next(struct port_gen *g) {
+  while (g->window < g->n_windows) {
+    const struct port_window *w = &g->windows[g->window];
+    int d = (g->offset + 1) / 2;
+    if (d > w->spread) {
+      ++g->window;
+      g->offset = 0;
+      continue;
+    }
+    int port = w->center + (g->offset % 2 ? d : -d);
+    ++g->offset;
+    if (window_draws(g, g->window, port)) {
+      return port;
+    }
+  }
+  while (g->index < g->size) {
+    int port = g->min + permute(g, g->index++);
+    if (!excluded(g, port) && !in_windows(g, port, g->n_windows)) {
+      return port;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <stdint.h>
+
+// windows and excluded ports one generator holds
+#define PORT_GEN_WINDOWS 8
+#define PORT_GEN_EXCLUDED 8
+#define PORT_GEN_ROUNDS 6
+
+struct port_window {
+  uint16_t center;
+  uint16_t spread;
+};
+
+// the ports of a range in a keyed pseudorandom order, each at most once,
+// drawn one by one in constant memory. The order is a permutation of the
+// range by a Feistel network, so the same key gives the same sequence on any
+// host. Windows around predicted ports come first, nearest first
+struct port_gen {
+  uint16_t min;
+  // ports in the range
+  uint32_t size;
+  // the network permutes [0, 2^(2 * half_bits)), indices past size are
+  // walked through again
+  int half_bits;
+  uint32_t round_keys[PORT_GEN_ROUNDS];
+  // next index of the permutation
+  uint32_t index;
+  struct port_window windows[PORT_GEN_WINDOWS];
+  int n_windows;
+  // window being drawn and the next offset in it: 0, +1, -1, +2, -2...
+  int window;
+  int offset;
+  uint16_t excluded[PORT_GEN_EXCLUDED];
+  int n_excluded;
+};
+
+void port_gen_init(struct port_gen *g, uint16_t min, uint16_t max,
+                   uint64_t key);
+// the port is never drawn, returns -1 if there are too many exclusions
+int port_gen_exclude(struct port_gen *g, uint16_t port);
+// ports within spread of center come first, after those of earlier windows.
+// Returns the number of ports the window adds, leaving out the ones excluded
+// so far, -1 if there are too many windows. Exclusions are set before the
+// first port is drawn. A window added later is drawn next, its ports may
+// then come twice
+int port_gen_window(struct port_gen *g, uint16_t center, uint16_t spread);
+// the next port, 0 once the range is used up
+uint16_t port_gen_next(struct port_gen *g);
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "port_gen.h"
+
+/*
+ * port_gen_test, checks the port generator the way traversals use it: the
+ * whole range of candidate ports, windows around predicted ports and the
+ * peer's published port left out. Every sequence is drawn to the end.
+ */
+
+// as in nat_traversal.c
+#define MAX_PORT 65535
+#define MIN_PORT 1025
+#define RANGE (MAX_PORT - MIN_PORT + 1)
+
+static const uint64_t keys[] = {0, 1, 0x9e3779b97f4a7c15ULL, 42, ~0ULL};
+#define N_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+static uint16_t seq[RANGE + 1];
+
+static int failures;
+
+static void fail(const char *what, uint64_t key) {
+  printf("key %llx: %s\n", (unsigned long long)key, what);
+  ++failures;
+}
+
+// draws g to the end into seq, returns how many ports came
+static int draw(struct port_gen *g) {
+  int n = 0;
+  uint16_t port;
+  while ((port = port_gen_next(g)) != 0 && n <= RANGE) {
+    seq[n++] = port;
+  }
+  return n;
+}
+
+// whether the n ports of seq are the range once each, but the excluded ones
+static int covers(int n, const uint16_t *excluded, int n_excluded) {
+  static uint8_t seen[MAX_PORT + 1];
+  memset(seen, 0, sizeof(seen));
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (seq[i] < MIN_PORT || seen[seq[i]]++) {
+      return 0;
+    }
+  }
+  for (i = 0; i < n_excluded; ++i) {
+    if (seen[excluded[i]]) {
+      return 0;
+    }
+  }
+  return n == RANGE - n_excluded;
+}
+
+static void test_range(uint64_t key) {
+  struct port_gen g;
+  port_gen_init(&g, MIN_PORT, MAX_PORT, key);
+  if (!covers(draw(&g), NULL, 0)) {
+    fail("range not drawn exactly once", key);
+  }
+  if (port_gen_next(&g) != 0) {
+    fail("port drawn after the range was used up", key);
+  }
+}
+
+static void test_windows(uint64_t key) {
+  // overlapping windows, and one clipped by the bottom of the range
+  static const struct port_window windows[] = {
+      {30000, 5}, {30003, 4}, {MIN_PORT + 1, 3}, {50000, 0}};
+  int n_windows = sizeof(windows) / sizeof(windows[0]);
+  struct port_gen g;
+  port_gen_init(&g, MIN_PORT, MAX_PORT, key);
+  int i, in_windows = 0;
+  for (i = 0; i < n_windows; ++i) {
+    in_windows += port_gen_window(&g, windows[i].center, windows[i].spread);
+  }
+  if (in_windows != 11 + 2 + 5 + 1) {
+    fail("wrong number of ports in the windows", key);
+  }
+  int n = draw(&g);
+  if (!covers(n, NULL, 0)) {
+    fail("range not drawn exactly once with windows", key);
+  }
+  // each of the first ports in the first window holding it, windows in
+  // order and nearest first in each
+  int last_window = 0, last_distance = 0;
+  for (i = 0; i < in_windows && i < n; ++i) {
+    int w, d = 0;
+    for (w = 0; w < n_windows; ++w) {
+      d = abs(seq[i] - windows[w].center);
+      if (d <= windows[w].spread) {
+        break;
+      }
+    }
+    if (w == n_windows || w < last_window ||
+        (w == last_window && d < last_distance)) {
+      fail("window ports out of order", key);
+      return;
+    }
+    last_window = w;
+    last_distance = d;
+  }
+}
+
+static void test_excluded(uint64_t key) {
+  // one inside a window, both ends of the range
+  static const uint16_t excluded[] = {30001, MIN_PORT, MAX_PORT, 4242};
+  int n_excluded = sizeof(excluded) / sizeof(excluded[0]);
+  struct port_gen g;
+  port_gen_init(&g, MIN_PORT, MAX_PORT, key);
+  int i;
+  for (i = 0; i < n_excluded; ++i) {
+    port_gen_exclude(&g, excluded[i]);
+  }
+  if (port_gen_window(&g, 30000, 2) != 4) {
+    fail("excluded port counted in a window", key);
+  }
+  if (!covers(draw(&g), excluded, n_excluded)) {
+    fail("excluded port drawn, or range not drawn exactly once", key);
+  }
+}
+
+static void test_repeatable(uint64_t key) {
+  static uint16_t first[RANGE + 1];
+  struct port_gen g;
+  port_gen_init(&g, MIN_PORT, MAX_PORT, key);
+  port_gen_window(&g, 20000, 8);
+  int n = draw(&g);
+  memcpy(first, seq, n * sizeof(seq[0]));
+  port_gen_init(&g, MIN_PORT, MAX_PORT, key);
+  port_gen_window(&g, 20000, 8);
+  if (draw(&g) != n || memcmp(first, seq, n * sizeof(seq[0])) != 0) {
+    fail("same key gave another sequence", key);
+  }
+  port_gen_init(&g, MIN_PORT, MAX_PORT, key + 1);
+  port_gen_window(&g, 20000, 8);
+  if (draw(&g) == n && memcmp(first, seq, n * sizeof(seq[0])) == 0) {
+    fail("next key gave the same sequence", key);
+  }
+}
+
+int main(void) {
+  size_t i;
+  for (i = 0; i < N_KEYS; ++i) {
+    test_range(keys[i]);
+    test_windows(keys[i]);
+    test_excluded(keys[i]);
+    test_repeatable(keys[i]);
+  }
+  printf("%d keys, %d failures\n", (int)N_KEYS, failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,752 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nat_traversal.h"
+#include "utils.h"
+
+/*
+ * punch_bench, a load generator for the punch server. Every simulated client
+ * is one TCP connection that enrolls like nat_traversal does and then runs a
+ * closed loop of requests drawn from the mix, one outstanding request per
+ * connection. Latencies are kept in per-thread histograms and merged at the
+ * end.
+ */
+
+#define DEFAULT_SERVER_PORT 9988
+#define MSG_BUF_SIZE 512
+#define MAX_EVENTS 256
+// connects in flight per thread, so that the listen backlog isn't overrun
+#define MAX_CONNECTING 256
+#define MAX_THREADS 64
+#define MAX_SOURCES 64
+// outstanding requests get this long once the run is over
+#define DRAIN_MS 1000
+
+// latencies in microseconds: exact below 1024, then 512 buckets per power of
+// two, about 0.2% precision
+#define HIST_LINEAR 1024
+#define HIST_SUB 512
+#define HIST_BUCKETS (HIST_LINEAR + 32 * HIST_SUB)
+
+enum op {
+  OP_ENROLL,      // connect and Enroll
+  OP_LOOKUP,      // GetPeerInfo of a random peer
+  OP_LOOKUP_META, // GetPeerInfoFromMeta of a random peer
+  OP_NOTIFY,      // NotifyPeer of a random peer, answered with Delivered
+  OP_CHURN,       // disconnect, then connect and enroll again
+  N_OPS,
+};
+
+static const char *op_names[N_OPS] = {"enroll", "lookup", "meta", "notify",
+                                      "churn"};
+
+enum conn_state {
+  C_IDLE, // not connected yet
+  C_CONNECTING,
+  C_ENROLLING,
+  C_READY,
+  C_WAITING, // a request is outstanding
+};
+
+struct conn {
+  int fd;
+  int index; // across all threads, names the meta
+  enum conn_state state;
+  enum op op;
+  int64_t sent_at;
+  int64_t next_at; // think time, the next request is sent then
+  char in[MSG_BUF_SIZE];
+  size_t in_len;
+};
+
+struct hist {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+struct worker {
+  pthread_t thread;
+  int epfd;
+  struct conn *conns;
+  int n_conns;
+  unsigned int seed;
+  int connecting;
+  int next_idle;
+  struct hist hist[N_OPS];
+  uint64_t errors;
+  uint64_t pushes;   // notifications received from other clients
+  uint64_t deferred; // enrolls answered with RetryAfter
+};
+
+struct bench {
+  struct sockaddr_storage server;
+  socklen_t server_len;
+  struct sockaddr_storage sources[MAX_SOURCES];
+  socklen_t source_lens[MAX_SOURCES];
+  int n_sources;
+  int n_conns;
+  int duration_ms;
+  int think_ms;
+  int weights[N_OPS];
+  int weight_sum;
+  // ids of enrolled clients by index, 0 if not enrolled
+  uint32_t *ids;
+  // clients enrolled or given up in the first phase
+  int settled;
+  // when the mix starts and stops, 0 while clients enroll
+  int64_t start_at;
+  int64_t stop_at;
+};
+
+static struct bench bench;
+
+// definition checked against extern declaration
+int verbose = 0;
+
+static int64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bucket_of(uint64_t v) {
+  if (v < HIST_LINEAR) {
+    return v;
+  }
+  int shift = 63 - __builtin_clzll(v) - 9; // keeps the top 10 bits
+  int i = HIST_LINEAR + (shift - 1) * HIST_SUB + (int)(v >> shift) - HIST_SUB;
+  return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// the upper bound of the bucket
+static uint64_t value_of(int i) {
+  if (i < HIST_LINEAR) {
+    return i;
+  }
+  int shift = (i - HIST_LINEAR) / HIST_SUB + 1;
+  uint64_t m = (i - HIST_LINEAR) % HIST_SUB + HIST_SUB;
+  return ((m + 1) << shift) - 1;
+}
+
+static void record(struct hist *h, int64_t us) {
+  if (us < 0) {
+    us = 0;
+  }
+  ++h->counts[bucket_of(us)];
+  ++h->total;
+  if ((uint64_t)us > h->max) {
+    h->max = us;
+  }
+}
+
+static uint64_t percentile(const struct hist *h, double p) {
+  uint64_t want = (uint64_t)(h->total * p);
+  uint64_t seen = 0;
+  int i;
+  for (i = 0; i < HIST_BUCKETS; ++i) {
+    seen += h->counts[i];
+    if (seen > want) {
+      return value_of(i) < h->max ? value_of(i) : h->max;
+    }
+  }
+  return h->max;
+}
+
+static enum op pick_op(struct worker *w) {
+  int r = rand_r(&w->seed) % bench.weight_sum;
+  int op;
+  for (op = OP_LOOKUP; op < N_OPS; ++op) {
+    if (r < bench.weights[op]) {
+      break;
+    }
+    r -= bench.weights[op];
+  }
+  return op;
+}
+
+static uint32_t random_id(struct worker *w) {
+  uint32_t id = __atomic_load_n(&bench.ids[rand_r(&w->seed) % bench.n_conns],
+                                __ATOMIC_RELAXED);
+  return id ? id : 1;
+}
+
+static void meta_of(int index, char *meta) {
+  sprintf(meta, "bench-%d", index);
+}
+
+static int send_all(struct conn *c, const char *buf, size_t len) {
+  return send(c->fd, buf, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+static int send_enroll(struct conn *c) {
+  char buf[MSG_BUF_SIZE];
+  char ip[IP_STR_LEN] = "127.0.0.1";
+  char ip6[IP_STR_LEN] = {0};
+  char meta[32];
+  meta_of(c->index, meta);
+  size_t meta_len = strlen(meta);
+  char *p = buf;
+  p = encode16(p, Enroll);
+  p = encode(p, ip, IP_STR_LEN);
+  p = encode16(p, 10000 + c->index % 50000);
+  p = encode16(p, FullCone);
+  p = encode(p, ip6, IP_STR_LEN);
+  p = encode16(p, 0);
+  p = encode8(p, (uint8_t)meta_len);
+  p = encode(p, meta, meta_len);
+  return send_all(c, buf, p - buf);
+}
+
+static int send_request(struct worker *w, struct conn *c, enum op op) {
+  char buf[MSG_BUF_SIZE];
+  char meta[32];
+  char *p = buf;
+  switch (op) {
+  case OP_LOOKUP:
+    p = encode16(p, GetPeerInfo);
+    p = encode32(p, random_id(w));
+    break;
+  case OP_LOOKUP_META:
+    meta_of(rand_r(&w->seed) % bench.n_conns, meta);
+    p = encode16(p, GetPeerInfoFromMeta);
+    p = encode8(p, strlen(meta));
+    p = encode(p, meta, strlen(meta));
+    break;
+  case OP_NOTIFY:
+    p = encode16(p, NotifyPeer);
+    p = encode32(p, random_id(w));
+    break;
+  default:
+    return -1;
+  }
+  c->op = op;
+  c->state = C_WAITING;
+  c->sent_at = now_us();
+  return send_all(c, buf, p - buf);
+}
+
+static void close_conn(struct worker *w, struct conn *c) {
+  if (c->fd >= 0) {
+    close(c->fd);
+  }
+  if (c->state == C_CONNECTING) {
+    --w->connecting;
+  }
+  c->fd = -1;
+  c->state = C_IDLE;
+  c->in_len = 0;
+  __atomic_store_n(&bench.ids[c->index], 0, __ATOMIC_RELAXED);
+}
+
+// starts a non-blocking connect, the enroll follows once it completes
+static int open_conn(struct worker *w, struct conn *c) {
+  c->fd = socket(bench.server.ss_family,
+                 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd < 0) {
+    return -1;
+  }
+  if (bench.n_sources > 0) {
+    // one source address holds at most ~28k ephemeral ports
+    int i = c->index % bench.n_sources;
+    if (bind(c->fd, (struct sockaddr *)&bench.sources[i],
+             bench.source_lens[i])) {
+      close(c->fd);
+      c->fd = -1;
+      return -1;
+    }
+  }
+  if (connect(c->fd, (struct sockaddr *)&bench.server, bench.server_len) &&
+      errno != EINPROGRESS) {
+    close(c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.ptr = c;
+  epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+  c->state = C_CONNECTING;
+  c->sent_at = now_us();
+  ++w->connecting;
+  return 0;
+}
+
+// the size of the first frame in buf, 0 if incomplete, -1 if unknown. Same
+// layout as the client's parse_control_input() expects over TCP
+static ssize_t frame_len(const char *buf, size_t len) {
+  if (len < 3) {
+    return 0;
+  }
+  uint16_t type;
+  memcpy(&type, buf, sizeof(type));
+  type = ntohs(type);
+  uint8_t status = buf[2];
+  size_t need = 3;
+  switch (type) {
+  case Enroll:
+    // the id and the resume token, or the milliseconds to wait
+    need += sizeof(uint32_t) + (status == StatusOK ? RESUME_TOKEN_LEN : 0);
+    break;
+  case NotifyPeerFromMeta:
+    need += sizeof(uint32_t);
+    break;
+  case GetPeerInfo:
+  case GetPeerInfoFromMeta:
+  case NotifyPeer:
+  case MeshConnect:
+    if (status == StatusOK) {
+      need += sizeof(struct my_peer_info);
+      if (len >= need) {
+        need += ((const struct my_peer_info *)(buf + 3))->len;
+      }
+    } else if (type == GetPeerInfoFromMeta) {
+      need += 1;
+      if (len >= need) {
+        need += (uint8_t)buf[3];
+      }
+    } else {
+      need += sizeof(uint32_t);
+    }
+    break;
+  default:
+    return -1;
+  }
+  return len >= need ? (ssize_t)need : 0;
+}
+
+static void next_request(struct worker *w, struct conn *c) {
+  c->state = C_READY;
+  c->next_at = bench.think_ms > 0 ? now_us() + bench.think_ms * 1000 : 0;
+}
+
+static void handle_frame(struct worker *w, struct conn *c, const char *buf) {
+  uint16_t type;
+  memcpy(&type, buf, sizeof(type));
+  type = ntohs(type);
+  uint8_t status = buf[2];
+  int64_t now = now_us();
+
+  if (type == NotifyPeer && status == StatusOK) {
+    ++w->pushes; // another client notified us
+    return;
+  }
+  if (c->state == C_ENROLLING && type == Enroll && status == RetryAfter) {
+    // enrolled again after the wait plus jitter, like nat_traversal does
+    uint32_t wait;
+    memcpy(&wait, buf + 3, sizeof(wait));
+    wait = ntohl(wait) + 1;
+    ++w->deferred;
+    c->next_at = now + (int64_t)(wait + rand_r(&w->seed) % wait / 4) * 1000;
+    return;
+  }
+  if (c->state == C_ENROLLING && type == Enroll) {
+    uint32_t id;
+    memcpy(&id, buf + 3, sizeof(id));
+    __atomic_store_n(&bench.ids[c->index], ntohl(id), __ATOMIC_RELAXED);
+    record(&w->hist[c->op], now - c->sent_at);
+    if (c->op == OP_ENROLL) {
+      __atomic_add_fetch(&bench.settled, 1, __ATOMIC_RELAXED);
+    }
+    next_request(w, c);
+    return;
+  }
+  if (c->state != C_WAITING) {
+    return;
+  }
+  int replied = 0;
+  switch (c->op) {
+  case OP_LOOKUP:
+    replied = type == GetPeerInfo;
+    break;
+  case OP_LOOKUP_META:
+    replied = type == GetPeerInfoFromMeta;
+    break;
+  case OP_NOTIFY:
+    replied = type == NotifyPeer;
+    break;
+  default:
+    break;
+  }
+  if (replied) {
+    record(&w->hist[c->op], now - c->sent_at);
+    next_request(w, c);
+  }
+}
+
+static void conn_ready(struct worker *w, struct conn *c, uint32_t events) {
+  if (c->state == C_CONNECTING) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err || (events & (EPOLLERR | EPOLLHUP))) {
+      goto failed;
+    }
+    --w->connecting;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->state = C_ENROLLING;
+    c->next_at = 0;
+    if (send_enroll(c) < 0) {
+      goto failed;
+    }
+    return;
+  }
+
+  ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+  if (n <= 0) {
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    goto failed;
+  }
+  c->in_len += n;
+  ssize_t len;
+  while ((len = frame_len(c->in, c->in_len)) > 0) {
+    handle_frame(w, c, c->in);
+    memmove(c->in, c->in + len, c->in_len - len);
+    c->in_len -= len;
+  }
+  if (len < 0) {
+    goto failed;
+  }
+  return;
+
+failed:
+  ++w->errors;
+  if (c->state == C_CONNECTING || c->state == C_ENROLLING) {
+    if (c->op == OP_ENROLL) {
+      __atomic_add_fetch(&bench.settled, 1, __ATOMIC_RELAXED);
+    }
+  }
+  close_conn(w, c);
+  // reconnected by the churn path during the run
+  c->op = OP_CHURN;
+}
+
+// issues the next request of every ready connection and opens idle ones, up
+// to MAX_CONNECTING at a time
+static void drive(struct worker *w) {
+  int64_t now = now_us();
+  int running = bench.start_at > 0 && now < bench.stop_at;
+  int i;
+  for (; w->next_idle < w->n_conns && w->connecting < MAX_CONNECTING;
+       ++w->next_idle) {
+    struct conn *c = &w->conns[w->next_idle];
+    c->op = OP_ENROLL;
+    if (open_conn(w, c) < 0) {
+      ++w->errors;
+      __atomic_add_fetch(&bench.settled, 1, __ATOMIC_RELAXED);
+    }
+  }
+  for (i = 0; i < w->n_conns; ++i) {
+    struct conn *c = &w->conns[i];
+    if (c->state == C_ENROLLING && c->next_at > 0 && c->next_at <= now) {
+      c->next_at = 0;
+      if (send_enroll(c) < 0) {
+        ++w->errors;
+      }
+      continue;
+    }
+    if (!running) {
+      continue;
+    }
+    if (c->state == C_IDLE && c->op == OP_CHURN &&
+        w->connecting < MAX_CONNECTING) {
+      open_conn(w, c);
+      continue;
+    }
+    if (c->state != C_READY || c->next_at > now) {
+      continue;
+    }
+    enum op op = pick_op(w);
+    if (op == OP_CHURN) {
+      close_conn(w, c);
+      c->op = OP_CHURN;
+      if (open_conn(w, c) < 0) {
+        ++w->errors;
+      }
+    } else if (send_request(w, c, op) < 0) {
+      ++w->errors;
+      close_conn(w, c);
+      c->op = OP_CHURN;
+    }
+  }
+}
+
+static void *run_worker(void *arg) {
+  struct worker *w = arg;
+  struct epoll_event events[MAX_EVENTS];
+  for (;;) {
+    int64_t now = now_us();
+    if (bench.start_at > 0 && now >= bench.stop_at + DRAIN_MS * 1000) {
+      break;
+    }
+    drive(w);
+    // ready connections are driven again soon when think time is set
+    int n = epoll_wait(w->epfd, events, MAX_EVENTS, 1);
+    int i;
+    for (i = 0; i < n; ++i) {
+      conn_ready(w, events[i].data.ptr, events[i].events);
+    }
+  }
+  int i;
+  for (i = 0; i < w->n_conns; ++i) {
+    if (w->conns[i].fd >= 0) {
+      close(w->conns[i].fd);
+    }
+  }
+  return NULL;
+}
+
+static void merge(struct hist *into, const struct hist *from) {
+  int i;
+  for (i = 0; i < HIST_BUCKETS; ++i) {
+    into->counts[i] += from->counts[i];
+  }
+  into->total += from->total;
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+static void report_op(const char *name, const struct hist *h, double secs) {
+  if (h->total == 0) {
+    return;
+  }
+  printf("%-8s %10llu ops %10.0f/s  p50 %6llu us  p99 %6llu us  "
+         "p999 %7llu us  max %7llu us\n",
+         name, (unsigned long long)h->total, secs > 0 ? h->total / secs : 0,
+         (unsigned long long)percentile(h, 0.5),
+         (unsigned long long)percentile(h, 0.99),
+         (unsigned long long)percentile(h, 0.999),
+         (unsigned long long)h->max);
+}
+
+// VmRSS and VmHWM of the server, if its pid was given
+static void report_rss(int pid) {
+  char path[64], line[256];
+  sprintf(path, "/proc/%d/status", pid);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    printf("server rss: unknown, %s unreadable\n", path);
+    return;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (!strncmp(line, "VmRSS:", 6) || !strncmp(line, "VmHWM:", 6)) {
+      printf("server %s", line);
+    }
+  }
+  fclose(f);
+}
+
+// "lookup=70,meta=20,notify=10,churn=0", unnamed ops keep their weight
+static int parse_mix(char *mix) {
+  char *save = NULL;
+  char *item;
+  for (item = strtok_r(mix, ",", &save); item != NULL;
+       item = strtok_r(NULL, ",", &save)) {
+    char *eq = strchr(item, '=');
+    int op;
+    if (eq == NULL) {
+      return -1;
+    }
+    *eq = '\0';
+    for (op = OP_LOOKUP; op < N_OPS && strcmp(op_names[op], item); ++op) {
+    }
+    if (op == N_OPS) {
+      return -1;
+    }
+    bench.weights[op] = atoi(eq + 1);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char *server = "127.0.0.1";
+  uint16_t port = DEFAULT_SERVER_PORT;
+  int n_threads = 1;
+  int server_pid = 0;
+  bench.n_conns = 1000;
+  bench.duration_ms = 10 * 1000;
+  bench.weights[OP_LOOKUP] = 70;
+  bench.weights[OP_LOOKUP_META] = 20;
+  bench.weights[OP_NOTIFY] = 10;
+
+  static char usage[] =
+      "usage: [-h] [-s punch server] [-P port] [-n connections] "
+      "[-t seconds] [-j threads] [-w think time ms] "
+      "[-m lookup=70,meta=20,notify=10,churn=0] "
+      "[-a source address, repeatable] [-p server pid for rss]\n";
+  int opt;
+  while ((opt = getopt(argc, argv, "hs:P:n:t:j:w:m:a:p:")) != -1) {
+    switch (opt) {
+    case 'h':
+      printf("%s", usage);
+      return 0;
+    case 's':
+      server = optarg;
+      break;
+    case 'P':
+      port = atoi(optarg);
+      break;
+    case 'n':
+      bench.n_conns = atoi(optarg);
+      break;
+    case 't':
+      bench.duration_ms = atoi(optarg) * 1000;
+      break;
+    case 'j':
+      n_threads = atoi(optarg);
+      break;
+    case 'w':
+      bench.think_ms = atoi(optarg);
+      break;
+    case 'm':
+      if (parse_mix(optarg) < 0) {
+        printf("invalid mix: %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'a':
+      if (bench.n_sources == MAX_SOURCES) {
+        break;
+      }
+      bench.source_lens[bench.n_sources] =
+          make_sockaddr(optarg, 0, &bench.sources[bench.n_sources]);
+      if (!bench.source_lens[bench.n_sources]) {
+        printf("invalid source address %s\n", optarg);
+        return -1;
+      }
+      ++bench.n_sources;
+      break;
+    case 'p':
+      server_pid = atoi(optarg);
+      break;
+    case '?':
+    default:
+      printf("invalid option: %c\n", opt);
+      printf("%s", usage);
+      return -1;
+    }
+  }
+  int op;
+  for (op = OP_LOOKUP; op < N_OPS; ++op) {
+    bench.weight_sum += bench.weights[op];
+  }
+  if (bench.n_conns <= 0 || bench.weight_sum <= 0 || n_threads <= 0 ||
+      n_threads > MAX_THREADS) {
+    printf("%s", usage);
+    return -1;
+  }
+  bench.server_len = make_sockaddr(server, port, &bench.server);
+  if (!bench.server_len) {
+    printf("invalid punch server address %s\n", server);
+    return -1;
+  }
+
+  // one descriptor per connection, raised up to the hard limit
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    rlim_t want = bench.n_conns + 64;
+    limit.rlim_cur = want < limit.rlim_max ? want : limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < want) {
+      printf("RLIMIT_NOFILE allows only %llu descriptors\n",
+             (unsigned long long)limit.rlim_cur);
+    }
+  }
+
+  bench.ids = calloc(bench.n_conns, sizeof(uint32_t));
+  struct conn *conns = calloc(bench.n_conns, sizeof(struct conn));
+  struct worker *workers = calloc(n_threads, sizeof(struct worker));
+  if (bench.ids == NULL || conns == NULL || workers == NULL) {
+    printf("out of memory\n");
+    return -1;
+  }
+  int i;
+  for (i = 0; i < bench.n_conns; ++i) {
+    conns[i].fd = -1;
+    conns[i].index = i;
+  }
+
+  int64_t begin = now_us();
+  int per_thread = (bench.n_conns + n_threads - 1) / n_threads;
+  for (i = 0; i < n_threads; ++i) {
+    struct worker *w = &workers[i];
+    w->conns = conns + i * per_thread;
+    w->n_conns = bench.n_conns - i * per_thread;
+    if (w->n_conns > per_thread) {
+      w->n_conns = per_thread;
+    }
+    if (w->n_conns < 0) {
+      w->n_conns = 0;
+    }
+    w->seed = time(NULL) ^ (i * 2654435761u);
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0 || pthread_create(&w->thread, NULL, run_worker, w)) {
+      printf("failed to start worker %d\n", i);
+      return -1;
+    }
+  }
+
+  // every client enrolls first, then the mix runs for the duration
+  while (__atomic_load_n(&bench.settled, __ATOMIC_RELAXED) < bench.n_conns) {
+    usleep(10 * 1000);
+  }
+  int64_t enrolled_at = now_us();
+  bench.stop_at = enrolled_at + (int64_t)bench.duration_ms * 1000;
+  __atomic_store_n(&bench.start_at, enrolled_at, __ATOMIC_RELEASE);
+  int enrolled = 0;
+  for (i = 0; i < bench.n_conns; ++i) {
+    enrolled += __atomic_load_n(&bench.ids[i], __ATOMIC_RELAXED) != 0;
+  }
+  printf("%d of %d clients enrolled in %.2f s\n", enrolled, bench.n_conns,
+         (enrolled_at - begin) / 1e6);
+  if (server_pid > 0) {
+    report_rss(server_pid);
+  }
+
+  struct hist *total = calloc(N_OPS + 1, sizeof(struct hist));
+  uint64_t errors = 0, pushes = 0, deferred = 0;
+  for (i = 0; i < n_threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    for (op = 0; op < N_OPS; ++op) {
+      merge(&total[op], &workers[i].hist[op]);
+      if (op != OP_ENROLL) {
+        merge(&total[N_OPS], &workers[i].hist[op]);
+      }
+    }
+    errors += workers[i].errors;
+    pushes += workers[i].pushes;
+    deferred += workers[i].deferred;
+  }
+
+  report_op(op_names[OP_ENROLL], &total[OP_ENROLL],
+            (enrolled_at - begin) / 1e6);
+  double secs = bench.duration_ms / 1e3;
+  for (op = OP_LOOKUP; op < N_OPS; ++op) {
+    report_op(op_names[op], &total[op], secs);
+  }
+  report_op("all", &total[N_OPS], secs);
+  printf("notifications received: %llu, enrolls deferred: %llu, errors: "
+         "%llu\n",
+         (unsigned long long)pushes, (unsigned long long)deferred,
+         (unsigned long long)errors);
+  if (server_pid > 0) {
+    report_rss(server_pid);
+  }
+  return 0;
+}
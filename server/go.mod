@@ -0,0 +1,5 @@
+module github.com/contrun/nat_traversal/server
+
+go 1.21
+
+require github.com/sirupsen/logrus v1.9.3
@@ -0,0 +1,2449 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	crand "crypto/rand"
+	"crypto/subtle"
+	"encoding/binary"
+	"errors"
+	"flag"
+	"hash/crc32"
+	"hash/fnv"
+	"io"
+	"math"
+	"math/rand"
+	"net"
+	"os"
+	"os/signal"
+	"runtime"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+
+	log "github.com/sirupsen/logrus"
+)
+
+// IPLen is the size of a textual IP on the wire, large enough for IPv6
+const IPLen = 46
+
+type PeerInfo struct {
+	IP      [IPLen]byte
+	Port    uint16
+	NatType uint16
+	// global IPv6 address for the direct path, empty if the peer has none
+	IP6   [IPLen]byte
+	Port6 uint16
+	Meta  string
+	ID    uint32
+	// the record as sent to other peers, encoded once by register
+	wire []byte
+	// handed out with the ID, the peer reclaims both with it
+	token [TokenLen]byte
+}
+
+// TokenLen is the size of resume tokens
+const TokenLen = 16
+
+type natInfo struct {
+	IP      [IPLen]byte
+	Port    uint16
+	NatType uint16
+	IP6     [IPLen]byte
+	Port6   uint16
+}
+
+const (
+	_ = iota
+	Enroll
+	GetPeerInfo
+	NotifyPeer
+	GetPeerInfoFromMeta
+	NotifyPeerFromMeta
+	// sent over UDP by enrolled peers to keep their mapping and registration
+	// alive, the source address of the latest one is where the peer is reached
+	Keepalive
+	// joins the peer to a group, whose members all get connected pairwise
+	JoinMesh
+	// pushed to the peer that starts the traversal of a mesh pair
+	MeshConnect
+	// the outcome of a mesh pair, reported by the peer that started it
+	MeshResult
+	// reclaims the ID and record of an earlier enroll with its token
+	Resume
+	// ports a peer's pooled sockets were mapped to, passed on to the peer it
+	// traverses to with the sender's ID, best effort and not replied
+	PortHint
+	// asks for a relay to the peer, answered with the sender's half
+	RelayAlloc
+	// pushed to the peer with its half of the relay and the sender's record
+	RelayOffer
+
+	// status byte following the message type in every reply, so that clients
+	// can tell replies and notifications apart without blocking on them
+	StatusOK    uint8 = 0
+	PeerOffline uint8 = 1
+	PeerError   uint8 = 2
+	// the notification was passed on to the peer
+	Delivered uint8 = 3
+	// the enroll was refused under load, followed by the milliseconds the
+	// client waits before enrolling again
+	RetryAfter uint8 = 4
+
+	// the TCP and the UDP rendezvous channel share the port
+	ListeningPort = ":9988"
+)
+
+// UDPPeerTimeout is how long a peer enrolled over UDP stays registered
+// without sending anything
+const UDPPeerTimeout = 60 * time.Second
+
+// ResumeWindow is how long the record of a peer that left, or that was
+// loaded from the snapshot, waits to be resumed
+const ResumeWindow = 5 * time.Minute
+
+// MaxHintPorts is the most ports a port hint may carry, MAX_POOL of the
+// client, a client reading a longer one would overflow its buffer
+const MaxHintPorts = 16
+
+// admission control of enrolls and resumes, so that a reconnect storm is
+// turned away cheaply and drained at a steady rate instead of piling up on
+// the peer maps
+const (
+	// shortest wait asked of a refused client
+	MinRetryAfter = 250 * time.Millisecond
+	// how long an accepted connection may take to enroll
+	EnrollTimeout = 30 * time.Second
+	// source buckets untouched for this long are full again and dropped
+	BucketIdle = time.Minute
+)
+
+var (
+	seq              uint32 = 1
+	peers            map[uint32]PeerInfo
+	peersFromMeta    map[string]PeerInfo
+	peerConn         map[uint32]io.Writer
+	peerConnFromMeta map[string]io.Writer
+	mutex            sync.RWMutex
+	letterRunes      = []rune("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ")
+	ErrPeerNotFound  = errors.New("Peer not found")
+	ErrConnNotFound  = errors.New("Connection not found, peer maybe is now offline")
+)
+
+// mesh pairs are started in rounds, each NAT gets at most MeshNATBudget
+// mappings of pairs in flight, but always at least one pair
+const (
+	MeshRound       = 100 * time.Millisecond
+	MeshNATBudget   = 1024
+	MeshPairTimeout = 2 * time.Minute
+	// holes opened by a client that can't reuse its mapping, NUM_OF_PORTS
+	MeshHoles = 700
+)
+
+// peers enrolled over UDP, by observed address and by ID, guarded by mutex
+var (
+	udpPeerIDs map[string]uint32
+	udpSeen    map[uint32]time.Time
+)
+
+// parked holds the records of peers gone since less than ResumeWindow, by
+// ID, guarded by mutex
+type parkedPeer struct {
+	PeerInfo
+	since time.Time
+}
+
+var parked map[uint32]parkedPeer
+
+// meshes by group name, guarded by meshMutex, which is never taken while
+// holding mutex
+var (
+	meshes    map[string]*mesh
+	meshMutex sync.Mutex
+)
+
+func init() {
+	meshes = make(map[string]*mesh)
+	peers = make(map[uint32]PeerInfo)
+	peersFromMeta = make(map[string]PeerInfo)
+	peerConn = make(map[uint32]io.Writer)
+	peerConnFromMeta = make(map[string]io.Writer)
+	udpPeerIDs = make(map[string]uint32)
+	udpSeen = make(map[uint32]time.Time)
+	parked = make(map[uint32]parkedPeer)
+	rand.Seed(time.Now().UnixNano())
+
+	log.SetOutput(os.Stdout)
+	log.SetLevel(log.InfoLevel)
+}
+
+func main() {
+	listen := flag.String("listen", ListeningPort, "address of the TCP and the UDP channel")
+	nodes := flag.String("cluster", "", "comma separated link addresses of every node, in the same order on all of them")
+	self := flag.Int("node", 0, "index of this node in -cluster")
+	enrollRate := flag.Float64("enroll-rate", 2000, "enrolls and resumes admitted per second, 0 for no limit")
+	sourceRate := flag.Float64("source-rate", 20, "enrolls and resumes admitted per second from one IP, 0 for no limit")
+	maxPending := flag.Int("max-pending", 4096, "connections accepted but not enrolled yet, the rest wait in the listen backlog")
+	verbose := flag.Bool("v", false, "log every connection and peer")
+	snapshotPath := flag.String("snapshot", "", "file keeping the registry across restarts, so that peers resume their IDs")
+	snapshotEvery := flag.Duration("snapshot-interval", 5*time.Second, "how often the snapshot is written")
+	flag.IntVar(&maxRelays, "max-relays", 1024, "relays open at once for peers that can't punch, 0 disables relaying")
+	flag.Parse()
+	if *verbose {
+		log.SetLevel(log.DebugLevel)
+	}
+	if *snapshotPath != "" {
+		snap, err := openSnapshot(*snapshotPath)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err": err,
+			}).Fatal("Unable to open the snapshot")
+		}
+		log.WithFields(log.Fields{
+			"peers": snap.load(),
+		}).Info("Snapshot loaded")
+		go snap.run(*snapshotEvery)
+	}
+	adm = newAdmission(*enrollRate, *sourceRate)
+	if _, ok := mmsgTraps[runtime.GOARCH]; !ok && maxRelays > 0 {
+		log.WithFields(log.Fields{
+			"arch": runtime.GOARCH,
+		}).Warn("Relaying is not supported here")
+		maxRelays = 0
+	}
+	if *maxPending < 1 {
+		*maxPending = 1
+	}
+	pending := make(chan struct{}, *maxPending)
+
+	l, err := net.Listen("tcp", *listen)
+	if err != nil {
+		log.WithFields(log.Fields{
+			"err": err,
+		}).Fatal("Unable to start server")
+	}
+	defer l.Close()
+	addr, err := net.ResolveUDPAddr("udp", *listen)
+	if err == nil {
+		var u *net.UDPConn
+		if u, err = net.ListenUDP("udp", addr); err == nil {
+			go serveUDP(u)
+			go expireUDPPeers()
+		}
+	}
+	if err != nil {
+		log.WithFields(log.Fields{
+			"err": err,
+		}).Fatal("Unable to start UDP rendezvous")
+	}
+	if *nodes != "" {
+		addrs := strings.Split(*nodes, ",")
+		if *self < 0 || *self >= len(addrs) {
+			log.WithFields(log.Fields{
+				"node":  *self,
+				"nodes": len(addrs),
+			}).Fatal("Node index out of the cluster")
+		}
+		ll, err := net.Listen("tcp", addrs[*self])
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err": err,
+			}).Fatal("Unable to listen for links")
+		}
+		cl = newCluster(addrs, *self)
+		go serveLinks(ll)
+		for n, l := range cl.links {
+			if n != *self {
+				go l.run()
+			}
+		}
+	}
+	go dumpPeers()
+	go expireParked()
+	go expireRelays()
+	go scheduleMeshes()
+	for {
+		// a slot is taken before accepting, so that connections beyond
+		// maxPending wait in the kernel instead of costing a goroutine each
+		pending <- struct{}{}
+		conn, err := l.Accept()
+		if err != nil {
+			<-pending
+			log.WithFields(log.Fields{
+				"err": err,
+			}).Error("Accepting connection failed")
+			continue
+		}
+		go handleConn(conn, pending)
+	}
+}
+
+func dumpPeers() {
+	for {
+		time.Sleep(10 * time.Second)
+		if !log.IsLevelEnabled(log.DebugLevel) {
+			continue
+		}
+		mutex.RLock()
+		for k, v := range peers {
+			log.WithFields(log.Fields{
+				"Key":     k,
+				"ID":      v.ID,
+				"Meta":    v.Meta,
+				"IP":      string(v.IP[:]),
+				"Port":    v.Port,
+				"NatType": v.NatType,
+				"IP6":     string(v.IP6[:]),
+				"Port6":   v.Port6,
+			}).Debug("peer info")
+		}
+		mutex.RUnlock()
+	}
+}
+
+func RandStringRunes(n int) string {
+	b := make([]rune, n)
+	for i := range b {
+		b[i] = letterRunes[rand.Intn(len(letterRunes))]
+	}
+	return string(b)
+}
+
+func readMeta(c io.Reader) (meta string, err error) {
+	var metaSize uint8
+	err = binary.Read(c, binary.BigEndian, &metaSize)
+	if err != nil || metaSize == 0 {
+		log.WithFields(log.Fields{
+			"err":      err,
+			"metaSize": metaSize,
+		}).Debug("reading meta failed")
+		return
+	}
+	data := make([]byte, metaSize)
+	if _, err = io.ReadFull(c, data); err != nil {
+		log.WithFields(log.Fields{
+			"err": err,
+		}).Info("reading meta failed")
+		return
+	}
+	meta = string(data)
+	return
+}
+
+func writeMeta(c io.Writer, meta string) (err error) {
+	err = binary.Write(c, binary.BigEndian, uint8(len(meta)))
+	if err != nil {
+		return
+	}
+	return binary.Write(c, binary.BigEndian, []byte(meta))
+}
+
+func readPeerInfo(r io.Reader) (p PeerInfo, err error) {
+	var n natInfo
+	if err = binary.Read(r, binary.BigEndian, &n); err != nil {
+		return
+	}
+	p = PeerInfo{
+		IP:      n.IP,
+		Port:    n.Port,
+		NatType: n.NatType,
+		IP6:     n.IP6,
+		Port6:   n.Port6,
+	}
+
+	meta, err := readMeta(r)
+	if err != nil {
+		log.WithFields(log.Fields{
+			"err": err,
+		}).Warn("reading meta failed")
+		meta = RandStringRunes(18)
+	}
+	p.Meta = meta
+	if log.IsLevelEnabled(log.DebugLevel) {
+		log.WithFields(log.Fields{
+			"meta": meta,
+		}).Debug("reading meta succeeded")
+	}
+	return
+}
+
+// encodePeer lays out the record of the peer as sent in replies and
+// notifications: the ID, the natInfo fields and the meta
+func encodePeer(p PeerInfo) []byte {
+	b := make([]byte, 0, 4+2*IPLen+6+1+len(p.Meta))
+	b = binary.BigEndian.AppendUint32(b, p.ID)
+	b = append(b, p.IP[:]...)
+	b = binary.BigEndian.AppendUint16(b, p.Port)
+	b = binary.BigEndian.AppendUint16(b, p.NatType)
+	b = append(b, p.IP6[:]...)
+	b = binary.BigEndian.AppendUint16(b, p.Port6)
+	b = append(b, uint8(len(p.Meta)))
+	return append(b, p.Meta...)
+}
+
+// writeReply frames a reply as message type, status and payload, the frame
+// goes out in one Write so that notifications pushed from other connections'
+// goroutines never interleave with it
+func writeReply(w io.Writer, t uint16, status uint8, payload []byte) (err error) {
+	buf := make([]byte, 3, 3+len(payload))
+	binary.BigEndian.PutUint16(buf, t)
+	buf[2] = status
+	_, err = w.Write(append(buf, payload...))
+	return
+}
+
+func writeID(w io.Writer, t uint16, status uint8, id uint32) (err error) {
+	var payload [4]byte
+	binary.BigEndian.PutUint32(payload[:], id)
+	return writeReply(w, t, status, payload[:])
+}
+
+func writeMetaReply(w io.Writer, t uint16, status uint8, meta string) (err error) {
+	var buf bytes.Buffer
+	if err = writeMeta(&buf, meta); err != nil {
+		return
+	}
+	return writeReply(w, t, status, (&buf).Bytes())
+}
+
+func writePeerInfo(w io.Writer, t uint16, p PeerInfo) (err error) {
+	payload := p.wire
+	if payload == nil {
+		payload = encodePeer(p)
+	}
+	return writeReply(w, t, StatusOK, payload)
+}
+
+// push sends a frame the peer didn't ask for, replies still buffered on its
+// connection go out with it
+func push(w io.Writer, t uint16, p PeerInfo) (err error) {
+	payload := p.wire
+	if payload == nil {
+		payload = encodePeer(p)
+	}
+	return pushFrame(w, t, payload)
+}
+
+func pushFrame(w io.Writer, t uint16, payload []byte) (err error) {
+	if err = writeReply(w, t, StatusOK, payload); err != nil {
+		return
+	}
+	if cw, ok := w.(*connWriter); ok {
+		err = cw.Flush()
+	}
+	return
+}
+
+// connWriter buffers the frames for a TCP peer, so that replies to pipelined
+// requests leave in one write. Frames pushed from other connections'
+// goroutines go through the same lock and never interleave with them
+type connWriter struct {
+	mu sync.Mutex
+	w  *bufio.Writer
+}
+
+func (cw *connWriter) Write(b []byte) (int, error) {
+	cw.mu.Lock()
+	defer cw.mu.Unlock()
+	return cw.w.Write(b)
+}
+
+func (cw *connWriter) Flush() error {
+	cw.mu.Lock()
+	defer cw.mu.Unlock()
+	return cw.w.Flush()
+}
+
+// flushingReader flushes the replies before the connection blocks for more
+// requests, the reads of a bufio.Reader on top only get here once its buffer
+// is drained
+type flushingReader struct {
+	c  net.Conn
+	cw *connWriter
+}
+
+func (r flushingReader) Read(b []byte) (int, error) {
+	if err := r.cw.Flush(); err != nil {
+		return 0, err
+	}
+	return r.c.Read(b)
+}
+
+func getPeerInfo(p PeerInfo) (p1 PeerInfo, err error) {
+	var ok bool
+	mutex.RLock()
+	defer mutex.RUnlock()
+	if p.ID != 0 {
+		if p1, ok = peers[p.ID]; ok {
+			return
+		}
+	}
+	if p.Meta != "" {
+		if p1, ok = peersFromMeta[p.Meta]; ok {
+			return
+		}
+	}
+	err = ErrPeerNotFound
+	return
+}
+
+func getConn(p PeerInfo) (c io.Writer, err error) {
+	var ok bool
+	mutex.RLock()
+	defer mutex.RUnlock()
+	if p.ID != 0 {
+		if c, ok = peerConn[p.ID]; ok {
+			return
+		}
+	}
+	if p.Meta != "" {
+		if c, ok = peerConnFromMeta[p.Meta]; ok {
+			return
+		}
+	}
+	err = ErrConnNotFound
+	return
+}
+
+// removePeer drops every record of the peer but the parked one, the caller
+// holds the lock
+func removePeer(p PeerInfo) {
+	if q, ok := peers[p.ID]; ok {
+		parked[p.ID] = parkedPeer{q, time.Now()}
+	}
+	delete(peers, p.ID)
+	delete(peerConn, p.ID)
+	if q, ok := peersFromMeta[p.Meta]; ok && q.ID == p.ID {
+		delete(peersFromMeta, p.Meta)
+		delete(peerConnFromMeta, p.Meta)
+	}
+	if cl != nil {
+		cl.metaDel(p)
+	}
+}
+
+// register records the peer and where its notifications go, the caller holds
+// the lock. The wire record of p is encoded before, outside the lock
+func register(p *PeerInfo, w io.Writer) {
+	peers[p.ID] = *p
+	peerConn[p.ID] = w
+	if p.Meta != "" {
+		peersFromMeta[p.Meta] = *p
+		peerConnFromMeta[p.Meta] = w
+	}
+	if cl != nil {
+		cl.metaSet(*p)
+	}
+}
+
+// newToken draws a resume token
+func newToken() (t [TokenLen]byte) {
+	if _, err := crand.Read(t[:]); err != nil {
+		log.WithFields(log.Fields{
+			"err": err,
+		}).Error("Drawing a resume token failed")
+	}
+	return
+}
+
+// resume hands the record enrolled with token back to its peer. The peer may
+// still be registered from a connection the server hasn't seen go yet. The
+// caller holds the lock
+func resume(id uint32, token []byte) (p PeerInfo, ok bool) {
+	if cl != nil && cl.idOwner(id) != cl.self {
+		return
+	}
+	if q, live := peers[id]; live && subtle.ConstantTimeCompare(q.token[:], token) == 1 {
+		removePeer(q)
+	}
+	r, found := parked[id]
+	if !found || subtle.ConstantTimeCompare(r.token[:], token) != 1 {
+		return
+	}
+	delete(parked, id)
+	return r.PeerInfo, true
+}
+
+// readResume reads the body of a Resume, the ID and the token
+func readResume(r io.Reader) (id uint32, token [TokenLen]byte, err error) {
+	if err = binary.Read(r, binary.BigEndian, &id); err != nil {
+		return
+	}
+	_, err = io.ReadFull(r, token[:])
+	return
+}
+
+// enrollReply is the ID and the resume token, followed over UDP by the
+// reflexive address the request came from
+func enrollReply(p PeerInfo, addr *net.UDPAddr) []byte {
+	b := make([]byte, 0, 4+TokenLen+IPLen+2)
+	b = binary.BigEndian.AppendUint32(b, p.ID)
+	b = append(b, p.token[:]...)
+	if addr != nil {
+		var ip [IPLen]byte
+		copy(ip[:], addr.IP.String())
+		b = append(b, ip[:]...)
+		b = binary.BigEndian.AppendUint16(b, uint16(addr.Port))
+	}
+	return b
+}
+
+// 2 bytes for message type. The pending slot of the connection is given back
+// once it enrolls or closes
+func handleConn(c net.Conn, pending chan struct{}) {
+	var once sync.Once
+	release := func() {
+		once.Do(func() { <-pending })
+	}
+	defer release()
+	defer c.Close()
+	log.Debug("new connection received")
+	c.SetReadDeadline(time.Now().Add(EnrollTimeout))
+	var source string
+	if a, ok := c.RemoteAddr().(*net.TCPAddr); ok {
+		source = a.IP.String()
+	}
+	var myInfo PeerInfo
+	w := &connWriter{w: bufio.NewWriter(c)}
+	r := bufio.NewReader(flushingReader{c, w})
+	var data [2]byte
+	for {
+		_, err := io.ReadFull(r, data[:])
+		if err == nil && log.IsLevelEnabled(log.TraceLevel) {
+			log.WithFields(log.Fields{
+				"header": data,
+			}).Trace("new received header")
+		}
+		if err != nil {
+			mutex.Lock()
+			if peerConn[myInfo.ID] == io.Writer(w) {
+				// not resumed from another connection meanwhile
+				removePeer(myInfo)
+			}
+			mutex.Unlock()
+			log.WithFields(log.Fields{
+				"err":  err,
+				"myID": myInfo.ID,
+			}).Debug("peer left")
+			return
+		}
+		t := binary.BigEndian.Uint16(data[:])
+		switch t {
+		case Enroll:
+			p, err := readPeerInfo(r)
+			if err != nil {
+				log.WithFields(log.Fields{
+					"err": err,
+				}).Warn("Reading meta failed")
+				break
+			}
+			if myInfo.ID == 0 {
+				if wait := adm.admit(source); wait > 0 {
+					c.SetReadDeadline(time.Now().Add(wait + EnrollTimeout))
+					writeID(w, Enroll, RetryAfter, uint32(wait/time.Millisecond))
+					break
+				}
+			}
+			p.ID = nextID()
+			p.wire = encodePeer(p)
+			p.token = newToken()
+			mutex.Lock()
+			if myInfo.ID != 0 {
+				// enrolling again replaces the previous registration
+				removePeer(myInfo)
+			}
+			myInfo = p
+			register(&myInfo, w)
+			mutex.Unlock()
+			c.SetReadDeadline(time.Time{})
+			release()
+			if log.IsLevelEnabled(log.DebugLevel) {
+				log.WithFields(log.Fields{
+					"ID":      myInfo.ID,
+					"Meta":    myInfo.Meta,
+					"IP":      string(myInfo.IP[:]),
+					"Port":    myInfo.Port,
+					"NatType": myInfo.NatType,
+					"IP6":     string(myInfo.IP6[:]),
+					"Port6":   myInfo.Port6,
+				}).Debug("New peer enrolled")
+			}
+			err = writeReply(w, Enroll, StatusOK, enrollReply(myInfo, nil))
+			if err != nil {
+				log.WithFields(log.Fields{
+					"err":     err,
+					"ID":      myInfo.ID,
+					"Meta":    myInfo.Meta,
+					"IP":      string(myInfo.IP[:]),
+					"Port":    myInfo.Port,
+					"NatType": myInfo.NatType,
+				}).Warn("Unable to return my peer info")
+				break
+			}
+		case Resume:
+			id, token, err := readResume(r)
+			if err != nil {
+				break
+			}
+			if myInfo.ID == 0 {
+				// a restart brings every client back at once
+				if wait := adm.admit(source); wait > 0 {
+					c.SetReadDeadline(time.Now().Add(wait + EnrollTimeout))
+					writeID(w, Resume, RetryAfter, uint32(wait/time.Millisecond))
+					break
+				}
+			}
+			mutex.Lock()
+			p, ok := resume(id, token[:])
+			if ok {
+				if myInfo.ID != 0 && myInfo.ID != id {
+					removePeer(myInfo)
+				}
+				myInfo = p
+				register(&myInfo, w)
+			}
+			mutex.Unlock()
+			if !ok {
+				writeID(w, Resume, PeerOffline, id)
+				break
+			}
+			c.SetReadDeadline(time.Time{})
+			release()
+			log.WithFields(log.Fields{
+				"ID": id,
+			}).Debug("Peer resumed")
+			writeReply(w, Resume, StatusOK, enrollReply(myInfo, nil))
+		default:
+			handleRequest(t, r, w, myInfo)
+		}
+	}
+
+	return
+}
+
+// handleRequest serves the messages that are the same on both channels,
+// failures carry the requested key so that replies can be matched to requests
+// on UDP, where they may be lost or reordered
+func handleRequest(t uint16, r io.Reader, w io.Writer, myInfo PeerInfo) {
+	switch t {
+	case GetPeerInfo:
+		var peerID uint32
+		err := binary.Read(r, binary.BigEndian, &peerID)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"peerID": peerID,
+				"myID":   myInfo.ID,
+			}).Warn("Unable to get peer id")
+			writeID(w, GetPeerInfo, PeerOffline, peerID)
+			break
+		}
+		peer, err := findPeer(PeerInfo{ID: peerID})
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"peerID": peerID,
+				"myID":   myInfo.ID,
+			}).Warn("Unable to get peer info")
+			writeID(w, GetPeerInfo, PeerOffline, peerID)
+			break
+		}
+		err = writePeerInfo(w, GetPeerInfo, peer)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"peerID": peerID,
+				"myID":   myInfo.ID,
+			}).Warn("Unable to write peer info")
+			break
+		}
+	case NotifyPeer:
+		var peerID uint32
+		err := binary.Read(r, binary.BigEndian, &peerID)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"peerID": peerID,
+				"myID":   myInfo.ID,
+			}).Warn("Unable to get peer id")
+			break
+		}
+		err = notifyPeer(PeerInfo{ID: peerID}, myInfo)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"peerID": peerID,
+				"myID":   myInfo.ID,
+			}).Warn("Unable to notify peer")
+			writeID(w, NotifyPeer, PeerOffline, peerID)
+			break
+		}
+		writeID(w, NotifyPeer, Delivered, peerID)
+	case GetPeerInfoFromMeta:
+		peerMeta, err := readMeta(r)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"myMeta": myInfo.Meta,
+			}).Warn("Unable to get peer meta")
+			writeMetaReply(w, GetPeerInfoFromMeta, PeerOffline, peerMeta)
+			break
+		}
+		peer, err := findPeer(PeerInfo{Meta: peerMeta})
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"meta":   peerMeta,
+				"myMeta": myInfo.Meta,
+			}).Warn("Unable to get peer info")
+			writeMetaReply(w, GetPeerInfoFromMeta, PeerOffline, peerMeta)
+			break
+		}
+		err = writePeerInfo(w, GetPeerInfoFromMeta, peer)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":      err,
+				"peerMeta": peer.Meta,
+				"myMeta":   myInfo.Meta,
+			}).Warn("Unable to write peer info")
+			break
+		}
+	case NotifyPeerFromMeta:
+		peerMeta, err := readMeta(r)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"myMeta": myInfo.Meta,
+			}).Warn("Unable to get peer id")
+			break
+		}
+		err = notifyPeer(PeerInfo{Meta: peerMeta}, myInfo)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"meta":   peerMeta,
+				"myMeta": myInfo.Meta,
+			}).Warn("Unable to notify peer")
+			writeID(w, NotifyPeerFromMeta, PeerOffline, 0)
+			break
+		}
+	case JoinMesh:
+		name, err := readMeta(r)
+		if err == nil && name == "" {
+			// the meta prefix up to the last slash names the group
+			if i := strings.LastIndex(myInfo.Meta, "/"); i > 0 {
+				name = myInfo.Meta[:i]
+			}
+		}
+		if err != nil || name == "" || myInfo.ID == 0 {
+			log.WithFields(log.Fields{
+				"err":  err,
+				"myID": myInfo.ID,
+			}).Warn("Unable to join mesh")
+			writeMetaReply(w, JoinMesh, PeerError, name)
+			break
+		}
+		joinMesh(name, myInfo)
+		writeMetaReply(w, JoinMesh, StatusOK, name)
+	case PortHint:
+		var h struct {
+			PeerID uint32
+			N      uint8
+		}
+		if err := binary.Read(r, binary.BigEndian, &h); err != nil {
+			break
+		}
+		ports := make([]byte, 2*int(h.N))
+		if _, err := io.ReadFull(r, ports); err != nil || myInfo.ID == 0 {
+			break
+		}
+		if h.N > MaxHintPorts {
+			log.WithFields(log.Fields{
+				"ports":  h.N,
+				"peerID": h.PeerID,
+				"myID":   myInfo.ID,
+			}).Warn("Port hint too long")
+			break
+		}
+		hint := binary.BigEndian.AppendUint32(nil, myInfo.ID)
+		hint = append(append(hint, h.N), ports...)
+		if err := pushHint(h.PeerID, hint); err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"peerID": h.PeerID,
+				"myID":   myInfo.ID,
+			}).Debug("Unable to pass port hint on")
+		}
+	case RelayAlloc:
+		var peerID uint32
+		if err := binary.Read(r, binary.BigEndian, &peerID); err != nil {
+			break
+		}
+		if err := allocRelay(w, peerID, myInfo); err != nil {
+			log.WithFields(log.Fields{
+				"err":    err,
+				"peerID": peerID,
+				"myID":   myInfo.ID,
+			}).Warn("Unable to allocate relay")
+			writeID(w, RelayAlloc, PeerOffline, peerID)
+		}
+	case MeshResult:
+		var res struct {
+			PeerID uint32
+			Result uint8
+		}
+		if err := binary.Read(r, binary.BigEndian, &res); err != nil {
+			break
+		}
+		meshMutex.Lock()
+		for _, m := range meshes {
+			m.finish(meshPair{myInfo.ID, res.PeerID}, res.Result == 0)
+		}
+		meshMutex.Unlock()
+	default:
+		log.WithFields(log.Fields{
+			"type": t,
+		}).Warn("Illegal message")
+	}
+}
+
+// a group of peers connected pairwise. Every pair is one traversal started by
+// the server, so the mesh converges in a few rounds instead of N^2 manual
+// connects
+type mesh struct {
+	name    string
+	members []uint32
+	// pairs waiting for a start, cheapest first
+	pending []meshPair
+	running map[meshPair]meshRun
+	// since the mesh last had no pending or running pair
+	since      time.Time
+	ok, failed int
+}
+
+// from starts the traversal towards to
+type meshPair struct {
+	from, to uint32
+}
+
+type meshRun struct {
+	at   time.Time
+	nats [2]string
+	cost [2]int
+}
+
+// natCost is how many mappings a traversal costs the peer's NAT
+func natCost(p PeerInfo) int {
+	// open internet up to port restricted cone keep one mapping per socket
+	if p.NatType >= 1 && p.NatType <= 4 {
+		return 1
+	}
+	return MeshHoles
+}
+
+// joinMesh adds pairs of the peer and every live member, the caller holds
+// neither lock
+func joinMesh(name string, p PeerInfo) {
+	meshMutex.Lock()
+	defer meshMutex.Unlock()
+	m, ok := meshes[name]
+	if !ok {
+		m = &mesh{name: name, running: make(map[meshPair]meshRun)}
+		meshes[name] = m
+	}
+	for _, id := range m.members {
+		if id == p.ID {
+			// joined again, over UDP the reply may have been lost
+			return
+		}
+	}
+	if len(m.pending) == 0 && len(m.running) == 0 {
+		m.since = time.Now()
+	}
+	cost := make(map[meshPair]int)
+	live := m.members[:0]
+	for _, id := range m.members {
+		q, err := getPeerInfo(PeerInfo{ID: id})
+		if err != nil {
+			continue
+		}
+		live = append(live, id)
+		pair := meshPair{p.ID, id}
+		cost[pair] = natCost(p) + natCost(q)
+		m.pending = append(m.pending, pair)
+	}
+	m.members = append(live, p.ID)
+	// pairs of cone NATs finish quickly, symmetric ones take what is left of
+	// the budget
+	sort.SliceStable(m.pending, func(i, j int) bool {
+		return cost[m.pending[i]] < cost[m.pending[j]]
+	})
+	log.WithFields(log.Fields{
+		"mesh":    name,
+		"ID":      p.ID,
+		"members": len(m.members),
+		"pending": len(m.pending),
+	}).Info("Peer joined mesh")
+}
+
+// dispatch starts pending pairs whose NATs have room in load, the mappings in
+// flight by NAT address, the caller holds meshMutex
+func (m *mesh) dispatch(load map[string]int) {
+	waiting := m.pending[:0]
+	for _, pair := range m.pending {
+		from, err1 := getPeerInfo(PeerInfo{ID: pair.from})
+		to, err2 := getPeerInfo(PeerInfo{ID: pair.to})
+		if err1 != nil || err2 != nil {
+			m.failed++
+			continue
+		}
+		run := meshRun{
+			nats: [2]string{string(from.IP[:]), string(to.IP[:])},
+			cost: [2]int{natCost(from), natCost(to)},
+		}
+		if run.nats[0] == run.nats[1] {
+			// both behind one NAT, which pays for both sides
+			run.cost[0] += run.cost[1]
+			run.cost[1] = 0
+		}
+		full := false
+		for i := range run.nats {
+			n := load[run.nats[i]]
+			if n > 0 && n+run.cost[i] > MeshNATBudget {
+				full = true
+			}
+		}
+		if full {
+			waiting = append(waiting, pair)
+			continue
+		}
+		conn, err := getConn(from)
+		if err == nil {
+			err = push(conn, MeshConnect, to)
+		}
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":  err,
+				"mesh": m.name,
+				"from": pair.from,
+				"to":   pair.to,
+			}).Warn("Unable to start mesh pair")
+			m.failed++
+			continue
+		}
+		run.at = time.Now()
+		m.running[pair] = run
+		for i := range run.nats {
+			load[run.nats[i]] += run.cost[i]
+		}
+	}
+	m.pending = waiting
+	m.converged()
+}
+
+// finish records the result of the pair if it belongs to the mesh, the caller
+// holds meshMutex
+func (m *mesh) finish(pair meshPair, ok bool) {
+	if _, running := m.running[pair]; !running {
+		return
+	}
+	delete(m.running, pair)
+	if ok {
+		m.ok++
+	} else {
+		m.failed++
+	}
+	log.WithFields(log.Fields{
+		"mesh": m.name,
+		"from": pair.from,
+		"to":   pair.to,
+		"ok":   ok,
+	}).Debug("Mesh pair finished")
+	m.converged()
+}
+
+func (m *mesh) converged() {
+	if len(m.pending) > 0 || len(m.running) > 0 || m.ok+m.failed == 0 {
+		return
+	}
+	log.WithFields(log.Fields{
+		"mesh":    m.name,
+		"members": len(m.members),
+		"ok":      m.ok,
+		"failed":  m.failed,
+		"took":    time.Since(m.since),
+	}).Info("Mesh converged")
+	m.ok, m.failed = 0, 0
+}
+
+// scheduleMeshes starts the pending pairs of every mesh once per round,
+// pairs that never reported back free their budget after MeshPairTimeout
+func scheduleMeshes() {
+	for {
+		time.Sleep(MeshRound)
+		meshMutex.Lock()
+		load := make(map[string]int)
+		for _, m := range meshes {
+			for pair, run := range m.running {
+				if time.Since(run.at) > MeshPairTimeout {
+					m.finish(pair, false)
+					continue
+				}
+				for i := range run.nats {
+					load[run.nats[i]] += run.cost[i]
+				}
+			}
+		}
+		for name, m := range meshes {
+			m.dispatch(load)
+			if len(m.running) == 0 && len(m.pending) == 0 {
+				alive := false
+				for _, id := range m.members {
+					if _, err := getPeerInfo(PeerInfo{ID: id}); err == nil {
+						alive = true
+						break
+					}
+				}
+				if !alive {
+					delete(meshes, name)
+				}
+			}
+		}
+		meshMutex.Unlock()
+	}
+}
+
+// udpPeer delivers frames to a peer enrolled over UDP, one datagram each
+type udpPeer struct {
+	conn *net.UDPConn
+	addr *net.UDPAddr
+}
+
+func (u udpPeer) Write(b []byte) (int, error) {
+	return u.conn.WriteToUDP(b, u.addr)
+}
+
+// serveUDP is the rendezvous channel, every datagram carries one message.
+// Peers enroll from the socket they punch with, so the address the server
+// observes is the mapping their NAT uses for the punch
+func serveUDP(u *net.UDPConn) {
+	buf := make([]byte, 1500)
+	for {
+		n, addr, err := u.ReadFromUDP(buf)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err": err,
+			}).Error("Reading from UDP failed")
+			continue
+		}
+		if n < 2 {
+			continue
+		}
+		handleDatagram(udpPeer{u, addr}, buf[:n])
+	}
+}
+
+func handleDatagram(w udpPeer, data []byte) {
+	t := binary.BigEndian.Uint16(data)
+	r := bytes.NewReader(data[2:])
+	key := w.addr.String()
+
+	mutex.Lock()
+	var myInfo PeerInfo
+	id, known := udpPeerIDs[key]
+	if known {
+		myInfo = peers[id]
+		udpSeen[id] = time.Now()
+	}
+	mutex.Unlock()
+
+	switch t {
+	case Enroll:
+		p, err := readPeerInfo(r)
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err":  err,
+				"addr": key,
+			}).Warn("Reading UDP enroll failed")
+			break
+		}
+		if known {
+			// a retransmitted enroll keeps the ID
+			p.ID = id
+		} else if wait := adm.admit(w.addr.IP.String()); wait > 0 {
+			writeID(w, Enroll, RetryAfter, uint32(wait/time.Millisecond))
+			break
+		} else {
+			p.ID = nextID()
+		}
+		observe(&p, w.addr)
+		p.wire = encodePeer(p)
+		if known {
+			p.token = myInfo.token
+		} else {
+			p.token = newToken()
+		}
+		mutex.Lock()
+		if known {
+			removePeer(myInfo)
+		}
+		udpPeerIDs[key] = p.ID
+		udpSeen[p.ID] = time.Now()
+		register(&p, w)
+		mutex.Unlock()
+		log.WithFields(log.Fields{
+			"ID":      p.ID,
+			"Meta":    p.Meta,
+			"Addr":    key,
+			"NatType": p.NatType,
+		}).Debug("New peer enrolled over UDP")
+		writeReply(w, Enroll, StatusOK, enrollReply(p, w.addr))
+	case Resume:
+		resumeID, token, err := readResume(r)
+		if err != nil {
+			break
+		}
+		if !known || id != resumeID {
+			if wait := adm.admit(w.addr.IP.String()); wait > 0 {
+				writeID(w, Resume, RetryAfter, uint32(wait/time.Millisecond))
+				break
+			}
+		}
+		mutex.Lock()
+		_, live := peers[resumeID]
+		p, ok := resume(resumeID, token[:])
+		if ok {
+			if live {
+				// resumed from a new address, the old one is stale
+				for k, v := range udpPeerIDs {
+					if v == resumeID {
+						delete(udpPeerIDs, k)
+					}
+				}
+			}
+			observe(&p, w.addr)
+			p.wire = encodePeer(p)
+			udpPeerIDs[key] = p.ID
+			udpSeen[p.ID] = time.Now()
+			register(&p, w)
+		}
+		mutex.Unlock()
+		if !ok {
+			writeID(w, Resume, PeerOffline, resumeID)
+			break
+		}
+		writeReply(w, Resume, StatusOK, enrollReply(p, w.addr))
+	case Keepalive:
+		// the ID and resume token, the token proves a keepalive from a new
+		// address comes from the peer and not from someone who learned its ID
+		myID, token, err := readResume(r)
+		if err != nil {
+			break
+		}
+		if !known && !rebind(myID, token[:], w) {
+			// expired, the peer has to enroll again
+			writeReply(w, Keepalive, PeerOffline, nil)
+			break
+		}
+		writeReply(w, Keepalive, StatusOK, nil)
+	case NotifyPeer, NotifyPeerFromMeta:
+		if !known {
+			// notifications carry the address the sender enrolled from
+			var peerID uint32
+			if t == NotifyPeer {
+				binary.Read(r, binary.BigEndian, &peerID)
+			}
+			writeID(w, t, PeerOffline, peerID)
+			break
+		}
+		handleRequest(t, r, w, myInfo)
+	default:
+		handleRequest(t, r, w, myInfo)
+	}
+}
+
+// observe replaces the self reported address of the family the datagram came
+// from with the one seen by the server
+func observe(p *PeerInfo, addr *net.UDPAddr) (ip [IPLen]byte) {
+	copy(ip[:], addr.IP.String())
+	if addr.IP.To4() != nil {
+		p.IP = ip
+		p.Port = uint16(addr.Port)
+	} else {
+		p.IP6 = ip
+		p.Port6 = uint16(addr.Port)
+	}
+	return
+}
+
+// rebind moves a UDP peer to the address a keepalive came from, after its NAT
+// changed the mapping or it opened a new socket on the enrolled port. The
+// keepalive has to carry the token the peer enrolled with
+func rebind(id uint32, token []byte, w udpPeer) bool {
+	mutex.Lock()
+	defer mutex.Unlock()
+	p, ok := peers[id]
+	if _, udp := udpSeen[id]; !ok || !udp ||
+		subtle.ConstantTimeCompare(p.token[:], token) != 1 {
+		return false
+	}
+	for k, v := range udpPeerIDs {
+		if v == id {
+			delete(udpPeerIDs, k)
+		}
+	}
+	observe(&p, w.addr)
+	p.wire = encodePeer(p)
+	udpPeerIDs[w.addr.String()] = id
+	udpSeen[id] = time.Now()
+	register(&p, w)
+	log.WithFields(log.Fields{
+		"ID":   id,
+		"Addr": w.addr.String(),
+	}).Debug("UDP peer moved")
+	return true
+}
+
+// expireParked drops the records not resumed within ResumeWindow
+func expireParked() {
+	for {
+		time.Sleep(ResumeWindow / 4)
+		mutex.Lock()
+		for id, p := range parked {
+			if time.Since(p.since) > ResumeWindow {
+				delete(parked, id)
+			}
+		}
+		mutex.Unlock()
+	}
+}
+
+func expireUDPPeers() {
+	for {
+		time.Sleep(UDPPeerTimeout / 4)
+		mutex.Lock()
+		for k, id := range udpPeerIDs {
+			if time.Since(udpSeen[id]) > UDPPeerTimeout {
+				removePeer(peers[id])
+				delete(udpPeerIDs, k)
+				delete(udpSeen, id)
+				log.WithFields(log.Fields{
+					"ID": id,
+				}).Info("UDP peer expired")
+			}
+		}
+		mutex.Unlock()
+	}
+}
+
+// snapshot keeps the registry in a memory mapped file, so that a restarted
+// server hands their IDs back to the peers that resume. The pages are written
+// back by the kernel, a process dying loses only what changed since the last
+// snapshot. The file starts with two slots, each describing a copy of the
+// registry stored after them. A snapshot is copied where it doesn't overlap
+// the newer copy, then the other slot is pointed at it, so that dying
+// halfway leaves the newer copy whole. A copy holds the live and the parked
+// peers, each as the token, the size of its wire record and the record
+type snapshot struct {
+	f   *os.File
+	mem []byte
+}
+
+const (
+	SnapshotMagic = "ntps"
+	// magic, generation, seq, count of records, their offset and size, and
+	// the CRC32 of the slot and the records
+	SnapshotSlot = 28
+	// both slots, the copies follow
+	SnapshotHeader = 2 * SnapshotSlot
+	// the file grows by this much
+	SnapshotChunk = 1 << 20
+)
+
+type snapshotSlot struct {
+	gen, seq, count, off, size uint32
+}
+
+func openSnapshot(path string) (*snapshot, error) {
+	f, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return nil, err
+	}
+	st, err := f.Stat()
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+	s := &snapshot{f: f}
+	if st.Size() > 0 {
+		if err = s.mmap(int(st.Size())); err != nil {
+			f.Close()
+			return nil, err
+		}
+	}
+	return s, nil
+}
+
+// mmap maps size bytes of the file, growing it if needed
+func (s *snapshot) mmap(size int) (err error) {
+	if s.mem != nil {
+		syscall.Munmap(s.mem)
+		s.mem = nil
+	}
+	if err = s.f.Truncate(int64(size)); err != nil {
+		return
+	}
+	s.mem, err = syscall.Mmap(int(s.f.Fd()), 0, size,
+		syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	return
+}
+
+// slot decodes slot i, ok if it describes a whole copy
+func (s *snapshot) slot(i int) (h snapshotSlot, ok bool) {
+	be := binary.BigEndian
+	b := s.mem[i*SnapshotSlot : (i+1)*SnapshotSlot]
+	if string(b[:4]) != SnapshotMagic {
+		return
+	}
+	h = snapshotSlot{be.Uint32(b[4:]), be.Uint32(b[8:]), be.Uint32(b[12:]),
+		be.Uint32(b[16:]), be.Uint32(b[20:])}
+	if h.off < SnapshotHeader || int64(h.off)+int64(h.size) > int64(len(s.mem)) {
+		return
+	}
+	crc := crc32.Update(crc32.ChecksumIEEE(b[:24]), crc32.IEEETable,
+		s.mem[h.off:h.off+h.size])
+	return h, crc == be.Uint32(b[24:])
+}
+
+// current is the slot of the newer whole copy, -1 if there is none
+func (s *snapshot) current() int {
+	if len(s.mem) < SnapshotHeader {
+		return -1
+	}
+	h0, ok0 := s.slot(0)
+	h1, ok1 := s.slot(1)
+	switch {
+	case ok0 && ok1 && int32(h1.gen-h0.gen) > 0, !ok0 && ok1:
+		return 1
+	case ok0:
+		return 0
+	}
+	return -1
+}
+
+// load parks the peers of the snapshot and moves seq past the IDs handed out
+// before, it runs before any peer is served. Returns the peers loaded
+func (s *snapshot) load() int {
+	be := binary.BigEndian
+	cur := s.current()
+	if cur < 0 {
+		if len(s.mem) > 0 {
+			log.Warn("Snapshot corrupted, starting empty")
+		}
+		return 0
+	}
+	h, _ := s.slot(cur)
+	if h.seq > seq {
+		seq = h.seq
+	}
+	b := s.mem[h.off : h.off+h.size]
+	now := time.Now()
+	n := 0
+	for count := h.count; count > 0; count-- {
+		if len(b) < TokenLen+2 {
+			break
+		}
+		l := int(be.Uint16(b[TokenLen:]))
+		if len(b) < TokenLen+2+l {
+			break
+		}
+		// the record outlives the mapping, which the next snapshot rewrites
+		p, err := decodePeer(append([]byte(nil), b[TokenLen+2:TokenLen+2+l]...))
+		if err != nil {
+			break
+		}
+		copy(p.token[:], b)
+		parked[p.ID] = parkedPeer{p, now}
+		b = b[TokenLen+2+l:]
+		n++
+	}
+	return n
+}
+
+// write copies the registry before the newer copy if it fits there, after it
+// otherwise, then points the other slot at it
+func (s *snapshot) write() error {
+	be := binary.BigEndian
+	b := make([]byte, 0, SnapshotChunk)
+	count := 0
+	add := func(p PeerInfo) {
+		b = append(b, p.token[:]...)
+		b = be.AppendUint16(b, uint16(len(p.wire)))
+		b = append(b, p.wire...)
+		count++
+	}
+	mutex.RLock()
+	for _, p := range peers {
+		add(p)
+	}
+	for _, p := range parked {
+		add(p.PeerInfo)
+	}
+	mutex.RUnlock()
+	h := snapshotSlot{gen: 1, seq: atomic.LoadUint32(&seq),
+		count: uint32(count), off: SnapshotHeader, size: uint32(len(b))}
+	i := 0
+	if cur := s.current(); cur >= 0 {
+		newer, _ := s.slot(cur)
+		h.gen, i = newer.gen+1, 1-cur
+		if SnapshotHeader+len(b) > int(newer.off) {
+			h.off = newer.off + newer.size
+		}
+	}
+	if end := int(h.off) + len(b); end > len(s.mem) {
+		size := (end + SnapshotChunk - 1) / SnapshotChunk * SnapshotChunk
+		if err := s.mmap(size); err != nil {
+			return err
+		}
+	}
+	copy(s.mem[h.off:], b)
+	var slot [SnapshotSlot]byte
+	copy(slot[:], SnapshotMagic)
+	be.PutUint32(slot[4:], h.gen)
+	be.PutUint32(slot[8:], h.seq)
+	be.PutUint32(slot[12:], h.count)
+	be.PutUint32(slot[16:], h.off)
+	be.PutUint32(slot[20:], h.size)
+	be.PutUint32(slot[24:], crc32.Update(crc32.ChecksumIEEE(slot[:24]),
+		crc32.IEEETable, b))
+	copy(s.mem[i*SnapshotSlot:], slot[:])
+	return nil
+}
+
+// run writes the snapshot every interval, and a last time when the server is
+// told to stop, so that a restart loses no enroll
+func (s *snapshot) run(every time.Duration) {
+	stop := make(chan os.Signal, 1)
+	signal.Notify(stop, syscall.SIGTERM, syscall.SIGINT)
+	t := time.NewTicker(every)
+	for {
+		select {
+		case <-t.C:
+			if err := s.write(); err != nil {
+				log.WithFields(log.Fields{
+					"err": err,
+				}).Error("Writing the snapshot failed")
+			}
+		case sig := <-stop:
+			err := s.write()
+			log.WithFields(log.Fields{
+				"signal": sig,
+				"err":    err,
+			}).Info("Snapshot written, stopping")
+			os.Exit(0)
+		}
+	}
+}
+
+// bucket is a token bucket, filled at a rate per second up to a burst.
+// Refused takers are told to come back in turn, queued counts the turns
+// handed out and not drained yet
+type bucket struct {
+	tokens float64
+	queued float64
+	last   time.Time
+}
+
+// take takes a token, or tells how long until the turn of the taker. A rate
+// of 0 never runs out
+func (b *bucket) take(now time.Time, rate, burst float64) time.Duration {
+	if rate <= 0 {
+		return 0
+	}
+	filled := now.Sub(b.last).Seconds() * rate
+	b.tokens = math.Min(burst, b.tokens+filled)
+	b.queued = math.Max(0, b.queued-filled)
+	b.last = now
+	if b.tokens >= 1 {
+		b.tokens--
+		return 0
+	}
+	wait := time.Duration((1 - b.tokens + b.queued) / rate * float64(time.Second))
+	if wait < EnrollTimeout {
+		b.queued++
+	}
+	return wait
+}
+
+// admission hands out enrolls from a global bucket and one bucket per source
+// IP, so that a single NAT or host can't take the whole rate. Bursts are
+// twice the rates
+type admission struct {
+	mu         sync.Mutex
+	rate       float64
+	sourceRate float64
+	global     bucket
+	sources    map[string]*bucket
+}
+
+var adm *admission
+
+func newAdmission(rate, sourceRate float64) *admission {
+	a := &admission{
+		rate:       rate,
+		sourceRate: sourceRate,
+		global:     bucket{tokens: 2 * rate, last: time.Now()},
+		sources:    make(map[string]*bucket),
+	}
+	go a.sweep()
+	return a
+}
+
+// admit returns 0 if an enroll or resume from ip may go on, or how long the
+// client should wait before trying again
+func (a *admission) admit(ip string) time.Duration {
+	now := time.Now()
+	a.mu.Lock()
+	defer a.mu.Unlock()
+	b, ok := a.sources[ip]
+	if !ok {
+		b = &bucket{tokens: 2 * a.sourceRate, last: now}
+		a.sources[ip] = b
+	}
+	wait := b.take(now, a.sourceRate, 2*a.sourceRate)
+	if wait == 0 {
+		if wait = a.global.take(now, a.rate, 2*a.rate); wait > 0 {
+			// refused anyway, the source keeps its token
+			b.tokens++
+		}
+	}
+	if wait > 0 && wait < MinRetryAfter {
+		wait = MinRetryAfter
+	} else if wait > EnrollTimeout {
+		wait = EnrollTimeout
+	}
+	return wait
+}
+
+// sweep drops the buckets of sources gone quiet, they would be full by now
+func (a *admission) sweep() {
+	for {
+		time.Sleep(BucketIdle)
+		now := time.Now()
+		a.mu.Lock()
+		for ip, b := range a.sources {
+			if now.Sub(b.last) > BucketIdle {
+				delete(a.sources, ip)
+			}
+		}
+		a.mu.Unlock()
+	}
+}
+
+// the cluster partitions peers across punch server nodes. The ID of a peer
+// hashes to the node it enrolled with, which holds its record and connection,
+// its meta hashes to the node that resolves it. Lookups and notifications for
+// peers owned by another node are forwarded over a persistent link to it
+var cl *cluster
+
+const (
+	_ = iota
+	// u32 ID, replied with the status and the record
+	LinkGetPeer
+	// meta, replied with the status and the record
+	LinkGetPeerFromMeta
+	// u32 ID and the record of the sender, replied with the status
+	LinkNotify
+	// the record of a peer whose meta the receiver owns, not replied
+	LinkMetaSet
+	// u32 ID and meta of a peer that left, not replied
+	LinkMetaDel
+	// u32 ID and a port hint for the peer, not replied
+	LinkHint
+	LinkReply
+)
+
+const (
+	// points of each node on the ring
+	RingReplicas = 64
+	LinkTimeout  = 2 * time.Second
+	LinkRetry    = time.Second
+	// frames queued on a link before senders block
+	LinkQueue = 4096
+)
+
+var ErrLinkDown = errors.New("Link to node is down")
+
+type ringPoint struct {
+	hash uint32
+	node int
+}
+
+type cluster struct {
+	self  int
+	ring  []ringPoint
+	links []*link
+}
+
+// link carries the requests of this node to another one, replies come back
+// on the same connection
+type link struct {
+	node  int
+	addr  string
+	out   chan []byte
+	mu    sync.Mutex
+	up    bool
+	tag   uint32
+	calls map[uint32]chan []byte
+	// frames dropped on a full queue since the metas were last sent again
+	dropped uint32
+}
+
+type linkHeader struct {
+	Len uint32
+	Tag uint32
+	Op  uint16
+}
+
+func hash32(b []byte) uint32 {
+	h := fnv.New32a()
+	h.Write(b)
+	return h.Sum32()
+}
+
+func idKey(id uint32) []byte {
+	return binary.BigEndian.AppendUint32(nil, id)
+}
+
+func newCluster(addrs []string, self int) *cluster {
+	c := &cluster{self: self}
+	for i, addr := range addrs {
+		for r := 0; r < RingReplicas; r++ {
+			h := hash32([]byte(addr + "#" + strconv.Itoa(r)))
+			c.ring = append(c.ring, ringPoint{h, i})
+		}
+		c.links = append(c.links, &link{
+			node:  i,
+			addr:  addr,
+			out:   make(chan []byte, LinkQueue),
+			calls: make(map[uint32]chan []byte),
+		})
+	}
+	sort.Slice(c.ring, func(i, j int) bool {
+		return c.ring[i].hash < c.ring[j].hash
+	})
+	return c
+}
+
+// owner walks the ring clockwise from the key to the first node accepted by
+// alive, nil accepting any
+func (c *cluster) owner(key []byte, alive func(int) bool) int {
+	h := hash32(key)
+	i := sort.Search(len(c.ring), func(i int) bool { return c.ring[i].hash >= h })
+	for n := 0; n < len(c.ring); n++ {
+		p := c.ring[(i+n)%len(c.ring)]
+		if alive == nil || alive(p.node) {
+			return p.node
+		}
+	}
+	return c.self
+}
+
+// idOwner is the node the peer enrolled with, the ring of every configured
+// node is used so that the owner of an ID never moves
+func (c *cluster) idOwner(id uint32) int {
+	return c.owner(idKey(id), nil)
+}
+
+// metaOwner skips nodes that are down, their metas move to the next node
+func (c *cluster) metaOwner(meta string) int {
+	return c.owner([]byte(meta), c.alive)
+}
+
+func (c *cluster) alive(node int) bool {
+	if node == c.self {
+		return true
+	}
+	l := c.links[node]
+	l.mu.Lock()
+	defer l.mu.Unlock()
+	return l.up
+}
+
+// nextID hands out the next ID this node owns, without taking the lock
+func nextID() uint32 {
+	for {
+		id := atomic.AddUint32(&seq, 1)
+		if cl == nil || cl.idOwner(id) == cl.self {
+			return id
+		}
+	}
+}
+
+func linkFrame(tag uint32, op uint16, payload []byte) []byte {
+	b := make([]byte, 0, 10+len(payload))
+	b = binary.BigEndian.AppendUint32(b, uint32(len(payload)))
+	b = binary.BigEndian.AppendUint32(b, tag)
+	b = binary.BigEndian.AppendUint16(b, op)
+	return append(b, payload...)
+}
+
+func readLinkFrame(r io.Reader) (h linkHeader, payload []byte, err error) {
+	if err = binary.Read(r, binary.BigEndian, &h); err != nil {
+		return
+	}
+	payload = make([]byte, h.Len)
+	_, err = io.ReadFull(r, payload)
+	return
+}
+
+// send queues a frame that isn't replied. Senders hold the global lock, so a
+// frame finding the queue full is dropped rather than waited on, and the
+// metas are sent again once the queue drains. Frames for a link that is down
+// are dropped too, the node gets every meta it owns again once the link is up
+func (l *link) send(op uint16, payload []byte) {
+	l.mu.Lock()
+	up := l.up
+	l.mu.Unlock()
+	if !up {
+		return
+	}
+	select {
+	case l.out <- linkFrame(0, op, payload):
+	default:
+		atomic.AddUint32(&l.dropped, 1)
+	}
+}
+
+// call sends a request and waits for the status and body of its reply
+func (l *link) call(op uint16, payload []byte) (status uint8, body []byte, err error) {
+	ch := make(chan []byte, 1)
+	l.mu.Lock()
+	if !l.up {
+		l.mu.Unlock()
+		err = ErrLinkDown
+		return
+	}
+	l.tag++
+	tag := l.tag
+	l.calls[tag] = ch
+	l.mu.Unlock()
+	defer func() {
+		l.mu.Lock()
+		delete(l.calls, tag)
+		l.mu.Unlock()
+	}()
+
+	l.out <- linkFrame(tag, op, payload)
+	select {
+	case reply, ok := <-ch:
+		if !ok || len(reply) == 0 {
+			err = ErrLinkDown
+			return
+		}
+		return reply[0], reply[1:], nil
+	case <-time.After(LinkTimeout):
+		err = ErrLinkDown
+		return
+	}
+}
+
+// run keeps the link connected, redialing after failures
+func (l *link) run() {
+	for {
+		c, err := net.Dial("tcp", l.addr)
+		if err != nil {
+			time.Sleep(LinkRetry)
+			continue
+		}
+		log.WithFields(log.Fields{
+			"node": l.node,
+			"addr": l.addr,
+		}).Info("Link to node up")
+		l.mu.Lock()
+		l.up = true
+		l.mu.Unlock()
+		go cl.membershipChanged(l.node, true)
+
+		done := make(chan struct{})
+		go l.write(c, done)
+		r := bufio.NewReader(c)
+		for {
+			h, payload, err := readLinkFrame(r)
+			if err != nil {
+				break
+			}
+			l.mu.Lock()
+			if ch, ok := l.calls[h.Tag]; ok && h.Op == LinkReply {
+				ch <- payload
+			}
+			l.mu.Unlock()
+		}
+		close(done)
+		c.Close()
+
+		l.mu.Lock()
+		l.up = false
+		for tag, ch := range l.calls {
+			close(ch)
+			delete(l.calls, tag)
+		}
+		l.mu.Unlock()
+		log.WithFields(log.Fields{
+			"node": l.node,
+			"addr": l.addr,
+		}).Warn("Link to node down")
+		cl.membershipChanged(l.node, false)
+		time.Sleep(LinkRetry)
+	}
+}
+
+// write sends the queued frames, flushing whenever the queue runs empty
+func (l *link) write(c net.Conn, done chan struct{}) {
+	w := bufio.NewWriter(c)
+	for {
+		select {
+		case f := <-l.out:
+			if _, err := w.Write(f); err != nil {
+				c.Close()
+				return
+			}
+			if len(l.out) > 0 {
+				break
+			}
+			if w.Flush() != nil {
+				c.Close()
+				return
+			}
+			if n := atomic.SwapUint32(&l.dropped, 0); n > 0 {
+				log.WithFields(log.Fields{
+					"node":    l.node,
+					"dropped": n,
+				}).Warn("Link queue overflowed, sending the metas again")
+				go cl.membershipChanged(l.node, true)
+			}
+		case <-done:
+			return
+		}
+	}
+}
+
+// membershipChanged drops the metas of peers of a node that went down and
+// registers every local meta with its owner, which may have moved
+func (c *cluster) membershipChanged(node int, up bool) {
+	mutex.Lock()
+	defer mutex.Unlock()
+	if !up {
+		for meta, p := range peersFromMeta {
+			if _, local := peerConnFromMeta[meta]; !local && c.idOwner(p.ID) == node {
+				delete(peersFromMeta, meta)
+			}
+		}
+	}
+	for _, p := range peers {
+		c.metaSet(p)
+	}
+}
+
+// metaSet registers the meta of a local peer with the node owning it, the
+// caller holds the lock
+func (c *cluster) metaSet(p PeerInfo) {
+	if p.Meta == "" {
+		return
+	}
+	if n := c.metaOwner(p.Meta); n != c.self {
+		c.links[n].send(LinkMetaSet, p.wire)
+	}
+}
+
+// metaDel goes to every node, the owner of the meta may have moved since it
+// was registered
+func (c *cluster) metaDel(p PeerInfo) {
+	if p.Meta == "" || p.ID == 0 {
+		return
+	}
+	payload := binary.BigEndian.AppendUint32(nil, p.ID)
+	payload = append(payload, uint8(len(p.Meta)))
+	payload = append(payload, p.Meta...)
+	for n, l := range c.links {
+		if n != c.self {
+			l.send(LinkMetaDel, payload)
+		}
+	}
+}
+
+// findPeer looks the peer up here, then on the node owning its ID or meta
+func findPeer(p PeerInfo) (PeerInfo, error) {
+	q, err := getPeerInfo(p)
+	if err == nil || cl == nil {
+		return q, err
+	}
+	var n int
+	var status uint8
+	var body []byte
+	if p.ID != 0 {
+		if n = cl.idOwner(p.ID); n == cl.self {
+			return q, err
+		}
+		status, body, err = cl.links[n].call(LinkGetPeer, idKey(p.ID))
+	} else {
+		if n = cl.metaOwner(p.Meta); n == cl.self {
+			return q, err
+		}
+		payload := append([]byte{uint8(len(p.Meta))}, p.Meta...)
+		status, body, err = cl.links[n].call(LinkGetPeerFromMeta, payload)
+	}
+	if err == nil && status != StatusOK {
+		err = ErrPeerNotFound
+	}
+	if err != nil {
+		return q, err
+	}
+	return decodePeer(body)
+}
+
+// notifyPeer pushes the record of from to the peer, wherever it is connected
+func notifyPeer(to PeerInfo, from PeerInfo) error {
+	conn, err := getConn(to)
+	if err == nil {
+		return push(conn, NotifyPeer, from)
+	}
+	if cl == nil {
+		return err
+	}
+	if to.ID == 0 {
+		// the meta resolves to the ID, whose node has the connection
+		q, err := findPeer(to)
+		if err != nil {
+			return ErrConnNotFound
+		}
+		to = PeerInfo{ID: q.ID}
+	}
+	n := cl.idOwner(to.ID)
+	if n == cl.self {
+		return ErrConnNotFound
+	}
+	if from.wire == nil {
+		from.wire = encodePeer(from)
+	}
+	payload := append(idKey(to.ID), from.wire...)
+	status, _, err := cl.links[n].call(LinkNotify, payload)
+	if err == nil && status != Delivered {
+		err = ErrConnNotFound
+	}
+	return err
+}
+
+// pushHint passes a port hint, the sender's ID, the count and the ports, on
+// to the peer, wherever it is connected
+func pushHint(to uint32, hint []byte) error {
+	conn, err := getConn(PeerInfo{ID: to})
+	if err == nil {
+		return pushFrame(conn, PortHint, hint)
+	}
+	if cl == nil {
+		return err
+	}
+	n := cl.idOwner(to)
+	if n == cl.self {
+		return ErrConnNotFound
+	}
+	cl.links[n].send(LinkHint, append(idKey(to), hint...))
+	return nil
+}
+
+// decodePeer reads a record laid out by encodePeer
+func decodePeer(b []byte) (p PeerInfo, err error) {
+	r := bytes.NewReader(b)
+	if err = binary.Read(r, binary.BigEndian, &p.ID); err != nil {
+		return
+	}
+	var n natInfo
+	if err = binary.Read(r, binary.BigEndian, &n); err != nil {
+		return
+	}
+	p.IP, p.Port, p.NatType, p.IP6, p.Port6 = n.IP, n.Port, n.NatType, n.IP6, n.Port6
+	if p.Meta, err = readMeta(r); err != nil {
+		return
+	}
+	p.wire = b
+	return
+}
+
+// serveLinks answers the links of the other nodes
+func serveLinks(l net.Listener) {
+	for {
+		c, err := l.Accept()
+		if err != nil {
+			log.WithFields(log.Fields{
+				"err": err,
+			}).Error("Accepting link failed")
+			continue
+		}
+		go serveLink(c)
+	}
+}
+
+func serveLink(c net.Conn) {
+	defer c.Close()
+	w := &connWriter{w: bufio.NewWriter(c)}
+	r := bufio.NewReader(c)
+	for {
+		h, payload, err := readLinkFrame(r)
+		if err != nil {
+			return
+		}
+		switch h.Op {
+		case LinkMetaSet:
+			// in order, a set and the del that follows it must not swap
+			p, err := decodePeer(payload)
+			if err != nil || p.Meta == "" {
+				break
+			}
+			mutex.Lock()
+			peersFromMeta[p.Meta] = p
+			delete(peerConnFromMeta, p.Meta)
+			mutex.Unlock()
+		case LinkMetaDel:
+			if len(payload) < 5 {
+				break
+			}
+			id := binary.BigEndian.Uint32(payload)
+			meta := string(payload[5:])
+			mutex.Lock()
+			if q, ok := peersFromMeta[meta]; ok && q.ID == id {
+				if _, local := peerConnFromMeta[meta]; !local {
+					delete(peersFromMeta, meta)
+				}
+			}
+			mutex.Unlock()
+		case LinkHint:
+			if len(payload) < 4 {
+				break
+			}
+			conn, err := getConn(PeerInfo{ID: binary.BigEndian.Uint32(payload)})
+			if err == nil {
+				go pushFrame(conn, PortHint, payload[4:])
+			}
+		default:
+			// a push to a slow peer mustn't hold up the other requests
+			go answerLink(w, h, payload)
+		}
+	}
+}
+
+func answerLink(w *connWriter, h linkHeader, payload []byte) {
+	reply := []byte{PeerOffline}
+	switch h.Op {
+	case LinkGetPeer, LinkGetPeerFromMeta:
+		var p PeerInfo
+		if h.Op == LinkGetPeer && len(payload) >= 4 {
+			p.ID = binary.BigEndian.Uint32(payload)
+		} else if h.Op == LinkGetPeerFromMeta && len(payload) >= 1 {
+			p.Meta = string(payload[1:])
+		}
+		if p.ID == 0 && p.Meta == "" {
+			break
+		}
+		if q, err := getPeerInfo(p); err == nil {
+			if q.wire == nil {
+				q.wire = encodePeer(q)
+			}
+			reply = append([]byte{StatusOK}, q.wire...)
+		}
+	case LinkNotify:
+		if len(payload) < 4 {
+			break
+		}
+		conn, err := getConn(PeerInfo{ID: binary.BigEndian.Uint32(payload)})
+		if err == nil && push(conn, NotifyPeer, PeerInfo{wire: payload[4:]}) == nil {
+			reply = []byte{Delivered}
+		}
+	default:
+		log.WithFields(log.Fields{
+			"op": h.Op,
+		}).Warn("Illegal link message")
+		return
+	}
+	w.Write(linkFrame(h.Tag, LinkReply, reply))
+	w.Flush()
+}
+
+// relays carry the data of peers whose holes didn't connect in time. Each
+// peer gets a UDP port of its own, the half, and binds to it by sending the
+// half's token from the socket it relays with. Datagrams from the bound
+// address of one half leave through the other half to the peer bound there
+const (
+	// relays without a datagram this long are closed
+	RelayIdle     = time.Minute
+	RelayTokenLen = 8
+	// datagrams moved by one recvmmsg and one sendmmsg
+	RelayBatch = 64
+	// larger datagrams are dropped
+	RelayMTU = 2048
+	// socket buffers of a half, room for the bursts of a tunnel
+	RelayBuffer = 4 << 20
+)
+
+// RelayMagic starts the bind message, the token follows. The relay answers
+// with the same bytes and whether the other half is bound yet
+var RelayMagic = []byte("NTR")
+
+var (
+	ErrRelaysFull = errors.New("Too many relays")
+	maxRelays     int
+	relays        = map[*relay]struct{}{}
+	relayMutex    sync.Mutex
+)
+
+// mmsgTraps are the numbers of recvmmsg(2) and sendmmsg(2), the syscall
+// package lacks the latter. Elsewhere relaying is off
+var mmsgTraps = map[string][2]uintptr{
+	"386":     {337, 345},
+	"amd64":   {299, 307},
+	"arm":     {365, 374},
+	"arm64":   {243, 269},
+	"loong64": {243, 269},
+	"ppc64le": {343, 349},
+	"riscv64": {243, 269},
+	"s390x":   {357, 358},
+}
+
+// mmsghdr is struct mmsghdr of recvmmsg(2) and sendmmsg(2)
+type mmsghdr struct {
+	hdr syscall.Msghdr
+	n   uint32
+}
+
+// relayAddr is the bound address of a half, as the kernel reports it
+type relayAddr struct {
+	sa  syscall.RawSockaddrAny
+	len uint32
+}
+
+func (a *relayAddr) bytes() []byte {
+	return (*[syscall.SizeofSockaddrAny]byte)(unsafe.Pointer(&a.sa))[:a.len]
+}
+
+type relayHalf struct {
+	conn  *net.UDPConn
+	raw   syscall.RawConn
+	token [RelayTokenLen]byte
+	addr  atomic.Pointer[relayAddr]
+}
+
+type relay struct {
+	halves [2]relayHalf
+	last   atomic.Int64
+}
+
+// offer is the port of the half and its token, as sent to its peer
+func (h *relayHalf) offer() []byte {
+	b := binary.BigEndian.AppendUint16(nil, uint16(h.conn.LocalAddr().(*net.UDPAddr).Port))
+	return append(b, h.token[:]...)
+}
+
+func newRelay() (*relay, error) {
+	relayMutex.Lock()
+	defer relayMutex.Unlock()
+	if len(relays) >= maxRelays {
+		return nil, ErrRelaysFull
+	}
+	r := &relay{}
+	for i := range r.halves {
+		h := &r.halves[i]
+		conn, err := net.ListenUDP("udp", nil)
+		if err == nil {
+			h.conn = conn
+			conn.SetReadBuffer(RelayBuffer)
+			conn.SetWriteBuffer(RelayBuffer)
+			h.raw, err = conn.SyscallConn()
+		}
+		if err == nil {
+			_, err = crand.Read(h.token[:])
+		}
+		if err != nil {
+			r.close()
+			return nil, err
+		}
+	}
+	r.last.Store(time.Now().UnixNano())
+	relays[r] = struct{}{}
+	go r.forward(0)
+	go r.forward(1)
+	return r, nil
+}
+
+// close ends the forwarding goroutines with the sockets
+func (r *relay) close() {
+	for i := range r.halves {
+		if r.halves[i].conn != nil {
+			r.halves[i].conn.Close()
+		}
+	}
+}
+
+// mmsg runs recvmmsg or sendmmsg on the socket, waiting in the poller while
+// it would block. Returns the number of messages done
+func mmsg(raw syscall.RawConn, read bool, msgs []mmsghdr) (n int, err error) {
+	trap := mmsgTraps[runtime.GOARCH][1]
+	if read {
+		trap = mmsgTraps[runtime.GOARCH][0]
+	}
+	var errno syscall.Errno
+	op := func(fd uintptr) bool {
+		r, _, e := syscall.Syscall6(trap, fd, uintptr(unsafe.Pointer(&msgs[0])),
+			uintptr(len(msgs)), syscall.MSG_DONTWAIT, 0, 0)
+		n, errno = int(r), e
+		return errno != syscall.EAGAIN
+	}
+	if read {
+		err = raw.Read(op)
+	} else {
+		err = raw.Write(op)
+	}
+	if err == nil && errno != 0 {
+		err = errno
+	}
+	return
+}
+
+// bound answers a bind message to the half, which binds the sender. Returns
+// false for anything else
+func (h *relayHalf) bound(data []byte, from *relayAddr, other *relayHalf) bool {
+	if len(data) != len(RelayMagic)+RelayTokenLen ||
+		!bytes.Equal(data[:len(RelayMagic)], RelayMagic) ||
+		subtle.ConstantTimeCompare(data[len(RelayMagic):], h.token[:]) != 1 {
+		return false
+	}
+	a := *from
+	h.addr.Store(&a)
+	ack := append(data[:len(data):len(data)], 0)
+	if other.addr.Load() != nil {
+		ack[len(data)] = 1
+	}
+	iov := syscall.Iovec{Base: &ack[0]}
+	iov.SetLen(len(ack))
+	msg := []mmsghdr{{hdr: syscall.Msghdr{
+		Name:    (*byte)(unsafe.Pointer(&a.sa)),
+		Namelen: a.len,
+		Iov:     &iov,
+		Iovlen:  1,
+	}}}
+	mmsg(h.raw, false, msg)
+	return true
+}
+
+// forward moves the datagrams arriving on half i to the peer bound to the
+// other half. A batch comes in with one recvmmsg and leaves with one
+// sendmmsg out of the same buffers, the data is never copied
+func (r *relay) forward(i int) {
+	in, out := &r.halves[i], &r.halves[1-i]
+	bufs := make([]byte, RelayBatch*RelayMTU)
+	from := make([]relayAddr, RelayBatch)
+	iovs := make([]syscall.Iovec, RelayBatch)
+	msgs := make([]mmsghdr, RelayBatch)
+	outIovs := make([]syscall.Iovec, RelayBatch)
+	outMsgs := make([]mmsghdr, RelayBatch)
+	for {
+		for j := range msgs {
+			iovs[j].Base = &bufs[j*RelayMTU]
+			iovs[j].SetLen(RelayMTU)
+			msgs[j].hdr = syscall.Msghdr{
+				Name:    (*byte)(unsafe.Pointer(&from[j].sa)),
+				Namelen: syscall.SizeofSockaddrAny,
+				Iov:     &iovs[j],
+				Iovlen:  1,
+			}
+		}
+		n, err := mmsg(in.raw, true, msgs)
+		if err != nil {
+			return
+		}
+		r.last.Store(time.Now().UnixNano())
+		self, dst := in.addr.Load(), out.addr.Load()
+		k := 0
+		for j := 0; j < n; j++ {
+			m := &msgs[j]
+			from[j].len = m.hdr.Namelen
+			data := bufs[j*RelayMTU : j*RelayMTU+int(m.n)]
+			if m.hdr.Flags&syscall.MSG_TRUNC != 0 || in.bound(data, &from[j], out) {
+				continue
+			}
+			if self == nil || dst == nil ||
+				!bytes.Equal(from[j].bytes(), self.bytes()) {
+				continue
+			}
+			outIovs[k].Base = &data[0]
+			outIovs[k].SetLen(len(data))
+			outMsgs[k].hdr = syscall.Msghdr{
+				Name:    (*byte)(unsafe.Pointer(&dst.sa)),
+				Namelen: dst.len,
+				Iov:     &outIovs[k],
+				Iovlen:  1,
+			}
+			k++
+		}
+		for sent := 0; sent < k; {
+			m, err := mmsg(out.raw, false, outMsgs[sent:k])
+			if err != nil {
+				break
+			}
+			sent += m
+		}
+	}
+}
+
+// allocRelay opens a relay between the sender and the peer, pushes the
+// peer its half along with the sender's record and replies the sender's
+// half. The peer has to be connected to this node, relays don't span the
+// cluster
+func allocRelay(w io.Writer, peerID uint32, myInfo PeerInfo) error {
+	if myInfo.ID == 0 {
+		return ErrPeerNotFound
+	}
+	conn, err := getConn(PeerInfo{ID: peerID})
+	if err != nil {
+		return err
+	}
+	r, err := newRelay()
+	if err != nil {
+		return err
+	}
+	if myInfo.wire == nil {
+		myInfo.wire = encodePeer(myInfo)
+	}
+	if err = pushFrame(conn, RelayOffer, append(r.halves[1].offer(), myInfo.wire...)); err != nil {
+		relayMutex.Lock()
+		delete(relays, r)
+		relayMutex.Unlock()
+		r.close()
+		return err
+	}
+	log.WithFields(log.Fields{
+		"myID":   myInfo.ID,
+		"peerID": peerID,
+	}).Debug("Relay allocated")
+	reply := binary.BigEndian.AppendUint32(nil, peerID)
+	return writeReply(w, RelayAlloc, StatusOK, append(reply, r.halves[0].offer()...))
+}
+
+// expireRelays closes the relays idle for RelayIdle
+func expireRelays() {
+	for range time.Tick(RelayIdle / 4) {
+		idle := time.Now().Add(-RelayIdle).UnixNano()
+		relayMutex.Lock()
+		for r := range relays {
+			if r.last.Load() < idle {
+				r.close()
+				delete(relays, r)
+			}
+		}
+		relayMutex.Unlock()
+	}
+}
@@ -0,0 +1,217 @@
+package main
+
+import (
+	"encoding/binary"
+	"io"
+	"net"
+	"path/filepath"
+	"testing"
+	"time"
+)
+
+// newTestPeer registers a peer with a fresh ID, as an enroll does
+func newTestPeer(meta string) PeerInfo {
+	p := PeerInfo{ID: nextID(), Port: 40001, NatType: 2, Meta: meta}
+	copy(p.IP[:], "192.0.2.1")
+	p.wire = encodePeer(p)
+	p.token = newToken()
+	mutex.Lock()
+	register(&p, io.Discard)
+	mutex.Unlock()
+	return p
+}
+
+// forgetTestPeers drops every record of the peers, parked ones too
+func forgetTestPeers(ps ...PeerInfo) {
+	mutex.Lock()
+	for _, p := range ps {
+		removePeer(p)
+		delete(parked, p.ID)
+	}
+	mutex.Unlock()
+}
+
+// TestSnapshotTornWrite breaks the newer copy of a snapshot, as a server
+// dying while writing it would, and loads the older one instead
+func TestSnapshotTornWrite(t *testing.T) {
+	s, err := openSnapshot(filepath.Join(t.TempDir(), "snapshot"))
+	if err != nil {
+		t.Fatal(err)
+	}
+	a := newTestPeer("a")
+	if err = s.write(); err != nil {
+		t.Fatal(err)
+	}
+	b := newTestPeer("b")
+	if err = s.write(); err != nil {
+		t.Fatal(err)
+	}
+	forgetTestPeers(a, b)
+	if n := s.load(); n != 2 {
+		t.Fatalf("loaded %d peers of the newer copy, want 2", n)
+	}
+	forgetTestPeers(a, b)
+
+	h, _ := s.slot(s.current())
+	s.mem[h.off+h.size-1] ^= 0xff
+	if n := s.load(); n != 1 {
+		t.Fatalf("loaded %d peers of the older copy, want 1", n)
+	}
+	if p, ok := parked[a.ID]; !ok || p.token != a.token {
+		t.Fatal("peer of the older copy not loaded")
+	}
+	forgetTestPeers(a, b)
+}
+
+// TestKeepaliveRebind sends keepalives for a UDP peer from a new address, one
+// with a wrong token that must not move the peer and one with its own
+func TestKeepaliveRebind(t *testing.T) {
+	srv, err := net.ListenUDP("udp", &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1)})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer srv.Close()
+	c, err := net.ListenUDP("udp", &net.UDPAddr{IP: net.IPv4(127, 0, 0, 1)})
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer c.Close()
+	from := c.LocalAddr().(*net.UDPAddr)
+
+	p := newTestPeer("udp")
+	mutex.Lock()
+	udpPeerIDs["192.0.2.1:40001"] = p.ID
+	udpSeen[p.ID] = time.Now()
+	mutex.Unlock()
+	defer func() {
+		mutex.Lock()
+		delete(udpPeerIDs, "192.0.2.1:40001")
+		delete(udpPeerIDs, from.String())
+		delete(udpSeen, p.ID)
+		mutex.Unlock()
+		forgetTestPeers(p)
+	}()
+
+	keepalive := func(token [TokenLen]byte) uint8 {
+		req := binary.BigEndian.AppendUint16(nil, Keepalive)
+		req = binary.BigEndian.AppendUint32(req, p.ID)
+		handleDatagram(udpPeer{srv, from}, append(req, token[:]...))
+		reply := make([]byte, 16)
+		c.SetReadDeadline(time.Now().Add(time.Second))
+		if n, err := c.Read(reply); err != nil || n < 3 {
+			t.Fatal("no reply to the keepalive", err)
+		}
+		return reply[2]
+	}
+	wrong := p.token
+	wrong[0] ^= 1
+	if status := keepalive(wrong); status != PeerOffline {
+		t.Fatalf("keepalive with a wrong token answered %d", status)
+	}
+	mutex.Lock()
+	_, moved := udpPeerIDs[from.String()]
+	mutex.Unlock()
+	if moved {
+		t.Fatal("keepalive with a wrong token moved the peer")
+	}
+	if status := keepalive(p.token); status != StatusOK {
+		t.Fatalf("keepalive with the token answered %d", status)
+	}
+	mutex.Lock()
+	id := udpPeerIDs[from.String()]
+	mutex.Unlock()
+	if id != p.ID {
+		t.Fatal("keepalive with the token didn't move the peer")
+	}
+}
+
+// TestJoinMeshAgain joins a peer twice, as a UDP client whose reply was lost
+// does, which must leave the members and the pending pairs as they were
+func TestJoinMeshAgain(t *testing.T) {
+	a, b, c := newTestPeer("a"), newTestPeer("b"), newTestPeer("c")
+	defer forgetTestPeers(a, b, c)
+	defer func() {
+		meshMutex.Lock()
+		delete(meshes, "again")
+		meshMutex.Unlock()
+	}()
+	joinMesh("again", a)
+	joinMesh("again", b)
+	joinMesh("again", c)
+	joinMesh("again", b)
+	meshMutex.Lock()
+	m := meshes["again"]
+	members, pending := len(m.members), len(m.pending)
+	meshMutex.Unlock()
+	if members != 3 || pending != 3 {
+		t.Fatalf("%d members and %d pending pairs, want 3 and 3", members,
+			pending)
+	}
+}
+
+// TestLinkSendFull sends on a link whose queue is full, which has to return
+// at once, senders hold the global lock
+func TestLinkSendFull(t *testing.T) {
+	l := &link{out: make(chan []byte, 1), up: true}
+	done := make(chan struct{})
+	go func() {
+		l.send(LinkMetaSet, nil)
+		l.send(LinkMetaSet, nil)
+		close(done)
+	}()
+	select {
+	case <-done:
+	case <-time.After(time.Second):
+		t.Fatal("send blocked on a full queue")
+	}
+	if l.dropped != 1 {
+		t.Fatalf("%d frames counted as dropped, want 1", l.dropped)
+	}
+}
+
+// GetPeerBatch requests are pipelined at a time, as a client with
+// several traversals in flight sends them
+const GetPeerBatch = 64
+
+// BenchmarkGetPeerInfo serves GetPeerInfo through handleConn over a pipe,
+// one operation is one request read, looked up and answered
+func BenchmarkGetPeerInfo(b *testing.B) {
+	p := newTestPeer("bench")
+	defer forgetTestPeers(p)
+
+	server, client := net.Pipe()
+	pending := make(chan struct{}, 1)
+	pending <- struct{}{}
+	done := make(chan struct{})
+	go func() {
+		handleConn(server, pending)
+		close(done)
+	}()
+
+	req := make([]byte, 0, 6*GetPeerBatch)
+	for i := 0; i < GetPeerBatch; i++ {
+		req = binary.BigEndian.AppendUint16(req, GetPeerInfo)
+		req = binary.BigEndian.AppendUint32(req, p.ID)
+	}
+	reply := make([]byte, 3+len(p.wire))
+	b.ReportAllocs()
+	b.ResetTimer()
+	go func() {
+		for n := b.N; n > 0; n -= GetPeerBatch {
+			if _, err := client.Write(req[:6*min(n, GetPeerBatch)]); err != nil {
+				return
+			}
+		}
+	}()
+	for i := 0; i < b.N; i++ {
+		if _, err := io.ReadFull(client, reply); err != nil {
+			b.Fatal(err)
+		}
+		if reply[2] != StatusOK {
+			b.Fatalf("status %d", reply[2])
+		}
+	}
+	b.StopTimer()
+	client.Close()
+	<-done
+}
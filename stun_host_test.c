@@ -21,9 +21,9 @@ int appendToFile(char *c, nat_type type) {
 int main() {
   uint16_t stun_port = DEFAULT_STUN_SERVER_PORT;
   uint16_t local_port = DEFAULT_LOCAL_PORT;
-  char ext_ip[16] = {0};
+  char ext_ip[IP_STR_LEN] = {0};
   uint16_t ext_port = 0;
-  char local_ip[16] = "0.0.0.0";
+  char local_ip[IP_STR_LEN] = "0.0.0.0";
 
   FILE *fp;
   char *line = NULL;
@@ -1,5 +1,44 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+
 #include "utils.h"
 
+socklen_t make_sockaddr(const char *ip, uint16_t port,
+                        struct sockaddr_storage *addr) {
+  memset(addr, 0, sizeof(*addr));
+  struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+  if (inet_pton(AF_INET, ip, &in4->sin_addr) == 1) {
+    in4->sin_family = AF_INET;
+    in4->sin_port = htons(port);
+    return sizeof(struct sockaddr_in);
+  }
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+  if (inet_pton(AF_INET6, ip, &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    return sizeof(struct sockaddr_in6);
+  }
+  return 0;
+}
+
+uint16_t sockaddr_ntop(const struct sockaddr *addr, char *buf, size_t len) {
+  if (addr->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)addr;
+    inet_ntop(AF_INET6, &in6->sin6_addr, buf, len);
+    return ntohs(in6->sin6_port);
+  }
+  const struct sockaddr_in *in4 = (const struct sockaddr_in *)addr;
+  inet_ntop(AF_INET, &in4->sin_addr, buf, len);
+  return ntohs(in4->sin_port);
+}
+
+int64_t wall_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void hex_dump(char *desc, void *addr, int len) {
   int i;
   unsigned char buff[17];
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 #ifdef VERBOSE
 #define verbose_log(format, ...)                                               \
@@ -8,16 +10,30 @@
 
 #define verbose_dump(...)                                                      \
   do {                                                                         \
-    hex_dump(##__VA_ARGS__);                                                   \
+    hex_dump(__VA_ARGS__);                                                     \
   } while (0)
 #else
+// keep the arguments type checked and referenced, the call is compiled out
 #define verbose_log(format, ...)                                               \
   do {                                                                         \
+    if (0)                                                                     \
+      printf(format, ##__VA_ARGS__);                                           \
   } while (0)
 
 #define verbose_dump(...)                                                      \
   do {                                                                         \
+    if (0)                                                                     \
+      hex_dump(__VA_ARGS__);                                                   \
   } while (0)
 #endif
 
 void hex_dump(char *desc, void *addr, int len);
+
+// fill addr with a numeric IPv4 or IPv6 address and port, returns the length
+// of the filled address or 0 if ip is not a valid address
+socklen_t make_sockaddr(const char *ip, uint16_t port,
+                        struct sockaddr_storage *addr);
+// write the textual ip of addr to buf and return its port in host byte order
+uint16_t sockaddr_ntop(const struct sockaddr *addr, char *buf, size_t len);
+// CLOCK_REALTIME in nanoseconds
+int64_t wall_ns(void);